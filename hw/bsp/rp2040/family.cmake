@@ -26,6 +26,8 @@ set(SRC_TINYUSB
 	${TOP}/src/class/midi/midi_device.c
 	${TOP}/src/class/msc/msc_device.c
 	${TOP}/src/class/net/net_device.c
+	${TOP}/src/class/net/ncm_device.c
+	${TOP}/src/class/net/net_checksum.c
 	${TOP}/src/class/usbtmc/usbtmc_device.c
 	${TOP}/src/class/vendor/vendor_device.c
 	${TOP}/src/host/hub.c
@@ -23,6 +23,8 @@
  */
 
 #include "dhserver.h"
+#include "lwip/sys.h"
+#include "lwip/timeouts.h"
 
 /* DHCP message type */
 #define DHCP_DISCOVER       1
@@ -108,10 +110,69 @@ static void set_ip(uint8_t *pnt, ip_addr_t value)
   memcpy(pnt, &value.addr, sizeof(value.addr));
 }
 
-static dhcp_entry_t *entry_by_ip(ip_addr_t ip)
+/*
+ * Lease table
+ *
+ * Entries are indexed by IP (fixed after init) and, while bound, by MAC in
+ * chained hash tables. Vacant entries are kept in a FIFO so a host coming
+ * back soon is likely to be offered its previous address again.
+ */
+
+#define NO_ENTRY (-1)
+
+#if (DHSERV_HASH_SIZE & (DHSERV_HASH_SIZE - 1)) != 0
+#error "DHSERV_HASH_SIZE must be a power of 2"
+#endif
+
+static int16_t  ip_bucket[DHSERV_HASH_SIZE];
+static int16_t  ip_link[DHSERV_MAX_ENTRIES];
+static int16_t  mac_bucket[DHSERV_HASH_SIZE];
+static int16_t  mac_link[DHSERV_MAX_ENTRIES];
+static int16_t  free_prev[DHSERV_MAX_ENTRIES];
+static int16_t  free_next[DHSERV_MAX_ENTRIES];
+static int16_t  free_head;
+static int16_t  free_tail;
+static uint32_t expires[DHSERV_MAX_ENTRIES];   /* sys_now() at the end of the lease */
+static bool     reserved[DHSERV_MAX_ENTRIES];
+
+static __inline unsigned hash_mac(const uint8_t *mac)
 {
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
 	int i;
-	for (i = 0; i < config->num_entry; i++)
+	for (i = 0; i < 6; i++)
+		h = (h ^ mac[i]) * 16777619u;
+	return (h ^ (h >> 16)) & (DHSERV_HASH_SIZE - 1);
+}
+
+static __inline unsigned hash_ip(ip_addr_t ip)
+{
+	/* pools differ in the low octets, which are on either end depending on byte order */
+	uint32_t h = ip.addr;
+	h ^= h >> 16;
+	h ^= h >> 8;
+	return h & (DHSERV_HASH_SIZE - 1);
+}
+
+static __inline int16_t index_of(const dhcp_entry_t *entry)
+{
+	return (int16_t)(entry - config->entries);
+}
+
+static __inline bool is_vacant(dhcp_entry_t *entry)
+{
+	return memcmp("\0\0\0\0\0", entry->mac, 6) == 0;
+}
+
+static __inline bool is_expired(int16_t i, uint32_t now)
+{
+	return !reserved[i] && (int32_t)(now - expires[i]) >= 0;
+}
+
+static dhcp_entry_t *entry_by_ip(ip_addr_t ip)
+{
+	int16_t i;
+	for (i = ip_bucket[hash_ip(ip)]; i != NO_ENTRY; i = ip_link[i])
 		if (config->entries[i].addr.addr == ip.addr)
 			return &config->entries[i];
 	return NULL;
@@ -119,30 +180,119 @@ static dhcp_entry_t *entry_by_ip(ip_addr_t ip)
 
 static dhcp_entry_t *entry_by_mac(uint8_t *mac)
 {
-	int i;
-	for (i = 0; i < config->num_entry; i++)
+	int16_t i;
+	for (i = mac_bucket[hash_mac(mac)]; i != NO_ENTRY; i = mac_link[i])
 		if (memcmp(config->entries[i].mac, mac, 6) == 0)
 			return &config->entries[i];
 	return NULL;
 }
 
-static __inline bool is_vacant(dhcp_entry_t *entry)
+static void free_list_push(int16_t i)
 {
-	return memcmp("\0\0\0\0\0", entry->mac, 6) == 0;
+	free_prev[i] = free_tail;
+	free_next[i] = NO_ENTRY;
+	if (free_tail != NO_ENTRY) free_next[free_tail] = i;
+	else free_head = i;
+	free_tail = i;
 }
 
-static dhcp_entry_t *vacant_address(void)
+static void free_list_remove(int16_t i)
 {
-	int i;
-	for (i = 0; i < config->num_entry; i++)
-		if (is_vacant(config->entries + i))
-			return config->entries + i;
-	return NULL;
+	if (free_prev[i] != NO_ENTRY) free_next[free_prev[i]] = free_next[i];
+	else free_head = free_next[i];
+	if (free_next[i] != NO_ENTRY) free_prev[free_next[i]] = free_prev[i];
+	else free_tail = free_prev[i];
+}
+
+static void mac_insert(int16_t i)
+{
+	unsigned h = hash_mac(config->entries[i].mac);
+	mac_link[i] = mac_bucket[h];
+	mac_bucket[h] = i;
+}
+
+static void bind_entry(dhcp_entry_t *entry, const uint8_t *mac, uint32_t seconds)
+{
+	int16_t i = index_of(entry);
+	uint32_t ms = (seconds > 0x7FFFFFFFu / 1000) ? 0x7FFFFFFFu : seconds * 1000;
+
+	if (is_vacant(entry))
+	{
+		free_list_remove(i);
+		memcpy(entry->mac, mac, 6);
+		mac_insert(i);
+	}
+	expires[i] = sys_now() + ms;
 }
 
-static __inline void free_entry(dhcp_entry_t *entry)
+static void free_entry(dhcp_entry_t *entry)
 {
+	int16_t i = index_of(entry);
+	int16_t *pnt = &mac_bucket[hash_mac(entry->mac)];
+
+	while (*pnt != i) pnt = &mac_link[*pnt];
+	*pnt = mac_link[i];
+
 	memset(entry->mac, 0, 6);
+	free_list_push(i);
+
+	if (config->lease_cb != NULL) config->lease_cb(entry, false);
+}
+
+/* free all expired leases, return number of reclaimed entries */
+static int reclaim_expired(void)
+{
+	uint32_t now = sys_now();
+	int count = 0;
+	int16_t i;
+
+	for (i = 0; i < config->num_entry; i++)
+	{
+		if (!is_vacant(&config->entries[i]) && is_expired(i, now))
+		{
+			free_entry(&config->entries[i]);
+			count++;
+		}
+	}
+	return count;
+}
+
+static dhcp_entry_t *vacant_address(void)
+{
+	if (free_head == NO_ENTRY) reclaim_expired();
+	if (free_head == NO_ENTRY) return NULL;
+	return &config->entries[free_head];
+}
+
+#if DHSERV_EXPIRE_INTERVAL_MS
+static void expire_timer(void *arg)
+{
+	(void)arg;
+	reclaim_expired();
+	sys_timeout(DHSERV_EXPIRE_INTERVAL_MS, expire_timer, NULL);
+}
+#endif
+
+static void table_init(void)
+{
+	int16_t i;
+
+	memset(ip_bucket, 0xFF, sizeof(ip_bucket));
+	memset(mac_bucket, 0xFF, sizeof(mac_bucket));
+	free_head = free_tail = NO_ENTRY;
+
+	for (i = 0; i < config->num_entry; i++)
+	{
+		dhcp_entry_t *entry = &config->entries[i];
+		unsigned h = hash_ip(entry->addr);
+
+		ip_link[i] = ip_bucket[h];
+		ip_bucket[h] = i;
+
+		reserved[i] = !is_vacant(entry);
+		if (reserved[i]) mac_insert(i);
+		else free_list_push(i);
+	}
 }
 
 uint8_t *find_dhcp_option(uint8_t *attrs, int size, uint8_t attr)
@@ -278,14 +428,22 @@ static void udp_recv_proc(void *arg, struct udp_pcb *upcb, struct pbuf *p, const
 			if (ptr[1] != 4) break;
 			ptr += 2;
 
-			/* 2. does hw-address registered? */
+			/* 2. does hw-address registered? renewal keeps the entry */
 			entry = entry_by_mac(dhcp_data.dp_chaddr);
-			if (entry != NULL) free_entry(entry);
+			if (entry != NULL && entry->addr.addr != get_ip(ptr).addr)
+			{
+				if (reserved[index_of(entry)]) break;
+				free_entry(entry);
+			}
 
-			/* 3. find requested ipaddr */
+			/* 3. find requested ipaddr, taking over an expired lease */
 			entry = entry_by_ip(get_ip(ptr));
 			if (entry == NULL) break;
-			if (!is_vacant(entry)) break;
+			if (!is_vacant(entry) && memcmp(entry->mac, dhcp_data.dp_chaddr, 6) != 0)
+			{
+				if (!is_expired(index_of(entry), sys_now())) break;
+				free_entry(entry);
+			}
 
 			/* 4. fill struct fields */
 			memcpy(dhcp_data.dp_yiaddr, ptr, 4);
@@ -309,12 +467,20 @@ static void udp_recv_proc(void *arg, struct udp_pcb *upcb, struct pbuf *p, const
 			/* 6. send ACK */
 			pp = pbuf_alloc(PBUF_TRANSPORT, sizeof(dhcp_data), PBUF_POOL);
 			if (pp == NULL) break;
-			memcpy(entry->mac, dhcp_data.dp_chaddr, 6);
+			bind_entry(entry, dhcp_data.dp_chaddr, entry->lease);
+			if (config->lease_cb != NULL) config->lease_cb(entry, true);
 			memcpy(pp->payload, &dhcp_data, sizeof(dhcp_data));
 			udp_sendto(upcb, pp, IP_ADDR_BROADCAST, port);
 			pbuf_free(pp);
 			break;
 
+		case DHCP_RELEASE:
+			entry = entry_by_mac(dhcp_data.dp_chaddr);
+			if (entry == NULL || reserved[index_of(entry)]) break;
+			if (entry->addr.addr != get_ip(dhcp_data.dp_ciaddr).addr) break;
+			free_entry(entry);
+			break;
+
 		default:
 				break;
 	}
@@ -324,6 +490,8 @@ static void udp_recv_proc(void *arg, struct udp_pcb *upcb, struct pbuf *p, const
 err_t dhserv_init(const dhcp_config_t *c)
 {
 	err_t err;
+	if (c->num_entry > DHSERV_MAX_ENTRIES)
+		return ERR_VAL;
 	udp_init();
 	dhserv_free();
 	pcb = udp_new();
@@ -337,12 +505,45 @@ err_t dhserv_init(const dhcp_config_t *c)
 	}
 	udp_recv(pcb, udp_recv_proc, NULL);
 	config = c;
+	table_init();
+#if DHSERV_EXPIRE_INTERVAL_MS
+	sys_timeout(DHSERV_EXPIRE_INTERVAL_MS, expire_timer, NULL);
+#endif
 	return ERR_OK;
 }
 
 void dhserv_free(void)
 {
+	int16_t i;
+
+	/* forget dynamic leases, so that only reservations have a preset mac
+	 * on the next init. Saved leases are brought back with dhserv_restore() */
+	if (config != NULL)
+	{
+		for (i = 0; i < config->num_entry; i++)
+			if (!reserved[i]) memset(config->entries[i].mac, 0, 6);
+		config = NULL;
+	}
+
 	if (pcb == NULL) return;
+#if DHSERV_EXPIRE_INTERVAL_MS
+	sys_untimeout(expire_timer, NULL);
+#endif
 	udp_remove(pcb);
 	pcb = NULL;
 }
+
+err_t dhserv_restore(const uint8_t *mac, ip_addr_t addr, uint32_t remaining)
+{
+	dhcp_entry_t *entry;
+
+	if (config == NULL) return ERR_CONN;
+
+	entry = entry_by_ip(addr);
+	if (entry == NULL) return ERR_VAL;
+	if (!is_vacant(entry) && memcmp(entry->mac, mac, 6) != 0) return ERR_USE;
+	if (is_vacant(entry) && entry_by_mac((uint8_t *)mac) != NULL) return ERR_USE;
+
+	bind_entry(entry, mac, remaining);
+	return ERR_OK;
+}
@@ -39,11 +39,28 @@
 #include "lwip/udp.h"
 #include "netif/etharp.h"
 
+/* capacity of the lease table, num_entry of the config must not exceed it */
+#ifndef DHSERV_MAX_ENTRIES
+#define DHSERV_MAX_ENTRIES         32
+#endif
+
+/* buckets of the MAC and IP hash tables, power of 2 */
+#ifndef DHSERV_HASH_SIZE
+#define DHSERV_HASH_SIZE           16
+#endif
+
+/* period of the expired lease scan, 0: reclaim only when the pool runs empty */
+#ifndef DHSERV_EXPIRE_INTERVAL_MS
+#define DHSERV_EXPIRE_INTERVAL_MS  10000
+#endif
+
+/* an entry with a preset mac is reserved for that host and never expires.
+ * dhserv_free() clears the mac of the other entries, their leases are lost */
 typedef struct dhcp_entry
 {
 	uint8_t  mac[6];
 	ip_addr_t addr;
-	uint32_t lease;
+	uint32_t lease;     /* seconds */
 } dhcp_entry_t;
 
 typedef struct dhcp_config
@@ -54,9 +71,16 @@ typedef struct dhcp_config
 	const char   *domain;
 	int           num_entry;
 	dhcp_entry_t *entries;
+
+	/* optional persistence hook, called when a lease is bound or renewed
+	 * (bound = true) and when it is released or expired (bound = false) */
+	void (*lease_cb)(const dhcp_entry_t *entry, bool bound);
 } dhcp_config_t;
 
 err_t dhserv_init(const dhcp_config_t *config);
 void dhserv_free(void);
 
+/* restore a lease saved by lease_cb after dhserv_init(), remaining in seconds */
+err_t dhserv_restore(const uint8_t *mac, ip_addr_t addr, uint32_t remaining);
+
 #endif /* DHSERVER_H */
@@ -30,9 +30,17 @@
 #include "dnserver.h"
 
 #define DNS_MAX_HOST_NAME_LEN 128
+#define DNS_MAX_REPLY_LEN     512   /* plain UDP, no EDNS */
+
+#define DNS_TYPE_A            1
+#define DNS_TYPE_AAAA         28
+#define DNS_TYPE_ANY          255
+#define DNS_CLASS_IN          1
+#define DNS_CLASS_ANY         255
 
 static struct udp_pcb *pcb = NULL;
 dns_query_proc_t query_proc = NULL;
+static dns_query6_proc_t query6_proc = NULL;
 
 #pragma pack(push, 1)
 typedef struct
@@ -65,17 +73,33 @@ typedef struct
 	uint16_t n_record[4];
 } dns_header_t;
 
-typedef struct dns_answer
-{
-	uint16_t name;
-	uint16_t type;
-	uint16_t Class;
-	uint32_t ttl;
-	uint16_t len;
-	uint32_t addr;
-} dns_answer_t;
 #pragma pack(pop)
 
+/* answer records following the compressed name, address is appended */
+#define TTL_BYTES ((DNS_TTL >> 24) & 0xFF), ((DNS_TTL >> 16) & 0xFF), ((DNS_TTL >> 8) & 0xFF), (DNS_TTL & 0xFF)
+
+static const uint8_t a_template[10]    = { 0, DNS_TYPE_A, 0, DNS_CLASS_IN, TTL_BYTES, 0, 4 };
+static const uint8_t aaaa_template[10] = { 0, DNS_TYPE_AAAA, 0, DNS_CLASS_IN, TTL_BYTES, 0, 16 };
+
+typedef struct dns_result
+{
+	bool    found;
+	uint8_t addr[16];
+} dns_result_t;
+
+#if DNS_CACHE_SIZE
+typedef struct dns_cache_entry
+{
+	uint32_t     hash;
+	uint16_t     type;      /* 0: unused */
+	dns_result_t result;
+	char         name[DNS_CACHE_NAME_LEN];
+} dns_cache_entry_t;
+
+static dns_cache_entry_t cache[DNS_CACHE_SIZE];
+static int cache_next;
+#endif
+
 typedef struct dns_query
 {
 	char name[DNS_MAX_HOST_NAME_LEN];
@@ -130,42 +154,149 @@ static int parse_next_query(void *data, int size, dns_query_t *query)
 	return ptr - (uint8_t *)data;
 }
 
+static void query_resolve(const char *name, uint16_t type, dns_result_t *result)
+{
+	memset(result, 0, sizeof(dns_result_t));
+	if (type == DNS_TYPE_A)
+	{
+		ip_addr_t host_addr;
+		result->found = query_proc(name, &host_addr);
+		if (result->found) memcpy(result->addr, &host_addr.addr, 4);
+	}
+	else if (query6_proc != NULL)
+	{
+		result->found = query6_proc(name, result->addr);
+	}
+}
+
+/* connectivity checks repeat the same few names, only ask the query procs once */
+static void resolve(const char *name, uint16_t type, dns_result_t *result)
+{
+#if DNS_CACHE_SIZE
+	uint32_t hash = 2166136261u;
+	size_t len;
+	int i;
+
+	for (len = 0; name[len] != 0; len++)
+		hash = (hash ^ (uint8_t)name[len]) * 16777619u;
+
+	for (i = 0; i < DNS_CACHE_SIZE; i++)
+	{
+		if (cache[i].type == type && cache[i].hash == hash && strcmp(cache[i].name, name) == 0)
+		{
+			*result = cache[i].result;
+			return;
+		}
+	}
+
+	query_resolve(name, type, result);
+
+	if (len < DNS_CACHE_NAME_LEN)
+	{
+		dns_cache_entry_t *entry = &cache[cache_next];
+		cache_next = (cache_next + 1) % DNS_CACHE_SIZE;
+		entry->hash = hash;
+		entry->type = type;
+		entry->result = *result;
+		memcpy(entry->name, name, len + 1);
+	}
+#else
+	query_resolve(name, type, result);
+#endif
+}
+
+static int put_answer(uint8_t *dst, uint16_t name_offset, const uint8_t *tmpl, const uint8_t *addr)
+{
+	int len = tmpl[9];
+	dst[0] = 0xC0 | (name_offset >> 8);
+	dst[1] = name_offset & 0xFF;
+	memcpy(dst + 2, tmpl, 10);
+	memcpy(dst + 12, addr, len);
+	return 12 + len;
+}
+
 static void udp_recv_proc(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
 {
-	int len;
-	dns_header_t *header;
 	static dns_query_t query;
+	static uint8_t reply[DNS_MAX_REPLY_LEN];
+	static dns_result_t result4[DNS_MAX_QUESTIONS];
+	static dns_result_t result6[DNS_MAX_QUESTIONS];
+	uint16_t name_offset[DNS_MAX_QUESTIONS];
+	dns_header_t *header;
 	struct pbuf *out;
-	ip_addr_t host_addr;
-	dns_answer_t *answer;
+	int n, i, len, pos, answers;
+	bool known = false;
 
 	(void)arg;
 
 	if (p->len <= sizeof(dns_header_t)) goto error;
 	header = (dns_header_t *)p->payload;
 	if (header->flags.qr != 0) goto error;
-	if (ntohs(header->n_record[0]) != 1) goto error;
+	n = ntohs(header->n_record[0]);
+	if (n < 1 || n > DNS_MAX_QUESTIONS) goto error;
+
+	/* 1. parse and resolve questions, they are echoed back unchanged */
+	pos = sizeof(dns_header_t);
+	for (i = 0; i < n; i++)
+	{
+		bool want4, want6;
 
-	len = parse_next_query(header + 1, p->len - sizeof(dns_header_t), &query);
-	if (len < 0) goto error;
-	if (!query_proc(query.name, &host_addr)) goto error;
+		len = parse_next_query((uint8_t *)p->payload + pos, p->len - pos, &query);
+		if (len < 0) goto error;
+		name_offset[i] = pos;
+		pos += len;
 
-	len += sizeof(dns_header_t);
-	out = pbuf_alloc(PBUF_TRANSPORT, len + 16, PBUF_POOL);
-	if (out == NULL) goto error;
+		query.type = ntohs(query.type);
+		query.Class = ntohs(query.Class);
+		want4 = query.type == DNS_TYPE_A || query.type == DNS_TYPE_ANY;
+		want6 = query.type == DNS_TYPE_AAAA || query.type == DNS_TYPE_ANY;
+
+		result4[i].found = result6[i].found = false;
+		if (query.Class == DNS_CLASS_IN || query.Class == DNS_CLASS_ANY)
+		{
+			if (want6) resolve(query.name, DNS_TYPE_AAAA, &result6[i]);
 
-	memcpy(out->payload, p->payload, len);
-	header = (dns_header_t *)out->payload;
+			/* a question of any other type (AAAA without record, HTTPS, ...) is still
+			 * answered without records (NODATA) if the name exists, hosts do not wait */
+			resolve(query.name, DNS_TYPE_A, &result4[i]);
+		}
+		known |= result4[i].found || result6[i].found;
+		if (!want4) result4[i].found = false;
+	}
+	if (!known) goto error;
+	if (pos > DNS_MAX_REPLY_LEN) goto error;
+
+	/* 2. header and questions, additional records (e.g. EDNS) are dropped */
+	memcpy(reply, p->payload, pos);
+	header = (dns_header_t *)reply;
 	header->flags.qr = 1;
-	header->n_record[1] = htons(1);
-	answer = (struct dns_answer *)((uint8_t *)out->payload + len);
-	answer->name = htons(0xC00C);
-	answer->type = htons(1);
-	answer->Class = htons(1);
-	answer->ttl = htonl(32);
-	answer->len = htons(4);
-	answer->addr = host_addr.addr;
-	
+	header->n_record[2] = 0;
+	header->n_record[3] = 0;
+
+	/* 3. answers from templates */
+	answers = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (result4[i].found)
+		{
+			if (pos + 16 > DNS_MAX_REPLY_LEN) { header->flags.tc = 1; break; }
+			pos += put_answer(reply + pos, name_offset[i], a_template, result4[i].addr);
+			answers++;
+		}
+		if (result6[i].found)
+		{
+			if (pos + 28 > DNS_MAX_REPLY_LEN) { header->flags.tc = 1; break; }
+			pos += put_answer(reply + pos, name_offset[i], aaaa_template, result6[i].addr);
+			answers++;
+		}
+	}
+	header->n_record[1] = htons(answers);
+
+	/* 4. one exactly sized pbuf per reply */
+	out = pbuf_alloc(PBUF_TRANSPORT, pos, PBUF_POOL);
+	if (out == NULL) goto error;
+	pbuf_take(out, reply, pos);
+
 	udp_sendto(upcb, out, addr, port);
 	pbuf_free(out);
 
@@ -189,9 +320,24 @@ err_t dnserv_init(const ip_addr_t *bind, uint16_t port, dns_query_proc_t qp)
 	}
 	udp_recv(pcb, udp_recv_proc, NULL);
 	query_proc = qp;
+	dnserv_flush_cache();
 	return ERR_OK;
 }
 
+void dnserv_set_query6(dns_query6_proc_t qp)
+{
+	query6_proc = qp;
+	dnserv_flush_cache();
+}
+
+void dnserv_flush_cache(void)
+{
+#if DNS_CACHE_SIZE
+	memset(cache, 0, sizeof(cache));
+	cache_next = 0;
+#endif
+}
+
 void dnserv_free()
 {
 	if (pcb == NULL) return;
@@ -39,9 +39,38 @@
 #include "lwip/udp.h"
 #include "netif/etharp.h"
 
+/* questions answered per request, requests with more are dropped */
+#ifndef DNS_MAX_QUESTIONS
+#define DNS_MAX_QUESTIONS   4
+#endif
+
+/* resolved (or unknown) name/type pairs remembered, 0 to disable */
+#ifndef DNS_CACHE_SIZE
+#define DNS_CACHE_SIZE      8
+#endif
+
+/* longer names are resolved every time */
+#ifndef DNS_CACHE_NAME_LEN
+#define DNS_CACHE_NAME_LEN  48
+#endif
+
+/* time to live of the answers, seconds */
+#ifndef DNS_TTL
+#define DNS_TTL             32
+#endif
+
 typedef bool (*dns_query_proc_t)(const char *name, ip_addr_t *addr);
+typedef bool (*dns_query6_proc_t)(const char *name, uint8_t addr[16]);
 
 err_t dnserv_init(const ip_addr_t *bind, uint16_t port, dns_query_proc_t query_proc);
 void  dnserv_free(void);
 
+/* optional AAAA resolver. Without one, AAAA questions for names known to
+ * query_proc get an empty answer so hosts do not wait for a timeout, as do
+ * questions of other types (e.g. HTTPS) */
+void  dnserv_set_query6(dns_query6_proc_t query6_proc);
+
+/* forget cached results, e.g. after the answers of the query procs changed */
+void  dnserv_flush_cache(void);
+
 #endif
@@ -39,7 +39,6 @@
 static const uint8_t *const station_hwaddr = tud_network_mac_address;
 static const uint8_t *const permanent_hwaddr = tud_network_mac_address;
 
-static usb_eth_stat_t usb_eth_stat = { 0, 0, 0, 0 };
 static uint32_t oid_packet_filter = 0x0000000;
 static rndis_state_t rndis_state;
 
@@ -64,6 +63,15 @@ static const uint32_t OIDSupportedList[] =
   OID_GEN_MAC_OPTIONS,
   OID_GEN_MEDIA_CONNECT_STATUS,
   OID_GEN_MAXIMUM_SEND_PACKETS,
+  OID_GEN_XMIT_OK,
+  OID_GEN_RCV_OK,
+  OID_GEN_XMIT_ERROR,
+  OID_GEN_RCV_ERROR,
+  OID_GEN_RCV_NO_BUFFER,
+  OID_GEN_DIRECTED_BYTES_XMIT,
+  OID_GEN_DIRECTED_FRAMES_XMIT,
+  OID_GEN_DIRECTED_BYTES_RCV,
+  OID_GEN_DIRECTED_FRAMES_RCV,
   OID_802_3_PERMANENT_ADDRESS,
   OID_802_3_CURRENT_ADDRESS,
   OID_802_3_MULTICAST_LIST,
@@ -74,6 +82,10 @@ static const uint32_t OIDSupportedList[] =
 #define OID_LIST_LENGTH TU_ARRAY_SIZE(OIDSupportedList)
 #define ENC_BUF_SIZE    (OID_LIST_LENGTH * 4 + 32)
 
+/* replies are written into the driver's encapsulated buffer, the OID list is the largest one */
+TU_VERIFY_STATIC(ENC_BUF_SIZE <= NETD_RNDIS_ENC_BUF_SIZE, "OIDSupportedList does not fit NETD_RNDIS_ENC_BUF_SIZE");
+TU_VERIFY_STATIC(sizeof(rndis_query_cmplt_t) + sizeof(OIDSupportedList) <= ENC_BUF_SIZE, "ENC_BUF_SIZE is too small");
+
 static void *encapsulated_buffer;
 
 static void rndis_report(void)
@@ -116,6 +128,9 @@ static const char *rndis_vendor = RNDIS_VENDOR;
 
 static void rndis_query(void)
 {
+  tud_network_stats_t stats;
+  tud_network_stats_get(&stats);
+
   switch (((rndis_query_msg_t *)encapsulated_buffer)->Oid)
   {
     case OID_GEN_SUPPORTED_LIST:         rndis_query_cmplt(RNDIS_STATUS_SUCCESS, OIDSupportedList, 4 * OID_LIST_LENGTH); return;
@@ -143,11 +158,16 @@ static void rndis_query(void)
     case OID_802_3_RCV_ERROR_ALIGNMENT:  rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
     case OID_802_3_XMIT_ONE_COLLISION:   rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
     case OID_802_3_XMIT_MORE_COLLISIONS: rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
-    case OID_GEN_XMIT_OK:                rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.txok); return;
-    case OID_GEN_RCV_OK:                 rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.rxok); return;
-    case OID_GEN_RCV_ERROR:              rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.rxbad); return;
-    case OID_GEN_XMIT_ERROR:             rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, usb_eth_stat.txbad); return;
-    case OID_GEN_RCV_NO_BUFFER:          rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, 0); return;
+    case OID_GEN_XMIT_OK:                rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.tx_frames); return;
+    case OID_GEN_RCV_OK:                 rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.rx_frames); return;
+    case OID_GEN_RCV_ERROR:              rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.rx_errors); return;
+    case OID_GEN_XMIT_ERROR:             rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.tx_dropped); return;
+    case OID_GEN_RCV_NO_BUFFER:          rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.rx_dropped); return;
+    /* frames are not classified by destination, all are reported as directed */
+    case OID_GEN_DIRECTED_BYTES_XMIT:    rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.tx_bytes); return;
+    case OID_GEN_DIRECTED_FRAMES_XMIT:   rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.tx_frames); return;
+    case OID_GEN_DIRECTED_BYTES_RCV:     rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.rx_bytes); return;
+    case OID_GEN_DIRECTED_FRAMES_RCV:    rndis_query_cmplt32(RNDIS_STATUS_SUCCESS, stats.rx_frames); return;
     default:                             rndis_query_cmplt(RNDIS_STATUS_FAILURE, NULL, 0); return;
   }
 }
@@ -245,6 +265,8 @@ void rndis_class_set_handler(uint8_t *data, int size)
       {
         rndis_initialize_cmplt_t *m;
         m = ((rndis_initialize_cmplt_t *)encapsulated_buffer);
+        /* largest transfer host accepts, read before the response overwrites it */
+        netd_rndis_set_host_max_xfer(((rndis_initialize_msg_t *)encapsulated_buffer)->MaxTransferSize);
         /* m->MessageID is same as before */
         m->MessageType = REMOTE_NDIS_INITIALIZE_CMPLT;
         m->MessageLength = sizeof(rndis_initialize_cmplt_t);
@@ -253,9 +275,9 @@ void rndis_class_set_handler(uint8_t *data, int size)
         m->Status = RNDIS_STATUS_SUCCESS;
         m->DeviceFlags = RNDIS_DF_CONNECTIONLESS;
         m->Medium = RNDIS_MEDIUM_802_3;
-        m->MaxPacketsPerTransfer = 1;
-        m->MaxTransferSize = CFG_TUD_NET_MTU + sizeof(rndis_data_packet_t);
-        m->PacketAlignmentFactor = 0;
+        m->MaxPacketsPerTransfer = CFG_TUD_NET_RNDIS_PACKETS_PER_XFER;
+        m->MaxTransferSize = netd_rndis_max_xfer();
+        m->PacketAlignmentFactor = (CFG_TUD_NET_RNDIS_PACKETS_PER_XFER > 1) ? 2 : 0; /* 2^2: 32-bit aligned messages */
         m->AfListOffset = 0;
         m->AfListSize = 0;
         rndis_state = rndis_initialized;
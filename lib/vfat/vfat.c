@@ -0,0 +1,528 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+
+#include "vfat.h"
+
+//--------------------------------------------------------------------+
+// MACRO CONSTANT TYPEDEF
+//--------------------------------------------------------------------+
+#define RESERVED_SECTORS    1
+#define NUM_FATS            2
+#define ROOT_SECTORS        ((VFAT_ROOT_ENTRIES * 32) / VFAT_SECTOR_SIZE)
+#define DIR_ENTRY_SIZE      32
+
+#define FAT12_MAX_CLUSTERS  4084
+#define FAT16_MAX_CLUSTERS  65524
+
+enum
+{
+  ATTR_READ_ONLY = 0x01,
+  ATTR_VOLUME_ID = 0x08,
+  ATTR_DIRECTORY = 0x10,
+  ATTR_ARCHIVE   = 0x20,
+};
+
+#if (VFAT_ROOT_ENTRIES * 32) % VFAT_SECTOR_SIZE
+  #error VFAT_ROOT_ENTRIES must fill whole sectors
+#endif
+
+static inline void put16(uint8_t* p, uint16_t v)
+{
+  p[0] = (uint8_t) v;
+  p[1] = (uint8_t) (v >> 8);
+}
+
+static inline void put32(uint8_t* p, uint32_t v)
+{
+  put16(p, (uint16_t) v);
+  put16(p+2, (uint16_t) (v >> 16));
+}
+
+static inline uint16_t get16(uint8_t const* p)
+{
+  return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get32(uint8_t const* p)
+{
+  return get16(p) | ((uint32_t) get16(p+2) << 16);
+}
+
+static inline uint32_t min32(uint32_t x, uint32_t y)
+{
+  return (x < y) ? x : y;
+}
+
+static inline uint32_t cluster_size(vfat_t const* vfat)
+{
+  return vfat->sec_per_cluster * VFAT_SECTOR_SIZE;
+}
+
+static inline uint32_t file_clusters(vfat_t const* vfat, vfat_file_t const* file)
+{
+  return (file->size + cluster_size(vfat) - 1) / cluster_size(vfat);
+}
+
+// Copy the part of a generated object [obj_off, obj_off+obj_len) that overlaps the requested sector range
+static void copy_overlap(uint8_t* buffer, uint32_t offset, uint32_t len, uint8_t const* obj, uint32_t obj_off, uint32_t obj_len)
+{
+  uint32_t const start = (obj_off > offset) ? obj_off : offset;
+  uint32_t const end   = min32(obj_off + obj_len, offset + len);
+
+  if ( start < end ) memcpy(buffer + (start - offset), obj + (start - obj_off), end - start);
+}
+
+//--------------------------------------------------------------------+
+// Layout
+//--------------------------------------------------------------------+
+bool vfat_init(vfat_t* vfat, vfat_config_t const* cfg)
+{
+  memset(vfat, 0, sizeof(vfat_t));
+  vfat->cfg           = cfg;
+  vfat->sector_count  = cfg->sector_count;
+  vfat->cache_cluster = 2;
+
+  uint32_t const overhead = RESERVED_SECTORS + ROOT_SECTORS;
+  if ( cfg->sector_count <= overhead ) return false;
+
+  // smallest cluster giving a valid FAT12/FAT16 cluster count
+  for ( uint32_t spc = 1; spc <= 64; spc *= 2 )
+  {
+    // FAT size for the upper bound of clusters, slightly oversized FAT is allowed
+    uint32_t const max_clusters = (cfg->sector_count - overhead) / spc;
+    uint32_t const fat_bytes    = (max_clusters > FAT12_MAX_CLUSTERS) ? (max_clusters + 2) * 2 : ((max_clusters + 2) * 3 + 1) / 2;
+    uint32_t const fat_sectors  = (fat_bytes + VFAT_SECTOR_SIZE - 1) / VFAT_SECTOR_SIZE;
+
+    if ( cfg->sector_count <= overhead + NUM_FATS*fat_sectors ) return false;
+
+    uint32_t const clusters = (cfg->sector_count - overhead - NUM_FATS*fat_sectors) / spc;
+    if ( clusters > FAT16_MAX_CLUSTERS ) continue;
+
+    vfat->sec_per_cluster = (uint8_t) spc;
+    vfat->fat_sectors     = fat_sectors;
+    vfat->cluster_count   = clusters;
+    vfat->fat16           = (clusters > FAT12_MAX_CLUSTERS);
+    break;
+  }
+
+  if ( vfat->sec_per_cluster == 0 ) return false;
+
+  vfat->fat_start  = RESERVED_SECTORS;
+  vfat->root_start = vfat->fat_start + NUM_FATS*vfat->fat_sectors;
+  vfat->data_start = vfat->root_start + ROOT_SECTORS;
+
+  // files are laid out back to back from cluster 2
+  uint32_t cluster = 2;
+  for ( uint16_t i = 0; i < cfg->file_count; i++ ) cluster += file_clusters(vfat, &cfg->files[i]);
+
+  if ( cluster - 2 > vfat->cluster_count ) return false;
+  if ( cfg->file_count > VFAT_ROOT_ENTRIES - 1 ) return false;
+
+  vfat->free_cluster = cluster;
+
+  return true;
+}
+
+// Return file occupying cluster and its first cluster, NULL if cluster is free
+static vfat_file_t const* find_file(vfat_t* vfat, uint32_t cluster, uint32_t* first)
+{
+  vfat_config_t const* cfg = vfat->cfg;
+
+  if ( cluster < 2 || cluster >= vfat->free_cluster ) return NULL;
+
+  // continue from the cached file if it is not behind
+  uint16_t i = 0;
+  uint32_t c = 2;
+  if ( cluster >= vfat->cache_cluster )
+  {
+    i = vfat->cache_file;
+    c = vfat->cache_cluster;
+  }
+
+  for ( ; i < cfg->file_count; i++ )
+  {
+    uint32_t const n = file_clusters(vfat, &cfg->files[i]);
+
+    if ( cluster < c + n )
+    {
+      vfat->cache_file    = i;
+      vfat->cache_cluster = c;
+
+      *first = c;
+      return &cfg->files[i];
+    }
+
+    c += n;
+  }
+
+  return NULL;
+}
+
+static void format_name(char const* name, uint8_t out[11])
+{
+  memset(out, ' ', 11);
+
+  uint8_t i = 0;
+  while ( *name && *name != '.' )
+  {
+    char const ch = *name++;
+    if ( i < 8 ) out[i++] = (uint8_t) ((ch >= 'a' && ch <= 'z') ? (ch - 'a' + 'A') : ch);
+  }
+
+  if ( *name == '.' )
+  {
+    name++;
+    for ( i = 8; *name && i < 11; i++ )
+    {
+      char const ch = *name++;
+      out[i] = (uint8_t) ((ch >= 'a' && ch <= 'z') ? (ch - 'a' + 'A') : ch);
+    }
+  }
+}
+
+//--------------------------------------------------------------------+
+// Sector generation, each fills [offset, offset+len) of one sector
+//--------------------------------------------------------------------+
+static void gen_boot(vfat_t const* vfat, uint32_t offset, uint8_t* buffer, uint32_t len)
+{
+  vfat_config_t const* cfg = vfat->cfg;
+  uint8_t bpb[62] = { 0xEB, 0x3C, 0x90, 'M', 'S', 'D', 'O', 'S', '5', '.', '0' };
+
+  put16(bpb + 11, VFAT_SECTOR_SIZE);
+  bpb[13] = vfat->sec_per_cluster;
+  put16(bpb + 14, RESERVED_SECTORS);
+  bpb[16] = NUM_FATS;
+  put16(bpb + 17, VFAT_ROOT_ENTRIES);
+  put16(bpb + 19, (vfat->sector_count < 0x10000) ? (uint16_t) vfat->sector_count : 0);
+  bpb[21] = 0xF8; // fixed disk
+  put16(bpb + 22, (uint16_t) vfat->fat_sectors);
+  put16(bpb + 24, 63);  // sectors per track
+  put16(bpb + 26, 255); // heads
+  put32(bpb + 28, 0);   // hidden sectors
+  put32(bpb + 32, (vfat->sector_count < 0x10000) ? 0 : vfat->sector_count);
+  bpb[36] = 0x80;       // drive number
+  bpb[38] = 0x29;       // extended boot signature
+  put32(bpb + 39, cfg->volume_id);
+
+  memset(bpb + 43, ' ', 11);
+  if ( cfg->label ) memcpy(bpb + 43, cfg->label, min32((uint32_t) strlen(cfg->label), 11));
+  memcpy(bpb + 54, vfat->fat16 ? "FAT16   " : "FAT12   ", 8);
+
+  static uint8_t const signature[2] = { 0x55, 0xAA };
+
+  copy_overlap(buffer, offset, len, bpb, 0, sizeof(bpb));
+  copy_overlap(buffer, offset, len, signature, 510, 2);
+}
+
+static uint32_t fat_entry(vfat_t* vfat, uint32_t cluster)
+{
+  uint32_t const eoc = vfat->fat16 ? 0xFFFF : 0xFFF;
+
+  if ( cluster == 0 ) return eoc & 0xFFF8; // media descriptor
+  if ( cluster == 1 ) return eoc;
+
+  uint32_t first;
+  vfat_file_t const* file = find_file(vfat, cluster, &first);
+  if ( !file ) return 0;
+
+  return (cluster == first + file_clusters(vfat, file) - 1) ? eoc : (cluster + 1);
+}
+
+// fat_sector is relative to the start of one FAT copy
+static void gen_fat(vfat_t* vfat, uint32_t fat_sector, uint32_t offset, uint8_t* buffer, uint32_t len)
+{
+  for ( uint32_t i = 0; i < len; i++ )
+  {
+    uint32_t const pos = fat_sector*VFAT_SECTOR_SIZE + offset + i;
+    uint8_t value;
+
+    if ( vfat->fat16 )
+    {
+      uint32_t const cluster = pos / 2;
+      value = (cluster < vfat->cluster_count + 2) ? (uint8_t) (fat_entry(vfat, cluster) >> ((pos & 1) * 8)) : 0;
+    }
+    else
+    {
+      // two 12-bit entries are packed into three bytes
+      uint32_t const c0 = (pos / 3) * 2;
+      uint32_t const c1 = c0 + 1;
+      uint32_t const e0 = (c0 < vfat->cluster_count + 2) ? fat_entry(vfat, c0) : 0;
+      uint32_t const e1 = (c1 < vfat->cluster_count + 2) ? fat_entry(vfat, c1) : 0;
+
+      switch ( pos % 3 )
+      {
+        case 0 : value = (uint8_t) e0; break;
+        case 1 : value = (uint8_t) ((e0 >> 8) | (e1 << 4)); break;
+        default: value = (uint8_t) (e1 >> 4); break;
+      }
+    }
+
+    buffer[i] = value;
+  }
+}
+
+static void gen_root(vfat_t* vfat, uint32_t root_sector, uint32_t offset, uint8_t* buffer, uint32_t len)
+{
+  vfat_config_t const* cfg = vfat->cfg;
+
+  uint32_t const first_entry = (root_sector*VFAT_SECTOR_SIZE + offset) / DIR_ENTRY_SIZE;
+  uint32_t const last_entry  = (root_sector*VFAT_SECTOR_SIZE + offset + len - 1) / DIR_ENTRY_SIZE;
+
+  uint32_t cluster = 2;
+  uint16_t file_idx = 0;
+
+  for ( uint32_t idx = first_entry; idx <= last_entry; idx++ )
+  {
+    uint8_t entry[DIR_ENTRY_SIZE];
+    memset(entry, 0, sizeof(entry));
+
+    if ( idx == 0 )
+    {
+      // volume label
+      memset(entry, ' ', 11);
+      if ( cfg->label ) memcpy(entry, cfg->label, min32((uint32_t) strlen(cfg->label), 11));
+      entry[11] = ATTR_VOLUME_ID;
+    }
+    else if ( idx - 1 < cfg->file_count )
+    {
+      // first cluster of the file: sum up clusters of the files before it
+      for ( ; file_idx < idx - 1; file_idx++ ) cluster += file_clusters(vfat, &cfg->files[file_idx]);
+
+      vfat_file_t const* file = &cfg->files[idx - 1];
+
+      format_name(file->name, entry);
+      entry[11] = ATTR_READ_ONLY | ATTR_ARCHIVE;
+      put16(entry + 14, VFAT_TIME);
+      put16(entry + 16, VFAT_DATE);
+      put16(entry + 18, VFAT_DATE);
+      put16(entry + 22, VFAT_TIME);
+      put16(entry + 24, VFAT_DATE);
+      put16(entry + 26, file->size ? (uint16_t) cluster : 0);
+      put32(entry + 28, file->size);
+    }
+
+    uint32_t const entry_off = idx*DIR_ENTRY_SIZE - root_sector*VFAT_SECTOR_SIZE;
+    copy_overlap(buffer, offset, len, entry, entry_off, DIR_ENTRY_SIZE);
+  }
+}
+
+static void gen_data(vfat_t* vfat, uint32_t data_sector, uint32_t offset, uint8_t* buffer, uint32_t len)
+{
+  uint32_t const cluster = 2 + data_sector / vfat->sec_per_cluster;
+
+  memset(buffer, 0, len);
+
+  uint32_t first;
+  vfat_file_t const* file = find_file(vfat, cluster, &first);
+  if ( !file ) return;
+
+  uint32_t const file_off = (data_sector - (first - 2) * vfat->sec_per_cluster) * VFAT_SECTOR_SIZE + offset;
+  if ( file_off >= file->size ) return;
+
+  uint32_t const count = min32(len, file->size - file_off);
+
+  if ( file->data )
+  {
+    memcpy(buffer, ((uint8_t const*) file->data) + file_off, count);
+  }
+  else if ( file->read_cb )
+  {
+    file->read_cb(file, file_off, buffer, count);
+  }
+}
+
+int32_t vfat_read10(vfat_t* vfat, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
+{
+  uint8_t* buf = (uint8_t*) buffer;
+  uint32_t done = 0;
+
+  while ( done < bufsize )
+  {
+    lba    += offset / VFAT_SECTOR_SIZE;
+    offset %= VFAT_SECTOR_SIZE;
+
+    uint32_t const len = min32(bufsize - done, VFAT_SECTOR_SIZE - offset);
+
+    if ( lba >= vfat->sector_count ) return -1;
+
+    if ( lba < vfat->fat_start )
+    {
+      memset(buf + done, 0, len);
+      if ( lba == 0 ) gen_boot(vfat, offset, buf + done, len);
+    }
+    else if ( lba < vfat->root_start )
+    {
+      // all FAT copies are identical
+      gen_fat(vfat, (lba - vfat->fat_start) % vfat->fat_sectors, offset, buf + done, len);
+    }
+    else if ( lba < vfat->data_start )
+    {
+      gen_root(vfat, lba - vfat->root_start, offset, buf + done, len);
+    }
+    else
+    {
+      gen_data(vfat, lba - vfat->data_start, offset, buf + done, len);
+    }
+
+    done   += len;
+    offset += len;
+  }
+
+  return (int32_t) bufsize;
+}
+
+//--------------------------------------------------------------------+
+// Write detection
+//--------------------------------------------------------------------+
+
+// Report the candidate file once every cluster of it is written
+static void check_candidate(vfat_t* vfat)
+{
+  vfat_config_t const* cfg = vfat->cfg;
+
+  if ( !vfat->cand_valid || !cfg->write_map || !cfg->report_map ) return;
+
+  uint32_t const first = vfat->cand_cluster - vfat->free_cluster;
+  uint32_t const count = (vfat->cand_size + cluster_size(vfat) - 1) / cluster_size(vfat);
+  uint32_t const last  = first + count - 1;
+
+  if ( first + count > cfg->write_map_size * 8 ) return;
+
+  for ( uint32_t i = first; i < last; i++ )
+  {
+    if ( !(cfg->write_map[i / 8] & (1u << (i % 8))) ) return;
+  }
+
+  // last cluster is usually not filled up, it is enough that the sectors holding the file are written
+  uint32_t const tail_sectors = ((vfat->cand_size - 1) % cluster_size(vfat)) / VFAT_SECTOR_SIZE + 1;
+
+  if ( !(cfg->write_map[last / 8] & (1u << (last % 8))) &&
+       !(vfat->tail_cluster == vfat->cand_cluster + count - 1 && vfat->tail_sectors >= tail_sectors) )
+  {
+    return;
+  }
+
+  vfat->cand_valid = false;
+  cfg->report_map[first / 8] |= (uint8_t) (1u << (first % 8));
+
+  if ( cfg->file_cb ) cfg->file_cb(vfat, vfat->cand_name, first * cluster_size(vfat), vfat->cand_size);
+}
+
+static void parse_dir_entry(vfat_t* vfat, uint8_t const* entry)
+{
+  // free or deleted
+  if ( entry[0] == 0x00 || entry[0] == 0xE5 ) return;
+
+  // label, directory and long name entries
+  if ( entry[11] & (ATTR_VOLUME_ID | ATTR_DIRECTORY) ) return;
+
+  uint32_t const cluster = get16(entry + 26) | ((uint32_t) get16(entry + 20) << 16);
+  uint32_t const size    = get32(entry + 28);
+
+  if ( size == 0 || cluster < vfat->free_cluster ) return;
+
+  // every other entry of a rewritten directory sector was seen before
+  uint32_t const idx = cluster - vfat->free_cluster;
+  uint8_t const* report_map = vfat->cfg->report_map;
+
+  if ( report_map && idx < vfat->cfg->write_map_size * 8 && (report_map[idx / 8] & (1u << (idx % 8))) ) return;
+
+  memcpy(vfat->cand_name, entry, 11);
+  vfat->cand_cluster = cluster;
+  vfat->cand_size    = size;
+  vfat->cand_valid   = true;
+
+  check_candidate(vfat);
+}
+
+static void write_data(vfat_t* vfat, uint32_t data_sector, uint32_t offset, uint8_t const* data, uint32_t len)
+{
+  vfat_config_t const* cfg = vfat->cfg;
+
+  uint32_t const cluster = 2 + data_sector / vfat->sec_per_cluster;
+
+  // generated files are read-only
+  if ( cluster < vfat->free_cluster ) return;
+
+  uint32_t const free_off = (data_sector - (vfat->free_cluster - 2) * vfat->sec_per_cluster) * VFAT_SECTOR_SIZE + offset;
+  if ( cfg->write_cb ) cfg->write_cb(vfat, free_off, data, len);
+
+  if ( offset + len != VFAT_SECTOR_SIZE ) return;
+
+  // host writes clusters in order: remember how far the latest one got,
+  // it is complete once its last sector is written
+  uint32_t const idx = cluster - vfat->free_cluster;
+
+  vfat->tail_cluster = cluster;
+  vfat->tail_sectors = (uint8_t) (data_sector % vfat->sec_per_cluster + 1);
+
+  if ( (vfat->tail_sectors == vfat->sec_per_cluster) && cfg->write_map && idx < cfg->write_map_size * 8 )
+  {
+    cfg->write_map[idx / 8] |= (uint8_t) (1u << (idx % 8));
+  }
+
+  check_candidate(vfat);
+}
+
+int32_t vfat_write10(vfat_t* vfat, uint32_t lba, uint32_t offset, void const* buffer, uint32_t bufsize)
+{
+  uint8_t const* buf = (uint8_t const*) buffer;
+  uint32_t done = 0;
+
+  while ( done < bufsize )
+  {
+    lba    += offset / VFAT_SECTOR_SIZE;
+    offset %= VFAT_SECTOR_SIZE;
+
+    uint32_t const len = min32(bufsize - done, VFAT_SECTOR_SIZE - offset);
+
+    if ( lba >= vfat->sector_count ) return -1;
+
+    if ( lba >= vfat->data_start )
+    {
+      write_data(vfat, lba - vfat->data_start, offset, buf + done, len);
+    }
+    else if ( lba >= vfat->root_start )
+    {
+      // entries completely inside this write
+      uint32_t const first = (offset + DIR_ENTRY_SIZE - 1) / DIR_ENTRY_SIZE;
+      uint32_t const end   = (offset + len) / DIR_ENTRY_SIZE;
+
+      for ( uint32_t i = first; i < end; i++ )
+      {
+        parse_dir_entry(vfat, buf + done + i*DIR_ENTRY_SIZE - offset);
+      }
+    }
+    else
+    {
+      // boot sector and FAT are generated, host's version is dropped
+    }
+
+    done   += len;
+    offset += len;
+  }
+
+  return (int32_t) bufsize;
+}
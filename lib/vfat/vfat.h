@@ -0,0 +1,153 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef _VFAT_H_
+#define _VFAT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Virtual FAT12/FAT16 volume for the MSC device
+ *
+ * Every sector is computed on demand from a constant file table, nothing but the volume
+ * layout and a few lookup values are kept in RAM. Files are placed back to back in the
+ * data area in table order, followed by free space host can write to.
+ *
+ *   int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
+ *   {
+ *     return vfat_read10(&vfat, lba, offset, buffer, bufsize);
+ *   }
+ *
+ * Host writes are not stored: data written to free clusters is passed to write_cb, and
+ * file_cb reports a new file in the root directory once all of its clusters were written.
+ * Only contiguous files are recognized, which is what hosts allocate on a volume with one
+ * run of free space. Written FAT and directory sectors are not kept, the volume is meant
+ * to be re-enumerated afterwards (e.g. firmware drop followed by a reset).
+ */
+
+#define VFAT_SECTOR_SIZE     512
+
+// Number of root directory entries, including the volume label
+#ifndef VFAT_ROOT_ENTRIES
+#define VFAT_ROOT_ENTRIES    64
+#endif
+
+// Date and time of all generated directory entries, FAT encoded
+#ifndef VFAT_DATE
+#define VFAT_DATE            (((2021 - 1980) << 9) | (1 << 5) | 1)
+#endif
+
+#ifndef VFAT_TIME
+#define VFAT_TIME            0
+#endif
+
+typedef struct vfat_file vfat_file_t;
+typedef struct vfat      vfat_t;
+
+struct vfat_file
+{
+  char const* name;        // 8.3 name e.g "README.TXT", longer parts are truncated
+  uint32_t    size;
+  void const* data;        // content in flash, NULL to use read_cb
+
+  // Generate content on demand when data is NULL, zero filled if both are NULL
+  void (*read_cb)(vfat_file_t const* file, uint32_t offset, uint8_t* buffer, uint32_t len);
+};
+
+typedef struct
+{
+  char const*        label;        // volume label, up to 11 characters
+  uint32_t           volume_id;
+  uint32_t           sector_count; // size of the volume in VFAT_SECTOR_SIZE sectors
+
+  vfat_file_t const* files;
+  uint16_t           file_count;
+
+  // Write detection (optional): one bit per cluster following the generated files.
+  // File detection only covers clusters within the map.
+  uint8_t*           write_map;
+  uint32_t           write_map_size;  // in bytes
+
+  // Same size as write_map, one bit per cluster a file reported to file_cb starts at: host
+  // rewrites the directory whenever it changes, a file is reported once. Needed for file_cb
+  uint8_t*           report_map;
+
+  // Host wrote to the free area. offset is relative to the first free cluster:
+  // a contiguous file written to an empty volume is found at its own offset
+  void (*write_cb)(vfat_t* vfat, uint32_t offset, uint8_t const* data, uint32_t len);
+
+  // All clusters of a new root directory entry were written. name is the 8.3 name as in the
+  // directory entry (space padded, no dot), offset is relative to the first free cluster as for write_cb
+  void (*file_cb)(vfat_t* vfat, uint8_t const name[11], uint32_t offset, uint32_t size);
+} vfat_config_t;
+
+struct vfat
+{
+  vfat_config_t const* cfg;
+
+  // layout, all in sectors
+  uint32_t sector_count;
+  uint32_t fat_start;
+  uint32_t fat_sectors;       // per FAT
+  uint32_t root_start;
+  uint32_t data_start;
+  uint32_t cluster_count;
+  uint32_t free_cluster;      // first cluster after the generated files
+  uint8_t  sec_per_cluster;
+  bool     fat16;
+
+  // last file found by cluster, sequential reads look it up in constant time
+  uint16_t cache_file;
+  uint32_t cache_cluster;
+
+  // newest directory entry pointing into the free area that is not complete yet
+  uint8_t  cand_name[11];
+  bool     cand_valid;
+  uint32_t cand_cluster;
+  uint32_t cand_size;
+
+  uint32_t tail_cluster;      // cluster of the latest data write and sectors written into it
+  uint8_t  tail_sectors;
+};
+
+// Compute the volume layout, return false if the files do not fit
+bool vfat_init(vfat_t* vfat, vfat_config_t const* cfg);
+
+// Same semantic as tud_msc_read10_cb() and tud_msc_write10_cb() with a block size of VFAT_SECTOR_SIZE
+int32_t vfat_read10(vfat_t* vfat, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
+int32_t vfat_write10(vfat_t* vfat, uint32_t lba, uint32_t offset, void const* buffer, uint32_t bufsize);
+
+static inline uint32_t vfat_block_count(vfat_t const* vfat)
+{
+  return vfat->sector_count;
+}
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif /* _VFAT_H_ */
@@ -65,7 +65,8 @@ typedef enum
 {
   MSC_PROTOCOL_CBI              = 0 ,  ///< Control/Bulk/Interrupt protocol (with command completion interrupt)
   MSC_PROTOCOL_CBI_NO_INTERRUPT = 1 ,  ///< Control/Bulk/Interrupt protocol (without command completion interrupt)
-  MSC_PROTOCOL_BOT              = 0x50 ///< Bulk-Only Transport
+  MSC_PROTOCOL_BOT              = 0x50, ///< Bulk-Only Transport
+  MSC_PROTOCOL_UAS              = 0x62  ///< USB Attached SCSI
 }msc_protocol_type_t;
 
 /// MassStorage Class-Specific Control Request
@@ -128,8 +129,19 @@ typedef enum
   SCSI_CMD_READ_FORMAT_CAPACITY         = 0x23, ///< The command allows the Host to request a list of the possible format capacities for an installed writable media. This command also has the capability to report the writable capacity for a media when it is installed
   SCSI_CMD_READ_10                      = 0x28, ///< The READ (10) command requests that the device server read the specified logical block(s) and transfer them to the data-in buffer.
   SCSI_CMD_WRITE_10                     = 0x2A, ///< The WRITE (10) command requests thatthe device server transfer the specified logical block(s) from the data-out buffer and write them.
+  SCSI_CMD_SYNCHRONIZE_CACHE_10         = 0x35, ///< Write back cached data of the given range (or everything) to the medium
+  SCSI_CMD_READ_16                      = 0x88, ///< READ (16) is READ (10) with 64-bit LBA and 32-bit transfer length
+  SCSI_CMD_WRITE_16                     = 0x8A, ///< WRITE (16) is WRITE (10) with 64-bit LBA and 32-bit transfer length
+  SCSI_CMD_SYNCHRONIZE_CACHE_16         = 0x91, ///< SYNCHRONIZE CACHE (10) with 64-bit LBA
+  SCSI_CMD_SERVICE_ACTION_IN_16         = 0x9E, ///< Service action in byte 1, see \ref SCSI_SERVICE_ACTION_READ_CAPACITY_16
 }scsi_cmd_type_t;
 
+/// Service actions of \ref SCSI_CMD_SERVICE_ACTION_IN_16
+enum
+{
+  SCSI_SERVICE_ACTION_READ_CAPACITY_16 = 0x10,
+};
+
 /// SCSI Sense Key
 typedef enum
 {
@@ -382,6 +394,158 @@ typedef struct TU_ATTR_PACKED
 TU_VERIFY_STATIC(sizeof(scsi_read10_t) == 10, "size is not correct");
 TU_VERIFY_STATIC(sizeof(scsi_write10_t) == 10, "size is not correct");
 
+/// SCSI Read Capacity 16 Command
+typedef struct TU_ATTR_PACKED
+{
+  uint8_t  cmd_code       ; ///< SCSI OpCode for \ref SCSI_CMD_SERVICE_ACTION_IN_16
+  uint8_t  service_action ; ///< \ref SCSI_SERVICE_ACTION_READ_CAPACITY_16 (lower 5 bits)
+  uint64_t lba            ;
+  uint32_t alloc_length   ; ///< Maximum number of response bytes the host accepts
+  uint8_t  pmi            ;
+  uint8_t  control        ;
+} scsi_read_capacity16_t;
+
+TU_VERIFY_STATIC(sizeof(scsi_read_capacity16_t) == 16, "size is not correct");
+
+/// SCSI Read Capacity 16 Response Data
+typedef struct TU_ATTR_PACKED
+{
+  uint64_t last_lba      ; ///< The last Logical Block Address of the device
+  uint32_t block_size    ; ///< Block size in bytes
+  uint8_t  prot_info     ;
+  uint8_t  lbppb_exp     ; ///< logical blocks per physical block exponent
+  uint16_t lowest_aligned_lba;
+  uint8_t  reserved[16]  ;
+} scsi_read_capacity16_resp_t;
+
+TU_VERIFY_STATIC(sizeof(scsi_read_capacity16_resp_t) == 32, "size is not correct");
+
+/// SCSI Read 16 Command
+typedef struct TU_ATTR_PACKED
+{
+  uint8_t  cmd_code    ; ///< SCSI OpCode
+  uint8_t  flags       ;
+  uint64_t lba         ; ///< The first Logical Block Address (LBA) accessed by this command
+  uint32_t block_count ; ///< Number of Blocks used by this command
+  uint8_t  group       ;
+  uint8_t  control     ;
+} scsi_read16_t, scsi_write16_t;
+
+TU_VERIFY_STATIC(sizeof(scsi_read16_t) == 16, "size is not correct");
+TU_VERIFY_STATIC(sizeof(scsi_write16_t) == 16, "size is not correct");
+
+//--------------------------------------------------------------------+
+// USB Attached SCSI (UAS)
+//--------------------------------------------------------------------+
+
+/// Pipe Usage descriptor, follows every endpoint descriptor of an UAS interface
+enum { MSC_DESC_TYPE_PIPE_USAGE = 0x24 };
+
+/// UAS Pipe ID
+typedef enum
+{
+  MSC_UAS_PIPE_COMMAND  = 1,
+  MSC_UAS_PIPE_STATUS   = 2,
+  MSC_UAS_PIPE_DATA_IN  = 3,
+  MSC_UAS_PIPE_DATA_OUT = 4
+}msc_uas_pipe_id_t;
+
+/// UAS Information Unit ID
+typedef enum
+{
+  MSC_UAS_IU_COMMAND     = 0x01,
+  MSC_UAS_IU_SENSE       = 0x03,
+  MSC_UAS_IU_RESPONSE    = 0x04,
+  MSC_UAS_IU_TASK_MGMT   = 0x05,
+  MSC_UAS_IU_READ_READY  = 0x06,
+  MSC_UAS_IU_WRITE_READY = 0x07
+}msc_uas_iu_id_t;
+
+/// Response code of Response IU
+typedef enum
+{
+  MSC_UAS_RESPONSE_TMF_COMPLETE      = 0x00,
+  MSC_UAS_RESPONSE_INVALID_IU        = 0x02,
+  MSC_UAS_RESPONSE_TMF_NOT_SUPPORTED = 0x04,
+  MSC_UAS_RESPONSE_TMF_FAILED        = 0x05,
+  MSC_UAS_RESPONSE_TMF_SUCCEEDED     = 0x08,
+  MSC_UAS_RESPONSE_INCORRECT_LUN     = 0x09,
+  MSC_UAS_RESPONSE_OVERLAPPED_TAG    = 0x0A
+}msc_uas_response_code_t;
+
+/// Task management function
+enum
+{
+  MSC_UAS_TMF_ABORT_TASK = 0x01
+};
+
+/// Command IU, without additional CDB bytes
+typedef struct TU_ATTR_PACKED
+{
+  uint8_t  iu_id;       ///< MSC_UAS_IU_COMMAND
+  uint8_t  reserved;
+  uint16_t tag;         ///< Big Endian, echoed in every IU of this command
+  uint8_t  attribute;   ///< Task priority and attribute
+  uint8_t  reserved2;
+  uint8_t  add_cdb_len; ///< Additional CDB length in dwords (bit 7..2)
+  uint8_t  reserved3;
+  uint8_t  lun[8];
+  uint8_t  cdb[16];
+}msc_uas_command_iu_t;
+
+TU_VERIFY_STATIC(sizeof(msc_uas_command_iu_t) == 32, "size is not correct");
+
+/// Task Management IU
+typedef struct TU_ATTR_PACKED
+{
+  uint8_t  iu_id;       ///< MSC_UAS_IU_TASK_MGMT
+  uint8_t  reserved;
+  uint16_t tag;         ///< Big Endian
+  uint8_t  function;    ///< Task management function
+  uint8_t  reserved2;
+  uint16_t task_tag;    ///< Big Endian, tag of the task to manage
+  uint8_t  lun[8];
+}msc_uas_task_mgmt_iu_t;
+
+TU_VERIFY_STATIC(sizeof(msc_uas_task_mgmt_iu_t) == 16, "size is not correct");
+
+/// Sense IU, completes a command. Sense data is only present with a CHECK CONDITION status
+typedef struct TU_ATTR_PACKED
+{
+  uint8_t  iu_id;       ///< MSC_UAS_IU_SENSE
+  uint8_t  reserved;
+  uint16_t tag;         ///< Big Endian
+  uint16_t status_qualifier;
+  uint8_t  status;      ///< SCSI status: 0 Good, 2 Check Condition
+  uint8_t  reserved2[7];
+  uint16_t sense_len;   ///< Big Endian
+  scsi_sense_fixed_resp_t sense;
+}msc_uas_sense_iu_t;
+
+TU_VERIFY_STATIC(sizeof(msc_uas_sense_iu_t) == 16 + 18, "size is not correct");
+
+/// Response IU, answers a Task Management IU
+typedef struct TU_ATTR_PACKED
+{
+  uint8_t  iu_id;       ///< MSC_UAS_IU_RESPONSE
+  uint8_t  reserved;
+  uint16_t tag;         ///< Big Endian
+  uint8_t  add_info[3];
+  uint8_t  response_code;
+}msc_uas_response_iu_t;
+
+TU_VERIFY_STATIC(sizeof(msc_uas_response_iu_t) == 8, "size is not correct");
+
+/// Read Ready and Write Ready IU, announce the data phase of a command
+typedef struct TU_ATTR_PACKED
+{
+  uint8_t  iu_id;       ///< MSC_UAS_IU_READ_READY or MSC_UAS_IU_WRITE_READY
+  uint8_t  reserved;
+  uint16_t tag;         ///< Big Endian
+}msc_uas_ready_iu_t;
+
+TU_VERIFY_STATIC(sizeof(msc_uas_ready_iu_t) == 4, "size is not correct");
+
 #ifdef __cplusplus
  }
 #endif
@@ -41,112 +41,1355 @@ enum
   MSC_STAGE_CMD  = 0,
   MSC_STAGE_DATA,
   MSC_STAGE_STATUS,
-  MSC_STAGE_STATUS_SENT
+  MSC_STAGE_STATUS_SENT,
+  MSC_STAGE_UAS_READY   // UAS: Read/Write Ready IU is on the status pipe, data phase follows
 };
 
+// Asynchronous read10/write10 callback
+enum
+{
+  MSC_ASYNC_NONE = 0,
+  MSC_ASYNC_PENDING,  // callback returned TUD_MSC_RET_ASYNC
+  MSC_ASYNC_DONE      // result is available, returned to the next callback invocation instead of calling it
+};
+
+typedef struct
+{
+  // TODO optimize alignment
+  CFG_TUSB_MEM_ALIGN msc_cbw_t cbw;
+  CFG_TUSB_MEM_ALIGN msc_csw_t csw;
+
+  uint8_t  rhport;
+  uint8_t  itf_num;
+  uint8_t  ep_in;       // BOT endpoint, or UAS Data-In pipe when alternate setting 1 is active
+  uint8_t  ep_out;      // BOT endpoint, or UAS Data-Out pipe when alternate setting 1 is active
+
+#if CFG_TUD_MSC_UAS
+  uint8_t  ep_bot_in;
+  uint8_t  ep_bot_out;
+  uint8_t  ep_cmd;
+  uint8_t  ep_status;
+  uint8_t  ep_data_in;
+  uint8_t  ep_data_out;
+  bool     uas;         // alternate setting 1 is active
+
+  // endpoints are only open while their alternate setting is active
+  tusb_desc_interface_t const * desc_alt[2];
+#endif
+
+  // Bulk Only Transfer (BOT) Protocol
+  uint8_t  stage;
+  uint32_t total_len;
+  uint32_t xferred_len; // numbered of bytes transferred so far in the Data Stage
+
+  // READ10 : buffer on the bus
+  // WRITE10: buffer the next OUT transfer goes to, application drains the other one
+  uint8_t  buf_idx;
+
+  uint8_t  async;
+  int32_t  async_result;
+  uint32_t async_len;   // WRITE10: bytes in buffer offered to the pending callback
+
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+  bool     rd_async;    // READ10 : pending async callback is a prefetch
+  bool     rd_wait;     // READ10 : bus is idle, waiting for the prefetch to complete
+  bool     rd_failed;   // READ10 : prefetch returned an error, command fails once the bus is idle
+  uint32_t rd_ready;    // READ10 : bytes already read into the idle buffer
+  uint32_t rx_len;      // WRITE10: bytes requested from host so far
+  uint32_t rx_ready;    // WRITE10: bytes received into buf_idx, not handed to application yet
+  uint32_t wr_off;      // WRITE10: application progress in the other buffer
+  uint32_t wr_len;      // WRITE10: bytes left for application in the other buffer
+  bool     out_busy;
+#endif
+
+  // Sense Response Data
+  uint8_t sense_key;
+  uint8_t add_sense_code;
+  uint8_t add_sense_qualifier;
+}mscd_interface_t;
+
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static mscd_interface_t _mscd_itf;
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t _mscd_buf[CFG_TUD_MSC_DOUBLE_BUFFER ? 2 : 1][CFG_TUD_MSC_EP_BUFSIZE];
+
+#if CFG_TUD_MSC_UAS
 typedef struct
 {
-  // TODO optimize alignment
-  CFG_TUSB_MEM_ALIGN msc_cbw_t cbw;
-  CFG_TUSB_MEM_ALIGN msc_csw_t csw;
+  CFG_TUSB_MEM_ALIGN uint8_t iu_buf[64]; // command pipe
+
+  // status pipe
+  CFG_TUSB_MEM_ALIGN union
+  {
+    msc_uas_ready_iu_t    ready;
+    msc_uas_sense_iu_t    sense;
+    msc_uas_response_iu_t response;
+  } status;
+
+  // commands received but not started yet
+  msc_uas_command_iu_t queue[CFG_TUD_MSC_UAS_QDEPTH];
+  uint8_t  rd_idx;
+  uint8_t  count;
+
+  uint16_t tag;          // Big Endian, command being executed
+
+  bool     tmf_pending;  // Response IU is waiting for the status pipe
+  uint8_t  tmf_response;
+  uint16_t tmf_tag;      // Big Endian
+} mscd_uas_t;
+
+CFG_TUSB_MEM_SECTION static mscd_uas_t _mscd_uas;
+#endif
+
+//--------------------------------------------------------------------+
+// INTERNAL OBJECT & FUNCTION DECLARATION
+//--------------------------------------------------------------------+
+static int32_t proc_builtin_scsi(uint8_t lun, uint8_t const scsi_cmd[16], uint8_t* buffer, uint32_t bufsize);
+static int32_t invoke_read10_cb(mscd_interface_t* p_msc, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
+static int32_t invoke_write10_cb(mscd_interface_t* p_msc, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize);
+static bool proc_command(uint8_t rhport, mscd_interface_t* p_msc);
+static bool proc_status(uint8_t rhport, mscd_interface_t* p_msc);
+static void proc_read10_cmd(uint8_t rhport, mscd_interface_t* p_msc);
+static void proc_write10_cmd(uint8_t rhport, mscd_interface_t* p_msc);
+
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+static void proc_read10_prefetch(mscd_interface_t* p_msc, uint32_t block_sz, uint32_t offset);
+static void proc_write10_data(uint8_t rhport, mscd_interface_t* p_msc, uint8_t ep_addr, uint32_t xferred_bytes);
+#endif
+
+// READ10/READ16 and WRITE10/WRITE16 share callbacks and data stage handling
+static inline bool rdwr_is_read(uint8_t cmd)
+{
+  return (cmd == SCSI_CMD_READ_10) || (cmd == SCSI_CMD_READ_16);
+}
+
+static inline bool rdwr_is_write(uint8_t cmd)
+{
+  return (cmd == SCSI_CMD_WRITE_10) || (cmd == SCSI_CMD_WRITE_16);
+}
+
+static inline bool rdwr_is_cmd16(uint8_t cmd)
+{
+  return (cmd == SCSI_CMD_READ_16) || (cmd == SCSI_CMD_WRITE_16);
+}
+
+// Upper 32 bit of a 16-byte command's LBA, callbacks can only address the lower 32 bit
+static inline uint32_t rdwr16_get_lba_high(uint8_t const command[])
+{
+  return rdwr_is_cmd16(command[0]) ? tu_unaligned_read32(command + offsetof(scsi_write16_t, lba)) : 0;
+}
+
+static inline uint32_t rdwr_get_lba(uint8_t const command[])
+{
+  // use offsetof to avoid pointer to the odd/unaligned address
+  // for 16-byte command take the lower half of the 64-bit lba
+  uint32_t const lba = rdwr_is_cmd16(command[0]) ? tu_unaligned_read32(command + offsetof(scsi_write16_t, lba) + 4) :
+                                                   tu_unaligned_read32(command + offsetof(scsi_write10_t, lba));
+
+  // lba is in Big Endian
+  return tu_ntohl(lba);
+}
+
+static inline uint32_t rdwr_get_blockcount(uint8_t const command[])
+{
+  // use offsetof to avoid pointer to the odd/misaligned address
+  // block count is in Big Endian
+  if ( rdwr_is_cmd16(command[0]) )
+  {
+    return tu_ntohl(tu_unaligned_read32(command + offsetof(scsi_write16_t, block_count)));
+  }
+
+  return tu_ntohs(tu_unaligned_read16(command + offsetof(scsi_write10_t, block_count)));
+}
+
+// Terminate data stage early: BOT stalls the endpoint so that host moves on to the status stage.
+// UAS has no such handshake, host stops the data phase once it receives the Sense IU.
+static inline void proc_stall_data(uint8_t rhport, mscd_interface_t* p_msc, uint8_t ep_addr)
+{
+#if CFG_TUD_MSC_UAS
+  if ( p_msc->uas ) return;
+#else
+  (void) p_msc;
+#endif
+
+  usbd_edpt_stall(rhport, ep_addr);
+}
+
+static void proc_complete_cb(msc_cbw_t const * p_cbw)
+{
+  // Invoke complete callback if defined
+  // Note: There is racing issue with samd51 + qspi flash testing with arduino
+  // if complete_cb() is invoked after queuing the status.
+  switch(p_cbw->command[0])
+  {
+    case SCSI_CMD_READ_10:
+    case SCSI_CMD_READ_16:
+      if ( tud_msc_read10_complete_cb ) tud_msc_read10_complete_cb(p_cbw->lun);
+    break;
+
+    case SCSI_CMD_WRITE_10:
+    case SCSI_CMD_WRITE_16:
+      if ( tud_msc_write10_complete_cb ) tud_msc_write10_complete_cb(p_cbw->lun);
+    break;
+
+    default:
+      if ( tud_msc_scsi_complete_cb ) tud_msc_scsi_complete_cb(p_cbw->lun, p_cbw->command);
+    break;
+  }
+}
+
+//--------------------------------------------------------------------+
+// Debug
+//--------------------------------------------------------------------+
+#if CFG_TUSB_DEBUG >= 2
+
+static tu_lookup_entry_t const _msc_scsi_cmd_lookup[] =
+{
+  { .key = SCSI_CMD_TEST_UNIT_READY              , .data = "Test Unit Ready" },
+  { .key = SCSI_CMD_INQUIRY                      , .data = "Inquiry" },
+  { .key = SCSI_CMD_MODE_SELECT_6                , .data = "Mode_Select 6" },
+  { .key = SCSI_CMD_MODE_SENSE_6                 , .data = "Mode_Sense 6" },
+  { .key = SCSI_CMD_START_STOP_UNIT              , .data = "Start Stop Unit" },
+  { .key = SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL , .data = "Prevent Allow Medium Removal" },
+  { .key = SCSI_CMD_READ_CAPACITY_10             , .data = "Read Capacity10" },
+  { .key = SCSI_CMD_REQUEST_SENSE                , .data = "Request Sense" },
+  { .key = SCSI_CMD_READ_FORMAT_CAPACITY         , .data = "Read Format Capacity" },
+  { .key = SCSI_CMD_READ_10                      , .data = "Read10" },
+  { .key = SCSI_CMD_WRITE_10                     , .data = "Write10" },
+  { .key = SCSI_CMD_READ_16                      , .data = "Read16" },
+  { .key = SCSI_CMD_WRITE_16                     , .data = "Write16" },
+  { .key = SCSI_CMD_SERVICE_ACTION_IN_16         , .data = "Service Action In16" }
+};
+
+static tu_lookup_table_t const _msc_scsi_cmd_table =
+{
+  .count = TU_ARRAY_SIZE(_msc_scsi_cmd_lookup),
+  .items = _msc_scsi_cmd_lookup
+};
+
+#endif
+
+//--------------------------------------------------------------------+
+// Write-back Cache
+//--------------------------------------------------------------------+
+#if CFG_TUD_MSC_CACHE_LINES
+
+TU_VERIFY_STATIC(CFG_TUD_MSC_CACHE_ERASE_SIZE % 512 == 0, "erase size must be multiple of 512");
+
+typedef struct
+{
+  uint32_t base_lba;   // first block of the erase block
+  uint32_t dirty;      // one bit per block, only dirty blocks hold valid data
+  uint32_t stamp;      // last use for LRU eviction
+  uint16_t block_sz;
+  uint8_t  lun;
+  bool     valid;
+
+  CFG_TUSB_MEM_ALIGN uint8_t data[CFG_TUD_MSC_CACHE_ERASE_SIZE];
+} mscd_cache_line_t;
+
+// Result of a write back
+enum
+{
+  CACHE_WB_DONE = 0,
+  CACHE_WB_PENDING,  // callback busy or asynchronous, invoke again to continue
+  CACHE_WB_ERROR
+};
+
+// What waits for a pending write back
+enum
+{
+  CACHE_RESUME_NONE = 0,
+  CACHE_RESUME_IDLE,   // idle flush
+  CACHE_RESUME_CMD,    // command, executed again once write back is complete
+  CACHE_RESUME_WRITE   // WRITE10 data stage evicting a line
+};
+
+typedef struct
+{
+  mscd_cache_line_t line[CFG_TUD_MSC_CACHE_LINES];
+  uint32_t stamp;
+
+  // block written in pieces smaller than a block, only marked dirty once complete
+  mscd_cache_line_t* fill_line;
+  uint32_t fill_idx;
+  uint32_t fill_len;
+
+  // write back interrupted by a busy or asynchronous tud_msc_write10_cb()
+  mscd_cache_line_t* wb_line;
+  uint32_t wb_off;     // bytes of the first dirty block already written
+  bool     wb_async;   // callback returned TUD_MSC_RET_ASYNC, completed by tud_msc_async_io_done()
+  bool     wb_error;   // asynchronous write failed
+  uint8_t  wb_resume;
+
+  // idle detection, write_count is updated in usbd task, the rest by tud_msc_cache_task()
+  volatile uint32_t write_count;
+  volatile bool     flush_posted;
+  volatile bool     flush_failed;
+  uint32_t idle_count;
+  uint32_t idle_start;
+
+  tud_msc_cache_stats_t stats;
+} mscd_cache_t;
+
+// not cleared on bus reset, dirty data must survive until written back
+CFG_TUSB_MEM_SECTION static mscd_cache_t _mscd_cache;
+
+static void cache_resume(void* param);
+
+static inline bool cache_usable(uint32_t block_sz)
+{
+  return block_sz && (CFG_TUD_MSC_CACHE_ERASE_SIZE % block_sz == 0) && (CFG_TUD_MSC_CACHE_ERASE_SIZE / block_sz <= 32);
+}
+
+// First run of adjacent dirty blocks, return its length in blocks (0 if line is clean)
+static uint32_t cache_first_run(mscd_cache_line_t const* line, uint32_t* blk)
+{
+  uint32_t const nblocks = CFG_TUD_MSC_CACHE_ERASE_SIZE / line->block_sz;
+  uint32_t i = 0;
+
+  while ( (i < nblocks) && !tu_bit_test(line->dirty, i) ) i++;
+  *blk = i;
+
+  uint32_t run = 0;
+  while ( (i + run < nblocks) && tu_bit_test(line->dirty, i + run) ) run++;
+
+  return run;
+}
+
+// Account for nbytes of the first dirty run written to the medium
+static void cache_writeback_advance(mscd_cache_line_t* line, uint32_t nbytes)
+{
+  uint32_t const block_sz = line->block_sz;
+  uint32_t blk;
+  uint32_t const remain = cache_first_run(line, &blk)*block_sz - _mscd_cache.wb_off;
+  uint32_t const pos    = _mscd_cache.wb_off + tu_min32(nbytes, remain);
+
+  // clear as we go, a failed line keeps only what is not written yet
+  for(uint32_t i=0; i<pos/block_sz; i++) line->dirty = tu_bit_clear(line->dirty, blk + i);
+  _mscd_cache.wb_off = pos % block_sz;
+}
+
+// Write dirty blocks back, every run of adjacent dirty blocks with one callback.
+// A busy or asynchronous callback leaves the line as it is, invoking this again continues where it stopped.
+static uint8_t cache_writeback(mscd_cache_line_t* line)
+{
+  if ( _mscd_cache.wb_async ) return CACHE_WB_PENDING;
+
+  if ( _mscd_cache.wb_line != line )
+  {
+    // an interrupted write back of another line starts over with its first dirty block
+    _mscd_cache.wb_line  = line;
+    _mscd_cache.wb_off   = 0;
+    _mscd_cache.wb_error = false;
+  }
+
+  if ( _mscd_cache.wb_error )
+  {
+    _mscd_cache.wb_error = false;
+    _mscd_cache.wb_line  = NULL;
+    _mscd_cache.stats.writeback_errors++;
+    return CACHE_WB_ERROR;
+  }
+
+  uint32_t blk;
+  uint32_t run;
+
+  while ( (run = cache_first_run(line, &blk)) != 0 )
+  {
+    uint32_t const off = _mscd_cache.wb_off;
+    int32_t const nbytes = tud_msc_write10_cb(line->lun, line->base_lba + blk, off, line->data + blk*line->block_sz + off,
+                                              run*line->block_sz - off);
+    _mscd_cache.stats.write_cbs++;
+
+    if ( nbytes == TUD_MSC_RET_ASYNC )
+    {
+      _mscd_cache.wb_async = true;
+      return CACHE_WB_PENDING;
+    }
+
+    if ( nbytes == TUD_MSC_RET_BUSY ) return CACHE_WB_PENDING;
+
+    if ( nbytes < 0 )
+    {
+      _mscd_cache.wb_line = NULL;
+      _mscd_cache.stats.writeback_errors++;
+      return CACHE_WB_ERROR;
+    }
+
+    cache_writeback_advance(line, (uint32_t) nbytes);
+  }
+
+  _mscd_cache.wb_line = NULL;
+  _mscd_cache.stats.writebacks++;
+  line->valid = false;
+  if ( _mscd_cache.fill_line == line ) _mscd_cache.fill_line = NULL;
+
+  return CACHE_WB_DONE;
+}
+
+// Invoked by proc_async_io_done() with the result of an asynchronous write back
+static void cache_writeback_done(int32_t nbytes)
+{
+  _mscd_cache.wb_async = false;
+
+  if ( nbytes < 0 )
+  {
+    // reported by the next cache_writeback() of this line
+    _mscd_cache.wb_error = true;
+  }else
+  {
+    cache_writeback_advance(_mscd_cache.wb_line, (uint32_t) nbytes);
+  }
+}
+
+// Command or idle flush waits for a pending write back, continued by cache_resume()
+static void cache_wait(uint8_t resume)
+{
+  // a command takes over from the idle flush, which is posted again by tud_msc_cache_task()
+  if ( (_mscd_cache.wb_resume == CACHE_RESUME_IDLE) && (resume != CACHE_RESUME_IDLE) ) _mscd_cache.flush_posted = false;
+
+  _mscd_cache.wb_resume = resume;
+
+  // busy callback is retried from usbd task, an asynchronous one resumes once it completes
+  if ( !_mscd_cache.wb_async ) usbd_defer_func(cache_resume, NULL, false);
+}
+
+static uint8_t cache_flush(uint8_t lun)
+{
+  uint8_t ret = CACHE_WB_DONE;
+
+  for(uint8_t i=0; i<CFG_TUD_MSC_CACHE_LINES; i++)
+  {
+    mscd_cache_line_t* line = &_mscd_cache.line[i];
+    if ( !line->valid || line->lun != lun ) continue;
+
+    uint8_t const wb = cache_writeback(line);
+
+    // lines done so far are invalid, the flush continues with the rest when executed again
+    if ( wb == CACHE_WB_PENDING ) return CACHE_WB_PENDING;
+    if ( wb == CACHE_WB_ERROR   ) ret = CACHE_WB_ERROR;
+  }
+
+  return ret;
+}
+
+static mscd_cache_line_t* cache_find_line(uint8_t lun, uint32_t lba, uint32_t block_sz)
+{
+  for(uint8_t i=0; i<CFG_TUD_MSC_CACHE_LINES; i++)
+  {
+    mscd_cache_line_t* line = &_mscd_cache.line[i];
+
+    if ( line->valid && line->lun == lun && line->block_sz == block_sz &&
+         (lba - line->base_lba) < CFG_TUD_MSC_CACHE_ERASE_SIZE / block_sz )
+    {
+      return line;
+    }
+  }
+
+  return NULL;
+}
+
+// Allocate line for the erase block containing lba, evict the least recently used one if needed.
+// Return write back result of the evicted line, *p_line is only set on CACHE_WB_DONE.
+static uint8_t cache_alloc_line(uint8_t lun, uint32_t lba, uint32_t block_sz, mscd_cache_line_t** p_line)
+{
+  mscd_cache_line_t* victim = &_mscd_cache.line[0];
+
+  for(uint8_t i=1; i<CFG_TUD_MSC_CACHE_LINES && victim->valid; i++)
+  {
+    mscd_cache_line_t* line = &_mscd_cache.line[i];
+    if ( !line->valid || (int32_t) (line->stamp - victim->stamp) < 0 ) victim = line;
+  }
+
+  if ( victim->valid )
+  {
+    uint8_t const wb = cache_writeback(victim);
+    if ( wb != CACHE_WB_DONE ) return wb;
+  }
+
+  victim->valid    = true;
+  victim->lun      = lun;
+  victim->base_lba = lba - (lba % (CFG_TUD_MSC_CACHE_ERASE_SIZE / block_sz));
+  victim->block_sz = (uint16_t) block_sz;
+  victim->dirty    = 0;
+
+  *p_line = victim;
+  return CACHE_WB_DONE;
+}
+
+// Store host data in cache. Return number of bytes taken: less than bufsize (including zero) if write back
+// of an evicted line has to wait, negative if it failed.
+static int32_t cache_write(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t const* buffer, uint32_t bufsize, uint32_t block_sz)
+{
+  uint32_t done = 0;
+
+  _mscd_cache.write_count++;
+
+  while ( done < bufsize )
+  {
+    lba    += offset / block_sz;
+    offset %= block_sz;
+
+    mscd_cache_line_t* line = cache_find_line(lun, lba, block_sz);
+    bool const hit = (line != NULL);
+
+    if ( !line )
+    {
+      uint8_t const wb = cache_alloc_line(lun, lba, block_sz, &line);
+
+      // evicted line is not written back yet: host data is offered again later
+      if ( wb == CACHE_WB_PENDING ) return (int32_t) done;
+      if ( wb == CACHE_WB_ERROR   ) return -1;
+    }
+
+    // statistics are per block, counted where the block starts
+    if ( offset == 0 )
+    {
+      if ( hit ) _mscd_cache.stats.write_hits++;
+      else       _mscd_cache.stats.write_misses++;
+    }
+
+    uint32_t const idx = lba - line->base_lba;
+    uint32_t const len = tu_min32(bufsize - done, block_sz - offset);
+
+    memcpy(line->data + idx*block_sz + offset, buffer + done, len);
+
+    if ( (len == block_sz) || tu_bit_test(line->dirty, idx) )
+    {
+      // whole block, or part of a block that already holds valid data
+      line->dirty = tu_bit_set(line->dirty, idx);
+    }
+    else if ( offset == 0 )
+    {
+      // first piece of a block: the rest is stale until host sends it, not dirty yet
+      _mscd_cache.fill_line = line;
+      _mscd_cache.fill_idx  = idx;
+      _mscd_cache.fill_len  = len;
+    }
+    else if ( (_mscd_cache.fill_line == line) && (_mscd_cache.fill_idx == idx) && (_mscd_cache.fill_len == offset) )
+    {
+      _mscd_cache.fill_len += len;
+      if ( _mscd_cache.fill_len == block_sz )
+      {
+        line->dirty = tu_bit_set(line->dirty, idx);
+        _mscd_cache.fill_line = NULL;
+      }
+    }
+    else
+    {
+      // piece without the start of its block, it could only be written back with stale data around it
+      return -1;
+    }
+
+    line->stamp = ++_mscd_cache.stamp;
+
+    done   += len;
+    offset += len;
+  }
+
+  return (int32_t) done;
+}
+
+// Patch data read from medium with blocks that are still dirty in cache
+static void cache_read_overlay(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize, uint32_t block_sz)
+{
+  for(uint8_t i=0; i<CFG_TUD_MSC_CACHE_LINES; i++)
+  {
+    mscd_cache_line_t const* line = &_mscd_cache.line[i];
+    if ( !line->valid || line->lun != lun || line->block_sz != block_sz ) continue;
+
+    uint32_t done = 0;
+    uint32_t cur_lba = lba;
+    uint32_t cur_off = offset;
+
+    while ( done < bufsize )
+    {
+      cur_lba += cur_off / block_sz;
+      cur_off %= block_sz;
+
+      uint32_t const len = tu_min32(bufsize - done, block_sz - cur_off);
+      uint32_t const idx = cur_lba - line->base_lba;
+
+      if ( idx < CFG_TUD_MSC_CACHE_ERASE_SIZE / block_sz && tu_bit_test(line->dirty, idx) )
+      {
+        memcpy(buffer + done, line->data + idx*block_sz + cur_off, len);
+        if ( cur_off == 0 ) _mscd_cache.stats.read_hits++;
+      }
+
+      done    += len;
+      cur_off += len;
+    }
+  }
+}
+
+static void cache_idle_flush(void* param)
+{
+  (void) param;
+
+  // only between commands, a write in progress restarts the idle time anyway.
+  // An asynchronous read-ahead may still be running, only one asynchronous callback at a time.
+  if ( (_mscd_itf.stage != MSC_STAGE_CMD) || (_mscd_itf.async != MSC_ASYNC_NONE) )
+  {
+    _mscd_cache.flush_posted = false;
+    return;
+  }
+
+  for(uint8_t i=0; i<CFG_TUD_MSC_CACHE_LINES; i++)
+  {
+    if ( !_mscd_cache.line[i].valid ) continue;
+
+    uint8_t const wb = cache_writeback(&_mscd_cache.line[i]);
+
+    if ( wb == CACHE_WB_PENDING )
+    {
+      cache_wait(CACHE_RESUME_IDLE);
+      return;
+    }
+
+    // line keeps what is not written, retried after another idle period or reported by SYNCHRONIZE CACHE
+    if ( wb == CACHE_WB_ERROR ) _mscd_cache.flush_failed = true;
+  }
+
+  _mscd_cache.flush_posted = false;
+}
+
+// Continue whatever waits for a write back, in usbd task context
+static void cache_resume(void* param)
+{
+  (void) param;
+
+  mscd_interface_t* p_msc = &_mscd_itf;
+  uint8_t const rhport = p_msc->rhport;
+  uint8_t const resume = _mscd_cache.wb_resume;
+
+  _mscd_cache.wb_resume = CACHE_RESUME_NONE;
+
+  switch ( resume )
+  {
+    case CACHE_RESUME_IDLE:
+      cache_idle_flush(NULL);
+    break;
+
+    case CACHE_RESUME_CMD:
+      // interface was reset meanwhile
+      if ( p_msc->stage != MSC_STAGE_DATA ) break;
+
+      proc_command(rhport, p_msc);
+      if ( p_msc->stage == MSC_STAGE_STATUS ) proc_status(rhport, p_msc);
+    break;
+
+    case CACHE_RESUME_WRITE:
+      if ( p_msc->stage != MSC_STAGE_DATA ) break;
+
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+      proc_write10_data(rhport, p_msc, p_msc->ep_in, 0);
+      if ( p_msc->stage == MSC_STAGE_STATUS ) proc_status(rhport, p_msc);
+#else
+      // offer the host data again, also sends status if data stage is complete
+      mscd_xfer_cb(rhport, p_msc->ep_out, XFER_RESULT_SUCCESS, p_msc->async_len);
+#endif
+    break;
+
+    default: break;
+  }
+}
+
+void tud_msc_cache_task(uint32_t now_ms)
+{
+  uint32_t const count = _mscd_cache.write_count;
+
+  if ( count != _mscd_cache.idle_count || _mscd_cache.flush_failed )
+  {
+    // a failed idle flush is retried after another idle period
+    _mscd_cache.flush_failed = false;
+    _mscd_cache.idle_count = count;
+    _mscd_cache.idle_start = now_ms;
+    return;
+  }
+
+  if ( _mscd_cache.flush_posted || (now_ms - _mscd_cache.idle_start) < CFG_TUD_MSC_CACHE_IDLE_MS ) return;
+
+  for(uint8_t i=0; i<CFG_TUD_MSC_CACHE_LINES; i++)
+  {
+    if ( _mscd_cache.line[i].valid )
+    {
+      // write back in usbd task context
+      _mscd_cache.flush_posted = true;
+      usbd_defer_func(cache_idle_flush, NULL, false);
+      break;
+    }
+  }
+}
+
+void tud_msc_cache_get_stats(tud_msc_cache_stats_t* stats)
+{
+  *stats = _mscd_cache.stats;
+}
+
+#endif
+
+//--------------------------------------------------------------------+
+// Sequential Read-ahead
+//--------------------------------------------------------------------+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+
+// Read-ahead is a ring refilled one piece at a time: after every chunk queued on the bus (overlapping
+// its transfer when the callback is synchronous) and, for an asynchronous callback, as soon as the
+// previous piece completes. Nothing is read after the status, next command is not held up.
+#define READAHEAD_PIECE   tu_min32(CFG_TUD_MSC_EP_BUFSIZE, CFG_TUD_MSC_READAHEAD_SIZE)
+
+TU_VERIFY_STATIC(CFG_TUD_MSC_READAHEAD_SIZE % CFG_TUD_MSC_EP_BUFSIZE == 0 || CFG_TUD_MSC_READAHEAD_SIZE < CFG_TUD_MSC_EP_BUFSIZE,
+                 "CFG_TUD_MSC_READAHEAD_SIZE must be a multiple of CFG_TUD_MSC_EP_BUFSIZE");
+
+typedef struct
+{
+  // sequential access detection
+  uint32_t seq_next;     // lba following the last READ10
+  uint8_t  seq_lun;
+  uint8_t  seq_run;      // number of consecutive sequential READ10
+
+  // stream position of the first buffered byte, it is at buf[rd_idx]
+  uint8_t  lun;
+  uint32_t block_sz;     // 0 if there is no stream
+  uint32_t lba;
+  uint32_t offset;       // within block
+  uint32_t rd_idx;
+  uint32_t len;          // buffered bytes
+
+  uint32_t fill;         // bytes requested by the asynchronous refill in flight, 0 if none
+  bool     cmd_wait;     // next command waits for the refill
+  bool     data_wait;    // data stage waits for the refill, it needs its bytes
+
+  tud_msc_readahead_stats_t stats;
+
+  CFG_TUSB_MEM_ALIGN uint8_t buf[CFG_TUD_MSC_READAHEAD_SIZE];
+} mscd_readahead_t;
+
+CFG_TUSB_MEM_SECTION static mscd_readahead_t _mscd_ra;
+
+// Invoked for every READ10, update sequential access detection
+static void readahead_detect(uint8_t lun, uint32_t lba, uint32_t block_cnt)
+{
+  if ( (lun == _mscd_ra.seq_lun) && (lba == _mscd_ra.seq_next) )
+  {
+    if ( _mscd_ra.seq_run < UINT8_MAX ) _mscd_ra.seq_run++;
+  }else
+  {
+    _mscd_ra.seq_run = 0;
+  }
+
+  _mscd_ra.seq_lun  = lun;
+  _mscd_ra.seq_next = lba + block_cnt;
+}
+
+// Byte distance of lba/offset from the stream position, false if it lies before or too far after it
+static bool readahead_distance(uint8_t lun, uint32_t lba, uint32_t offset, uint32_t block_sz, uint32_t* dist)
+{
+  if ( !_mscd_ra.block_sz || (lun != _mscd_ra.lun) || (block_sz != _mscd_ra.block_sz) ) return false;
+  if ( (lba < _mscd_ra.lba) || (lba - _mscd_ra.lba) > CFG_TUD_MSC_READAHEAD_SIZE / block_sz + 1 ) return false;
+
+  uint32_t const pos = (lba - _mscd_ra.lba) * block_sz + offset;
+  if ( pos < _mscd_ra.offset ) return false;
+
+  *dist = pos - _mscd_ra.offset;
+  return true;
+}
+
+// Drop n bytes from the front of the stream
+static void readahead_advance(uint32_t n)
+{
+  _mscd_ra.offset += n;
+  _mscd_ra.lba    += _mscd_ra.offset / _mscd_ra.block_sz;
+  _mscd_ra.offset %= _mscd_ra.block_sz;
+  _mscd_ra.rd_idx  = (_mscd_ra.rd_idx + n) % CFG_TUD_MSC_READAHEAD_SIZE;
+  _mscd_ra.len    -= n;
+}
+
+// Restart the stream empty at lba/offset, where the data stage continues
+static void readahead_anchor(uint8_t lun, uint32_t lba, uint32_t offset, uint32_t block_sz)
+{
+  _mscd_ra.lun      = lun;
+  _mscd_ra.block_sz = block_sz;
+  _mscd_ra.lba      = lba + offset / block_sz;
+  _mscd_ra.offset   = offset % block_sz;
+  _mscd_ra.rd_idx   = 0;
+  _mscd_ra.len      = 0;
+}
+
+// Copy from the read-ahead buffer. Return number of bytes copied, 0 if not buffered and
+// TUD_MSC_RET_ASYNC if they are about to be: data stage is resumed once the refill completes.
+static int32_t readahead_copy(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize, uint32_t block_sz)
+{
+  uint32_t dist;
+
+  if ( readahead_distance(lun, lba, offset, block_sz, &dist) )
+  {
+    if ( dist < _mscd_ra.len )
+    {
+      // host consumes the stream: everything up to the copied bytes is not needed anymore
+      uint32_t const len = tu_min32(tu_min32(bufsize, _mscd_ra.len - dist), CFG_TUD_MSC_READAHEAD_SIZE - (_mscd_ra.rd_idx + dist) % CFG_TUD_MSC_READAHEAD_SIZE);
+      memcpy(buffer, _mscd_ra.buf + (_mscd_ra.rd_idx + dist) % CFG_TUD_MSC_READAHEAD_SIZE, len);
+      readahead_advance(dist + len);
+
+      _mscd_ra.stats.hits++;
+      return (int32_t) len;
+    }
+  }
+
+  // only one asynchronous callback at a time, also if the refill does not have these bytes
+  if ( _mscd_ra.fill )
+  {
+    _mscd_ra.data_wait = true;
+    return TUD_MSC_RET_ASYNC;
+  }
+
+  if ( _mscd_ra.seq_run >= CFG_TUD_MSC_READAHEAD_TRIGGER ) _mscd_ra.stats.misses++;
+  return 0;
+}
+
+// Host is writing, drop buffered blocks it may overwrite
+static void readahead_invalidate(uint8_t lun, uint32_t lba, uint32_t nblocks)
+{
+  if ( !_mscd_ra.block_sz || (lun != _mscd_ra.lun) ) return;
+
+  uint32_t const ra_blocks = (_mscd_ra.offset + _mscd_ra.len + _mscd_ra.block_sz - 1) / _mscd_ra.block_sz;
+
+  if ( (lba - _mscd_ra.lba) < ra_blocks || (_mscd_ra.lba - lba) < nblocks ) _mscd_ra.block_sz = 0;
+}
+
+// Read the next piece of a sequential stream into free ring space. Invoked when a chunk is queued
+// on the bus and when an asynchronous piece completes, only one piece is read per invocation.
+static void readahead_fill(mscd_interface_t* p_msc)
+{
+  if ( !_mscd_ra.block_sz || _mscd_ra.fill || (_mscd_ra.seq_run < CFG_TUD_MSC_READAHEAD_TRIGGER) ) return;
+
+  // only one asynchronous callback at a time
+  if ( p_msc->async != MSC_ASYNC_NONE ) return;
+
+#if CFG_TUD_MSC_CACHE_LINES
+  if ( _mscd_cache.wb_async ) return;
+#endif
+
+  uint32_t const block_sz = _mscd_ra.block_sz;
+  uint32_t const end      = _mscd_ra.offset + _mscd_ra.len;
+  uint32_t const lba      = _mscd_ra.lba + end / block_sz;
+  uint32_t const wr_idx   = (_mscd_ra.rd_idx + _mscd_ra.len) % CFG_TUD_MSC_READAHEAD_SIZE;
+
+  uint32_t block_count;
+  uint16_t block_size;
+  tud_msc_capacity_cb(_mscd_ra.lun, &block_count, &block_size);
+
+  if ( lba >= block_count ) return;
+
+  // up to a piece, without wrapping around the end of the ring or reading past the medium
+  uint32_t len = tu_min32(READAHEAD_PIECE, CFG_TUD_MSC_READAHEAD_SIZE - _mscd_ra.len);
+  len = tu_min32(len, CFG_TUD_MSC_READAHEAD_SIZE - wr_idx);
+  if ( block_count - lba <= CFG_TUD_MSC_READAHEAD_SIZE / block_sz ) len = tu_min32(len, (block_count - lba) * block_sz - end % block_sz);
+  if ( len == 0 ) return;
+
+  _mscd_ra.stats.prefetches++;
+
+  int32_t const nbytes = tud_msc_read10_cb(_mscd_ra.lun, lba, end % block_sz, _mscd_ra.buf + wr_idx, len);
+
+  if ( nbytes == TUD_MSC_RET_ASYNC )
+  {
+    // completed by proc_async_io_done()
+    _mscd_ra.fill = len;
+    p_msc->async  = MSC_ASYNC_PENDING;
+  }
+  else if ( nbytes > 0 )
+  {
+    _mscd_ra.len += tu_min32((uint32_t) nbytes, len);
+  }
+  else
+  {
+    // medium busy or failing: data stage reads it again when needed
+    _mscd_ra.block_sz = 0;
+  }
+}
+
+void tud_msc_readahead_get_stats(tud_msc_readahead_stats_t* stats)
+{
+  *stats = _mscd_ra.stats;
+}
+
+#endif
+
+//--------------------------------------------------------------------+
+// APPLICATION API
+//--------------------------------------------------------------------+
+bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier)
+{
+  (void) lun;
+
+  _mscd_itf.sense_key           = sense_key;
+  _mscd_itf.add_sense_code      = add_sense_code;
+  _mscd_itf.add_sense_qualifier = add_sense_qualifier;
+
+  return true;
+}
+
+// Resume the data stage in usbd task context with the result of an asynchronous callback
+static void proc_async_io_done(void* param)
+{
+  (void) param;
+
+  mscd_interface_t* p_msc = &_mscd_itf;
+  msc_cbw_t const * p_cbw = &p_msc->cbw;
+  uint8_t const rhport = p_msc->rhport;
+
+#if CFG_TUD_MSC_CACHE_LINES
+  if ( _mscd_cache.wb_async )
+  {
+    // write back of a cache line, not the I/O of the command itself
+    cache_writeback_done(p_msc->async_result);
+    cache_resume(NULL);
+    return;
+  }
+#endif
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  if ( _mscd_ra.fill && p_msc->async == MSC_ASYNC_PENDING )
+  {
+    if ( p_msc->async_result > 0 )
+    {
+      _mscd_ra.len += tu_min32((uint32_t) p_msc->async_result, _mscd_ra.fill);
+    }else
+    {
+      _mscd_ra.block_sz = 0;
+    }
+    _mscd_ra.fill = 0;
+    p_msc->async  = MSC_ASYNC_NONE;
+
+    if ( _mscd_ra.cmd_wait )
+    {
+      _mscd_ra.cmd_wait = false;
+
+      // interface was reset meanwhile
+      if ( p_msc->stage != MSC_STAGE_DATA ) return;
+
+      proc_command(rhport, p_msc);
+    }
+    else if ( _mscd_ra.data_wait )
+    {
+      _mscd_ra.data_wait = false;
+
+      // interface was reset meanwhile
+      if ( p_msc->stage != MSC_STAGE_DATA ) return;
+
+      proc_read10_cmd(rhport, p_msc);
+    }
+    else
+    {
+      // keep the stream going while host is busy with the buffered data
+      readahead_fill(p_msc);
+      return;
+    }
+
+    if ( p_msc->stage == MSC_STAGE_STATUS ) proc_status(rhport, p_msc);
+    return;
+  }
+#endif
+
+  // interface was reset meanwhile
+  if ( p_msc->async != MSC_ASYNC_PENDING || p_msc->stage != MSC_STAGE_DATA ) return;
+
+  p_msc->async = MSC_ASYNC_DONE;
+
+  if ( rdwr_is_read(p_cbw->command[0]) )
+  {
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+    if ( p_msc->rd_async )
+    {
+      p_msc->rd_async = false;
+      p_msc->async    = MSC_ASYNC_NONE;
+      p_msc->rd_ready = (p_msc->async_result > 0) ? (uint32_t) p_msc->async_result : 0;
+      p_msc->rd_failed = (p_msc->async_result < 0);
+
+      if ( !p_msc->rd_wait ) return;
+      p_msc->rd_wait = false;
+    }
+#endif
+    proc_read10_cmd(rhport, p_msc);
+  }
+  else
+  {
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+    proc_write10_data(rhport, p_msc, p_msc->ep_in, 0);
+#else
+    // also sends status if data stage is complete
+    mscd_xfer_cb(rhport, p_msc->ep_out, XFER_RESULT_SUCCESS, p_msc->async_len);
+    return;
+#endif
+  }
+
+  // data stage may be complete now, send status
+  if ( p_msc->stage == MSC_STAGE_STATUS ) proc_status(rhport, p_msc);
+}
+
+bool tud_msc_async_io_done(uint8_t lun, int32_t nbytes, bool in_isr)
+{
+  mscd_interface_t* p_msc = &_mscd_itf;
 
-  uint8_t  itf_num;
-  uint8_t  ep_in;
-  uint8_t  ep_out;
+  TU_VERIFY(nbytes != TUD_MSC_RET_ASYNC);
 
-  // Bulk Only Transfer (BOT) Protocol
-  uint8_t  stage;
-  uint32_t total_len;
-  uint32_t xferred_len; // numbered of bytes transferred so far in the Data Stage
+#if CFG_TUD_MSC_CACHE_LINES
+  if ( _mscd_cache.wb_async )
+  {
+    TU_VERIFY(lun == _mscd_cache.wb_line->lun);
+  }else
+#endif
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  if ( _mscd_ra.fill )
+  {
+    // cbw may already hold the next command
+    TU_VERIFY(p_msc->async == MSC_ASYNC_PENDING && lun == _mscd_ra.lun);
+  }else
+#endif
+  {
+    TU_VERIFY(p_msc->async == MSC_ASYNC_PENDING && lun == p_msc->cbw.lun);
+  }
 
-  // Sense Response Data
-  uint8_t sense_key;
-  uint8_t add_sense_code;
-  uint8_t add_sense_qualifier;
-}mscd_interface_t;
+  p_msc->async_result = nbytes;
+  usbd_defer_func(proc_async_io_done, NULL, in_isr);
 
-CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static mscd_interface_t _mscd_itf;
-CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t _mscd_buf[CFG_TUD_MSC_EP_BUFSIZE];
+  return true;
+}
 
 //--------------------------------------------------------------------+
-// INTERNAL OBJECT & FUNCTION DECLARATION
+// USB Attached SCSI (UAS)
 //--------------------------------------------------------------------+
-static int32_t proc_builtin_scsi(uint8_t lun, uint8_t const scsi_cmd[16], uint8_t* buffer, uint32_t bufsize);
-static void proc_read10_cmd(uint8_t rhport, mscd_interface_t* p_msc);
-static void proc_write10_cmd(uint8_t rhport, mscd_interface_t* p_msc);
+#if CFG_TUD_MSC_UAS
 
-static inline uint32_t rdwr10_get_lba(uint8_t const command[])
+// Length and direction of a command's data phase. Command IU has no transfer length as the CBW does,
+// it is derived from the CDB the same way host does. Return false if the command is not known, or
+// its data phase does not fit the 32-bit length of the CBW (READ16/WRITE16 of 4 GiB or more).
+static bool uas_cmd_data_len(uint8_t lun, uint8_t const cdb[16], uint32_t* len, bool* dir_in)
 {
-  // use offsetof to avoid pointer to the odd/unaligned address
-  uint32_t const lba = tu_unaligned_read32(command + offsetof(scsi_write10_t, lba));
+  *dir_in = true;
+  *len    = 0;
 
-  // lba is in Big Endian
-  return tu_ntohl(lba);
+  switch ( cdb[0] )
+  {
+    case SCSI_CMD_READ_10:
+    case SCSI_CMD_READ_16:
+    case SCSI_CMD_WRITE_10:
+    case SCSI_CMD_WRITE_16:
+    {
+      uint32_t block_count;
+      uint16_t block_size;
+
+      tud_msc_capacity_cb(lun, &block_count, &block_size);
+
+      uint64_t const bytes = (uint64_t) rdwr_get_blockcount(cdb) * block_size;
+      TU_VERIFY(bytes <= UINT32_MAX);
+
+      *dir_in = rdwr_is_read(cdb[0]);
+      *len    = (uint32_t) bytes;
+    }
+    break;
+
+    case SCSI_CMD_INQUIRY              : *len = tu_u16(cdb[3], cdb[4]); break;
+    case SCSI_CMD_REQUEST_SENSE        : *len = cdb[4]; break;
+    case SCSI_CMD_MODE_SENSE_6         : *len = cdb[4]; break;
+    case SCSI_CMD_READ_CAPACITY_10     : *len = sizeof(scsi_read_capacity10_resp_t); break;
+    case SCSI_CMD_READ_FORMAT_CAPACITY : *len = tu_u16(cdb[7], cdb[8]); break;
+    case SCSI_CMD_SERVICE_ACTION_IN_16 : *len = tu_ntohl(tu_unaligned_read32(cdb + offsetof(scsi_read_capacity16_t, alloc_length))); break;
+
+    case SCSI_CMD_MODE_SELECT_6:
+      *dir_in = false;
+      *len    = cdb[4];
+    break;
+
+    case SCSI_CMD_TEST_UNIT_READY:
+    case SCSI_CMD_START_STOP_UNIT:
+    case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    case SCSI_CMD_SYNCHRONIZE_CACHE_16:
+    break;
+
+    // direction and length of the data phase are unknown, tud_msc_scsi_cb() cannot be used
+    default: return false;
+  }
+
+  return true;
 }
 
-static inline uint16_t rdwr10_get_blockcount(uint8_t const command[])
+// Receive the next IU on the command pipe as long as there is room in the queue
+static void uas_arm_cmd_pipe(uint8_t rhport, mscd_interface_t* p_msc)
 {
-  // use offsetof to avoid pointer to the odd/misaligned address
-  uint16_t const block_count = tu_unaligned_read16(command + offsetof(scsi_write10_t, block_count));
+  if ( (_mscd_uas.count < CFG_TUD_MSC_UAS_QDEPTH) && !usbd_edpt_busy(rhport, p_msc->ep_cmd) )
+  {
+    usbd_edpt_xfer(rhport, p_msc->ep_cmd, _mscd_uas.iu_buf, sizeof(_mscd_uas.iu_buf));
+  }
+}
 
-  // block count is in Big Endian
-  return tu_ntohs(block_count);
+// Start the next queued command, or send a pending task management response.
+// Commands are executed one at a time, the status pipe carries the IUs of the current one.
+static void uas_start_next(uint8_t rhport, mscd_interface_t* p_msc)
+{
+  if ( (p_msc->stage != MSC_STAGE_CMD) || usbd_edpt_busy(rhport, p_msc->ep_status) ) return;
+
+  if ( _mscd_uas.tmf_pending )
+  {
+    msc_uas_response_iu_t* resp = &_mscd_uas.status.response;
+
+    tu_memclr(resp, sizeof(msc_uas_response_iu_t));
+    resp->iu_id         = MSC_UAS_IU_RESPONSE;
+    resp->tag           = _mscd_uas.tmf_tag;
+    resp->response_code = _mscd_uas.tmf_response;
+
+    _mscd_uas.tmf_pending = false;
+    usbd_edpt_xfer(rhport, p_msc->ep_status, (uint8_t*) resp, sizeof(msc_uas_response_iu_t));
+    return;
+  }
+
+  if ( _mscd_uas.count == 0 ) return;
+
+  msc_uas_command_iu_t const* iu = &_mscd_uas.queue[_mscd_uas.rd_idx];
+  msc_cbw_t* p_cbw = &p_msc->cbw;
+  uint32_t data_len;
+  bool dir_in;
+
+  // commands run through the BOT engine, cbw is filled as host would have done it
+  p_cbw->lun     = iu->lun[1];
+  p_cbw->cmd_len = sizeof(iu->cdb);
+  memcpy(p_cbw->command, iu->cdb, sizeof(iu->cdb));
+  bool const known = uas_cmd_data_len(p_cbw->lun, p_cbw->command, &data_len, &dir_in);
+  p_cbw->total_bytes = data_len;
+  p_cbw->dir = dir_in ? TU_BIT(7) : 0;
+  _mscd_uas.tag = iu->tag;
+
+  _mscd_uas.rd_idx = (uint8_t) ((_mscd_uas.rd_idx + 1) % CFG_TUD_MSC_UAS_QDEPTH);
+  _mscd_uas.count--;
+
+  // a slot is free again
+  uas_arm_cmd_pipe(rhport, p_msc);
+
+  TU_LOG2("  UAS Command: %s\r\n", tu_lookup_find(&_msc_scsi_cmd_table, p_cbw->command[0]));
+
+  if ( !known )
+  {
+    p_msc->csw.status       = MSC_CSW_STATUS_FAILED;
+    p_msc->csw.data_residue = 0;
+    p_msc->stage            = MSC_STAGE_STATUS;
+
+    if ( rdwr_is_read(p_cbw->command[0]) || rdwr_is_write(p_cbw->command[0]) )
+    {
+      tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00); // Sense = Invalid Field in CDB
+    }else
+    {
+      tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00); // Sense = Invalid Command Operation
+    }
+    proc_status(rhport, p_msc);
+  }
+  else if ( p_cbw->total_bytes )
+  {
+    // tell host which command the data phase belongs to, it is started once the IU is sent
+    msc_uas_ready_iu_t* ready = &_mscd_uas.status.ready;
+
+    ready->iu_id    = dir_in ? MSC_UAS_IU_READ_READY : MSC_UAS_IU_WRITE_READY;
+    ready->reserved = 0;
+    ready->tag      = _mscd_uas.tag;
+
+    p_msc->stage = MSC_STAGE_UAS_READY;
+    usbd_edpt_xfer(rhport, p_msc->ep_status, (uint8_t*) ready, sizeof(msc_uas_ready_iu_t));
+  }
+  else
+  {
+    proc_command(rhport, p_msc);
+    if ( p_msc->stage == MSC_STAGE_STATUS ) proc_status(rhport, p_msc);
+  }
 }
 
-//--------------------------------------------------------------------+
-// Debug
-//--------------------------------------------------------------------+
-#if CFG_TUSB_DEBUG >= 2
+static void uas_task_mgmt(msc_uas_task_mgmt_iu_t const* tm)
+{
+  _mscd_uas.tmf_tag      = tm->tag;
+  _mscd_uas.tmf_response = MSC_UAS_RESPONSE_TMF_NOT_SUPPORTED;
+  _mscd_uas.tmf_pending  = true;
 
-static tu_lookup_entry_t const _msc_scsi_cmd_lookup[] =
+  if ( tm->function != MSC_UAS_TMF_ABORT_TASK ) return;
+
+  // a command that has not started yet is dropped from the queue, the running one completes normally
+  uint8_t kept = 0;
+  for(uint8_t i=0; i<_mscd_uas.count; i++)
+  {
+    msc_uas_command_iu_t const* iu = &_mscd_uas.queue[(_mscd_uas.rd_idx + i) % CFG_TUD_MSC_UAS_QDEPTH];
+    if ( iu->tag == tm->task_tag ) continue;
+
+    uint8_t const dst = (uint8_t) ((_mscd_uas.rd_idx + kept) % CFG_TUD_MSC_UAS_QDEPTH);
+    if ( &_mscd_uas.queue[dst] != iu ) memcpy(&_mscd_uas.queue[dst], iu, sizeof(msc_uas_command_iu_t));
+    kept++;
+  }
+
+  _mscd_uas.count        = kept;
+  _mscd_uas.tmf_response = MSC_UAS_RESPONSE_TMF_COMPLETE;
+}
+
+static bool uas_proc_cmd_pipe(uint8_t rhport, mscd_interface_t* p_msc, xfer_result_t event, uint32_t xferred_bytes)
 {
-  { .key = SCSI_CMD_TEST_UNIT_READY              , .data = "Test Unit Ready" },
-  { .key = SCSI_CMD_INQUIRY                      , .data = "Inquiry" },
-  { .key = SCSI_CMD_MODE_SELECT_6                , .data = "Mode_Select 6" },
-  { .key = SCSI_CMD_MODE_SENSE_6                 , .data = "Mode_Sense 6" },
-  { .key = SCSI_CMD_START_STOP_UNIT              , .data = "Start Stop Unit" },
-  { .key = SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL , .data = "Prevent Allow Medium Removal" },
-  { .key = SCSI_CMD_READ_CAPACITY_10             , .data = "Read Capacity10" },
-  { .key = SCSI_CMD_REQUEST_SENSE                , .data = "Request Sense" },
-  { .key = SCSI_CMD_READ_FORMAT_CAPACITY         , .data = "Read Format Capacity" },
-  { .key = SCSI_CMD_READ_10                      , .data = "Read10" },
-  { .key = SCSI_CMD_WRITE_10                     , .data = "Write10" }
-};
+  uint8_t const iu_id = _mscd_uas.iu_buf[0];
 
-static tu_lookup_table_t const _msc_scsi_cmd_table =
+  if ( event == XFER_RESULT_SUCCESS )
+  {
+    if ( (iu_id == MSC_UAS_IU_COMMAND) && (xferred_bytes >= sizeof(msc_uas_command_iu_t)) )
+    {
+      // additional CDB bytes beyond 16 are ignored
+      uint8_t const wr_idx = (uint8_t) ((_mscd_uas.rd_idx + _mscd_uas.count) % CFG_TUD_MSC_UAS_QDEPTH);
+      memcpy(&_mscd_uas.queue[wr_idx], _mscd_uas.iu_buf, sizeof(msc_uas_command_iu_t));
+      _mscd_uas.count++;
+    }
+    else if ( (iu_id == MSC_UAS_IU_TASK_MGMT) && (xferred_bytes >= sizeof(msc_uas_task_mgmt_iu_t)) )
+    {
+      uas_task_mgmt((msc_uas_task_mgmt_iu_t const*) _mscd_uas.iu_buf);
+    }
+    else
+    {
+      TU_LOG2("  UAS unknown IU %u\r\n", iu_id);
+    }
+  }
+
+  uas_arm_cmd_pipe(rhport, p_msc);
+  uas_start_next(rhport, p_msc);
+
+  return true;
+}
+
+static bool uas_proc_status_pipe(uint8_t rhport, mscd_interface_t* p_msc)
 {
-  .count = TU_ARRAY_SIZE(_msc_scsi_cmd_lookup),
-  .items = _msc_scsi_cmd_lookup
-};
+  switch ( p_msc->stage )
+  {
+    case MSC_STAGE_UAS_READY:
+      // host has been told about the data phase
+      TU_ASSERT( proc_command(rhport, p_msc) );
+      if ( p_msc->stage == MSC_STAGE_STATUS ) TU_ASSERT( proc_status(rhport, p_msc) );
+    break;
 
-#endif
+    case MSC_STAGE_STATUS_SENT:
+      // Sense IU is sent, command is complete
+      TU_LOG2("  UAS Status: %u\r\n", p_msc->csw.status);
+      proc_complete_cb(&p_msc->cbw);
+      p_msc->stage = MSC_STAGE_CMD;
+    break;
 
-//--------------------------------------------------------------------+
-// APPLICATION API
-//--------------------------------------------------------------------+
-bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier)
+    default: break; // Response IU of a task management function
+  }
+
+  uas_start_next(rhport, p_msc);
+
+  return true;
+}
+
+// Open the endpoints of an alternate setting, Pipe Usage descriptors in between are skipped
+static bool uas_open_alt(uint8_t rhport, tusb_desc_interface_t const * desc_itf)
 {
-  (void) lun;
+  uint8_t const * p_desc = tu_desc_next(desc_itf);
 
-  _mscd_itf.sense_key           = sense_key;
-  _mscd_itf.add_sense_code      = add_sense_code;
-  _mscd_itf.add_sense_qualifier = add_sense_qualifier;
+  for(uint8_t i=0; i<desc_itf->bNumEndpoints; p_desc = tu_desc_next(p_desc))
+  {
+    if ( TUSB_DESC_ENDPOINT != tu_desc_type(p_desc) ) continue;
+
+    TU_ASSERT( usbd_edpt_open(rhport, (tusb_desc_endpoint_t const *) p_desc) );
+    i++;
+  }
+
+  return true;
+}
+
+// GET_INTERFACE and SET_INTERFACE: alternate setting 0 is BOT, 1 is UAS
+static bool uas_set_get_interface(uint8_t rhport, tusb_control_request_t const * p_request)
+{
+  mscd_interface_t* p_msc = &_mscd_itf;
+
+  switch ( p_request->bRequest )
+  {
+    case TUSB_REQ_GET_INTERFACE:
+    {
+      uint8_t alt = p_msc->uas ? 1 : 0;
+      tud_control_xfer(rhport, p_request, &alt, 1);
+    }
+    break;
+
+    case TUSB_REQ_SET_INTERFACE:
+    {
+      uint8_t const alt = (uint8_t) p_request->wValue;
+      TU_VERIFY(alt < 2 && p_msc->desc_alt[alt]);
+
+      // transfers of the previous protocol are aborted, endpoints of the new one start fresh
+      if ( p_msc->uas )
+      {
+        usbd_edpt_close(rhport, p_msc->ep_cmd);
+        usbd_edpt_close(rhport, p_msc->ep_status);
+        usbd_edpt_close(rhport, p_msc->ep_data_in);
+        usbd_edpt_close(rhport, p_msc->ep_data_out);
+      }else
+      {
+        usbd_edpt_close(rhport, p_msc->ep_bot_in);
+        usbd_edpt_close(rhport, p_msc->ep_bot_out);
+      }
+
+      TU_ASSERT( uas_open_alt(rhport, p_msc->desc_alt[alt]) );
+
+      tu_memclr(&_mscd_uas, sizeof(_mscd_uas));
+      p_msc->stage  = MSC_STAGE_CMD;
+      p_msc->async  = MSC_ASYNC_NONE;
+      p_msc->uas    = (alt == 1);
+      p_msc->ep_in  = p_msc->uas ? p_msc->ep_data_in  : p_msc->ep_bot_in;
+      p_msc->ep_out = p_msc->uas ? p_msc->ep_data_out : p_msc->ep_bot_out;
+
+      if ( p_msc->uas )
+      {
+        uas_arm_cmd_pipe(rhport, p_msc);
+      }else
+      {
+        TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, (uint8_t*) &p_msc->cbw, sizeof(msc_cbw_t)) );
+      }
+
+      tud_control_status(rhport, p_request);
+    }
+    break;
+
+    default: return false;
+  }
 
   return true;
 }
 
+#endif
+
 //--------------------------------------------------------------------+
 // USBD Driver API
 //--------------------------------------------------------------------+
 void mscd_init(void)
 {
   tu_memclr(&_mscd_itf, sizeof(mscd_interface_t));
+
+#if CFG_TUD_MSC_CACHE_LINES
+  tu_memclr(&_mscd_cache, sizeof(_mscd_cache));
+#endif
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  tu_memclr(&_mscd_ra, sizeof(_mscd_ra));
+#endif
 }
 
 void mscd_reset(uint8_t rhport)
 {
   (void) rhport;
   tu_memclr(&_mscd_itf, sizeof(mscd_interface_t));
+
+#if CFG_TUD_MSC_UAS
+  tu_memclr(&_mscd_uas, sizeof(_mscd_uas));
+#endif
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  // medium may be changed while disconnected, statistics are kept
+  _mscd_ra.block_sz = 0;
+  _mscd_ra.len = 0;
+  _mscd_ra.seq_run = 0;
+  _mscd_ra.fill = 0;
+  _mscd_ra.cmd_wait = false;
+  _mscd_ra.data_wait = false;
+#endif
 }
 
 uint16_t mscd_open(uint8_t rhport, tusb_desc_interface_t const * itf_desc, uint16_t max_len)
@@ -156,18 +1399,63 @@ uint16_t mscd_open(uint8_t rhport, tusb_desc_interface_t const * itf_desc, uint1
             MSC_SUBCLASS_SCSI == itf_desc->bInterfaceSubClass &&
             MSC_PROTOCOL_BOT  == itf_desc->bInterfaceProtocol, 0);
 
-  // msc driver length is fixed
-  uint16_t const drv_len = sizeof(tusb_desc_interface_t) + 2*sizeof(tusb_desc_endpoint_t);
+  // msc driver length is fixed, unless followed by the UAS alternate setting
+  uint16_t drv_len = sizeof(tusb_desc_interface_t) + 2*sizeof(tusb_desc_endpoint_t);
 
   // Max length mus be at least 1 interface + 2 endpoints
   TU_ASSERT(max_len >= drv_len, 0);
 
   mscd_interface_t * p_msc = &_mscd_itf;
+  p_msc->rhport  = rhport;
   p_msc->itf_num = itf_desc->bInterfaceNumber;
 
   // Open endpoint pair
   TU_ASSERT( usbd_open_edpt_pair(rhport, tu_desc_next(itf_desc), 2, TUSB_XFER_BULK, &p_msc->ep_out, &p_msc->ep_in), 0 );
 
+#if CFG_TUD_MSC_UAS
+  p_msc->ep_bot_in   = p_msc->ep_in;
+  p_msc->ep_bot_out  = p_msc->ep_out;
+  p_msc->desc_alt[0] = itf_desc;
+
+  // Alternate setting 1 with UAS protocol: every endpoint is followed by a Pipe Usage descriptor
+  tusb_desc_interface_t const * alt_desc = (tusb_desc_interface_t const *) (((uint8_t const*) itf_desc) + drv_len);
+
+  if ( (max_len >= drv_len + sizeof(tusb_desc_interface_t))     &&
+       (TUSB_DESC_INTERFACE == alt_desc->bDescriptorType)      &&
+       (itf_desc->bInterfaceNumber == alt_desc->bInterfaceNumber) &&
+       (1 == alt_desc->bAlternateSetting)                      &&
+       (MSC_PROTOCOL_UAS == alt_desc->bInterfaceProtocol) )
+  {
+    uint8_t const * p_desc = tu_desc_next(alt_desc);
+    drv_len += sizeof(tusb_desc_interface_t);
+
+    for(uint8_t i=0; i<alt_desc->bNumEndpoints; i++)
+    {
+      tusb_desc_endpoint_t const * desc_ep = (tusb_desc_endpoint_t const *) p_desc;
+      uint8_t const * desc_pipe = tu_desc_next(p_desc);
+
+      TU_ASSERT(max_len >= drv_len + sizeof(tusb_desc_endpoint_t) + 4, 0);
+      TU_ASSERT(TUSB_DESC_ENDPOINT == tu_desc_type(desc_ep) && MSC_DESC_TYPE_PIPE_USAGE == tu_desc_type(desc_pipe), 0);
+
+      // opened by SET_INTERFACE, addresses may be shared with the BOT endpoints
+      switch ( desc_pipe[2] )
+      {
+        case MSC_UAS_PIPE_COMMAND : p_msc->ep_cmd      = desc_ep->bEndpointAddress; break;
+        case MSC_UAS_PIPE_STATUS  : p_msc->ep_status   = desc_ep->bEndpointAddress; break;
+        case MSC_UAS_PIPE_DATA_IN : p_msc->ep_data_in  = desc_ep->bEndpointAddress; break;
+        case MSC_UAS_PIPE_DATA_OUT: p_msc->ep_data_out = desc_ep->bEndpointAddress; break;
+        default: break;
+      }
+
+      drv_len += tu_desc_len(p_desc) + tu_desc_len(desc_pipe);
+      p_desc   = tu_desc_next(desc_pipe);
+    }
+
+    TU_ASSERT(p_msc->ep_cmd && p_msc->ep_status && p_msc->ep_data_in && p_msc->ep_data_out, 0);
+    p_msc->desc_alt[1] = alt_desc;
+  }
+#endif
+
   // Prepare for Command Block Wrapper
   if ( !usbd_edpt_xfer(rhport, p_msc->ep_out, (uint8_t*) &p_msc->cbw, sizeof(msc_cbw_t)) )
   {
@@ -186,6 +1474,13 @@ bool mscd_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t
   // nothing to do with DATA & ACK stage
   if (stage != CONTROL_STAGE_SETUP) return true;
 
+#if CFG_TUD_MSC_UAS
+  if ( (p_request->bmRequestType_bit.type == TUSB_REQ_TYPE_STANDARD) && _mscd_itf.ep_cmd )
+  {
+    return uas_set_get_interface(rhport, p_request);
+  }
+#endif
+
   // Handle class request only
   TU_VERIFY(p_request->bmRequestType_bit.type == TUSB_REQ_TYPE_CLASS);
 
@@ -221,6 +1516,19 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
   msc_cbw_t const * p_cbw = &p_msc->cbw;
   msc_csw_t       * p_csw = &p_msc->csw;
 
+#if CFG_TUD_MSC_UAS
+  if ( p_msc->uas )
+  {
+    if ( ep_addr == p_msc->ep_cmd    ) return uas_proc_cmd_pipe(rhport, p_msc, event, xferred_bytes);
+    if ( ep_addr == p_msc->ep_status ) return uas_proc_status_pipe(rhport, p_msc);
+    if ( ep_addr != p_msc->ep_in && ep_addr != p_msc->ep_out ) return true; // aborted BOT transfer
+  }
+  else if ( ep_addr != p_msc->ep_in && ep_addr != p_msc->ep_out )
+  {
+    return true; // aborted UAS transfer
+  }
+#endif
+
   switch (p_msc->stage)
   {
     case MSC_STAGE_CMD:
@@ -228,91 +1536,41 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
       // Complete IN while waiting for CMD is usually Status of previous SCSI op, ignore it
       if(ep_addr != p_msc->ep_out) return true;
 
-      TU_ASSERT( event == XFER_RESULT_SUCCESS &&
-                 xferred_bytes == sizeof(msc_cbw_t) && p_cbw->signature == MSC_CBW_SIGNATURE );
-
-      TU_LOG2("  SCSI Command: %s\r\n", tu_lookup_find(&_msc_scsi_cmd_table, p_cbw->command[0]));
-      // TU_LOG2_MEM(p_cbw, xferred_bytes, 2);
-
-      p_csw->signature    = MSC_CSW_SIGNATURE;
-      p_csw->tag          = p_cbw->tag;
-      p_csw->data_residue = 0;
-
-      /*------------- Parse command and prepare DATA -------------*/
-      p_msc->stage = MSC_STAGE_DATA;
-      p_msc->total_len = p_cbw->total_bytes;
-      p_msc->xferred_len = 0;
-
-      if (SCSI_CMD_READ_10 == p_cbw->command[0])
-      {
-        proc_read10_cmd(rhport, p_msc);
-      }
-      else if (SCSI_CMD_WRITE_10 == p_cbw->command[0])
-      {
-        proc_write10_cmd(rhport, p_msc);
-      }
-      else
-      {
-        // For other SCSI commands
-        // 1. OUT : queue transfer (invoke app callback after done)
-        // 2. IN & Zero: Process if is built-in, else Invoke app callback. Skip DATA if zero length
-        if ( (p_cbw->total_bytes > 0 ) && !tu_bit_test(p_cbw->dir, 7) )
-        {
-          // queue transfer
-          TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf, p_msc->total_len) );
-        }else
-        {
-          int32_t resplen;
-
-          // First process if it is a built-in commands
-          resplen = proc_builtin_scsi(p_cbw->lun, p_cbw->command, _mscd_buf, sizeof(_mscd_buf));
-
-          // Not built-in, invoke user callback
-          if ( (resplen < 0) && (p_msc->sense_key == 0) )
-          {
-            resplen = tud_msc_scsi_cb(p_cbw->lun, p_cbw->command, _mscd_buf, p_msc->total_len);
-          }
-
-          if ( resplen < 0 )
-          {
-            p_msc->total_len = 0;
-            p_csw->status = MSC_CSW_STATUS_FAILED;
-            p_msc->stage = MSC_STAGE_STATUS;
+#if CFG_TUD_MSC_UAS
+      // UAS commands arrive on the command pipe
+      if ( p_msc->uas ) return true;
+#endif
 
-            // failed but senskey is not set: default to Illegal Request
-            if ( p_msc->sense_key == 0 ) tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
+      TU_ASSERT( event == XFER_RESULT_SUCCESS &&
+                 xferred_bytes == sizeof(msc_cbw_t) && p_cbw->signature == MSC_CBW_SIGNATURE );
 
-            // Stall bulk In if needed
-            if (p_cbw->total_bytes) usbd_edpt_stall(rhport, p_msc->ep_in);
-          }
-          else
-          {
-            p_msc->total_len = (uint32_t) resplen;
-            p_csw->status = MSC_CSW_STATUS_PASSED;
+      TU_LOG2("  SCSI Command: %s\r\n", tu_lookup_find(&_msc_scsi_cmd_table, p_cbw->command[0]));
+      // TU_LOG2_MEM(p_cbw, xferred_bytes, 2);
 
-            if (p_msc->total_len)
-            {
-              TU_ASSERT( p_cbw->total_bytes >= p_msc->total_len ); // cannot return more than host expect
-              TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_in, _mscd_buf, p_msc->total_len) );
-            }else
-            {
-              p_msc->stage = MSC_STAGE_STATUS;
-            }
-          }
-        }
-      }
+      p_csw->signature    = MSC_CSW_SIGNATURE;
+      p_csw->tag          = p_cbw->tag;
+
+      TU_ASSERT( proc_command(rhport, p_msc) );
     break;
 
     case MSC_STAGE_DATA:
       TU_LOG2("  SCSI Data\r\n");
       //TU_LOG2_MEM(_mscd_buf, xferred_bytes, 2);
 
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+      if ( rdwr_is_write(p_cbw->command[0]) )
+      {
+        proc_write10_data(rhport, p_msc, ep_addr, xferred_bytes);
+        break;
+      }
+#endif
+
       // OUT transfer, invoke callback if needed
       if ( !tu_bit_test(p_cbw->dir, 7) )
       {
-        if ( SCSI_CMD_WRITE_10 != p_cbw->command[0] )
+        if ( !rdwr_is_write(p_cbw->command[0]) )
         {
-          int32_t cb_result = tud_msc_scsi_cb(p_cbw->lun, p_cbw->command, _mscd_buf, p_msc->total_len);
+          int32_t cb_result = tud_msc_scsi_cb(p_cbw->lun, p_cbw->command, _mscd_buf[0], p_msc->total_len);
 
           if ( cb_result < 0 )
           {
@@ -325,15 +1583,21 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
         }
         else
         {
-          uint16_t const block_sz = p_cbw->total_bytes / rdwr10_get_blockcount(p_cbw->command);
+          uint32_t const block_sz = p_cbw->total_bytes / rdwr_get_blockcount(p_cbw->command);
 
           // Adjust lba with transferred bytes
-          uint32_t const lba = rdwr10_get_lba(p_cbw->command) + (p_msc->xferred_len / block_sz);
+          uint32_t const lba = rdwr_get_lba(p_cbw->command) + (p_msc->xferred_len / block_sz);
 
           // Application can consume smaller bytes
-          int32_t nbytes = tud_msc_write10_cb(p_cbw->lun, lba, p_msc->xferred_len % block_sz, _mscd_buf, xferred_bytes);
+          int32_t nbytes = invoke_write10_cb(p_msc, lba, p_msc->xferred_len % block_sz, _mscd_buf[0], xferred_bytes);
 
-          if ( nbytes < 0 )
+          if ( nbytes == TUD_MSC_RET_ASYNC )
+          {
+            // resumed by tud_msc_async_io_done()
+            p_msc->async_len = xferred_bytes;
+            return true;
+          }
+          else if ( nbytes < 0 )
           {
             // negative means error -> skip to status phase, status in CSW set to failed
             p_csw->data_residue = p_cbw->total_bytes - p_msc->xferred_len;
@@ -350,7 +1614,7 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
               if ( nbytes > 0 )
               {
                 p_msc->xferred_len += nbytes;
-                memmove(_mscd_buf, _mscd_buf+nbytes, xferred_bytes-nbytes);
+                memmove(_mscd_buf[0], _mscd_buf[0]+nbytes, xferred_bytes-nbytes);
               }
 
               // simulate an transfer complete with adjusted parameters --> this driver callback will fired again
@@ -378,11 +1642,11 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
       {
         // READ10 & WRITE10 Can be executed with large bulk of data e.g write 8K bytes (several flash write)
         // We break it into multiple smaller command whose data size is up to CFG_TUD_MSC_EP_BUFSIZE
-        if (SCSI_CMD_READ_10 == p_cbw->command[0])
+        if ( rdwr_is_read(p_cbw->command[0]) )
         {
           proc_read10_cmd(rhport, p_msc);
         }
-        else if (SCSI_CMD_WRITE_10 == p_cbw->command[0])
+        else if ( rdwr_is_write(p_cbw->command[0]) )
         {
           proc_write10_cmd(rhport, p_msc);
         }else
@@ -404,23 +1668,7 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
         TU_LOG2("  SCSI Status: %u\r\n", p_csw->status);
         // TU_LOG2_MEM(p_csw, xferred_bytes, 2);
 
-        // Invoke complete callback if defined
-        // Note: There is racing issue with samd51 + qspi flash testing with arduino
-        // if complete_cb() is invoked after queuing the status.
-        switch(p_cbw->command[0])
-        {
-          case SCSI_CMD_READ_10:
-            if ( tud_msc_read10_complete_cb ) tud_msc_read10_complete_cb(p_cbw->lun);
-          break;
-
-          case SCSI_CMD_WRITE_10:
-            if ( tud_msc_write10_complete_cb ) tud_msc_write10_complete_cb(p_cbw->lun);
-          break;
-
-          default:
-            if ( tud_msc_scsi_complete_cb ) tud_msc_scsi_complete_cb(p_cbw->lun, p_cbw->command);
-          break;
-        }
+        proc_complete_cb(p_cbw);
 
         // Move to default CMD stage
         p_msc->stage = MSC_STAGE_CMD;
@@ -433,24 +1681,206 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
     default : break;
   }
 
-  if ( p_msc->stage == MSC_STAGE_STATUS )
+  if ( p_msc->stage == MSC_STAGE_STATUS ) TU_ASSERT( proc_status(rhport, p_msc) );
+
+  return true;
+}
+
+// Parse command in cbw and prepare DATA stage
+static bool proc_command(uint8_t rhport, mscd_interface_t* p_msc)
+{
+  msc_cbw_t const * p_cbw = &p_msc->cbw;
+  msc_csw_t       * p_csw = &p_msc->csw;
+
+  p_msc->stage = MSC_STAGE_DATA;
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  if ( _mscd_ra.fill )
+  {
+    // read-ahead is still running, resumed by proc_async_io_done()
+    _mscd_ra.cmd_wait = true;
+    return true;
+  }
+#endif
+
+#if CFG_TUD_MSC_CACHE_LINES
+  if ( _mscd_cache.wb_async )
+  {
+    // no other callback while asynchronous write back is in progress
+    cache_wait(CACHE_RESUME_CMD);
+    return true;
+  }
+#endif
+
+  p_csw->status       = MSC_CSW_STATUS_PASSED;
+  p_csw->data_residue = 0;
+
+  p_msc->total_len = p_cbw->total_bytes;
+  p_msc->xferred_len = 0;
+  p_msc->buf_idx = 0;
+  p_msc->async = MSC_ASYNC_NONE;
+
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+  p_msc->rd_ready = p_msc->rx_len = p_msc->rx_ready = p_msc->wr_off = p_msc->wr_len = 0;
+  p_msc->rd_async = p_msc->rd_wait = p_msc->rd_failed = p_msc->out_busy = false;
+#endif
+
+  if ( rdwr16_get_lba_high(p_cbw->command) )
+  {
+    // beyond what the 32-bit lba of read10/write10 callbacks can address
+    p_msc->total_len = 0;
+    p_csw->data_residue = p_cbw->total_bytes;
+    p_csw->status = MSC_CSW_STATUS_FAILED;
+    p_msc->stage = MSC_STAGE_STATUS;
+
+    tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00); // Sense = LBA out of range
+
+    if (p_cbw->total_bytes) proc_stall_data(rhport, p_msc, tu_bit_test(p_cbw->dir, 7) ? p_msc->ep_in : p_msc->ep_out);
+  }
+  else if ( (rdwr_is_read(p_cbw->command[0]) || rdwr_is_write(p_cbw->command[0])) && (p_cbw->total_bytes == 0) )
   {
-    // Either endpoints is stalled, need to wait until it is cleared by host
-    if ( usbd_edpt_stalled(rhport,  p_msc->ep_in) || usbd_edpt_stalled(rhport,  p_msc->ep_out) )
+    // nothing to transfer. With blocks requested, host and device disagree on the length
+    // (or the medium is not ready when the length is derived from capacity for UAS)
+    p_msc->stage = MSC_STAGE_STATUS;
+
+    if ( rdwr_get_blockcount(p_cbw->command) )
     {
-      // simulate an transfer complete with adjusted parameters --> this driver callback will fired again
-      // and response with status phase after halted endpoints are cleared.
-      // note: use ep_out to prevent confusing with STATUS complete
-      dcd_event_xfer_complete(rhport, p_msc->ep_out, 0, XFER_RESULT_SUCCESS, false);
+      p_csw->status = MSC_CSW_STATUS_FAILED;
+      tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_NOT_READY, 0x04, 0x00);
     }
-    else
+  }
+  else if ( rdwr_is_read(p_cbw->command[0]) )
+  {
+#if CFG_TUD_MSC_READAHEAD_SIZE
+    readahead_detect(p_cbw->lun, rdwr_get_lba(p_cbw->command), rdwr_get_blockcount(p_cbw->command));
+#endif
+    proc_read10_cmd(rhport, p_msc);
+  }
+  else if ( rdwr_is_write(p_cbw->command[0]) )
+  {
+#if CFG_TUD_MSC_READAHEAD_SIZE
+    readahead_invalidate(p_cbw->lun, rdwr_get_lba(p_cbw->command), rdwr_get_blockcount(p_cbw->command));
+#endif
+    proc_write10_cmd(rhport, p_msc);
+  }
+  else
+  {
+    // For other SCSI commands
+    // 1. OUT : queue transfer (invoke app callback after done)
+    // 2. IN & Zero: Process if is built-in, else Invoke app callback. Skip DATA if zero length
+    if ( (p_cbw->total_bytes > 0 ) && !tu_bit_test(p_cbw->dir, 7) )
     {
-      // Move to Status Sent stage
-      p_msc->stage = MSC_STAGE_STATUS_SENT;
+      // queue transfer
+      TU_ASSERT( p_msc->total_len <= CFG_TUD_MSC_EP_BUFSIZE );
+      TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf[0], p_msc->total_len) );
+    }else
+    {
+      int32_t resplen;
+
+      // First process if it is a built-in commands
+      resplen = proc_builtin_scsi(p_cbw->lun, p_cbw->command, _mscd_buf[0], CFG_TUD_MSC_EP_BUFSIZE);
+
+#if CFG_TUD_MSC_CACHE_LINES
+      if ( resplen == TUD_MSC_RET_ASYNC )
+      {
+        // needs a write back that has to wait
+        cache_wait(CACHE_RESUME_CMD);
+        return true;
+      }
+#endif
+
+      // Not built-in, invoke user callback
+      if ( (resplen < 0) && (p_msc->sense_key == 0) )
+      {
+        resplen = tud_msc_scsi_cb(p_cbw->lun, p_cbw->command, _mscd_buf[0], p_msc->total_len);
+      }
+
+      if ( resplen < 0 )
+      {
+        p_msc->total_len = 0;
+        p_csw->status = MSC_CSW_STATUS_FAILED;
+        p_msc->stage = MSC_STAGE_STATUS;
+
+        // failed but senskey is not set: default to Illegal Request
+        if ( p_msc->sense_key == 0 ) tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
+
+        // Stall bulk In if needed
+        if (p_cbw->total_bytes) proc_stall_data(rhport, p_msc, p_msc->ep_in);
+      }
+      else
+      {
+        // cannot return more than host expect
+        p_msc->total_len = tu_min32((uint32_t) resplen, p_cbw->total_bytes);
+
+        if (p_msc->total_len)
+        {
+          TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_in, _mscd_buf[0], p_msc->total_len) );
+        }else
+        {
+          p_msc->stage = MSC_STAGE_STATUS;
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+// Send status of the command once data stage is complete
+static bool proc_status(uint8_t rhport, mscd_interface_t* p_msc)
+{
+#if CFG_TUD_MSC_UAS
+  if ( p_msc->uas )
+  {
+    // an OUT transfer aborted by an error still completes with the data host sends anyway
+    if ( usbd_edpt_busy(rhport, p_msc->ep_out) ) return true;
+
+    msc_uas_sense_iu_t* sense_iu = &_mscd_uas.status.sense;
+    uint16_t len = offsetof(msc_uas_sense_iu_t, sense);
 
-      // Send SCSI Status
-      TU_ASSERT(usbd_edpt_xfer(rhport, p_msc->ep_in , (uint8_t*) &p_msc->csw, sizeof(msc_csw_t)));
+    tu_memclr(sense_iu, sizeof(msc_uas_sense_iu_t));
+    sense_iu->iu_id = MSC_UAS_IU_SENSE;
+    sense_iu->tag   = _mscd_uas.tag;
+
+    if ( p_msc->csw.status != MSC_CSW_STATUS_PASSED )
+    {
+      // sense data is reported right away, host does not issue REQUEST SENSE
+      sense_iu->status    = 0x02; // CHECK CONDITION
+      sense_iu->sense_len = tu_htons(sizeof(scsi_sense_fixed_resp_t));
+
+      sense_iu->sense.response_code       = 0x70;
+      sense_iu->sense.valid               = 1;
+      sense_iu->sense.add_sense_len       = sizeof(scsi_sense_fixed_resp_t) - 8;
+      sense_iu->sense.sense_key           = p_msc->sense_key;
+      sense_iu->sense.add_sense_code      = p_msc->add_sense_code;
+      sense_iu->sense.add_sense_qualifier = p_msc->add_sense_qualifier;
+
+      tud_msc_set_sense(p_msc->cbw.lun, 0, 0, 0);
+      len += sizeof(scsi_sense_fixed_resp_t);
     }
+
+    p_msc->stage = MSC_STAGE_STATUS_SENT;
+    TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_status, (uint8_t*) sense_iu, len) );
+  }
+  else
+#endif
+
+  // Either endpoints is stalled, need to wait until it is cleared by host
+  if ( usbd_edpt_stalled(rhport,  p_msc->ep_in) || usbd_edpt_stalled(rhport,  p_msc->ep_out) )
+  {
+    // simulate an transfer complete with adjusted parameters --> this driver callback will fired again
+    // and response with status phase after halted endpoints are cleared.
+    // note: use ep_out to prevent confusing with STATUS complete
+    dcd_event_xfer_complete(rhport, p_msc->ep_out, 0, XFER_RESULT_SUCCESS, false);
+    return true;
+  }
+  else
+  {
+    // Move to Status Sent stage
+    p_msc->stage = MSC_STAGE_STATUS_SENT;
+
+    // Send SCSI Status
+    TU_ASSERT(usbd_edpt_xfer(rhport, p_msc->ep_in , (uint8_t*) &p_msc->csw, sizeof(msc_csw_t)));
   }
 
   return true;
@@ -462,6 +1892,7 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
 
 // return response's length (copied to buffer). Negative if it is not an built-in command or indicate Failed status (CSW)
 // In case of a failed status, sense key must be set for reason of failure
+// TUD_MSC_RET_ASYNC if command waits for cache write back, it is executed again later
 static int32_t proc_builtin_scsi(uint8_t lun, uint8_t const scsi_cmd[16], uint8_t* buffer, uint32_t bufsize)
 {
   (void) bufsize; // TODO refractor later
@@ -484,6 +1915,27 @@ static int32_t proc_builtin_scsi(uint8_t lun, uint8_t const scsi_cmd[16], uint8_
     case SCSI_CMD_START_STOP_UNIT:
       resplen = 0;
 
+#if CFG_TUD_MSC_CACHE_LINES
+      // eject: medium may be removed right after this
+      if ( !((scsi_start_stop_unit_t const *) scsi_cmd)->start && ((scsi_start_stop_unit_t const *) scsi_cmd)->load_eject )
+      {
+        uint8_t const wb = cache_flush(lun);
+
+        if ( wb == CACHE_WB_PENDING )
+        {
+          resplen = TUD_MSC_RET_ASYNC;
+          break;
+        }
+
+        if ( wb == CACHE_WB_ERROR )
+        {
+          resplen = -1;
+          tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00); // Sense = Write error
+          break;
+        }
+      }
+#endif
+
       if (tud_msc_start_stop_cb)
       {
         scsi_start_stop_unit_t const * start_stop = (scsi_start_stop_unit_t const *) scsi_cmd;
@@ -498,6 +1950,26 @@ static int32_t proc_builtin_scsi(uint8_t lun, uint8_t const scsi_cmd[16], uint8_
       }
     break;
 
+#if CFG_TUD_MSC_CACHE_LINES
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    case SCSI_CMD_SYNCHRONIZE_CACHE_16:
+      // whole cache of this lun is written back regardless of the range
+      switch ( cache_flush(lun) )
+      {
+        case CACHE_WB_PENDING:
+          resplen = TUD_MSC_RET_ASYNC;
+        break;
+
+        case CACHE_WB_ERROR:
+          resplen = -1;
+          tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00); // Sense = Write error
+        break;
+
+        default: resplen = 0; break;
+      }
+    break;
+#endif
+
     case SCSI_CMD_READ_CAPACITY_10:
     {
       uint32_t block_count;
@@ -528,6 +2000,47 @@ static int32_t proc_builtin_scsi(uint8_t lun, uint8_t const scsi_cmd[16], uint8_
     }
     break;
 
+    case SCSI_CMD_SERVICE_ACTION_IN_16:
+    {
+      scsi_read_capacity16_t const * cmd16 = (scsi_read_capacity16_t const *) scsi_cmd;
+
+      // READ CAPACITY(16) is the only service action supported
+      if ( (cmd16->service_action & 0x1F) != SCSI_SERVICE_ACTION_READ_CAPACITY_16 )
+      {
+        resplen = -1;
+        break;
+      }
+
+      uint32_t block_count;
+      uint16_t block_size;
+
+      tud_msc_capacity_cb(lun, &block_count, &block_size);
+
+      if (block_count == 0 || block_size == 0)
+      {
+        resplen = -1;
+
+        // If sense key is not set by callback, default to Logical Unit Not Ready, Cause Not Reportable
+        if ( _mscd_itf.sense_key == 0 ) tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x00);
+      }else
+      {
+        scsi_read_capacity16_resp_t read_capa16;
+        tu_memclr(&read_capa16, sizeof(read_capa16));
+
+        // 64-bit big endian last lba, upper half is always zero
+        uint32_t const last_lba = tu_htonl(block_count-1);
+        memcpy(((uint8_t*) &read_capa16.last_lba) + 4, &last_lba, 4);
+        read_capa16.block_size = tu_htonl((uint32_t) block_size);
+
+        // host may ask for less than the full response
+        uint32_t const alloc_len = tu_ntohl(tu_unaligned_read32(scsi_cmd + offsetof(scsi_read_capacity16_t, alloc_length)));
+
+        resplen = (int32_t) tu_min32(sizeof(read_capa16), alloc_len);
+        memcpy(buffer, &read_capa16, resplen);
+      }
+    }
+    break;
+
     case SCSI_CMD_READ_FORMAT_CAPACITY:
     {
       scsi_read_format_capacity_data_t read_fmt_capa =
@@ -633,34 +2146,127 @@ static int32_t proc_builtin_scsi(uint8_t lun, uint8_t const scsi_cmd[16], uint8_
   return resplen;
 }
 
+// Invoke application callback, or return result of the asynchronous one that just completed
+static int32_t invoke_read10_cb(mscd_interface_t* p_msc, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
+{
+  if ( p_msc->async == MSC_ASYNC_DONE )
+  {
+    p_msc->async = MSC_ASYNC_NONE;
+    return p_msc->async_result;
+  }
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  uint32_t const block_cnt = rdwr_get_blockcount(p_msc->cbw.command);
+  uint32_t const block_sz  = block_cnt ? (p_msc->cbw.total_bytes / block_cnt) : 0;
+
+  if ( block_sz )
+  {
+    int32_t const copied = readahead_copy(p_msc->cbw.lun, lba, offset, (uint8_t*) buffer, bufsize, block_sz);
+    if ( copied != 0 ) return copied;
+  }
+#endif
+
+  int32_t const nbytes = tud_msc_read10_cb(p_msc->cbw.lun, lba, offset, buffer, bufsize);
+  if ( nbytes == TUD_MSC_RET_ASYNC ) p_msc->async = MSC_ASYNC_PENDING;
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  // stream continues behind the bytes just read
+  if ( block_sz ) readahead_anchor(p_msc->cbw.lun, lba, offset + ((nbytes > 0) ? (uint32_t) nbytes : bufsize), block_sz);
+#endif
+
+  return nbytes;
+}
+
+static int32_t invoke_write10_cb(mscd_interface_t* p_msc, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
+{
+  if ( p_msc->async == MSC_ASYNC_DONE )
+  {
+    p_msc->async = MSC_ASYNC_NONE;
+    return p_msc->async_result;
+  }
+
+#if CFG_TUD_MSC_CACHE_LINES
+  uint32_t const block_cnt = rdwr_get_blockcount(p_msc->cbw.command);
+  uint32_t const block_sz  = block_cnt ? (p_msc->cbw.total_bytes / block_cnt) : 0;
+  if ( cache_usable(block_sz) )
+  {
+    int32_t const nbytes = cache_write(p_msc->cbw.lun, lba, offset, buffer, bufsize, block_sz);
+
+    if ( (nbytes == 0) && _mscd_cache.wb_async )
+    {
+      // evicted line is being written back asynchronously, data stage is resumed by cache_resume()
+      _mscd_cache.wb_resume = CACHE_RESUME_WRITE;
+      return TUD_MSC_RET_ASYNC;
+    }
+
+    return nbytes;
+  }
+#endif
+
+  int32_t const nbytes = tud_msc_write10_cb(p_msc->cbw.lun, lba, offset, buffer, bufsize);
+  if ( nbytes == TUD_MSC_RET_ASYNC ) p_msc->async = MSC_ASYNC_PENDING;
+
+  return nbytes;
+}
+
 static void proc_read10_cmd(uint8_t rhport, mscd_interface_t* p_msc)
 {
   msc_cbw_t const * p_cbw = &p_msc->cbw;
   msc_csw_t       * p_csw = &p_msc->csw;
 
-  uint16_t const block_cnt = rdwr10_get_blockcount(p_cbw->command);
+  uint32_t const block_cnt = rdwr_get_blockcount(p_cbw->command);
   TU_ASSERT(block_cnt, ); // prevent div by zero
 
-  uint16_t const block_sz = p_cbw->total_bytes / block_cnt;
+  uint32_t const block_sz = p_cbw->total_bytes / block_cnt;
   TU_ASSERT(block_sz, ); // prevent div by zero
 
   // Adjust lba with transferred bytes
-  uint32_t const lba = rdwr10_get_lba(p_cbw->command) + (p_msc->xferred_len / block_sz);
+  uint32_t const lba = rdwr_get_lba(p_cbw->command) + (p_msc->xferred_len / block_sz);
 
   // remaining bytes capped at class buffer
-  int32_t nbytes = (int32_t) tu_min32(sizeof(_mscd_buf), p_cbw->total_bytes-p_msc->xferred_len);
+  int32_t nbytes = (int32_t) tu_min32(CFG_TUD_MSC_EP_BUFSIZE, p_cbw->total_bytes-p_msc->xferred_len);
 
-  // Application can consume smaller bytes
-  nbytes = tud_msc_read10_cb(p_cbw->lun, lba, p_msc->xferred_len % block_sz, _mscd_buf, (uint32_t) nbytes);
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+  if ( p_msc->rd_async )
+  {
+    // prefetch into the idle buffer is still in progress
+    p_msc->rd_wait = true;
+    return;
+  }
 
-  if ( nbytes < 0 )
+  if ( p_msc->rd_failed )
+  {
+    // prefetch failed while previous chunk was on the bus, fail the command now
+    nbytes = TUD_MSC_RET_ERROR;
+  }
+  else if ( p_msc->rd_ready )
+  {
+    // already read into the idle buffer while previous chunk was on the bus
+    p_msc->buf_idx ^= 1;
+    nbytes = (int32_t) p_msc->rd_ready;
+    p_msc->rd_ready = 0;
+  }
+  else
+#endif
+  {
+    // Application can consume smaller bytes
+    nbytes = invoke_read10_cb(p_msc, lba, p_msc->xferred_len % block_sz, _mscd_buf[p_msc->buf_idx], (uint32_t) nbytes);
+  }
+
+  if ( nbytes == TUD_MSC_RET_ASYNC )
+  {
+    // resumed by tud_msc_async_io_done()
+  }
+  else if ( nbytes < 0 )
   {
     // negative means error -> pipe is stalled & status in CSW set to failed
     p_csw->data_residue = p_cbw->total_bytes - p_msc->xferred_len;
     p_csw->status       = MSC_CSW_STATUS_FAILED;
 
+    p_msc->stage        = MSC_STAGE_STATUS;
+
     tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00); // Sense = Invalid Command Operation
-    usbd_edpt_stall(rhport, p_msc->ep_in);
+    proc_stall_data(rhport, p_msc, p_msc->ep_in);
   }
   else if ( nbytes == 0 )
   {
@@ -669,7 +2275,21 @@ static void proc_read10_cmd(uint8_t rhport, mscd_interface_t* p_msc)
   }
   else
   {
-    TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_in, _mscd_buf, nbytes), );
+#if CFG_TUD_MSC_CACHE_LINES
+    // blocks written by host may not be on the medium yet
+    cache_read_overlay(p_cbw->lun, lba, p_msc->xferred_len % block_sz, _mscd_buf[p_msc->buf_idx], (uint32_t) nbytes, block_sz);
+#endif
+
+    TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_in, _mscd_buf[p_msc->buf_idx], nbytes), );
+
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+    proc_read10_prefetch(p_msc, block_sz, p_msc->xferred_len + (uint32_t) nbytes);
+#endif
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+    // while this chunk is on the bus
+    readahead_fill(p_msc);
+#endif
   }
 }
 
@@ -684,17 +2304,141 @@ static void proc_write10_cmd(uint8_t rhport, mscd_interface_t* p_msc)
     msc_csw_t* p_csw = &p_msc->csw;
     p_csw->data_residue = p_cbw->total_bytes;
     p_csw->status       = MSC_CSW_STATUS_FAILED;
+    p_msc->stage        = MSC_STAGE_STATUS;
 
     tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00); // Sense = Write protected
-    usbd_edpt_stall(rhport, p_msc->ep_out);
+    proc_stall_data(rhport, p_msc, p_msc->ep_out);
     return;
   }
 
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+  // only invoked for the first chunk, proc_write10_data() keeps the pipeline going
+  int32_t nbytes = (int32_t) tu_min32(CFG_TUD_MSC_EP_BUFSIZE, p_cbw->total_bytes-p_msc->rx_len);
+
+  TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf[p_msc->buf_idx], nbytes), );
+  p_msc->rx_len  += nbytes;
+  p_msc->out_busy = true;
+#else
   // remaining bytes capped at class buffer
-  int32_t nbytes = (int32_t) tu_min32(sizeof(_mscd_buf), p_cbw->total_bytes-p_msc->xferred_len);
+  int32_t nbytes = (int32_t) tu_min32(CFG_TUD_MSC_EP_BUFSIZE, p_cbw->total_bytes-p_msc->xferred_len);
 
   // Write10 callback will be called later when usb transfer complete
-  TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf, nbytes), );
+  TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf[0], nbytes), );
+#endif
+}
+
+#if CFG_TUD_MSC_DOUBLE_BUFFER
+
+// Read the chunk starting at byte offset into the idle buffer while the current one is on the bus.
+// A chunk that is not ready is requested again by proc_read10_cmd() once the bus is idle,
+// an error fails the command there.
+static void proc_read10_prefetch(mscd_interface_t* p_msc, uint32_t block_sz, uint32_t offset)
+{
+  msc_cbw_t const * p_cbw = &p_msc->cbw;
+
+  if ( offset >= p_cbw->total_bytes ) return;
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  // only one asynchronous callback at a time, next chunk is read when the bus asks for it
+  if ( _mscd_ra.fill ) return;
+#endif
+
+  uint32_t const lba    = rdwr_get_lba(p_cbw->command) + (offset / block_sz);
+  uint32_t const buflen = tu_min32(CFG_TUD_MSC_EP_BUFSIZE, p_cbw->total_bytes - offset);
+
+  int32_t const nbytes = invoke_read10_cb(p_msc, lba, offset % block_sz, _mscd_buf[p_msc->buf_idx ^ 1], buflen);
+
+  p_msc->rd_async  = (nbytes == TUD_MSC_RET_ASYNC);
+  p_msc->rd_ready  = (nbytes > 0) ? (uint32_t) nbytes : 0;
+  p_msc->rd_failed = (nbytes < 0) && !p_msc->rd_async;
+}
+
+// WRITE10 data stage: host fills buffer buf_idx while application drains the other one.
+// Invoked for every OUT completion, and for retries when application consumed less than offered.
+static void proc_write10_data(uint8_t rhport, mscd_interface_t* p_msc, uint8_t ep_addr, uint32_t xferred_bytes)
+{
+  msc_cbw_t const * p_cbw = &p_msc->cbw;
+  msc_csw_t       * p_csw = &p_msc->csw;
+
+  if ( ep_addr == p_msc->ep_out )
+  {
+    p_msc->out_busy = false;
+    p_msc->rx_ready = xferred_bytes;
+  }
+
+  uint32_t const block_sz = p_cbw->total_bytes / rdwr_get_blockcount(p_cbw->command);
+
+  while (1)
+  {
+    // hand received buffer over to application once it is done with the other one
+    if ( (p_msc->wr_len == 0) && p_msc->rx_ready )
+    {
+      p_msc->wr_off   = 0;
+      p_msc->wr_len   = p_msc->rx_ready;
+      p_msc->rx_ready = 0;
+      p_msc->buf_idx ^= 1;
+    }
+
+    // keep the bus busy with the next chunk
+    if ( !p_msc->out_busy && !p_msc->rx_ready && (p_msc->rx_len < p_cbw->total_bytes) )
+    {
+      uint32_t const nbytes = tu_min32(CFG_TUD_MSC_EP_BUFSIZE, p_cbw->total_bytes - p_msc->rx_len);
+
+      TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf[p_msc->buf_idx], nbytes), );
+      p_msc->rx_len  += nbytes;
+      p_msc->out_busy = true;
+    }
+
+    // wait for host or for the pending asynchronous write
+    if ( p_msc->wr_len == 0 || p_msc->async == MSC_ASYNC_PENDING ) return;
+
+    // Adjust lba with transferred bytes
+    uint32_t const lba = rdwr_get_lba(p_cbw->command) + (p_msc->xferred_len / block_sz);
+
+    // Application can consume smaller bytes
+    int32_t nbytes = invoke_write10_cb(p_msc, lba, p_msc->xferred_len % block_sz,
+                                       _mscd_buf[p_msc->buf_idx ^ 1] + p_msc->wr_off, p_msc->wr_len);
+
+    // resumed by tud_msc_async_io_done()
+    if ( nbytes == TUD_MSC_RET_ASYNC ) return;
+
+    if ( nbytes < 0 )
+    {
+      // negative means error -> skip to status phase, status in CSW set to failed
+      p_csw->data_residue = p_cbw->total_bytes - p_msc->xferred_len;
+      p_csw->status       = MSC_CSW_STATUS_FAILED;
+      p_msc->stage        = MSC_STAGE_STATUS;
+
+      tud_msc_set_sense(p_cbw->lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00); // Sense = Invalid Command Operation
+
+      // abort the OUT transfer still queued for the other buffer
+      if ( p_msc->out_busy ) proc_stall_data(rhport, p_msc, p_msc->ep_out);
+      return;
+    }
+
+    nbytes = (int32_t) tu_min32((uint32_t) nbytes, p_msc->wr_len);
+
+    p_msc->xferred_len += (uint32_t) nbytes;
+    p_msc->wr_off      += (uint32_t) nbytes;
+    p_msc->wr_len      -= (uint32_t) nbytes;
+
+    if ( p_msc->xferred_len >= p_msc->total_len )
+    {
+      // Data Stage is complete
+      p_msc->stage = MSC_STAGE_STATUS;
+      return;
+    }
+
+    if ( p_msc->wr_len )
+    {
+      // Application consumed less than what we got (including zero), simulate a transfer complete so that
+      // this is invoked again. Use ep_in since the real completion of the other buffer may already be queued for ep_out.
+      dcd_event_xfer_complete(rhport, p_msc->ep_in, 0, XFER_RESULT_SUCCESS, false);
+      return;
+    }
+  }
 }
 
 #endif
+
+#endif
@@ -51,19 +51,111 @@
 
 TU_VERIFY_STATIC(CFG_TUD_MSC_EP_BUFSIZE < UINT16_MAX, "Size is not correct");
 
+// Use two CFG_TUD_MSC_EP_BUFSIZE buffers for READ10/WRITE10: while one is on the bus
+// the application fills (read) or drains (write) the other.
+#ifndef CFG_TUD_MSC_DOUBLE_BUFFER
+  #define CFG_TUD_MSC_DOUBLE_BUFFER 0
+#endif
+
+// Write-back cache between host writes and tud_msc_write10_cb(), in number of erase blocks (0 = disabled).
+// Small scattered writes to the same erase block are merged and written back as one run of blocks on
+// SYNCHRONIZE CACHE, eject, idle timeout (see tud_msc_cache_task()) or when the line is evicted.
+#ifndef CFG_TUD_MSC_CACHE_LINES
+  #define CFG_TUD_MSC_CACHE_LINES 0
+#endif
+
+// Erase block size of the medium, must be a multiple of the block size and at most 32 blocks
+#ifndef CFG_TUD_MSC_CACHE_ERASE_SIZE
+  #define CFG_TUD_MSC_CACHE_ERASE_SIZE 4096
+#endif
+
+// Write back the cache when host did not write for that long
+#ifndef CFG_TUD_MSC_CACHE_IDLE_MS
+  #define CFG_TUD_MSC_CACHE_IDLE_MS 1000
+#endif
+
+// USB Attached SCSI as alternate setting 1 of the BOT interface, see TUD_MSC_UAS_DESCRIPTOR().
+// Host can queue up to CFG_TUD_MSC_UAS_QDEPTH commands, they are executed one after another.
+// Switching the alternate setting closes the endpoints of the other one, port must implement dcd_edpt_close().
+// Commands the driver does not know are rejected: UAS gives no data length, tud_msc_scsi_cb() is not invoked.
+#ifndef CFG_TUD_MSC_UAS
+  #define CFG_TUD_MSC_UAS 0
+#endif
+
+#ifndef CFG_TUD_MSC_UAS_QDEPTH
+  #define CFG_TUD_MSC_UAS_QDEPTH 4
+#endif
+
+// Sequential read-ahead buffer in bytes (0 = disabled), a multiple of CFG_TUD_MSC_EP_BUFSIZE. When host reads
+// back to back, the data following the current chunk is read into it one chunk at a time while the previous
+// chunks are on the bus, never between status and next command. READ10 is served from there.
+#ifndef CFG_TUD_MSC_READAHEAD_SIZE
+  #define CFG_TUD_MSC_READAHEAD_SIZE 0
+#endif
+
+// Number of consecutive sequential READ10 before read-ahead kicks in
+#ifndef CFG_TUD_MSC_READAHEAD_TRIGGER
+  #define CFG_TUD_MSC_READAHEAD_TRIGGER 1
+#endif
+
 /** \addtogroup ClassDriver_MSC
  *  @{
  * \defgroup MSC_Device Device
  *  @{ */
 
+// Special return values of tud_msc_read10_cb() and tud_msc_write10_cb()
+enum
+{
+  TUD_MSC_RET_BUSY  = 0,   // not ready, callback is invoked again with the same parameters later
+  TUD_MSC_RET_ERROR = -1,
+};
+
+// I/O started, application calls tud_msc_async_io_done() once it completes. Every other negative value
+// is an error: this used to be -16, a callback passing on -EBUSY from its disk driver was taken as
+// asynchronous and the command never completed. Return it by name, not by value.
+#define TUD_MSC_RET_ASYNC  INT32_MIN
+
 bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
 
+// Complete an I/O for which read10/write10 callback returned TUD_MSC_RET_ASYNC.
+// nbytes has the same meaning as the callback's return value except TUD_MSC_RET_ASYNC. Can be called from any context,
+// in_isr must be true when called from an interrupt handler.
+bool tud_msc_async_io_done(uint8_t lun, int32_t nbytes, bool in_isr);
+
+#if CFG_TUD_MSC_CACHE_LINES
+typedef struct
+{
+  uint32_t write_hits;        // blocks written to an erase block already in cache
+  uint32_t write_misses;      // blocks that needed a new cache line
+  uint32_t read_hits;         // blocks read from cache instead of the medium
+  uint32_t writebacks;        // erase blocks written back
+  uint32_t write_cbs;         // tud_msc_write10_cb() invocations by write back
+  uint32_t writeback_errors;  // failed write backs, the line keeps the blocks not written yet
+} tud_msc_cache_stats_t;
+
+// Call periodically with a millisecond time stamp to write back the cache once host is idle
+void tud_msc_cache_task(uint32_t now_ms);
+
+void tud_msc_cache_get_stats(tud_msc_cache_stats_t* stats);
+#endif
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+typedef struct
+{
+  uint32_t hits;          // chunks served from the read-ahead buffer
+  uint32_t misses;        // chunks of a sequential read that had to invoke tud_msc_read10_cb()
+  uint32_t prefetches;    // read-ahead requests to tud_msc_read10_cb(), at most a chunk each
+} tud_msc_readahead_stats_t;
+
+void tud_msc_readahead_get_stats(tud_msc_readahead_stats_t* stats);
+#endif
+
 //--------------------------------------------------------------------+
 // Application Callbacks (WEAK is optional)
 //--------------------------------------------------------------------+
 
 /**
- * Invoked when received \ref SCSI_CMD_READ_10 command
+ * Invoked when received \ref SCSI_CMD_READ_10 or \ref SCSI_CMD_READ_16 command
  * \param[in]   lun         Logical unit number
  * \param[in]   lba         Logical Block Address to be read
  * \param[in]   offset      Byte offset from LBA
@@ -78,11 +170,22 @@ bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, u
  *
  * \retval      negative    Indicate error e.g reading disk I/O. tinyusb will \b STALL the corresponding
  *                          endpoint and return failed status in command status wrapper phase.
+ *
+ * \retval      TUD_MSC_RET_ASYNC  Read is in progress, \a \b buffer must stay valid until application calls
+ *                          tud_msc_async_io_done() with the actual result. No other read/write callback is
+ *                          invoked until then.
+ *
+ * \note        With CFG_TUD_MSC_DOUBLE_BUFFER the next chunk is requested while the previous one is still
+ *              being transmitted. A zero result is then simply requested again later, a negative one fails
+ *              the command once the previous chunk is sent.
+ *
+ * \note        With CFG_TUD_MSC_READAHEAD_SIZE data following a sequential read is requested ahead of time,
+ *              a chunk at a time. A zero or negative result only stops that read-ahead.
  */
 int32_t tud_msc_read10_cb (uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize);
 
 /**
- * Invoked when received \ref SCSI_CMD_WRITE_10 command
+ * Invoked when received \ref SCSI_CMD_WRITE_10 or \ref SCSI_CMD_WRITE_16 command
  * \param[in]   lun         Logical unit number
  * \param[in]   lba         Logical Block Address to be write
  * \param[in]   offset      Byte offset from LBA
@@ -97,6 +200,13 @@ int32_t tud_msc_read10_cb (uint8_t lun, uint32_t lba, uint32_t offset, void* buf
  *
  * \retval      negative    Indicate error writing disk I/O. Tinyusb will \b STALL the corresponding
  *                          endpoint and return failed status in command status wrapper phase.
+ *
+ * \retval      TUD_MSC_RET_ASYNC  Write is in progress, application calls tud_msc_async_io_done() with the
+ *                          actual result once it completes.
+ *
+ * \note        With CFG_TUD_MSC_CACHE_LINES this is invoked on write back with whole blocks only. TUD_MSC_RET_BUSY
+ *              and TUD_MSC_RET_ASYNC are supported there too: SYNCHRONIZE CACHE, eject or a WRITE10 that evicts
+ *              a line wait until the write back is complete, no other command is executed meanwhile.
  */
 int32_t tud_msc_write10_cb (uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize);
 
@@ -108,14 +218,14 @@ void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16
 // return true allowing host to read/write this LUN e.g SD card inserted
 bool tud_msc_test_unit_ready_cb(uint8_t lun);
 
-// Invoked when received SCSI_CMD_READ_CAPACITY_10 and SCSI_CMD_READ_FORMAT_CAPACITY to determine the disk size
+// Invoked when received SCSI_CMD_READ_CAPACITY_10, READ CAPACITY(16) and SCSI_CMD_READ_FORMAT_CAPACITY to determine the disk size
 // Application update block count and block size
 void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size);
 
 /**
  * Invoked when received an SCSI command not in built-in list below.
- * - READ_CAPACITY10, READ_FORMAT_CAPACITY, INQUIRY, TEST_UNIT_READY, START_STOP_UNIT, MODE_SENSE6, REQUEST_SENSE
- * - READ10 and WRITE10 has their own callbacks
+ * - READ_CAPACITY10, READ_CAPACITY16, READ_FORMAT_CAPACITY, INQUIRY, TEST_UNIT_READY, START_STOP_UNIT, MODE_SENSE6, REQUEST_SENSE
+ * - READ10/READ16 and WRITE10/WRITE16 has their own callbacks
  *
  * \param[in]   lun         Logical unit number
  * \param[in]   scsi_cmd    SCSI command contents which application must examine to response accordingly
@@ -140,10 +250,10 @@ TU_ATTR_WEAK uint8_t tud_msc_get_maxlun_cb(void);
 // - Start = 1 : active mode, if load_eject = 1 : load disk storage
 TU_ATTR_WEAK bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject);
 
-// Invoked when Read10 command is complete
+// Invoked when Read10 or Read16 command is complete
 TU_ATTR_WEAK void tud_msc_read10_complete_cb(uint8_t lun);
 
-// Invoke when Write10 command is complete, can be used to flush flash caching
+// Invoke when Write10 or Write16 command is complete, can be used to flush flash caching
 TU_ATTR_WEAK void tud_msc_write10_complete_cb(uint8_t lun);
 
 // Invoked when command in tud_msc_scsi_cb is complete
@@ -0,0 +1,142 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * This file is part of the TinyUSB stack.
+ */
+
+#ifndef _TUSB_NCM_H_
+#define _TUSB_NCM_H_
+
+#include "common/tusb_common.h"
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+//--------------------------------------------------------------------+
+// CDC Network Control Model [USBNCM1.0]
+//--------------------------------------------------------------------+
+
+// Data interface protocol code
+#define NCM_DATA_PROTOCOL_NTB          0x01
+
+// bmNtbFormatsSupported of NTB parameters
+#define NCM_NTB_FORMAT_SUPPORT_16      0x0001
+#define NCM_NTB_FORMAT_SUPPORT_32      0x0002
+
+// wValue of SET_NTB_FORMAT
+enum
+{
+  NCM_NTB_FORMAT_16 = 0x00,
+  NCM_NTB_FORMAT_32 = 0x01,
+};
+
+// dwSignature of transfer header and datagram pointer
+enum
+{
+  NCM_NTH16_SIGNATURE = 0x484D434E, // "NCMH"
+  NCM_NDP16_SIGNATURE = 0x304D434E, // "NCM0", no CRC
+  NCM_NTH32_SIGNATURE = 0x686D636E, // "ncmh"
+  NCM_NDP32_SIGNATURE = 0x306D636E, // "ncm0", no CRC
+};
+
+/// NTB Parameter Structure, response to GET_NTB_PARAMETERS
+typedef struct TU_ATTR_PACKED
+{
+  uint16_t wLength;
+  uint16_t bmNtbFormatsSupported;
+  uint32_t dwNtbInMaxSize;          ///< device to host
+  uint16_t wNdpInDivisor;
+  uint16_t wNdpInPayloadRemainder;
+  uint16_t wNdpInAlignment;
+  uint16_t wReserved;
+  uint32_t dwNtbOutMaxSize;         ///< host to device
+  uint16_t wNdpOutDivisor;
+  uint16_t wNdpOutPayloadRemainder;
+  uint16_t wNdpOutAlignment;
+  uint16_t wNtbOutMaxDatagrams;     ///< 0 : no limit
+} ncm_ntb_parameters_t;
+
+TU_VERIFY_STATIC(sizeof(ncm_ntb_parameters_t) == 28, "size is not correct");
+
+/// 16-bit NCM Transfer Header
+typedef struct TU_ATTR_PACKED
+{
+  uint32_t dwSignature;
+  uint16_t wHeaderLength;
+  uint16_t wSequence;
+  uint16_t wBlockLength;
+  uint16_t wNdpIndex;
+} ncm_nth16_t;
+
+TU_VERIFY_STATIC(sizeof(ncm_nth16_t) == 12, "size is not correct");
+
+/// 32-bit NCM Transfer Header
+typedef struct TU_ATTR_PACKED
+{
+  uint32_t dwSignature;
+  uint16_t wHeaderLength;
+  uint16_t wSequence;
+  uint32_t dwBlockLength;
+  uint32_t dwNdpIndex;
+} ncm_nth32_t;
+
+TU_VERIFY_STATIC(sizeof(ncm_nth32_t) == 16, "size is not correct");
+
+/// 16-bit NCM Datagram Pointer, followed by datagram entries terminated by a zero entry
+typedef struct TU_ATTR_PACKED
+{
+  uint32_t dwSignature;
+  uint16_t wLength;
+  uint16_t wNextNdpIndex;
+} ncm_ndp16_t;
+
+TU_VERIFY_STATIC(sizeof(ncm_ndp16_t) == 8, "size is not correct");
+
+typedef struct TU_ATTR_PACKED
+{
+  uint16_t wDatagramIndex;
+  uint16_t wDatagramLength;
+} ncm_ndp16_datagram_t;
+
+/// 32-bit NCM Datagram Pointer, followed by datagram entries terminated by a zero entry
+typedef struct TU_ATTR_PACKED
+{
+  uint32_t dwSignature;
+  uint16_t wLength;
+  uint16_t wReserved6;
+  uint32_t dwNextNdpIndex;
+  uint32_t dwReserved12;
+} ncm_ndp32_t;
+
+TU_VERIFY_STATIC(sizeof(ncm_ndp32_t) == 16, "size is not correct");
+
+typedef struct TU_ATTR_PACKED
+{
+  uint32_t dwDatagramIndex;
+  uint32_t dwDatagramLength;
+} ncm_ndp32_datagram_t;
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif /* _TUSB_NCM_H_ */
@@ -0,0 +1,826 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * This file is part of the TinyUSB stack.
+ */
+
+#include "tusb_option.h"
+
+#if ( TUSB_OPT_DEVICE_ENABLED && CFG_TUD_NCM )
+
+#include "net_device.h"
+#include "device/usbd_pvt.h"
+
+//--------------------------------------------------------------------+
+// MACRO CONSTANT TYPEDEF
+//--------------------------------------------------------------------+
+#define NCM_ALIGN(_x, _a)     ( ((_x) + (_a) - 1) & ~((uint32_t) (_a) - 1) )
+
+// every ring entry starts 32-bit aligned
+#define NCM_IN_BUFSIZE        NCM_ALIGN(CFG_TUD_NCM_IN_NTB_MAX_SIZE, 4)
+#define NCM_OUT_BUFSIZE       NCM_ALIGN(CFG_TUD_NCM_OUT_NTB_MAX_SIZE, 4)
+
+// NDPs are placed 32-bit aligned in both directions
+#define NCM_NDP_ALIGNMENT     4
+
+TU_VERIFY_STATIC(CFG_TUD_NCM_IN_NTB_MAX_SIZE  >= 2048 && CFG_TUD_NCM_IN_NTB_MAX_SIZE  <= UINT16_MAX, "CFG_TUD_NCM_IN_NTB_MAX_SIZE is out of range");
+TU_VERIFY_STATIC(CFG_TUD_NCM_OUT_NTB_MAX_SIZE >= 2048 && CFG_TUD_NCM_OUT_NTB_MAX_SIZE <= UINT16_MAX, "CFG_TUD_NCM_OUT_NTB_MAX_SIZE is out of range");
+TU_VERIFY_STATIC(CFG_TUD_NCM_IN_NTB_COUNT  > 0 && CFG_TUD_NCM_IN_NTB_COUNT  < 256, "CFG_TUD_NCM_IN_NTB_COUNT is out of range");
+TU_VERIFY_STATIC(CFG_TUD_NCM_OUT_NTB_COUNT > 0 && CFG_TUD_NCM_OUT_NTB_COUNT < 256, "CFG_TUD_NCM_OUT_NTB_COUNT is out of range");
+TU_VERIFY_STATIC(CFG_TUD_NCM_MAX_DATAGRAMS_PER_NTB > 0, "CFG_TUD_NCM_MAX_DATAGRAMS_PER_NTB is out of range");
+TU_VERIFY_STATIC(CFG_TUD_NCM_ALIGNMENT >= 4 && (CFG_TUD_NCM_ALIGNMENT & (CFG_TUD_NCM_ALIGNMENT - 1)) == 0, "CFG_TUD_NCM_ALIGNMENT must be a power of 2");
+TU_VERIFY_STATIC(sizeof(ncm_nth32_t) + CFG_TUD_NCM_ALIGNMENT + CFG_TUD_NET_MTU + NCM_NDP_ALIGNMENT + sizeof(ncm_ndp32_t) + 2*sizeof(ncm_ndp32_datagram_t)
+                 <= CFG_TUD_NCM_IN_NTB_MAX_SIZE, "CFG_TUD_NCM_IN_NTB_MAX_SIZE is too small for CFG_TUD_NET_MTU");
+
+typedef struct
+{
+  uint8_t itf_num;      // Index number of Management Interface, +1 for Data Interface
+  uint8_t itf_data_alt; // Alternate setting of Data Interface. 0 : inactive, 1 : active
+
+  uint8_t ep_notif;
+  uint8_t ep_in;
+  uint8_t ep_out;
+
+  bool started;         // endpoints opened and network initialized
+
+  uint8_t notify;       // pending notifications, kept until their transfer completed
+
+  // Endpoint descriptor use to open when receiving SetInterface
+  uint8_t const * desc_epdata;
+
+  // NTB parameters selected by host, reset by alternate setting 0
+  uint8_t  ntb_format;
+  uint32_t ntb_in_size;
+
+  uint32_t ctrl_buf[2]; // SET_NTB_INPUT_SIZE data stage
+
+  // RX ring: 'count' received NTBs starting at 'rd', followed by the one armed on ep_out
+  struct
+  {
+    uint32_t len[CFG_TUD_NCM_OUT_NTB_COUNT];
+    uint8_t  rd;
+    uint8_t  count;
+    bool     armed;
+    bool     held;       // datagram is passed to application and not renewed yet
+    bool     delivering;
+
+    // datagram walk within NTB 'rd'
+    bool     parsed;
+    bool     is32;
+    uint32_t ndp;        // current NDP, 0 when done
+    uint16_t datagram;   // next entry within that NDP
+  } rx;
+
+  // TX ring: 'count' sealed NTBs starting at 'rd', the one at 'rd' is in flight when busy.
+  // The NTB following them collects datagrams until it is sealed.
+  struct
+  {
+    uint32_t len[CFG_TUD_NCM_IN_NTB_COUNT];
+    uint8_t  rd;
+    uint8_t  count;
+    bool     busy;
+
+    bool     filling;
+    uint16_t datagrams;
+    uint32_t pos;        // end of the last datagram
+    uint16_t sequence;
+
+    uint32_t now_ms;     // latest time passed to tud_network_ncm_task()
+    uint32_t stamp_ms;   // first datagram was added
+
+    struct
+    {
+      uint32_t index;
+      uint16_t length;
+    } entry[CFG_TUD_NCM_MAX_DATAGRAMS_PER_NTB];
+  } tx;
+
+} ncmd_interface_t;
+
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t _ntb_out[CFG_TUD_NCM_OUT_NTB_COUNT][NCM_OUT_BUFSIZE];
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t _ntb_in[CFG_TUD_NCM_IN_NTB_COUNT][NCM_IN_BUFSIZE];
+
+static ncm_ntb_parameters_t const _ntb_parameters =
+{
+  .wLength                 = sizeof(ncm_ntb_parameters_t),
+  .bmNtbFormatsSupported   = NCM_NTB_FORMAT_SUPPORT_16 | NCM_NTB_FORMAT_SUPPORT_32,
+  .dwNtbInMaxSize          = CFG_TUD_NCM_IN_NTB_MAX_SIZE,
+  .wNdpInDivisor           = CFG_TUD_NCM_ALIGNMENT,
+  .wNdpInPayloadRemainder  = 0,
+  .wNdpInAlignment         = NCM_NDP_ALIGNMENT,
+  .wReserved               = 0,
+  .dwNtbOutMaxSize         = CFG_TUD_NCM_OUT_NTB_MAX_SIZE,
+  .wNdpOutDivisor          = CFG_TUD_NCM_ALIGNMENT,
+  .wNdpOutPayloadRemainder = 0,
+  .wNdpOutAlignment        = NCM_NDP_ALIGNMENT,
+  .wNtbOutMaxDatagrams     = 0,
+};
+
+typedef struct TU_ATTR_PACKED
+{
+  tusb_control_request_t header;
+  uint32_t downlink, uplink;
+} ncm_notify_t;
+
+enum
+{
+  NCM_NOTIFY_CONNECTION = TU_BIT(0),
+  NCM_NOTIFY_SPEED      = TU_BIT(1),  // follows connection
+};
+
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static ncm_notify_t _ncmd_notify;
+
+//--------------------------------------------------------------------+
+// INTERNAL OBJECT & FUNCTION DECLARATION
+//--------------------------------------------------------------------+
+CFG_TUSB_MEM_SECTION static ncmd_interface_t _ncmd_itf;
+
+static void rx_deliver(void);
+
+// arm OUT endpoint with the next free NTB buffer if there is one
+static void rx_arm(void)
+{
+  if ( _ncmd_itf.rx.armed || _ncmd_itf.rx.count >= CFG_TUD_NCM_OUT_NTB_COUNT ) return;
+
+  uint8_t const idx = (uint8_t) ((_ncmd_itf.rx.rd + _ncmd_itf.rx.count) % CFG_TUD_NCM_OUT_NTB_COUNT);
+
+  _ncmd_itf.rx.armed = true;
+  usbd_edpt_xfer(TUD_OPT_RHPORT, _ncmd_itf.ep_out, _ntb_out[idx], CFG_TUD_NCM_OUT_NTB_MAX_SIZE);
+}
+
+// all datagrams of NTB 'rd' were delivered
+static void rx_release(void)
+{
+  _ncmd_itf.rx.parsed = false;
+  _ncmd_itf.rx.rd     = (uint8_t) ((_ncmd_itf.rx.rd + 1) % CFG_TUD_NCM_OUT_NTB_COUNT);
+  _ncmd_itf.rx.count--;
+
+  rx_arm();
+}
+
+// Validate transfer header of NTB 'rd' and position on its first NDP
+static bool rx_parse_nth(uint8_t const* ntb, uint32_t* len)
+{
+  uint32_t block_len;
+  uint32_t ndp;
+
+  TU_VERIFY(*len >= sizeof(ncm_nth16_t));
+
+  ncm_nth16_t const* nth16 = (ncm_nth16_t const*) ntb;
+
+  if ( tu_le32toh(nth16->dwSignature) == NCM_NTH16_SIGNATURE )
+  {
+    TU_VERIFY(tu_le16toh(nth16->wHeaderLength) == sizeof(ncm_nth16_t));
+
+    _ncmd_itf.rx.is32 = false;
+    block_len = tu_le16toh(nth16->wBlockLength);
+    ndp       = tu_le16toh(nth16->wNdpIndex);
+  }
+  else if ( tu_le32toh(nth16->dwSignature) == NCM_NTH32_SIGNATURE )
+  {
+    ncm_nth32_t const* nth32 = (ncm_nth32_t const*) ntb;
+
+    TU_VERIFY(*len >= sizeof(ncm_nth32_t) && tu_le16toh(nth32->wHeaderLength) == sizeof(ncm_nth32_t));
+
+    _ncmd_itf.rx.is32 = true;
+    block_len = tu_le32toh(nth32->dwBlockLength);
+    ndp       = tu_le32toh(nth32->dwNdpIndex);
+  }
+  else
+  {
+    return false;
+  }
+
+  // block may be shorter than the transfer, 0 means up to the end of transfer
+  if ( block_len )
+  {
+    TU_VERIFY(block_len <= *len);
+    *len = block_len;
+  }
+
+  TU_VERIFY(ndp >= sizeof(ncm_nth16_t) && ndp < *len);
+
+  _ncmd_itf.rx.ndp      = ndp;
+  _ncmd_itf.rx.datagram = 0;
+
+  return true;
+}
+
+// Locate the next datagram of NTB 'rd', return false once there is none left.
+// NDPs must follow each other towards the end of the NTB.
+static bool rx_next_datagram(uint8_t const* ntb, uint32_t len, uint32_t* offset, uint32_t* size)
+{
+  while ( _ncmd_itf.rx.ndp )
+  {
+    uint32_t const ndp = _ncmd_itf.rx.ndp;
+    uint32_t ndp_len, next_ndp;
+    uint32_t index  = 0;
+    uint32_t length = 0;
+
+    if ( _ncmd_itf.rx.is32 )
+    {
+      TU_VERIFY(ndp + sizeof(ncm_ndp32_t) <= len);
+
+      ncm_ndp32_t const* p_ndp = (ncm_ndp32_t const*) (ntb + ndp);
+      TU_VERIFY(tu_le32toh(p_ndp->dwSignature) == NCM_NDP32_SIGNATURE);
+
+      ndp_len  = tu_le16toh(p_ndp->wLength);
+      next_ndp = tu_le32toh(p_ndp->dwNextNdpIndex);
+
+      uint32_t const entry = sizeof(ncm_ndp32_t) + _ncmd_itf.rx.datagram*sizeof(ncm_ndp32_datagram_t);
+      if ( entry + sizeof(ncm_ndp32_datagram_t) <= ndp_len && ndp + ndp_len <= len )
+      {
+        ncm_ndp32_datagram_t const* p_dg = (ncm_ndp32_datagram_t const*) (ntb + ndp + entry);
+        index  = tu_le32toh(p_dg->dwDatagramIndex);
+        length = tu_le32toh(p_dg->dwDatagramLength);
+      }
+    }
+    else
+    {
+      TU_VERIFY(ndp + sizeof(ncm_ndp16_t) <= len);
+
+      ncm_ndp16_t const* p_ndp = (ncm_ndp16_t const*) (ntb + ndp);
+      TU_VERIFY(tu_le32toh(p_ndp->dwSignature) == NCM_NDP16_SIGNATURE);
+
+      ndp_len  = tu_le16toh(p_ndp->wLength);
+      next_ndp = tu_le16toh(p_ndp->wNextNdpIndex);
+
+      uint32_t const entry = sizeof(ncm_ndp16_t) + _ncmd_itf.rx.datagram*sizeof(ncm_ndp16_datagram_t);
+      if ( entry + sizeof(ncm_ndp16_datagram_t) <= ndp_len && ndp + ndp_len <= len )
+      {
+        ncm_ndp16_datagram_t const* p_dg = (ncm_ndp16_datagram_t const*) (ntb + ndp + entry);
+        index  = tu_le16toh(p_dg->wDatagramIndex);
+        length = tu_le16toh(p_dg->wDatagramLength);
+      }
+    }
+
+    if ( index && length )
+    {
+      TU_VERIFY(index < len && length <= len - index);
+
+      _ncmd_itf.rx.datagram++;
+      *offset = index;
+      *size   = length;
+      return true;
+    }
+
+    // terminating entry: continue with the next NDP
+    TU_VERIFY(next_ndp == 0 || next_ndp > ndp);
+
+    _ncmd_itf.rx.ndp      = next_ndp;
+    _ncmd_itf.rx.datagram = 0;
+  }
+
+  return false;
+}
+
+// pass received datagrams to application in order, one at a time
+static void rx_deliver(void)
+{
+  // application may renew from within tud_network_recv_cb()
+  if ( _ncmd_itf.rx.delivering ) return;
+  _ncmd_itf.rx.delivering = true;
+
+  while ( !_ncmd_itf.rx.held && _ncmd_itf.rx.count )
+  {
+    uint8_t const idx = _ncmd_itf.rx.rd;
+    uint8_t const* ntb = _ntb_out[idx];
+    uint32_t offset, size;
+
+    if ( !_ncmd_itf.rx.parsed )
+    {
+      _ncmd_itf.rx.parsed = true;
+      if ( !rx_parse_nth(ntb, &_ncmd_itf.rx.len[idx]) ) _ncmd_itf.rx.ndp = 0;
+    }
+
+    if ( !rx_next_datagram(ntb, _ncmd_itf.rx.len[idx], &offset, &size) )
+    {
+      rx_release();
+      continue;
+    }
+
+    _ncmd_itf.rx.held = true;
+
+    if ( !tud_network_recv_cb(ntb + offset, (uint16_t) size) )
+    {
+      /* if a buffer was never handled by user code, we must renew on the user's behalf */
+      _ncmd_itf.rx.held = false;
+    }
+  }
+
+  _ncmd_itf.rx.delivering = false;
+}
+
+void tud_network_recv_renew(void)
+{
+  _ncmd_itf.rx.held = false;
+
+  rx_deliver();
+}
+
+//--------------------------------------------------------------------+
+// NTB transmit
+//--------------------------------------------------------------------+
+static inline bool tx_ntb32(void)
+{
+  return _ncmd_itf.ntb_format == NCM_NTB_FORMAT_32;
+}
+
+static inline uint32_t tx_nth_size(void)
+{
+  return tx_ntb32() ? sizeof(ncm_nth32_t) : sizeof(ncm_nth16_t);
+}
+
+// NDP with 'count' datagram entries and the terminating one
+static inline uint32_t tx_ndp_size(uint16_t count)
+{
+  return tx_ntb32() ? (sizeof(ncm_ndp32_t) + (count+1u)*sizeof(ncm_ndp32_datagram_t)) :
+                      (sizeof(ncm_ndp16_t) + (count+1u)*sizeof(ncm_ndp16_datagram_t));
+}
+
+// largest IN NTB, host may ask for less than we offered
+static inline uint32_t tx_max_size(void)
+{
+  return tu_min32(_ncmd_itf.ntb_in_size, CFG_TUD_NCM_IN_NTB_MAX_SIZE);
+}
+
+// another datagram of maximum size fits into the NTB being filled
+static bool tx_fits(void)
+{
+  TU_VERIFY(_ncmd_itf.tx.datagrams < CFG_TUD_NCM_MAX_DATAGRAMS_PER_NTB);
+
+  uint32_t const end = NCM_ALIGN(_ncmd_itf.tx.pos, CFG_TUD_NCM_ALIGNMENT) + CFG_TUD_NET_MTU;
+
+  return NCM_ALIGN(end, NCM_NDP_ALIGNMENT) + tx_ndp_size((uint16_t) (_ncmd_itf.tx.datagrams + 1)) <= tx_max_size();
+}
+
+// write transfer header and NDP of the NTB being filled and queue it
+static void tx_seal(void)
+{
+  uint8_t const idx = (uint8_t) ((_ncmd_itf.tx.rd + _ncmd_itf.tx.count) % CFG_TUD_NCM_IN_NTB_COUNT);
+  uint8_t* ntb = _ntb_in[idx];
+
+  uint16_t const count   = _ncmd_itf.tx.datagrams;
+  uint32_t const ndp     = NCM_ALIGN(_ncmd_itf.tx.pos, NCM_NDP_ALIGNMENT);
+  uint32_t const ndp_len = tx_ndp_size(count);
+  uint32_t const len     = ndp + ndp_len;
+
+  if ( tx_ntb32() )
+  {
+    ncm_nth32_t* p_nth = (ncm_nth32_t*) ntb;
+    p_nth->dwSignature   = tu_htole32(NCM_NTH32_SIGNATURE);
+    p_nth->wHeaderLength = tu_htole16(sizeof(ncm_nth32_t));
+    p_nth->wSequence     = tu_htole16(_ncmd_itf.tx.sequence);
+    p_nth->dwBlockLength = tu_htole32(len);
+    p_nth->dwNdpIndex    = tu_htole32(ndp);
+
+    ncm_ndp32_t* p_ndp = (ncm_ndp32_t*) (ntb + ndp);
+    p_ndp->dwSignature    = tu_htole32(NCM_NDP32_SIGNATURE);
+    p_ndp->wLength        = tu_htole16((uint16_t) ndp_len);
+    p_ndp->wReserved6     = 0;
+    p_ndp->dwNextNdpIndex = 0;
+    p_ndp->dwReserved12   = 0;
+
+    ncm_ndp32_datagram_t* p_dg = (ncm_ndp32_datagram_t*) (p_ndp + 1);
+    for(uint16_t i=0; i<count; i++)
+    {
+      p_dg[i].dwDatagramIndex  = tu_htole32(_ncmd_itf.tx.entry[i].index);
+      p_dg[i].dwDatagramLength = tu_htole32(_ncmd_itf.tx.entry[i].length);
+    }
+    p_dg[count].dwDatagramIndex  = 0;
+    p_dg[count].dwDatagramLength = 0;
+  }
+  else
+  {
+    ncm_nth16_t* p_nth = (ncm_nth16_t*) ntb;
+    p_nth->dwSignature   = tu_htole32(NCM_NTH16_SIGNATURE);
+    p_nth->wHeaderLength = tu_htole16(sizeof(ncm_nth16_t));
+    p_nth->wSequence     = tu_htole16(_ncmd_itf.tx.sequence);
+    p_nth->wBlockLength  = tu_htole16((uint16_t) len);
+    p_nth->wNdpIndex     = tu_htole16((uint16_t) ndp);
+
+    ncm_ndp16_t* p_ndp = (ncm_ndp16_t*) (ntb + ndp);
+    p_ndp->dwSignature   = tu_htole32(NCM_NDP16_SIGNATURE);
+    p_ndp->wLength       = tu_htole16((uint16_t) ndp_len);
+    p_ndp->wNextNdpIndex = 0;
+
+    ncm_ndp16_datagram_t* p_dg = (ncm_ndp16_datagram_t*) (p_ndp + 1);
+    for(uint16_t i=0; i<count; i++)
+    {
+      p_dg[i].wDatagramIndex  = tu_htole16((uint16_t) _ncmd_itf.tx.entry[i].index);
+      p_dg[i].wDatagramLength = tu_htole16(_ncmd_itf.tx.entry[i].length);
+    }
+    p_dg[count].wDatagramIndex  = 0;
+    p_dg[count].wDatagramLength = 0;
+  }
+
+  _ncmd_itf.tx.len[idx] = len;
+  _ncmd_itf.tx.count++;
+  _ncmd_itf.tx.sequence++;
+  _ncmd_itf.tx.filling = false;
+}
+
+// start sending the oldest sealed NTB if IN endpoint is idle
+static void tx_start(void)
+{
+  if ( _ncmd_itf.tx.busy || !_ncmd_itf.tx.count ) return;
+
+  uint8_t const idx = _ncmd_itf.tx.rd;
+
+  _ncmd_itf.tx.busy = true;
+  usbd_edpt_xfer(TUD_OPT_RHPORT, _ncmd_itf.ep_in, _ntb_in[idx], (uint16_t) _ncmd_itf.tx.len[idx]);
+}
+
+// Seal the NTB being filled when nothing else is pending: right away without flush timeout,
+// otherwise only once it is full (tud_network_ncm_task() takes care of the rest)
+static void tx_kick(void)
+{
+  if ( _ncmd_itf.tx.filling && !_ncmd_itf.tx.busy && !_ncmd_itf.tx.count )
+  {
+    if ( (CFG_TUD_NCM_FLUSH_TIMEOUT_MS == 0) || !tx_fits() ) tx_seal();
+  }
+
+  tx_start();
+}
+
+static void ncm_notify_next(void);
+
+#if CFG_TUD_NCM_FLUSH_TIMEOUT_MS
+void tud_network_ncm_task(uint32_t now_ms)
+{
+  _ncmd_itf.tx.now_ms = now_ms;
+
+  // notification that could not be queued
+  if ( _ncmd_itf.notify ) ncm_notify_next();
+
+  if ( !_ncmd_itf.tx.filling ) return;
+
+  if ( !_ncmd_itf.tx.busy && !_ncmd_itf.tx.count && (now_ms - _ncmd_itf.tx.stamp_ms >= CFG_TUD_NCM_FLUSH_TIMEOUT_MS) )
+  {
+    tx_seal();
+    tx_start();
+  }
+}
+#endif
+
+bool tud_network_can_xmit(void)
+{
+  TU_VERIFY(_ncmd_itf.started && _ncmd_itf.itf_data_alt);
+
+  if ( _ncmd_itf.tx.filling && tx_fits() ) return true;
+
+  // a new NTB is needed, sealing the current one if any
+  return (_ncmd_itf.tx.count + (_ncmd_itf.tx.filling ? 1 : 0)) < CFG_TUD_NCM_IN_NTB_COUNT;
+}
+
+void tud_network_xmit(void *ref, uint16_t arg)
+{
+  if ( !tud_network_can_xmit() ) return;
+
+  if ( _ncmd_itf.tx.filling && !tx_fits() ) tx_seal();
+
+  uint8_t const idx = (uint8_t) ((_ncmd_itf.tx.rd + _ncmd_itf.tx.count) % CFG_TUD_NCM_IN_NTB_COUNT);
+  uint32_t const pos    = _ncmd_itf.tx.filling ? _ncmd_itf.tx.pos : tx_nth_size();
+  uint32_t const offset = NCM_ALIGN(pos, CFG_TUD_NCM_ALIGNMENT);
+
+  uint16_t const len = tud_network_xmit_cb(_ntb_in[idx] + offset, ref, arg);
+
+  // zero length entry would terminate the NDP
+  if ( len == 0 ) return;
+
+  if ( !_ncmd_itf.tx.filling )
+  {
+    // flush timeout counts from the first datagram, at the resolution of tud_network_ncm_task() calls
+    _ncmd_itf.tx.filling   = true;
+    _ncmd_itf.tx.datagrams = 0;
+    _ncmd_itf.tx.stamp_ms  = _ncmd_itf.tx.now_ms;
+  }
+
+  _ncmd_itf.tx.entry[_ncmd_itf.tx.datagrams].index  = offset;
+  _ncmd_itf.tx.entry[_ncmd_itf.tx.datagrams].length = len;
+  _ncmd_itf.tx.datagrams++;
+  _ncmd_itf.tx.pos = offset + len;
+
+  tx_kick();
+}
+
+//--------------------------------------------------------------------+
+// Notification
+//--------------------------------------------------------------------+
+// Send the oldest pending notification. It stays pending until its transfer completed, a failed one
+// is sent again on the next transfer event of this function (or tud_network_ncm_task()).
+static void ncm_notify_next(void)
+{
+  if ( !_ncmd_itf.notify || usbd_edpt_busy(TUD_OPT_RHPORT, _ncmd_itf.ep_notif) ) return;
+
+  tu_varclr(&_ncmd_notify);
+
+  _ncmd_notify.header.bmRequestType = 0xA1;
+  _ncmd_notify.header.wIndex        = _ncmd_itf.itf_num;
+
+  if ( _ncmd_itf.notify & NCM_NOTIFY_CONNECTION )
+  {
+    _ncmd_notify.header.bRequest = NETWORK_CONNECTION;
+    _ncmd_notify.header.wValue   = 1; /* Connected */
+    usbd_edpt_xfer(TUD_OPT_RHPORT, _ncmd_itf.ep_notif, (uint8_t*) &_ncmd_notify, sizeof(_ncmd_notify.header));
+  }
+  else
+  {
+    // bulk payload limit of the negotiated bus speed, same figure as RNDIS/ECM report
+    uint32_t const speed = netd_link_speed();
+
+    _ncmd_notify.header.bRequest = CONNECTION_SPEED_CHANGE;
+    _ncmd_notify.header.wLength  = 8;
+    _ncmd_notify.downlink        = tu_htole32(speed);
+    _ncmd_notify.uplink          = tu_htole32(speed);
+    usbd_edpt_xfer(TUD_OPT_RHPORT, _ncmd_itf.ep_notif, (uint8_t*) &_ncmd_notify, sizeof(_ncmd_notify));
+  }
+}
+
+//--------------------------------------------------------------------+
+// USBD Driver API
+//--------------------------------------------------------------------+
+static void ncm_reset_ntb_parameters(void)
+{
+  _ncmd_itf.ntb_format  = NCM_NTB_FORMAT_16;
+  _ncmd_itf.ntb_in_size = CFG_TUD_NCM_IN_NTB_MAX_SIZE;
+}
+
+void ncmd_init(void)
+{
+  tu_memclr(&_ncmd_itf, sizeof(_ncmd_itf));
+  ncm_reset_ntb_parameters();
+}
+
+void ncmd_reset(uint8_t rhport)
+{
+  (void) rhport;
+
+  ncmd_init();
+}
+
+uint16_t ncmd_open(uint8_t rhport, tusb_desc_interface_t const * itf_desc, uint16_t max_len)
+{
+  TU_VERIFY(TUSB_CLASS_CDC                          == itf_desc->bInterfaceClass    &&
+            CDC_COMM_SUBCLASS_NETWORK_CONTROL_MODEL == itf_desc->bInterfaceSubClass &&
+            0x00                                    == itf_desc->bInterfaceProtocol, 0);
+
+  // confirm interface hasn't already been allocated
+  TU_ASSERT(0 == _ncmd_itf.ep_notif, 0);
+
+  //------------- Management Interface -------------//
+  _ncmd_itf.itf_num = itf_desc->bInterfaceNumber;
+
+  uint16_t drv_len = sizeof(tusb_desc_interface_t);
+  uint8_t const * p_desc = tu_desc_next( itf_desc );
+
+  // Communication Functional Descriptors
+  while ( TUSB_DESC_CS_INTERFACE == tu_desc_type(p_desc) && drv_len <= max_len )
+  {
+    drv_len += tu_desc_len(p_desc);
+    p_desc   = tu_desc_next(p_desc);
+  }
+
+  // notification endpoint
+  TU_ASSERT(TUSB_DESC_ENDPOINT == tu_desc_type(p_desc), 0);
+  TU_ASSERT( usbd_edpt_open(rhport, (tusb_desc_endpoint_t const *) p_desc), 0 );
+
+  _ncmd_itf.ep_notif = ((tusb_desc_endpoint_t const *) p_desc)->bEndpointAddress;
+
+  drv_len += tu_desc_len(p_desc);
+  p_desc   = tu_desc_next(p_desc);
+
+  //------------- Data Interface -------------//
+  // - 0 : zero endpoints for inactive (default)
+  // - 1 : IN & OUT endpoints for active networking
+  TU_ASSERT(TUSB_DESC_INTERFACE == tu_desc_type(p_desc), 0);
+
+  do
+  {
+    tusb_desc_interface_t const * data_itf_desc = (tusb_desc_interface_t const *) p_desc;
+    TU_ASSERT(TUSB_CLASS_CDC_DATA == data_itf_desc->bInterfaceClass, 0);
+
+    drv_len += tu_desc_len(p_desc);
+    p_desc   = tu_desc_next(p_desc);
+  }while( (TUSB_DESC_INTERFACE == tu_desc_type(p_desc)) && (drv_len <= max_len) );
+
+  // Pair of endpoints, opened later when host selects alternate setting 1
+  TU_ASSERT(TUSB_DESC_ENDPOINT == tu_desc_type(p_desc), 0);
+
+  _ncmd_itf.desc_epdata = p_desc;
+
+  drv_len += 2*sizeof(tusb_desc_endpoint_t);
+
+  return drv_len;
+}
+
+static bool ncm_set_interface(uint8_t rhport, tusb_control_request_t const * request)
+{
+  uint8_t const req_itfnum = (uint8_t) request->wIndex;
+  uint8_t const req_alt    = (uint8_t) request->wValue;
+
+  // Only valid for Data Interface with Alternate is either 0 or 1
+  TU_VERIFY(_ncmd_itf.itf_num+1 == req_itfnum && req_alt < 2);
+
+  _ncmd_itf.itf_data_alt = req_alt;
+
+  if ( req_alt )
+  {
+    // TODO since we don't actually close endpoint
+    // hack here to not re-open it
+    if ( !_ncmd_itf.started )
+    {
+      TU_ASSERT(_ncmd_itf.desc_epdata);
+      TU_ASSERT( usbd_open_edpt_pair(rhport, _ncmd_itf.desc_epdata, 2, TUSB_XFER_BULK, &_ncmd_itf.ep_out, &_ncmd_itf.ep_in) );
+
+      _ncmd_itf.started = true;
+
+      tud_network_init_cb();
+
+      // prepare for incoming NTBs
+      rx_arm();
+    }
+
+    _ncmd_itf.notify = NCM_NOTIFY_CONNECTION | NCM_NOTIFY_SPEED;
+    ncm_notify_next();
+  }
+  else
+  {
+    // function reset: NTB parameters back to default, a partially filled NTB is dropped
+    ncm_reset_ntb_parameters();
+    _ncmd_itf.tx.filling = false;
+  }
+
+  tud_control_status(rhport, request);
+
+  return true;
+}
+
+// Invoked when a control transfer occurred on an interface of this class
+// Driver response accordingly to the request and the transfer stage (setup/data/ack)
+// return false to stall control endpoint (e.g unsupported request)
+bool ncmd_control_xfer_cb (uint8_t rhport, uint8_t stage, tusb_control_request_t const * request)
+{
+  if ( stage == CONTROL_STAGE_SETUP )
+  {
+    switch ( request->bmRequestType_bit.type )
+    {
+      case TUSB_REQ_TYPE_STANDARD:
+        switch ( request->bRequest )
+        {
+          case TUSB_REQ_GET_INTERFACE:
+          {
+            uint8_t const req_itfnum = (uint8_t) request->wIndex;
+            TU_VERIFY(_ncmd_itf.itf_num+1 == req_itfnum);
+
+            tud_control_xfer(rhport, request, &_ncmd_itf.itf_data_alt, 1);
+          }
+          break;
+
+          case TUSB_REQ_SET_INTERFACE:
+            return ncm_set_interface(rhport, request);
+
+          // unsupported request
+          default: return false;
+        }
+      break;
+
+      case TUSB_REQ_TYPE_CLASS:
+        TU_VERIFY (_ncmd_itf.itf_num == request->wIndex);
+
+        switch ( request->bRequest )
+        {
+          case CDC_REQUEST_GET_NTB_PARAMETERS:
+            tud_control_xfer(rhport, request, (void*) (uintptr_t) &_ntb_parameters, sizeof(_ntb_parameters));
+          break;
+
+          case CDC_REQUEST_GET_NTB_FORMAT:
+          {
+            uint16_t const format = tu_htole16(_ncmd_itf.ntb_format);
+            tud_control_xfer(rhport, request, (void*) (uintptr_t) &format, sizeof(format));
+          }
+          break;
+
+          case CDC_REQUEST_SET_NTB_FORMAT:
+            // only while data interface is inactive
+            TU_VERIFY(_ncmd_itf.itf_data_alt == 0 && request->wValue <= NCM_NTB_FORMAT_32);
+            _ncmd_itf.ntb_format = (uint8_t) request->wValue;
+            tud_control_status(rhport, request);
+          break;
+
+          case CDC_REQUEST_GET_NTB_INPUT_SIZE:
+          {
+            uint32_t const size = tu_htole32(_ncmd_itf.ntb_in_size);
+            tud_control_xfer(rhport, request, (void*) (uintptr_t) &size, sizeof(size));
+          }
+          break;
+
+          case CDC_REQUEST_SET_NTB_INPUT_SIZE:
+            // dwNtbInMaxSize, optionally followed by wNtbInMaxDatagrams which is not enforced
+            TU_VERIFY(request->wLength == 4 || request->wLength == 8);
+            tud_control_xfer(rhport, request, _ncmd_itf.ctrl_buf, request->wLength);
+          break;
+
+          case CDC_REQUEST_GET_MAX_DATAGRAM_SIZE:
+          {
+            uint16_t const size = tu_htole16(CFG_TUD_NET_MTU);
+            tud_control_xfer(rhport, request, (void*) (uintptr_t) &size, sizeof(size));
+          }
+          break;
+
+          case CDC_REQUEST_SET_ETHERNET_PACKET_FILTER:
+            tud_control_status(rhport, request);
+          break;
+
+          // unsupported request
+          default: return false;
+        }
+      break;
+
+      // unsupported request
+      default: return false;
+    }
+  }
+  else if ( stage == CONTROL_STAGE_DATA )
+  {
+    if ( request->bmRequestType_bit.type == TUSB_REQ_TYPE_CLASS &&
+         request->bRequest == CDC_REQUEST_SET_NTB_INPUT_SIZE )
+    {
+      uint32_t const size = tu_le32toh(_ncmd_itf.ctrl_buf[0]);
+
+      // host can only ask for less than offered, and still at least the spec minimum
+      TU_VERIFY(size >= 2048 && size <= CFG_TUD_NCM_IN_NTB_MAX_SIZE);
+      _ncmd_itf.ntb_in_size = size;
+    }
+  }
+
+  return true;
+}
+
+bool ncmd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+  (void) rhport;
+
+  /* new NTB received */
+  if ( ep_addr == _ncmd_itf.ep_out )
+  {
+    uint8_t const idx = (uint8_t) ((_ncmd_itf.rx.rd + _ncmd_itf.rx.count) % CFG_TUD_NCM_OUT_NTB_COUNT);
+
+    _ncmd_itf.rx.len[idx] = xferred_bytes;
+    _ncmd_itf.rx.count++;
+    _ncmd_itf.rx.armed = false;
+
+    /* re-arm right away if there is a free buffer, then hand the datagrams over */
+    rx_arm();
+    rx_deliver();
+  }
+
+  /* NTB transmission finished */
+  if ( ep_addr == _ncmd_itf.ep_in )
+  {
+    /* a short packet terminates the NTB unless it has the maximum size */
+    if ( xferred_bytes && (0 == (xferred_bytes % CFG_TUD_NET_ENDPOINT_SIZE)) && (xferred_bytes < tx_max_size()) )
+    {
+      usbd_edpt_xfer(TUD_OPT_RHPORT, _ncmd_itf.ep_in, NULL, 0); /* a ZLP is needed */
+    }
+    else
+    {
+      _ncmd_itf.tx.busy = false;
+      _ncmd_itf.tx.rd   = (uint8_t) ((_ncmd_itf.tx.rd + 1) % CFG_TUD_NCM_IN_NTB_COUNT);
+      _ncmd_itf.tx.count--;
+
+      tx_kick();
+    }
+  }
+
+  if ( ep_addr == _ncmd_itf.ep_notif && result == XFER_RESULT_SUCCESS )
+  {
+    /* connection notification is followed by connection speed */
+    _ncmd_itf.notify &= (uint8_t) ~((_ncmd_itf.notify & NCM_NOTIFY_CONNECTION) ? NCM_NOTIFY_CONNECTION : NCM_NOTIFY_SPEED);
+  }
+
+  /* also retries a notification that failed or could not be queued */
+  ncm_notify_next();
+
+  return true;
+}
+
+#endif
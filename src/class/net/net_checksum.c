@@ -0,0 +1,226 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * This file is part of the TinyUSB stack.
+ */
+
+#include "tusb_option.h"
+
+#if ( TUSB_OPT_DEVICE_ENABLED && (CFG_TUD_NET || CFG_TUD_NCM) )
+
+#include "net_checksum.h"
+
+//--------------------------------------------------------------------+
+// MACRO CONSTANT TYPEDEF
+//--------------------------------------------------------------------+
+#define ETH_HEADER_LEN        14
+#define ETH_TYPE_IPV4         0x0800
+
+#define IPV4_HEADER_MIN_LEN   20
+#define IPV4_CHECKSUM_OFFSET  10
+
+#define IP_PROTO_TCP          6
+#define IP_PROTO_UDP          17
+
+#define TCP_HEADER_MIN_LEN    20
+#define TCP_CHECKSUM_OFFSET   16
+#define UDP_HEADER_LEN        8
+#define UDP_CHECKSUM_OFFSET   6
+
+typedef struct
+{
+  uint8_t* ip;
+  uint16_t ip_hlen;
+  uint8_t* l4;       // NULL if fragmented or neither TCP nor UDP
+  uint16_t l4_len;
+  uint8_t  proto;
+  uint8_t  csum_offset;
+} csum_frame_t;
+
+//--------------------------------------------------------------------+
+// Kernels
+//--------------------------------------------------------------------+
+
+// both halfwords of a 32-bit word, at most 0x1FFFE per word so a 32-bit
+// accumulator cannot overflow within 65535 bytes
+#define CSUM_WORD(_w)   ( ((_w) & 0xFFFFu) + ((_w) >> 16) )
+
+uint32_t netd_csum_add(void const* data, uint16_t len, uint32_t sum)
+{
+  uint8_t const* pb = (uint8_t const*) data;
+  uint32_t acc = 0;
+  uint16_t t = 0;
+  bool const odd = ((uintptr_t) pb) & 1;
+
+  // odd start: sum with halfwords shifted by one byte and swap the result
+  if ( odd && len )
+  {
+    ((uint8_t*) &t)[1] = *pb++;
+    len--;
+  }
+
+  // now 16-bit aligned, one halfword to get 32-bit aligned
+  if ( (((uintptr_t) pb) & 2) && len >= 2 )
+  {
+    acc += *((uint16_t const*) ((void const*) pb));
+    pb  += 2;
+    len -= 2;
+  }
+
+  uint32_t const* pw = (uint32_t const*) ((void const*) pb);
+
+  // unrolled: 16 bytes per iteration, loads are issued back to back
+  while ( len >= 16 )
+  {
+    uint32_t const w0 = pw[0];
+    uint32_t const w1 = pw[1];
+    uint32_t const w2 = pw[2];
+    uint32_t const w3 = pw[3];
+
+    acc += CSUM_WORD(w0) + CSUM_WORD(w1) + CSUM_WORD(w2) + CSUM_WORD(w3);
+    pw  += 4;
+    len -= 16;
+  }
+
+  while ( len >= 4 )
+  {
+    acc += CSUM_WORD(*pw);
+    pw++;
+    len -= 4;
+  }
+
+  pb = (uint8_t const*) pw;
+
+  if ( len >= 2 )
+  {
+    acc += *((uint16_t const*) ((void const*) pb));
+    pb  += 2;
+    len -= 2;
+  }
+
+  if ( len ) ((uint8_t*) &t)[0] = *pb;
+  acc += t;
+
+  uint16_t folded = netd_csum_fold(acc);
+  if ( odd ) folded = (uint16_t) ((folded << 8) | (folded >> 8));
+
+  return sum + folded;
+}
+
+uint16_t netd_inet_chksum(void const* data, uint16_t len)
+{
+  return netd_csum_fold(netd_csum_add(data, len, 0));
+}
+
+//--------------------------------------------------------------------+
+// Frame parsing
+//--------------------------------------------------------------------+
+static bool csum_parse(uint8_t* frame, uint16_t len, csum_frame_t* f)
+{
+  TU_VERIFY(len >= ETH_HEADER_LEN + IPV4_HEADER_MIN_LEN);
+  TU_VERIFY(tu_u16(frame[12], frame[13]) == ETH_TYPE_IPV4);
+
+  uint8_t* ip = frame + ETH_HEADER_LEN;
+  uint16_t const hlen    = (uint16_t) ((ip[0] & 0x0F) * 4);
+  uint16_t const tot_len = tu_u16(ip[2], ip[3]);
+
+  TU_VERIFY((ip[0] >> 4) == 4 && hlen >= IPV4_HEADER_MIN_LEN);
+  TU_VERIFY(hlen <= tot_len && tot_len <= len - ETH_HEADER_LEN);
+
+  f->ip      = ip;
+  f->ip_hlen = hlen;
+  f->proto   = ip[9];
+  f->l4      = NULL;
+  f->l4_len  = (uint16_t) (tot_len - hlen);
+
+  // more fragments flag or fragment offset: transport checksum spans several frames
+  if ( (ip[6] & 0x3F) || ip[7] ) return true;
+
+  if ( f->proto == IP_PROTO_TCP && f->l4_len >= TCP_HEADER_MIN_LEN )
+  {
+    f->csum_offset = TCP_CHECKSUM_OFFSET;
+    f->l4 = ip + hlen;
+  }
+  else if ( f->proto == IP_PROTO_UDP && f->l4_len >= UDP_HEADER_LEN )
+  {
+    f->csum_offset = UDP_CHECKSUM_OFFSET;
+    f->l4 = ip + hlen;
+  }
+
+  return true;
+}
+
+// pseudo header and transport segment
+static uint32_t csum_l4(csum_frame_t const* f)
+{
+  uint8_t const pseudo[4] = { 0, f->proto, TU_U16_HIGH(f->l4_len), TU_U16_LOW(f->l4_len) };
+
+  uint32_t sum = netd_csum_add(f->ip + 12, 8, 0); // source and destination address
+  sum = netd_csum_add(pseudo, sizeof(pseudo), sum);
+  return netd_csum_add(f->l4, f->l4_len, sum);
+}
+
+//--------------------------------------------------------------------+
+// Application API
+//--------------------------------------------------------------------+
+bool netd_csum_fill(uint8_t* frame, uint16_t len)
+{
+  csum_frame_t f;
+  TU_VERIFY(csum_parse(frame, len, &f));
+
+  uint16_t csum;
+
+  f.ip[IPV4_CHECKSUM_OFFSET] = f.ip[IPV4_CHECKSUM_OFFSET+1] = 0;
+  csum = (uint16_t) ~netd_inet_chksum(f.ip, f.ip_hlen);
+  memcpy(f.ip + IPV4_CHECKSUM_OFFSET, &csum, 2);
+
+  if ( f.l4 )
+  {
+    f.l4[f.csum_offset] = f.l4[f.csum_offset+1] = 0;
+    csum = (uint16_t) ~netd_csum_fold(csum_l4(&f));
+
+    // zero means no checksum for UDP
+    if ( f.proto == IP_PROTO_UDP && csum == 0 ) csum = 0xFFFF;
+    memcpy(f.l4 + f.csum_offset, &csum, 2);
+  }
+
+  return true;
+}
+
+bool netd_csum_verify(uint8_t const* frame, uint16_t len)
+{
+  csum_frame_t f;
+
+  // only parsed, nothing is written
+  if ( !csum_parse((uint8_t*) (uintptr_t) frame, len, &f) ) return true;
+
+  TU_VERIFY(netd_inet_chksum(f.ip, f.ip_hlen) == 0xFFFF);
+
+  if ( f.l4 )
+  {
+    bool const no_csum = (f.proto == IP_PROTO_UDP) && !f.l4[f.csum_offset] && !f.l4[f.csum_offset+1];
+    TU_VERIFY(no_csum || netd_csum_fold(csum_l4(&f)) == 0xFFFF);
+  }
+
+  return true;
+}
+
+#endif
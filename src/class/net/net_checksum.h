@@ -0,0 +1,65 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ * This file is part of the TinyUSB stack.
+ */
+
+#ifndef _TUSB_NET_CHECKSUM_H_
+#define _TUSB_NET_CHECKSUM_H_
+
+#include "common/tusb_common.h"
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+//--------------------------------------------------------------------+
+// Internet checksum [RFC1071]
+//--------------------------------------------------------------------+
+
+// Add 'len' bytes to a ones-complement sum. Halfwords are summed in memory order, so the folded
+// result can be stored as is into a header. 'data' may have any alignment but must start at an
+// even offset of the checksummed range, 'len' is at most 65535
+uint32_t netd_csum_add(void const* data, uint16_t len, uint32_t sum);
+
+// Fold a sum into 16 bits (not inverted)
+static inline uint16_t netd_csum_fold(uint32_t sum)
+{
+  sum = (sum >> 16) + (sum & 0xFFFF);
+  sum = (sum >> 16) + (sum & 0xFFFF);
+  return (uint16_t) sum;
+}
+
+// Same contract as lwIP's LWIP_CHKSUM, e.g. "#define LWIP_CHKSUM netd_inet_chksum" in lwipopts.h
+uint16_t netd_inet_chksum(void const* data, uint16_t len);
+
+// Ethernet frame carrying IPv4: compute IP header checksum and, unless fragmented, TCP or UDP
+// checksum including pseudo header. Return false if the frame was left untouched
+bool netd_csum_fill(uint8_t* frame, uint16_t len);
+
+// Ethernet frame carrying IPv4: check the same checksums, other frames always pass
+bool netd_csum_verify(uint8_t const* frame, uint16_t len);
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif /* _TUSB_NET_CHECKSUM_H_ */
@@ -33,6 +33,10 @@
 #include "device/usbd_pvt.h"
 #include "rndis_protocol.h"
 
+#if CFG_TUD_NET_LWIP_PBUF
+#include "lwip/pbuf.h"
+#endif
+
 void rndis_class_set_handler(uint8_t *data, int size); /* found in ./misc/networking/rndis_reports.c */
 
 //--------------------------------------------------------------------+
@@ -54,13 +58,70 @@ typedef struct
   // keep a copy of endpoint attribute instead
   uint8_t const * ecm_desc_epdata;
 
+  // ECM notifications waiting for the interrupt endpoint, requests for the same one are merged
+  uint8_t notify_pending;
+  bool    notify_busy;
+
+  // RX ring: 'count' received packets starting at 'rd', followed by the one armed on ep_out
+  struct
+  {
+    uint16_t len[CFG_TUD_NET_RX_PACKETS];
+    uint8_t  rd;
+    uint8_t  count;
+    bool     armed;
+    bool     starved;    // CFG_TUD_NET_LWIP_PBUF: pool was empty, arming is retried
+    bool     held;       // packet at 'rd' is passed to application and not renewed yet
+    bool     delivering;
+    uint16_t pos;        // RNDIS message within buffer 'rd' being delivered
+    uint16_t next;       // and the one following it
+  } rx;
+
+  // TX ring: 'count' queued transfers starting at 'rd', the one at 'rd' is in flight when busy.
+  // RNDIS packets are appended to the last transfer until it is started
+  struct
+  {
+    uint16_t len[CFG_TUD_NET_TX_PACKETS];
+    uint8_t  rd;
+    uint8_t  count;
+    bool     busy;
+    uint8_t  tail_packets;
+    uint32_t host_max_xfer; // from RNDIS initialize message, 0 : one packet per transfer
+  } tx;
+
 } netd_interface_t;
 
 #define CFG_TUD_NET_PACKET_PREFIX_LEN sizeof(rndis_data_packet_t)
 #define CFG_TUD_NET_PACKET_SUFFIX_LEN 0
 
-CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t received[CFG_TUD_NET_PACKET_PREFIX_LEN + CFG_TUD_NET_MTU + CFG_TUD_NET_PACKET_PREFIX_LEN];
-CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t transmitted[CFG_TUD_NET_PACKET_PREFIX_LEN + CFG_TUD_NET_MTU + CFG_TUD_NET_PACKET_PREFIX_LEN];
+// RNDIS packet message with a full MTU frame, aggregated messages are kept 32-bit aligned
+#define NETD_RNDIS_PACKET_SIZE  (((CFG_TUD_NET_PACKET_PREFIX_LEN + CFG_TUD_NET_MTU + CFG_TUD_NET_PACKET_SUFFIX_LEN) + 3) & ~3u)
+
+#if CFG_TUD_NET_RNDIS_PACKETS_PER_XFER > 1
+  #define NETD_PACKET_BUFSIZE   (CFG_TUD_NET_RNDIS_PACKETS_PER_XFER * NETD_RNDIS_PACKET_SIZE)
+#else
+  #define NETD_PACKET_BUFSIZE   ((CFG_TUD_NET_PACKET_PREFIX_LEN + CFG_TUD_NET_MTU + CFG_TUD_NET_PACKET_PREFIX_LEN + 3) & ~3u)
+#endif
+
+TU_VERIFY_STATIC(CFG_TUD_NET_RX_PACKETS > 0 && CFG_TUD_NET_RX_PACKETS < 256, "CFG_TUD_NET_RX_PACKETS is out of range");
+TU_VERIFY_STATIC(CFG_TUD_NET_TX_PACKETS > 0 && CFG_TUD_NET_TX_PACKETS < 256, "CFG_TUD_NET_TX_PACKETS is out of range");
+TU_VERIFY_STATIC(CFG_TUD_NET_RNDIS_PACKETS_PER_XFER > 0 && CFG_TUD_NET_RNDIS_PACKETS_PER_XFER < 256, "CFG_TUD_NET_RNDIS_PACKETS_PER_XFER is out of range");
+TU_VERIFY_STATIC(NETD_PACKET_BUFSIZE <= UINT16_MAX, "network packet buffer is too large");
+
+#if CFG_TUD_NET_LWIP_PBUF
+// transfer needs contiguous memory: a PBUF_POOL pbuf of one segment must hold it
+TU_VERIFY_STATIC(PBUF_POOL_BUFSIZE >= NETD_PACKET_BUFSIZE, "PBUF_POOL_BUFSIZE is smaller than a receive transfer");
+
+// received transfers, and packets sent in place (NULL if copied to 'transmitted')
+static struct pbuf* rx_pbuf[CFG_TUD_NET_RX_PACKETS];
+static struct pbuf* tx_pbuf[CFG_TUD_NET_TX_PACKETS];
+static uint8_t*     tx_pbuf_data[CFG_TUD_NET_TX_PACKETS];
+#else
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t received[CFG_TUD_NET_RX_PACKETS][NETD_PACKET_BUFSIZE];
+#endif
+
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static uint8_t transmitted[CFG_TUD_NET_TX_PACKETS][NETD_PACKET_BUFSIZE];
+
+static tud_network_stats_t _netd_stats;
 
 struct ecm_notify_struct
 {
@@ -78,6 +139,7 @@ static const struct ecm_notify_struct ecm_notify_nc =
   },
 };
 
+// speed is filled in when sent
 static const struct ecm_notify_struct ecm_notify_csc =
 {
   .header = {
@@ -85,14 +147,18 @@ static const struct ecm_notify_struct ecm_notify_csc =
     .bRequest = 0x2A /* CONNECTION_SPEED_CHANGE aka ConnectionSpeedChange */,
     .wLength = 8,
   },
-  .downlink = 9728000,
-  .uplink = 9728000,
+};
+
+enum
+{
+  ECM_NOTIFY_NC  = 0x01,
+  ECM_NOTIFY_CSC = 0x02,
 };
 
 // TODO remove CFG_TUSB_MEM_SECTION, control internal buffer is already in this special section
 CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static union
 {
-  uint8_t rndis_buf[120];
+  uint8_t rndis_buf[NETD_RNDIS_ENC_BUF_SIZE];
   struct ecm_notify_struct ecm_buf;
 } notify;
 
@@ -102,17 +168,155 @@ CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN static union
 // TODO remove CFG_TUSB_MEM_SECTION
 CFG_TUSB_MEM_SECTION static netd_interface_t _netd_itf;
 
-static bool can_xmit;
+static void handle_incoming_packet(uint8_t *buf, uint32_t len);
+
+// release received buffer 'rd' once all of its messages were delivered
+static void rx_release(void)
+{
+  _netd_itf.rx.pos   = 0;
+  _netd_itf.rx.rd    = (uint8_t) ((_netd_itf.rx.rd + 1) % CFG_TUD_NET_RX_PACKETS);
+  _netd_itf.rx.count--;
+}
+
+static inline uint8_t* rx_buffer(uint8_t idx)
+{
+#if CFG_TUD_NET_LWIP_PBUF
+  return (uint8_t*) rx_pbuf[idx]->payload;
+#else
+  return received[idx];
+#endif
+}
+
+// arm OUT endpoint with the next free RX buffer if there is one
+static void rx_arm(void)
+{
+  if ( _netd_itf.rx.armed || _netd_itf.rx.count >= CFG_TUD_NET_RX_PACKETS ) return;
+
+  uint8_t const idx = (uint8_t) ((_netd_itf.rx.rd + _netd_itf.rx.count) % CFG_TUD_NET_RX_PACKETS);
+
+#if CFG_TUD_NET_LWIP_PBUF
+  if ( !rx_pbuf[idx] )
+  {
+    struct pbuf* p = pbuf_alloc(PBUF_RAW, NETD_PACKET_BUFSIZE, PBUF_POOL);
+
+    if ( !p )
+    {
+      // pool is empty: host is held off until a pbuf is freed, retried on the next transfer
+      // event, tud_network_xmit() and tud_network_recv_renew(). Counted once per outage
+      if ( !_netd_itf.rx.starved ) _netd_stats.rx_dropped++;
+      _netd_itf.rx.starved = true;
+      return;
+    }
+
+    _netd_itf.rx.starved = false;
+    rx_pbuf[idx] = p;
+  }
+#endif
+
+  _netd_itf.rx.armed = true;
+  usbd_edpt_xfer(TUD_OPT_RHPORT, _netd_itf.ep_out, rx_buffer(idx), NETD_PACKET_BUFSIZE);
+}
+
+// message being delivered is the last one of buffer 'rd'
+static bool rx_last_message(void)
+{
+  uint16_t const len  = _netd_itf.rx.len[_netd_itf.rx.rd];
+  uint16_t const next = _netd_itf.rx.next;
+
+  // host pads aggregated messages to 32-bit, anything shorter than a header
+  // is the one-byte short packet terminating a transfer
+  return (next & 3) || (next + sizeof(rndis_data_packet_t) > len);
+}
+
+// pass received packets to application in order, one at a time
+static void rx_deliver(void)
+{
+  // application may renew from within tud_network_recv_cb()
+  if ( _netd_itf.rx.delivering ) return;
+  _netd_itf.rx.delivering = true;
+
+  while ( !_netd_itf.rx.held && _netd_itf.rx.count )
+  {
+    uint8_t const idx = _netd_itf.rx.rd;
+    uint16_t const pos = _netd_itf.rx.pos;
+
+    _netd_itf.rx.held = true;
+    handle_incoming_packet(rx_buffer(idx) + pos, (uint32_t) (_netd_itf.rx.len[idx] - pos));
+  }
+
+  _netd_itf.rx.delivering = false;
+}
 
 void tud_network_recv_renew(void)
 {
-  usbd_edpt_xfer(TUD_OPT_RHPORT, _netd_itf.ep_out, received, sizeof(received));
+  if ( _netd_itf.rx.held )
+  {
+    _netd_itf.rx.held = false;
+
+    if ( rx_last_message() )
+    {
+      rx_release();
+    }else
+    {
+      _netd_itf.rx.pos = _netd_itf.rx.next;
+    }
+  }
+
+  rx_arm();
+  rx_deliver();
+}
+
+// start sending the oldest queued transfer if IN endpoint is idle
+static void tx_start(void)
+{
+  if ( _netd_itf.tx.busy || !_netd_itf.tx.count ) return;
+
+  uint8_t const idx = _netd_itf.tx.rd;
+
+  uint8_t* buf = transmitted[idx];
+
+#if CFG_TUD_NET_LWIP_PBUF
+  if ( tx_pbuf[idx] ) buf = tx_pbuf_data[idx];
+#endif
+
+  _netd_itf.tx.busy = true;
+  usbd_edpt_xfer(TUD_OPT_RHPORT, _netd_itf.ep_in, buf, _netd_itf.tx.len[idx]);
+}
+
+// TX buffer for the next packet, append is true if it goes after packets already queued there.
+// Return false if all buffers are in use
+static bool tx_next_buffer(uint8_t* idx, bool* append)
+{
+  uint8_t const count = _netd_itf.tx.count;
+
+  if ( count && !_netd_itf.ecm_mode && (_netd_itf.tx.tail_packets < CFG_TUD_NET_RNDIS_PACKETS_PER_XFER) )
+  {
+    uint8_t const tail = (uint8_t) ((_netd_itf.tx.rd + count - 1) % CFG_TUD_NET_TX_PACKETS);
+    uint32_t const max_xfer = tu_min32(_netd_itf.tx.host_max_xfer, NETD_PACKET_BUFSIZE);
+
+    // transfer is not started yet and a full packet still fits
+    if ( !(count == 1 && _netd_itf.tx.busy) && (_netd_itf.tx.len[tail] + NETD_RNDIS_PACKET_SIZE <= max_xfer) )
+    {
+      *idx    = tail;
+      *append = true;
+      return true;
+    }
+  }
+
+  TU_VERIFY(count < CFG_TUD_NET_TX_PACKETS);
+
+  *idx    = (uint8_t) ((_netd_itf.tx.rd + count) % CFG_TUD_NET_TX_PACKETS);
+  *append = false;
+  return true;
 }
 
-static void do_in_xfer(uint8_t *buf, uint16_t len)
+// endpoints are opened, start the network
+static void netd_start(void)
 {
-  can_xmit = false;
-  usbd_edpt_xfer(TUD_OPT_RHPORT, _netd_itf.ep_in, buf, len);
+  tud_network_init_cb();
+
+  // prepare for incoming packets
+  rx_arm();
 }
 
 void netd_report(uint8_t *buf, uint16_t len)
@@ -120,6 +324,16 @@ void netd_report(uint8_t *buf, uint16_t len)
   usbd_edpt_xfer(TUD_OPT_RHPORT, _netd_itf.ep_notif, buf, len);
 }
 
+uint32_t netd_rndis_max_xfer(void)
+{
+  return (CFG_TUD_NET_RNDIS_PACKETS_PER_XFER > 1) ? NETD_PACKET_BUFSIZE : (CFG_TUD_NET_MTU + sizeof(rndis_data_packet_t));
+}
+
+void netd_rndis_set_host_max_xfer(uint32_t size)
+{
+  _netd_itf.tx.host_max_xfer = size;
+}
+
 //--------------------------------------------------------------------+
 // USBD Driver API
 //--------------------------------------------------------------------+
@@ -132,6 +346,21 @@ void netd_reset(uint8_t rhport)
 {
   (void) rhport;
 
+#if CFG_TUD_NET_LWIP_PBUF
+  // transfers are aborted by bus reset, give all pbufs back
+  for(uint8_t i=0; i<CFG_TUD_NET_RX_PACKETS; i++)
+  {
+    if ( rx_pbuf[i] ) pbuf_free(rx_pbuf[i]);
+    rx_pbuf[i] = NULL;
+  }
+
+  for(uint8_t i=0; i<CFG_TUD_NET_TX_PACKETS; i++)
+  {
+    if ( tx_pbuf[i] ) pbuf_free(tx_pbuf[i]);
+    tx_pbuf[i] = NULL;
+  }
+#endif
+
   netd_init();
 }
 
@@ -206,13 +435,7 @@ uint16_t netd_open(uint8_t rhport, tusb_desc_interface_t const * itf_desc, uint1
     // Open endpoint pair for RNDIS
     TU_ASSERT( usbd_open_edpt_pair(rhport, p_desc, 2, TUSB_XFER_BULK, &_netd_itf.ep_out, &_netd_itf.ep_in), 0 );
 
-    tud_network_init_cb();
-
-    // we are ready to transmit a packet
-    can_xmit = true;
-
-    // prepare for incoming packets
-    tud_network_recv_renew();
+    netd_start();
   }
 
   drv_len += 2*sizeof(tusb_desc_endpoint_t);
@@ -220,13 +443,35 @@ uint16_t netd_open(uint8_t rhport, tusb_desc_interface_t const * itf_desc, uint1
   return drv_len;
 }
 
-static void ecm_report(bool nc)
+// send the next pending notification, network connection first
+static void ecm_notify_kick(void)
 {
+  if ( _netd_itf.notify_busy || !_netd_itf.notify_pending ) return;
+
+  bool const nc = _netd_itf.notify_pending & ECM_NOTIFY_NC;
+  _netd_itf.notify_pending &= (uint8_t) ~(nc ? ECM_NOTIFY_NC : ECM_NOTIFY_CSC);
+
   notify.ecm_buf = (nc) ? ecm_notify_nc : ecm_notify_csc;
   notify.ecm_buf.header.wIndex = _netd_itf.itf_num;
+
+  if ( !nc )
+  {
+    uint32_t const speed = netd_link_speed();
+    notify.ecm_buf.downlink = tu_htole32(speed);
+    notify.ecm_buf.uplink   = tu_htole32(speed);
+  }
+
+  _netd_itf.notify_busy = true;
   netd_report((uint8_t *)&notify.ecm_buf, (nc) ? sizeof(notify.ecm_buf.header) : sizeof(notify.ecm_buf));
 }
 
+// queue notifications, ones already pending are sent once
+static void ecm_report(uint8_t which)
+{
+  _netd_itf.notify_pending |= which;
+  ecm_notify_kick();
+}
+
 // Invoked when a control transfer occurred on an interface of this class
 // Driver response accordingly to the request and the transfer stage (setup/data/ack)
 // return false to stall control endpoint (e.g unsupported request)
@@ -270,11 +515,8 @@ bool netd_control_xfer_cb (uint8_t rhport, uint8_t stage, tusb_control_request_t
                 TU_ASSERT(_netd_itf.ecm_desc_epdata);
                 TU_ASSERT( usbd_open_edpt_pair(rhport, _netd_itf.ecm_desc_epdata, 2, TUSB_XFER_BULK, &_netd_itf.ep_out, &_netd_itf.ep_in) );
 
-                // TODO should be merge with RNDIS's after endpoint opened
-                // Also should have opposite callback for application to disable network !!
-                tud_network_init_cb();
-                can_xmit = true; // we are ready to transmit a packet
-                tud_network_recv_renew(); // prepare for incoming packets
+                // TODO should have opposite callback for application to disable network !!
+                netd_start();
               }
             }else
             {
@@ -302,7 +544,25 @@ bool netd_control_xfer_cb (uint8_t rhport, uint8_t stage, tusb_control_request_t
           if (0x43 /* SET_ETHERNET_PACKET_FILTER */ == request->bRequest)
           {
             tud_control_xfer(rhport, request, NULL, 0);
-            ecm_report(true);
+
+            // host sets the filter several times while configuring, connection is reported once
+            ecm_report(ECM_NOTIFY_NC | ECM_NOTIFY_CSC);
+          }
+          else if (CDC_REQUEST_GET_ETHERNET_STATISTIC == request->bRequest)
+          {
+            // feature selectors as in bmEthernetStatistics of TUD_CDC_ECM_DESCRIPTOR
+            uint32_t value;
+            switch (request->wValue)
+            {
+              case 1: value = _netd_stats.tx_frames;  break; // XMIT_OK
+              case 2: value = _netd_stats.rx_frames;  break; // RCV_OK
+              case 3: value = _netd_stats.tx_dropped; break; // XMIT_ERROR
+              case 4: value = _netd_stats.rx_errors;  break; // RCV_ERROR
+              case 5: value = _netd_stats.rx_dropped; break; // RCV_NO_BUFFER
+              default: return false;
+            }
+            value = tu_htole32(value);
+            tud_control_xfer(rhport, request, &value, 4);
           }
         }
         else
@@ -342,11 +602,14 @@ bool netd_control_xfer_cb (uint8_t rhport, uint8_t stage, tusb_control_request_t
   return true;
 }
 
-static void handle_incoming_packet(uint32_t len)
+static void handle_incoming_packet(uint8_t *buf, uint32_t len)
 {
-  uint8_t *pnt = received;
+  uint8_t *pnt = buf;
   uint32_t size = 0;
 
+  // by default the rest of the buffer is consumed
+  _netd_itf.rx.next = _netd_itf.rx.len[_netd_itf.rx.rd];
+
   if (_netd_itf.ecm_mode)
   {
     size = len;
@@ -358,16 +621,69 @@ static void handle_incoming_packet(uint32_t len)
       if ( (r->MessageType == REMOTE_NDIS_PACKET_MSG) && (r->MessageLength <= len))
         if ( (r->DataOffset + offsetof(rndis_data_packet_t, DataOffset) + r->DataLength) <= len)
         {
-          pnt = &received[r->DataOffset + offsetof(rndis_data_packet_t, DataOffset)];
+          pnt = &buf[r->DataOffset + offsetof(rndis_data_packet_t, DataOffset)];
           size = r->DataLength;
+
+          // host may concatenate more packet messages in the same transfer
+          if (r->MessageLength) _netd_itf.rx.next = (uint16_t) (_netd_itf.rx.pos + r->MessageLength);
         }
   }
 
+#if CFG_TUD_NET_CHECKSUM
+  // bad frames are handled like malformed messages
+  if ( size && !netd_csum_verify(pnt, (uint16_t) size) ) size = 0;
+#endif
+
+  if ( size == 0 )
+  {
+    _netd_stats.rx_errors++;
+  }else
+  {
+    _netd_stats.rx_frames++;
+    _netd_stats.rx_bytes += size;
+  }
+
+#if CFG_TUD_NET_LWIP_PBUF
+  struct pbuf* p = NULL;
+
+  if ( size == 0 )
+  {
+    // malformed message, nothing to pass on
+  }
+  else if ( rx_last_message() )
+  {
+    // hand over the transfer's own pbuf, skipping everything in front of the frame
+    uint8_t const idx = _netd_itf.rx.rd;
+
+    p = rx_pbuf[idx];
+    rx_pbuf[idx] = NULL;
+
+    pbuf_remove_header(p, (size_t) (pnt - (uint8_t*) p->payload));
+    pbuf_realloc(p, (u16_t) size);
+  }
+  else
+  {
+    // more messages follow in the same transfer, this one is copied out
+    p = pbuf_alloc(PBUF_RAW, (u16_t) size, PBUF_POOL);
+    if ( p ) pbuf_take(p, pnt, (u16_t) size);
+    else _netd_stats.rx_dropped++;
+  }
+
+  if ( p && !tud_network_recv_pbuf_cb(p) )
+  {
+    _netd_stats.rx_not_renewed++;
+    pbuf_free(p);
+  }
+
+  tud_network_recv_renew();
+#else
   if (!tud_network_recv_cb(pnt, size))
   {
     /* if a buffer was never handled by user code, we must renew on the user's behalf */
+    _netd_stats.rx_not_renewed++;
     tud_network_recv_renew();
   }
+#endif
 }
 
 bool netd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
@@ -378,7 +694,21 @@ bool netd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_
   /* new packet received */
   if ( ep_addr == _netd_itf.ep_out )
   {
-    handle_incoming_packet(xferred_bytes);
+    _netd_itf.rx.armed = false;
+
+    // RNDIS one-byte short packet arriving as a transfer of its own, sent by the host instead
+    // of a ZLP. Not a message and not an error, the buffer is armed again
+    if ( _netd_itf.ecm_mode || xferred_bytes != 1 )
+    {
+      uint8_t const idx = (uint8_t) ((_netd_itf.rx.rd + _netd_itf.rx.count) % CFG_TUD_NET_RX_PACKETS);
+
+      _netd_itf.rx.len[idx] = (uint16_t) xferred_bytes;
+      _netd_itf.rx.count++;
+    }
+
+    /* re-arm right away if there is a free buffer, then hand the packet over */
+    rx_arm();
+    rx_deliver();
   }
 
   /* data transmission finished */
@@ -388,52 +718,180 @@ bool netd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_
 
     if ( xferred_bytes && (0 == (xferred_bytes % CFG_TUD_NET_ENDPOINT_SIZE)) )
     {
-      do_in_xfer(NULL, 0); /* a ZLP is needed */
+      usbd_edpt_xfer(TUD_OPT_RHPORT, _netd_itf.ep_in, NULL, 0); /* a ZLP is needed */
+      _netd_stats.tx_zlps++;
     }
     else
     {
-      /* we're finally finished */
-      can_xmit = true;
+      /* we're finally finished with this transfer, send the next queued one */
+#if CFG_TUD_NET_LWIP_PBUF
+      if ( tx_pbuf[_netd_itf.tx.rd] )
+      {
+        pbuf_free(tx_pbuf[_netd_itf.tx.rd]);
+        tx_pbuf[_netd_itf.tx.rd] = NULL;
+      }
+#endif
+
+      _netd_itf.tx.busy = false;
+      _netd_itf.tx.rd   = (uint8_t) ((_netd_itf.tx.rd + 1) % CFG_TUD_NET_TX_PACKETS);
+      _netd_itf.tx.count--;
+
+      tx_start();
     }
   }
 
   if ( _netd_itf.ecm_mode && (ep_addr == _netd_itf.ep_notif) )
   {
-    if (sizeof(notify.ecm_buf.header) == xferred_bytes) ecm_report(false);
+    _netd_itf.notify_busy = false;
+    ecm_notify_kick();
   }
 
+#if CFG_TUD_NET_LWIP_PBUF
+  // a completed transmission may have returned a pbuf to the pool
+  if ( _netd_itf.rx.starved ) rx_arm();
+#endif
+
   return true;
 }
 
 bool tud_network_can_xmit(void)
 {
-  return can_xmit;
+  uint8_t idx;
+  bool append;
+
+  // endpoints are not opened yet (ECM data interface inactive)
+  if ( !_netd_itf.ep_in ) return false;
+
+  return tx_next_buffer(&idx, &append);
+}
+
+#if CFG_TUD_NET_LWIP_PBUF
+// queue a single-segment pbuf to be sent in place, return false if it has to be copied
+static bool tx_pbuf_xmit(struct pbuf* p, uint8_t idx)
+{
+  TU_VERIFY(p && p->next == NULL);
+
+  uint8_t* data = (uint8_t*) p->payload;
+  uint16_t len  = p->len;
+
+  if (!_netd_itf.ecm_mode)
+  {
+    // write RNDIS header into headroom, payload is restored afterwards
+    TU_VERIFY(0 == pbuf_add_header(p, sizeof(rndis_data_packet_t)));
+
+    data = (uint8_t*) p->payload;
+    len  = (uint16_t) (len + sizeof(rndis_data_packet_t));
+    pbuf_remove_header(p, sizeof(rndis_data_packet_t));
+
+    rndis_data_packet_t *hdr = (rndis_data_packet_t *) ((void*) data);
+    memset(hdr, 0, sizeof(rndis_data_packet_t));
+    hdr->MessageType = REMOTE_NDIS_PACKET_MSG;
+    hdr->MessageLength = len;
+    hdr->DataOffset = sizeof(rndis_data_packet_t) - offsetof(rndis_data_packet_t, DataOffset);
+    hdr->DataLength = len - sizeof(rndis_data_packet_t);
+  }
+
+#if CFG_TUD_NET_CHECKSUM
+  netd_csum_fill((uint8_t*) p->payload, p->len);
+#endif
+
+  _netd_stats.tx_frames++;
+  _netd_stats.tx_bytes += p->len;
+
+  pbuf_ref(p);
+  tx_pbuf[idx]      = p;
+  tx_pbuf_data[idx] = data;
+
+  _netd_itf.tx.len[idx] = len;
+  _netd_itf.tx.count++;
+
+  // nothing can be appended to a packet sent in place
+  _netd_itf.tx.tail_packets = CFG_TUD_NET_RNDIS_PACKETS_PER_XFER;
+
+  tx_start();
+
+  return true;
 }
+#endif
 
 void tud_network_xmit(void *ref, uint16_t arg)
 {
   uint8_t *data;
   uint16_t len;
+  uint8_t idx;
+  bool append;
 
-  if (!can_xmit)
+#if CFG_TUD_NET_LWIP_PBUF
+  // network stack runs, it may have freed pbufs reception is waiting for
+  if ( _netd_itf.rx.starved ) rx_arm();
+#endif
+
+  if (!_netd_itf.ep_in || !tx_next_buffer(&idx, &append))
+  {
+    _netd_stats.tx_dropped++;
     return;
+  }
+
+#if CFG_TUD_NET_LWIP_PBUF
+  if ( !append && tx_pbuf_xmit((struct pbuf*) ref, idx) ) return;
+#endif
+
+  uint16_t const offset = append ? _netd_itf.tx.len[idx] : 0;
+  uint8_t* const buf = transmitted[idx] + offset;
 
   len = (_netd_itf.ecm_mode) ? 0 : CFG_TUD_NET_PACKET_PREFIX_LEN;
-  data = transmitted + len;
+  data = buf + len;
+
+  uint16_t const frame_len = tud_network_xmit_cb(data, ref, arg);
+  len += frame_len;
+
+#if CFG_TUD_NET_CHECKSUM
+  // frame was just written by the callback and is still in cache
+  netd_csum_fill(data, frame_len);
+#endif
 
-  len += tud_network_xmit_cb(data, ref, arg);
+  _netd_stats.tx_frames++;
+  _netd_stats.tx_bytes += frame_len;
 
   if (!_netd_itf.ecm_mode)
   {
-    rndis_data_packet_t *hdr = (rndis_data_packet_t *) ((void*) transmitted);
+    rndis_data_packet_t *hdr = (rndis_data_packet_t *) ((void*) buf);
     memset(hdr, 0, sizeof(rndis_data_packet_t));
     hdr->MessageType = REMOTE_NDIS_PACKET_MSG;
     hdr->MessageLength = len;
     hdr->DataOffset = sizeof(rndis_data_packet_t) - offsetof(rndis_data_packet_t, DataOffset);
     hdr->DataLength = len - sizeof(rndis_data_packet_t);
+
+    // pad so that a following packet message starts aligned
+    if (CFG_TUD_NET_RNDIS_PACKETS_PER_XFER > 1)
+    {
+      len = (uint16_t) ((len + 3) & ~3u);
+      hdr->MessageLength = len;
+    }
+  }
+
+  if (append)
+  {
+    _netd_itf.tx.len[idx] += len;
+    _netd_itf.tx.tail_packets++;
+  }else
+  {
+    _netd_itf.tx.len[idx] = len;
+    _netd_itf.tx.tail_packets = 1;
+    _netd_itf.tx.count++;
   }
 
-  do_in_xfer(transmitted, len);
+  tx_start();
+}
+
+void tud_network_stats_get(tud_network_stats_t* stats)
+{
+  *stats = _netd_stats;
+}
+
+void tud_network_stats_clear(void)
+{
+  tu_memclr(&_netd_stats, sizeof(_netd_stats));
 }
 
 #endif
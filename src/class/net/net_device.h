@@ -31,6 +31,12 @@
 #include "common/tusb_common.h"
 #include "device/usbd.h"
 #include "class/cdc/cdc.h"
+#include "ncm.h"
+#include "net_checksum.h"
+
+#if CFG_TUD_NET && CFG_TUD_NCM
+  #error "CFG_TUD_NET and CFG_TUD_NCM share the network API, only one of them can be enabled"
+#endif
 
 /* declared here, NOT in usb_descriptors.c, so that the driver can intelligently ZLP as needed */
 #define CFG_TUD_NET_ENDPOINT_SIZE (TUD_OPT_HIGH_SPEED ? 512 : 64)
@@ -40,6 +46,81 @@
 #define CFG_TUD_NET_MTU           1514
 #endif
 
+// Number of packet buffers for each direction. With more than one RX buffer the OUT endpoint
+// is re-armed while the application still holds a packet, more than one TX buffer allows
+// queueing several packets with tud_network_xmit() while one is being sent
+#ifndef CFG_TUD_NET_RX_PACKETS
+#define CFG_TUD_NET_RX_PACKETS    1
+#endif
+
+#ifndef CFG_TUD_NET_TX_PACKETS
+#define CFG_TUD_NET_TX_PACKETS    1
+#endif
+
+// RNDIS only: maximum number of packets aggregated into one bulk transfer, each packet buffer
+// is sized accordingly. Device-to-host transfers are further limited by host's MaxTransferSize.
+// Batching on TX happens while a previous transfer is in flight, it needs CFG_TUD_NET_TX_PACKETS > 1
+#ifndef CFG_TUD_NET_RNDIS_PACKETS_PER_XFER
+#define CFG_TUD_NET_RNDIS_PACKETS_PER_XFER  1
+#endif
+
+// RNDIS/ECM only: exchange lwIP pbufs with the application instead of copying frames.
+// - RX: each transfer lands in a PBUF_POOL pbuf, the RNDIS header is skipped by moving the payload and
+//   the pbuf is passed to tud_network_recv_pbuf_cb(). PBUF_POOL_BUFSIZE must hold a whole transfer
+//   (MTU + 44 bytes, times CFG_TUD_NET_RNDIS_PACKETS_PER_XFER), checked at compile time. While the
+//   pool is empty the host is held off, counted in rx_dropped.
+// - TX: tud_network_xmit() takes the pbuf as 'ref'. A single-segment pbuf is sent in place, for RNDIS
+//   it needs PBUF_LINK_ENCAPSULATION_HLEN >= 44 bytes of headroom. Others are still copied with
+//   tud_network_xmit_cb().
+// pbuf memory must be reachable by the USB controller.
+#ifndef CFG_TUD_NET_LWIP_PBUF
+#define CFG_TUD_NET_LWIP_PBUF     0
+#endif
+
+// RNDIS/ECM only: IPv4, TCP and UDP checksums are computed by the driver on frames queued with
+// tud_network_xmit() and verified on received frames, failing ones are dropped. Lets lwIP run with
+// CHECKSUM_GEN_* and CHECKSUM_CHECK_* disabled
+#ifndef CFG_TUD_NET_CHECKSUM
+#define CFG_TUD_NET_CHECKSUM      0
+#endif
+
+//------------- CDC-NCM -------------//
+
+// Maximum size of a transfer block (NTB) in each direction, at least 2048.
+// Host may ask for smaller IN blocks with SET_NTB_INPUT_SIZE
+#ifndef CFG_TUD_NCM_IN_NTB_MAX_SIZE
+#define CFG_TUD_NCM_IN_NTB_MAX_SIZE   2048
+#endif
+
+#ifndef CFG_TUD_NCM_OUT_NTB_MAX_SIZE
+#define CFG_TUD_NCM_OUT_NTB_MAX_SIZE  2048
+#endif
+
+// Number of NTB buffers in each direction
+#ifndef CFG_TUD_NCM_IN_NTB_COUNT
+#define CFG_TUD_NCM_IN_NTB_COUNT      2
+#endif
+
+#ifndef CFG_TUD_NCM_OUT_NTB_COUNT
+#define CFG_TUD_NCM_OUT_NTB_COUNT     2
+#endif
+
+// Maximum number of datagrams batched into one IN NTB
+#ifndef CFG_TUD_NCM_MAX_DATAGRAMS_PER_NTB
+#define CFG_TUD_NCM_MAX_DATAGRAMS_PER_NTB  8
+#endif
+
+// Alignment of datagrams within NTBs in both directions, power of 2 and at least 4
+#ifndef CFG_TUD_NCM_ALIGNMENT
+#define CFG_TUD_NCM_ALIGNMENT         4
+#endif
+
+// An IN NTB that is not full is held back for at most that long after its first datagram to batch
+// more, rounded up to the period of tud_network_ncm_task(). 0 : send as soon as the IN endpoint is idle
+#ifndef CFG_TUD_NCM_FLUSH_TIMEOUT_MS
+#define CFG_TUD_NCM_FLUSH_TIMEOUT_MS  0
+#endif
+
 #ifdef __cplusplus
  extern "C" {
 #endif
@@ -51,9 +132,18 @@
 // client must provide this: initialize any network state back to the beginning
 void tud_network_init_cb(void);
 
-// client must provide this: return false if the packet buffer was not accepted
+// client must provide this: return false if the packet buffer was not accepted.
+// Packets are passed in order, the next one only after the previous was renewed
 bool tud_network_recv_cb(const uint8_t *src, uint16_t size);
 
+#if CFG_TUD_NET_LWIP_PBUF
+struct pbuf;
+
+// client must provide this instead of tud_network_recv_cb() with CFG_TUD_NET_LWIP_PBUF:
+// ownership of the pbuf is passed to the client, return false to have the driver free it
+bool tud_network_recv_pbuf_cb(struct pbuf *p);
+#endif
+
 // client must provide this: copy from network stack packet pointer to dst
 uint16_t tud_network_xmit_cb(uint8_t *dst, void *ref, uint16_t arg);
 
@@ -61,15 +151,44 @@ uint16_t tud_network_xmit_cb(uint8_t *dst, void *ref, uint16_t arg);
 // TODO removed later since it is not part of tinyusb stack
 extern const uint8_t tud_network_mac_address[6];
 
-// indicate to network driver that client has finished with the packet provided to network_recv_cb()
+// indicate to network driver that client has finished with the packet provided to network_recv_cb().
+// With CFG_TUD_NET_LWIP_PBUF: retry receiving after the pbuf pool ran empty
 void tud_network_recv_renew(void);
 
 // poll network driver for its ability to accept another packet to transmit
 bool tud_network_can_xmit(void);
 
-// if network_can_xmit() returns true, network_xmit() can be called once
+// if network_can_xmit() returns true, network_xmit() can be called once.
+// Packet is queued and sent after the ones queued before it
 void tud_network_xmit(void *ref, uint16_t arg);
 
+#if CFG_TUD_NET
+// RNDIS/ECM link counters, cumulative since power up (not cleared by bus reset)
+typedef struct
+{
+  uint32_t rx_frames;
+  uint32_t rx_bytes;       // ethernet frames without RNDIS header
+  uint32_t rx_errors;      // malformed or empty messages, the RNDIS one-byte short packet is not counted
+  uint32_t rx_dropped;     // no pbuf: aggregated message not copied, or reception stalled (once per outage)
+  uint32_t rx_not_renewed; // refused by the receive callback, renewed on the application's behalf
+  uint32_t tx_frames;      // queued for transmission
+  uint32_t tx_bytes;
+  uint32_t tx_dropped;     // tud_network_xmit() called while tud_network_can_xmit() is false
+  uint32_t tx_zlps;        // zero length packets terminating a transfer
+} tud_network_stats_t;
+
+// copy current counters
+void tud_network_stats_get(tud_network_stats_t* stats);
+
+// reset all counters to zero
+void tud_network_stats_clear(void);
+#endif
+
+#if CFG_TUD_NCM && CFG_TUD_NCM_FLUSH_TIMEOUT_MS
+// NCM only: call periodically with a millisecond time stamp to flush a partially filled NTB
+void tud_network_ncm_task(uint32_t now_ms);
+#endif
+
 //--------------------------------------------------------------------+
 // INTERNAL USBD-CLASS DRIVER API
 //--------------------------------------------------------------------+
@@ -80,6 +199,28 @@ bool     netd_control_xfer_cb (uint8_t rhport, uint8_t stage, tusb_control_reque
 bool     netd_xfer_cb         (uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes);
 void     netd_report          (uint8_t *buf, uint16_t len);
 
+// Bit rate advertised to the host: bulk payload limit of the negotiated bus speed,
+// 19 x 64 bytes per 1 ms frame at full speed, 13 x 512 bytes per 125 us microframe at high speed
+static inline uint32_t netd_link_speed(void)
+{
+  return (tud_speed_get() == TUSB_SPEED_HIGH) ? (13u * 512 * 8 * 8000) : (19u * 64 * 8 * 1000);
+}
+
+// RNDIS message handler (lib/networking/rndis_reports.c) only
+
+// Encapsulated command and response buffer, it holds the largest reply of the handler:
+// OID_GEN_SUPPORTED_LIST, checked against its OID list at compile time
+#define NETD_RNDIS_ENC_BUF_SIZE  160
+
+uint32_t netd_rndis_max_xfer          (void);
+void     netd_rndis_set_host_max_xfer (uint32_t size);
+
+void     ncmd_init            (void);
+void     ncmd_reset           (uint8_t rhport);
+uint16_t ncmd_open            (uint8_t rhport, tusb_desc_interface_t const * itf_desc, uint16_t max_len);
+bool     ncmd_control_xfer_cb (uint8_t rhport, uint8_t stage, tusb_control_request_t const * request);
+bool     ncmd_xfer_cb         (uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes);
+
 #ifdef __cplusplus
  }
 #endif
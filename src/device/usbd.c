@@ -200,6 +200,18 @@ static usbd_class_driver_t const _usbd_driver[] =
   },
   #endif
 
+  #if CFG_TUD_NCM
+  {
+    DRIVER_NAME("NCM")
+    .init             = ncmd_init,
+    .reset            = ncmd_reset,
+    .open             = ncmd_open,
+    .control_xfer_cb  = ncmd_control_xfer_cb,
+    .xfer_cb          = ncmd_xfer_cb,
+    .sof              = NULL
+  },
+  #endif
+
   #if CFG_TUD_BTH
   {
     DRIVER_NAME("BTH")
@@ -1339,8 +1351,16 @@ void usbd_edpt_close(uint8_t rhport, uint8_t ep_addr)
   TU_ASSERT(dcd_edpt_close, /**/);
   TU_LOG2("  CLOSING Endpoint: 0x%02X\r\n", ep_addr);
 
+  uint8_t const epnum = tu_edpt_number(ep_addr);
+  uint8_t const dir   = tu_edpt_dir(ep_addr);
+
   dcd_edpt_close(rhport, ep_addr);
 
+  // transfer in progress is abandoned, endpoint can be opened again
+  _usbd_dev.ep_status[epnum][dir].stalled = false;
+  _usbd_dev.ep_status[epnum][dir].busy = false;
+  _usbd_dev.ep_status[epnum][dir].claimed = 0;
+
   return;
 }
 
@@ -96,7 +96,7 @@
     #include "class/dfu/dfu_rt_device.h"
   #endif
 
-  #if CFG_TUD_NET
+  #if CFG_TUD_NET || CFG_TUD_NCM
     #include "class/net/net_device.h"
   #endif
 
@@ -248,6 +248,10 @@
   #define CFG_TUD_NET             0
 #endif
 
+#ifndef CFG_TUD_NCM
+  #define CFG_TUD_NCM             0
+#endif
+
 #ifndef CFG_TUD_BTH
   #define CFG_TUD_BTH             0
 #endif
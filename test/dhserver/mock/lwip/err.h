@@ -0,0 +1,19 @@
+/*
+ * Minimal host mock of the lwIP headers used by dhserver.c.
+ * Sockets and timers are provided by the test.
+ */
+
+#ifndef LWIP_ERR_MOCK_H
+#define LWIP_ERR_MOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t  u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef int8_t   err_t;
+
+enum { ERR_OK = 0, ERR_MEM = -1, ERR_VAL = -6, ERR_USE = -8, ERR_CONN = -11 };
+
+#endif
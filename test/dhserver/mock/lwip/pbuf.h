@@ -0,0 +1,21 @@
+#ifndef LWIP_PBUF_MOCK_H
+#define LWIP_PBUF_MOCK_H
+
+#include "lwip/err.h"
+
+typedef enum { PBUF_TRANSPORT } pbuf_layer;
+typedef enum { PBUF_POOL } pbuf_type;
+
+struct pbuf
+{
+  struct pbuf* next;
+  void*        payload;
+  u16_t        tot_len;
+  u16_t        len;
+  u8_t         if_idx;
+};
+
+struct pbuf* pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+u8_t pbuf_free(struct pbuf* p);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef LWIP_SYS_MOCK_H
+#define LWIP_SYS_MOCK_H
+
+#include "lwip/err.h"
+
+u32_t sys_now(void);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef LWIP_TIMEOUTS_MOCK_H
+#define LWIP_TIMEOUTS_MOCK_H
+
+#include "lwip/err.h"
+
+typedef void (*sys_timeout_handler)(void* arg);
+
+void sys_timeout  (u32_t msecs, sys_timeout_handler handler, void* arg);
+void sys_untimeout(sys_timeout_handler handler, void* arg);
+
+#endif
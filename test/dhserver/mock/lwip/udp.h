@@ -0,0 +1,31 @@
+#ifndef LWIP_UDP_MOCK_H
+#define LWIP_UDP_MOCK_H
+
+#include "lwip/err.h"
+#include "lwip/pbuf.h"
+
+typedef struct { u32_t addr; } ip_addr_t;
+
+struct udp_pcb;
+struct netif;
+
+typedef void (*udp_recv_fn)(void* arg, struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* addr, u16_t port);
+
+extern const ip_addr_t ip_addr_any;
+extern const ip_addr_t ip_addr_broadcast;
+
+#define IP_ADDR_ANY        (&ip_addr_any)
+#define IP_ADDR_BROADCAST  (&ip_addr_broadcast)
+
+void            udp_init  (void);
+struct udp_pcb* udp_new   (void);
+err_t           udp_bind  (struct udp_pcb* pcb, const ip_addr_t* ipaddr, u16_t port);
+void            udp_recv  (struct udp_pcb* pcb, udp_recv_fn recv, void* recv_arg);
+void            udp_remove(struct udp_pcb* pcb);
+err_t           udp_sendto(struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* dst_ip, u16_t dst_port);
+
+struct netif*    netif_get_by_index(u8_t idx);
+const ip_addr_t* netif_ip4_addr    (const struct netif* netif);
+const ip_addr_t* netif_ip4_netmask (const struct netif* netif);
+
+#endif
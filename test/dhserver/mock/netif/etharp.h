@@ -0,0 +1,6 @@
+#ifndef NETIF_ETHARP_MOCK_H
+#define NETIF_ETHARP_MOCK_H
+
+#include "lwip/udp.h"
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ * Host test and load generator of lib/networking/dhserver.
+ *
+ * lwIP is mocked: the receive callback registered with udp_recv() is called
+ * with hand built DHCP messages and udp_sendto() captures the reply. Time is
+ * simulated, the expire timer fires as sys_now() passes its deadline.
+ * The load generator lets more clients than addresses discover, renew and
+ * release in random order and checks that no address is handed out twice.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dhserver.h"
+#include "lwip/sys.h"
+#include "lwip/timeouts.h"
+#include "test_common.h"
+
+//--------------------------------------------------------------------+
+// Mock lwIP
+//--------------------------------------------------------------------+
+const ip_addr_t ip_addr_any       = { 0 };
+const ip_addr_t ip_addr_broadcast = { 0xFFFFFFFFu };
+
+static const ip_addr_t netif_addr = { 0x0100A8C0u };   // 192.168.0.1
+static const ip_addr_t netif_mask = { 0x00FFFFFFu };   // 255.255.255.0
+
+static struct
+{
+  udp_recv_fn         recv;
+  bool                bound;
+
+  uint32_t            now;
+  sys_timeout_handler timer;
+  uint32_t            timer_due;
+
+  uint8_t             reply[600];
+  uint16_t            reply_len;   // 0 : server stayed silent
+} mock;
+
+u32_t sys_now(void)
+{
+  return mock.now;
+}
+
+void sys_timeout(u32_t msecs, sys_timeout_handler handler, void* arg)
+{
+  (void) arg;
+  mock.timer     = handler;
+  mock.timer_due = mock.now + msecs;
+}
+
+void sys_untimeout(sys_timeout_handler handler, void* arg)
+{
+  (void) arg;
+  if ( mock.timer == handler ) mock.timer = NULL;
+}
+
+void udp_init(void)
+{
+}
+
+struct udp_pcb* udp_new(void)
+{
+  static int pcb;
+  return (struct udp_pcb*) &pcb;
+}
+
+err_t udp_bind(struct udp_pcb* pcb, const ip_addr_t* ipaddr, u16_t port)
+{
+  (void) pcb; (void) ipaddr; (void) port;
+  mock.bound = true;
+  return ERR_OK;
+}
+
+void udp_recv(struct udp_pcb* pcb, udp_recv_fn recv, void* recv_arg)
+{
+  (void) pcb; (void) recv_arg;
+  mock.recv = recv;
+}
+
+void udp_remove(struct udp_pcb* pcb)
+{
+  (void) pcb;
+  mock.bound = false;
+}
+
+err_t udp_sendto(struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* dst_ip, u16_t dst_port)
+{
+  (void) pcb; (void) dst_ip; (void) dst_port;
+  uint16_t const len = (p->len < sizeof(mock.reply)) ? p->len : sizeof(mock.reply);
+  memcpy(mock.reply, p->payload, len);
+  mock.reply_len = len;
+  return ERR_OK;
+}
+
+struct pbuf* pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type)
+{
+  (void) layer; (void) type;
+  static uint8_t payload[600];
+  static struct pbuf p;
+
+  if ( length > sizeof(payload) ) return NULL;
+  p = (struct pbuf) { .payload = payload, .len = length, .tot_len = length };
+  return &p;
+}
+
+u8_t pbuf_free(struct pbuf* p)
+{
+  (void) p;
+  return 1;
+}
+
+struct netif* netif_get_by_index(u8_t idx)
+{
+  (void) idx;
+  return NULL;
+}
+
+const ip_addr_t* netif_ip4_addr(const struct netif* netif)
+{
+  (void) netif;
+  return &netif_addr;
+}
+
+const ip_addr_t* netif_ip4_netmask(const struct netif* netif)
+{
+  (void) netif;
+  return &netif_mask;
+}
+
+static void advance(uint32_t ms)
+{
+  mock.now += ms;
+  if ( mock.timer && (int32_t) (mock.now - mock.timer_due) >= 0 )
+  {
+    sys_timeout_handler const handler = mock.timer;
+    mock.timer = NULL;
+    handler(NULL);
+  }
+}
+
+//--------------------------------------------------------------------+
+// DHCP client messages
+//--------------------------------------------------------------------+
+enum
+{
+  MSG_DISCOVER = 1,
+  MSG_OFFER    = 2,
+  MSG_REQUEST  = 3,
+  MSG_ACK      = 5,
+  MSG_RELEASE  = 7,
+};
+
+// BOOTP layout
+enum
+{
+  OFS_CIADDR  = 12,
+  OFS_YIADDR  = 16,
+  OFS_CHADDR  = 28,
+  OFS_MAGIC   = 236,
+  OFS_OPTIONS = 240,
+  MSG_SIZE    = 548,
+};
+
+// send a message, return the offered or acknowledged address, 0 if none
+static uint32_t transact(uint8_t type, uint8_t const mac[6], uint32_t ip)
+{
+  static uint8_t msg[MSG_SIZE];
+  uint8_t* opt = msg + OFS_OPTIONS;
+
+  memset(msg, 0, sizeof(msg));
+  msg[0] = 1;  // request
+  msg[1] = 1;  // ethernet
+  msg[2] = 6;
+  memcpy(msg + OFS_CHADDR, mac, 6);
+  memcpy(msg + OFS_MAGIC, "\x63\x82\x53\x63", 4);
+  if ( type == MSG_RELEASE ) memcpy(msg + OFS_CIADDR, &ip, 4);
+
+  // message type must come first
+  *opt++ = 53; *opt++ = 1; *opt++ = type;
+  if ( type == MSG_REQUEST )
+  {
+    *opt++ = 50; *opt++ = 4;
+    memcpy(opt, &ip, 4);
+    opt += 4;
+  }
+  *opt = 255;
+
+  struct pbuf p = { .payload = msg, .len = sizeof(msg), .tot_len = sizeof(msg) };
+  mock.reply_len = 0;
+  mock.recv(NULL, NULL, &p, &ip_addr_any, 68);
+
+  if ( mock.reply_len == 0 ) return 0;
+
+  uint8_t const expected = (type == MSG_DISCOVER) ? MSG_OFFER : MSG_ACK;
+  CHECK(mock.reply[OFS_OPTIONS + 2] == expected, "reply type %u to %u", mock.reply[OFS_OPTIONS + 2], type);
+  CHECK(memcmp(mock.reply + OFS_CHADDR, mac, 6) == 0, "reply to another client");
+
+  uint32_t yiaddr;
+  memcpy(&yiaddr, mock.reply + OFS_YIADDR, 4);
+  return yiaddr;
+}
+
+// discover and request the offered address, return the bound address or 0
+static uint32_t obtain(uint8_t const mac[6])
+{
+  uint32_t const offered = transact(MSG_DISCOVER, mac, 0);
+  if ( offered == 0 ) return 0;
+  return transact(MSG_REQUEST, mac, offered);
+}
+
+//--------------------------------------------------------------------+
+// Pool
+//--------------------------------------------------------------------+
+#define POOL_SIZE    DHSERV_MAX_ENTRIES
+#define LEASE_S      60
+
+static dhcp_entry_t entries[POOL_SIZE];
+static dhcp_config_t config;
+static int lease_cb_count;
+
+static uint8_t const reserved_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0xAA, 0xAA };
+enum { RESERVED_IDX = 5 };
+
+static void lease_cb(dhcp_entry_t const* entry, bool bound)
+{
+  (void) entry; (void) bound;
+  lease_cb_count++;
+}
+
+static uint32_t pool_addr(unsigned idx)
+{
+  // 192.168.0.2 and up, in network order
+  return 0x0000A8C0u | ((uint32_t) ((idx + 2) & 0xFF) << 24) | ((uint32_t) ((idx + 2) >> 8) << 16);
+}
+
+static unsigned pool_index(uint32_t addr)
+{
+  unsigned const host = ((addr >> 8) & 0xFF00) | (addr >> 24);
+  return (host >= 2 && (addr & 0xFFFFu) == 0xA8C0u) ? host - 2 : POOL_SIZE;
+}
+
+static void pool_init(void)
+{
+  memset(entries, 0, sizeof(entries));
+  for (unsigned i = 0; i < POOL_SIZE; i++)
+  {
+    entries[i].addr.addr = pool_addr(i);
+    entries[i].lease     = LEASE_S;
+  }
+  memcpy(entries[RESERVED_IDX].mac, reserved_mac, 6);
+
+  config = (dhcp_config_t)
+  {
+    .router    = netif_addr,
+    .port      = 67,
+    .dns       = netif_addr,
+    .domain    = "usb",
+    .num_entry = POOL_SIZE,
+    .entries   = entries,
+    .lease_cb  = lease_cb,
+  };
+}
+
+static void client_mac(uint8_t mac[6], unsigned n)
+{
+  mac[0] = 0x02; mac[1] = 0x11;
+  mac[2] = (uint8_t) (n >> 24); mac[3] = (uint8_t) (n >> 16);
+  mac[4] = (uint8_t) (n >> 8);  mac[5] = (uint8_t) n;
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+
+// dynamic leases do not turn into reservations over dhserv_free() and dhserv_init()
+static void test_restart(void)
+{
+  uint8_t mac[6], other[6];
+
+  printf("restart:\n");
+  pool_init();
+  CHECK(dhserv_init(&config) == ERR_OK, "init failed");
+
+  client_mac(mac, 1);
+  uint32_t const addr = obtain(mac);
+  CHECK(addr != 0 && addr != entries[RESERVED_IDX].addr.addr, "no lease");
+
+  dhserv_free();
+  CHECK(!mock.bound, "pcb not removed");
+  CHECK(dhserv_init(&config) == ERR_OK, "second init failed");
+
+  // reservation kept, lease forgotten until restored
+  CHECK(obtain(reserved_mac) == entries[RESERVED_IDX].addr.addr, "reservation lost over restart");
+  CHECK(memcmp(entries[pool_index(addr)].mac, "\0\0\0\0\0\0", 6) == 0, "lease kept its mac");
+
+  ip_addr_t const ip = { addr };
+  CHECK(dhserv_restore(mac, ip, LEASE_S) == ERR_OK, "restore failed");
+  CHECK(transact(MSG_DISCOVER, mac, 0) == addr, "restored lease not offered");
+
+  // the restored lease can be released and is handed to another host
+  int const cb = lease_cb_count;
+  transact(MSG_RELEASE, mac, addr);
+  CHECK(lease_cb_count == cb + 1, "release ignored, lease became a reservation");
+
+  client_mac(other, 2);
+  CHECK(transact(MSG_REQUEST, other, addr) == addr, "released address not given to another host");
+
+  // and it expires: every address but the reserved one is handed out again
+  dhserv_free();
+  CHECK(dhserv_init(&config) == ERR_OK, "third init failed");
+  CHECK(dhserv_restore(other, ip, LEASE_S) == ERR_OK, "restore failed");
+  advance(LEASE_S * 1000 + 1);
+
+  unsigned count = 0;
+  for (unsigned n = 100; n < 100 + 2 * POOL_SIZE; n++)
+  {
+    client_mac(mac, n);
+    if ( obtain(mac) ) count++;
+  }
+  CHECK(count == POOL_SIZE - 1, "%u of %u addresses handed out", count, POOL_SIZE - 1);
+
+  dhserv_free();
+}
+
+// more clients than addresses obtain, renew and release leases in random order
+static void test_load(void)
+{
+  enum { CLIENTS = 4 * POOL_SIZE, ROUNDS = 200000 };
+
+  static struct
+  {
+    uint32_t addr;
+    uint32_t expires;
+  } client[CLIENTS];
+
+  static int16_t holder[POOL_SIZE];   // client with an unexpired lease on each address, -1 : none
+
+  printf("load, %u addresses, %u clients:\n", POOL_SIZE, CLIENTS);
+
+  pool_init();
+  memset(client, 0, sizeof(client));
+  memset(holder, 0xFF, sizeof(holder));
+  CHECK(dhserv_init(&config) == ERR_OK, "init failed");
+
+  uint32_t rng = 0x12345678;
+  unsigned messages = 0, bound = 0, refused = 0, renewed = 0, released = 0;
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  for (unsigned r = 0; r < ROUNDS; r++)
+  {
+    rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+
+    unsigned const c = rng % CLIENTS;
+    uint8_t mac[6];
+    client_mac(mac, c);
+
+    bool const valid = client[c].addr && (int32_t) (mock.now - client[c].expires) < 0;
+    uint32_t got = 0;
+
+    if ( valid && (rng & 0x300) == 0 )
+    {
+      transact(MSG_RELEASE, mac, client[c].addr);
+      messages++;
+      released++;
+      client[c].addr = 0;
+      continue;
+    }
+
+    if ( valid )
+    {
+      got = transact(MSG_REQUEST, mac, client[c].addr);
+      messages++;
+      CHECK(got == client[c].addr, "renewal of client %u refused", c);
+      renewed++;
+    }
+    else
+    {
+      got = obtain(mac);
+      messages += 2;
+      if ( got ) bound++;
+      else refused++;
+    }
+
+    if ( got )
+    {
+      // the address must not be held by another client with an unexpired lease
+      unsigned const idx = pool_index(got);
+      CHECK(idx < POOL_SIZE && idx != RESERVED_IDX, "client %u got %08x outside the pool", c, (unsigned) got);
+
+      if ( idx < POOL_SIZE )
+      {
+        int16_t const h = holder[idx];
+        CHECK(h < 0 || h == (int16_t) c || client[h].addr != got || (int32_t) (mock.now - client[h].expires) >= 0,
+              "%08x given to %u while leased by %d", (unsigned) got, c, h);
+        holder[idx] = (int16_t) c;
+      }
+
+      client[c].addr    = got;
+      client[c].expires = mock.now + LEASE_S * 1000;
+    }
+
+    advance(1 + (rng >> 24) % 64);
+
+    // the reserved host always gets its address
+    if ( (r & 0x3FF) == 0 )
+    {
+      CHECK(obtain(reserved_mac) == entries[RESERVED_IDX].addr.addr, "reservation not honoured");
+      messages += 2;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double const sec = (double) (t1.tv_sec - t0.tv_sec) + (double) (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+  printf("  %u messages in %.3f s: %.0f messages/s, %.0f ns each\n", messages, sec, messages / sec, sec * 1e9 / messages);
+  printf("  %u bound, %u renewed, %u released, %u refused (pool empty)\n", bound, renewed, released, refused);
+  CHECK(bound > 0 && refused > 0 && renewed > 0 && released > 0, "load did not exercise all paths");
+
+  dhserv_free();
+}
+
+int main(void)
+{
+  test_restart();
+  test_load();
+
+  return test_result("dhserver");
+}
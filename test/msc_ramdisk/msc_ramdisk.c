@@ -0,0 +1,760 @@
+/*
+ * RAM-disk harness for the MSC device driver.
+ *
+ * msc_device.c runs against a simulated bus: the host side issues BOT commands,
+ * transfers take bus time and the read10/write10 callbacks take media time on the
+ * device CPU. Both clocks run in parallel, so the result shows how much storage
+ * and USB I/O overlap. The RAM disk holds the data, only its access time is modeled.
+ *
+ * Built with CFG_TUD_MSC_CACHE_LINES it checks the write-back cache instead: the write
+ * callback is busy, asynchronous or partial in turn and the disk content is verified.
+ * Built with CFG_TUD_MSC_READAHEAD_SIZE sequential reads run with a synchronous and an
+ * asynchronous read callback, the latter completes in the background of the device CPU.
+ * Every build first checks the 16-byte commands at CDB level: READ(16), WRITE(16),
+ * READ CAPACITY(16) and the rejection of LBAs above 32 bits.
+ *
+ * Usage: msc_ramdisk [bus MB/s] [media latency us] [media MB/s, 0 = no cost per byte]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tusb.h"
+#include "device/usbd_pvt.h"
+#include "device/dcd.h"
+#include "test_common.h"
+
+#define EP_OUT        0x01
+#define EP_IN         0x81
+#define BLOCK_SIZE    512
+#define DISK_BLOCKS   16384
+
+static uint8_t disk[DISK_BLOCKS * BLOCK_SIZE];
+
+//--------------------------------------------------------------------+
+// Timing model, all times in microseconds
+//--------------------------------------------------------------------+
+static double bus_us_per_byte;
+static double media_latency_us;
+static double media_us_per_byte;
+
+static double now;         // device CPU
+static double bus_free;    // end of the last transfer scheduled on the bus
+
+typedef struct
+{
+  double   time;
+  uint8_t  ep;
+  uint32_t len;
+  bool     real;           // completed on the bus, not re-queued by the driver
+
+  // deferred function or completion of an asynchronous callback instead of a transfer
+  osal_task_func_t func;
+  void*    param;
+} event_t;
+
+static event_t events[32];
+static uint8_t event_count;
+
+static void event_insert(event_t const* ev)
+{
+  if ( event_count == TU_ARRAY_SIZE(events) ) { printf("event queue full\n"); exit(1); }
+
+  // sorted by time, FIFO for equal times
+  uint8_t i = event_count++;
+  while ( i && events[i-1].time > ev->time ) { events[i] = events[i-1]; i--; }
+  events[i] = *ev;
+}
+
+static void event_push(double time, uint8_t ep, uint32_t len, bool real)
+{
+  event_t const ev = { .time = time, .ep = ep, .len = len, .real = real };
+  event_insert(&ev);
+}
+
+static void event_push_func(double time, osal_task_func_t func, void* param)
+{
+  event_t const ev = { .time = time, .func = func, .param = param };
+  event_insert(&ev);
+}
+
+static event_t event_pop(void)
+{
+  if ( event_count == 0 ) { printf("deadlock: no transfer pending\n"); exit(1); }
+
+  event_t ev = events[0];
+  memmove(events, events + 1, --event_count * sizeof(event_t));
+  return ev;
+}
+
+static double bus_schedule(uint32_t len)
+{
+  double const start = (bus_free > now) ? bus_free : now;
+  bus_free = start + len * bus_us_per_byte;
+  return bus_free;
+}
+
+//--------------------------------------------------------------------+
+// Host
+//--------------------------------------------------------------------+
+static struct
+{
+  // OUT messages still to send: CBW, then data
+  uint8_t const* out_ptr[2];
+  uint32_t       out_len[2];
+  uint8_t        out_count;
+
+  // data stage of the current command
+  uint8_t*  in_buf;
+  uint32_t  in_len;
+  uint32_t  in_received;
+
+  bool      done;
+  msc_csw_t csw;
+} host;
+
+static struct
+{
+  uint8_t* buf;
+  uint16_t len;
+  bool     busy;
+} out_xfer, in_xfer;
+
+static bool in_stalled;
+
+static void bus_start_out(void)
+{
+  if ( !out_xfer.busy || out_xfer.len == 0 || host.out_count == 0 ) return;
+
+  uint32_t const n = tu_min32(out_xfer.len, host.out_len[0]);
+  memcpy(out_xfer.buf, host.out_ptr[0], n);
+
+  host.out_ptr[0] += n;
+  host.out_len[0] -= n;
+  if ( host.out_len[0] == 0 )
+  {
+    host.out_ptr[0] = host.out_ptr[1];
+    host.out_len[0] = host.out_len[1];
+    host.out_count--;
+  }
+
+  out_xfer.busy = false;
+  event_push(bus_schedule(n), EP_OUT, n, true);
+}
+
+static void host_in_complete(uint32_t len)
+{
+  in_xfer.busy = false;
+
+  if ( host.in_received < host.in_len )
+  {
+    memcpy(host.in_buf + host.in_received, in_xfer.buf, len);
+    host.in_received += len;
+  }
+  else
+  {
+    if ( len != sizeof(msc_csw_t) ) { printf("unexpected IN of %u bytes\n", (unsigned) len); exit(1); }
+    memcpy(&host.csw, in_xfer.buf, sizeof(msc_csw_t));
+    host.done = true;
+  }
+}
+
+static uint32_t cmd_tag;
+
+static void event_run(void)
+{
+  event_t const ev = event_pop();
+  if ( ev.time > now ) now = ev.time;
+
+  if ( ev.func )
+  {
+    ev.func(ev.param);
+    return;
+  }
+
+  if ( ev.real && ev.ep == EP_IN ) host_in_complete(ev.len);
+  mscd_xfer_cb(0, ev.ep, XFER_RESULT_SUCCESS, ev.len);
+
+  if ( in_stalled )
+  {
+    // host sees the stall instead of data, clears it and moves on to the status stage
+    in_stalled = false;
+    host.in_received = host.in_len;
+  }
+}
+
+// Run one BOT command, return CSW status
+static uint8_t host_command(uint8_t const* cdb, uint8_t cdb_len, bool dir_in, uint8_t* data, uint32_t len)
+{
+  static msc_cbw_t cbw;
+
+  tu_memclr(&cbw, sizeof(cbw));
+  cbw.signature   = MSC_CBW_SIGNATURE;
+  cbw.tag         = ++cmd_tag;
+  cbw.total_bytes = len;
+  cbw.dir         = dir_in ? TU_BIT(7) : 0;
+  cbw.cmd_len     = cdb_len;
+  memcpy(cbw.command, cdb, cdb_len);
+
+  host.out_ptr[0] = (uint8_t const*) &cbw;
+  host.out_len[0] = sizeof(cbw);
+  host.out_count  = 1;
+  if ( !dir_in && len )
+  {
+    host.out_ptr[1] = data;
+    host.out_len[1] = len;
+    host.out_count  = 2;
+  }
+
+  host.in_buf      = dir_in ? data : NULL;
+  host.in_len      = dir_in ? len : 0;
+  host.in_received = 0;
+  host.done        = false;
+
+  bus_start_out();
+
+  while ( !host.done ) event_run();
+
+  if ( host.csw.signature != MSC_CSW_SIGNATURE || host.csw.tag != cbw.tag )
+  {
+    printf("bad CSW\n");
+    exit(1);
+  }
+  return host.csw.status;
+}
+
+static uint8_t host_rdwr10(bool read, uint32_t lba, uint16_t blocks, uint8_t* data)
+{
+  uint8_t cdb[10] = { read ? SCSI_CMD_READ_10 : SCSI_CMD_WRITE_10 };
+  uint32_t const lba_be = tu_htonl(lba);
+  uint16_t const cnt_be = tu_htons(blocks);
+
+  memcpy(cdb + 2, &lba_be, 4);
+  memcpy(cdb + 7, &cnt_be, 2);
+  return host_command(cdb, sizeof(cdb), read, data, (uint32_t) blocks * BLOCK_SIZE);
+}
+
+static uint8_t host_rdwr16(bool read, uint64_t lba, uint32_t blocks, uint8_t* data)
+{
+  uint8_t cdb[16] = { read ? SCSI_CMD_READ_16 : SCSI_CMD_WRITE_16 };
+  uint32_t const lba_hi = tu_htonl((uint32_t) (lba >> 32));
+  uint32_t const lba_lo = tu_htonl((uint32_t) lba);
+  uint32_t const cnt_be = tu_htonl(blocks);
+
+  memcpy(cdb + 2, &lba_hi, 4);
+  memcpy(cdb + 6, &lba_lo, 4);
+  memcpy(cdb + 10, &cnt_be, 4);
+  return host_command(cdb, sizeof(cdb), read, data, blocks * BLOCK_SIZE);
+}
+
+//--------------------------------------------------------------------+
+// usbd and dcd mocks
+//--------------------------------------------------------------------+
+bool usbd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t * buffer, uint16_t total_bytes)
+{
+  (void) rhport;
+
+  if ( ep_addr == EP_IN )
+  {
+    if ( in_xfer.busy ) { printf("IN already busy\n"); exit(1); }
+    in_xfer = (typeof(in_xfer)) { .buf = buffer, .len = total_bytes, .busy = true };
+    event_push(bus_schedule(total_bytes), EP_IN, total_bytes, true);
+  }
+  else
+  {
+    if ( out_xfer.busy ) { printf("OUT already busy\n"); exit(1); }
+    out_xfer = (typeof(out_xfer)) { .buf = buffer, .len = total_bytes, .busy = true };
+    bus_start_out();
+  }
+
+  return true;
+}
+
+void dcd_event_xfer_complete(uint8_t rhport, uint8_t ep_addr, uint32_t xferred_bytes, uint8_t result, bool in_isr)
+{
+  (void) rhport; (void) result; (void) in_isr;
+  event_push(now, ep_addr, xferred_bytes, false);
+}
+
+void usbd_edpt_stall(uint8_t rhport, uint8_t ep_addr)
+{
+  (void) rhport;
+
+  if ( ep_addr == EP_IN )
+  {
+    in_stalled = true;
+  }
+  else
+  {
+    // host sees the stall, drops the rest of its data and reads the status
+    host.out_count = 0;
+  }
+}
+
+void usbd_edpt_clear_stall(uint8_t rhport, uint8_t ep_addr) { (void) rhport; (void) ep_addr; }
+
+bool usbd_edpt_stalled(uint8_t rhport, uint8_t ep_addr)
+{
+  (void) rhport;
+  return (ep_addr == EP_IN) && in_stalled;
+}
+
+bool usbd_edpt_busy(uint8_t rhport, uint8_t ep_addr)
+{
+  (void) rhport;
+  return (ep_addr == EP_IN) ? in_xfer.busy : out_xfer.busy;
+}
+
+bool usbd_open_edpt_pair(uint8_t rhport, uint8_t const* p_desc, uint8_t ep_count, uint8_t xfer_type, uint8_t* ep_out, uint8_t* ep_in)
+{
+  (void) rhport; (void) p_desc; (void) ep_count; (void) xfer_type;
+  *ep_out = EP_OUT;
+  *ep_in  = EP_IN;
+  return true;
+}
+
+void usbd_defer_func(osal_task_func_t func, void* param, bool in_isr)
+{
+  (void) in_isr;
+  event_push_func(now, func, param);
+}
+
+bool tud_control_xfer(uint8_t rhport, tusb_control_request_t const * request, void* buffer, uint16_t len)
+{
+  (void) rhport; (void) request; (void) buffer; (void) len;
+  return true;
+}
+
+bool tud_control_status(uint8_t rhport, tusb_control_request_t const * request)
+{
+  (void) rhport; (void) request;
+  return true;
+}
+
+//--------------------------------------------------------------------+
+// RAM disk callbacks
+//--------------------------------------------------------------------+
+static uint32_t fail_lba = UINT32_MAX;   // next read10 at this lba fails once
+
+static void media_access(uint32_t len)
+{
+  now += media_latency_us + len * media_us_per_byte;
+}
+
+// Asynchronous read: medium works in background, completion is reported at the end
+static bool   rd_async;
+static double media_free;
+
+static void read_async_done(void* param)
+{
+  if ( !tud_msc_async_io_done(0, (int32_t) (uintptr_t) param, false) )
+  {
+    printf("async completion refused\n");
+    exit(1);
+  }
+}
+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
+{
+  (void) lun;
+
+  if ( lba == fail_lba )
+  {
+    fail_lba = UINT32_MAX;
+    return TUD_MSC_RET_ERROR;
+  }
+
+  if ( (uint64_t) lba * BLOCK_SIZE + offset + bufsize > sizeof(disk) ) return TUD_MSC_RET_ERROR;
+
+  memcpy(buffer, disk + lba * BLOCK_SIZE + offset, bufsize);
+
+  if ( rd_async )
+  {
+    media_free = ((media_free > now) ? media_free : now) + media_latency_us + bufsize * media_us_per_byte;
+    event_push_func(media_free, read_async_done, (void*) (uintptr_t) bufsize);
+    return TUD_MSC_RET_ASYNC;
+  }
+
+  media_access(bufsize);
+  return (int32_t) bufsize;
+}
+
+// Write callback behaves badly in turn: busy, asynchronous and partial
+static bool     wr_quirks;
+static uint32_t wr_calls;
+
+static struct
+{
+  uint8_t* dst;
+  uint8_t const* src;
+  uint32_t len;
+} wr_async;
+
+static void write_async_done(void* param)
+{
+  (void) param;
+
+  // buffer must have stayed untouched until now
+  memcpy(wr_async.dst, wr_async.src, wr_async.len);
+  if ( !tud_msc_async_io_done(0, (int32_t) wr_async.len, false) )
+  {
+    printf("async completion refused\n");
+    exit(1);
+  }
+}
+
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
+{
+  (void) lun;
+
+  if ( (uint64_t) lba * BLOCK_SIZE + offset + bufsize > sizeof(disk) ) return TUD_MSC_RET_ERROR;
+
+  if ( wr_quirks )
+  {
+    switch ( wr_calls++ % 3 )
+    {
+      case 0: return TUD_MSC_RET_BUSY;
+
+      case 1:
+        wr_async.dst = disk + lba * BLOCK_SIZE + offset;
+        wr_async.src = buffer;
+        wr_async.len = tu_min32(bufsize, 700);
+        media_access(wr_async.len);
+        event_push_func(now, write_async_done, NULL);
+      return TUD_MSC_RET_ASYNC;
+
+      default: bufsize = tu_min32(bufsize, 1000); break;
+    }
+  }
+
+  memcpy(disk + lba * BLOCK_SIZE + offset, buffer, bufsize);
+  media_access(bufsize);
+  return (int32_t) bufsize;
+}
+
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
+{
+  (void) lun;
+  memcpy(vendor_id, "TinyUSB", 7);
+  memcpy(product_id, "RAM disk", 8);
+  memcpy(product_rev, "1.0", 3);
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun)
+{
+  (void) lun;
+  return true;
+}
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size)
+{
+  (void) lun;
+  *block_count = DISK_BLOCKS;
+  *block_size  = BLOCK_SIZE;
+}
+
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize)
+{
+  (void) lun; (void) scsi_cmd; (void) buffer; (void) bufsize;
+  return -1;
+}
+
+//--------------------------------------------------------------------+
+// Benchmark
+//--------------------------------------------------------------------+
+#define XFER_BLOCKS   128   // 64 KiB per command, as hosts typically issue for sequential access
+
+static uint8_t host_buf[XFER_BLOCKS * BLOCK_SIZE];
+
+static void fill(uint8_t* buf, uint32_t len, uint32_t seed)
+{
+  for (uint32_t i = 0; i < len; i++) buf[i] = (uint8_t) ((i * 7 + seed) ^ (i >> 9));
+}
+
+// Sequential access over the whole disk, return MB/s
+static double sequential(bool read)
+{
+  double const start = now;
+
+  for (uint32_t lba = 0; lba < DISK_BLOCKS; lba += XFER_BLOCKS)
+  {
+    if ( !read ) fill(host_buf, sizeof(host_buf), lba);
+
+    if ( host_rdwr10(read, lba, XFER_BLOCKS, host_buf) != MSC_CSW_STATUS_PASSED )
+    {
+      printf("%s failed at lba %u\n", read ? "read" : "write", (unsigned) lba);
+      exit(1);
+    }
+
+    if ( memcmp(host_buf, disk + lba * BLOCK_SIZE, sizeof(host_buf)) )
+    {
+      printf("%s data mismatch at lba %u\n", read ? "read" : "write", (unsigned) lba);
+      exit(1);
+    }
+  }
+
+  return sizeof(disk) / (now - start);
+}
+
+// A read error must fail the command with sense data, also when it hits a prefetch
+static void read_error(void)
+{
+  uint32_t const lba = 64;
+  fail_lba = lba + CFG_TUD_MSC_EP_BUFSIZE / BLOCK_SIZE;
+
+  if ( host_rdwr10(true, lba, XFER_BLOCKS, host_buf) != MSC_CSW_STATUS_FAILED )
+  {
+    printf("read error not reported\n");
+    exit(1);
+  }
+  if ( host.csw.data_residue == 0 )
+  {
+    printf("read error without data residue\n");
+    exit(1);
+  }
+
+  uint8_t cdb[6] = { SCSI_CMD_REQUEST_SENSE, 0, 0, 0, sizeof(scsi_sense_fixed_resp_t), 0 };
+  scsi_sense_fixed_resp_t sense;
+
+  if ( host_command(cdb, sizeof(cdb), true, (uint8_t*) &sense, sizeof(sense)) != MSC_CSW_STATUS_PASSED ||
+       sense.sense_key == 0 )
+  {
+    printf("read error without sense data\n");
+    exit(1);
+  }
+}
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+// A failing read-ahead is not reported: the stream stops and the data stage reads those blocks itself
+static void readahead_error(void)
+{
+  for (uint32_t lba = 0; lba < 4 * XFER_BLOCKS; lba += XFER_BLOCKS)
+  {
+    // read-ahead of the second command runs into it
+    if ( lba == XFER_BLOCKS ) fail_lba = 2 * XFER_BLOCKS + 8;
+
+    CHECK(host_rdwr10(true, lba, XFER_BLOCKS, host_buf) == MSC_CSW_STATUS_PASSED, "read-ahead error: read failed at lba %u", (unsigned) lba);
+    CHECK(!memcmp(host_buf, disk + lba * BLOCK_SIZE, sizeof(host_buf)), "read-ahead error: data mismatch at lba %u", (unsigned) lba);
+  }
+
+  CHECK(fail_lba == UINT32_MAX, "read-ahead error: failing block never read");
+  fail_lba = UINT32_MAX;
+}
+#endif
+
+//--------------------------------------------------------------------+
+// 16-byte commands
+//--------------------------------------------------------------------+
+static void check_sense(uint8_t key, uint8_t asc, char const* what)
+{
+  uint8_t cdb[6] = { SCSI_CMD_REQUEST_SENSE, 0, 0, 0, sizeof(scsi_sense_fixed_resp_t), 0 };
+  scsi_sense_fixed_resp_t sense;
+
+  CHECK(host_command(cdb, sizeof(cdb), true, (uint8_t*) &sense, sizeof(sense)) == MSC_CSW_STATUS_PASSED, "%s: request sense failed", what);
+  CHECK(sense.sense_key == key && sense.add_sense_code == asc, "%s: sense %u/%02x, expected %u/%02x",
+        what, sense.sense_key, sense.add_sense_code, key, asc);
+}
+
+static void cdb16_test(void)
+{
+  // READ CAPACITY(16): 64-bit last lba and block size, truncated to the allocation length
+  uint8_t cdb[16] = { SCSI_CMD_SERVICE_ACTION_IN_16, SCSI_SERVICE_ACTION_READ_CAPACITY_16 };
+  uint8_t resp[32];
+
+  cdb[13] = sizeof(resp);
+  memset(resp, 0xAA, sizeof(resp));
+  CHECK(host_command(cdb, sizeof(cdb), true, resp, sizeof(resp)) == MSC_CSW_STATUS_PASSED, "read capacity16 failed");
+  CHECK(host.csw.data_residue == 0, "read capacity16 residue %u", (unsigned) host.csw.data_residue);
+
+  uint8_t const capa[12] = { 0, 0, 0, 0, 0, 0, (DISK_BLOCKS - 1) >> 8, (DISK_BLOCKS - 1) & 0xFF, 0, 0, BLOCK_SIZE >> 8, 0 };
+  CHECK(memcmp(resp, capa, sizeof(capa)) == 0, "read capacity16: last lba %02x%02x%02x%02x%02x%02x%02x%02x, block size %02x%02x%02x%02x",
+        resp[0], resp[1], resp[2], resp[3], resp[4], resp[5], resp[6], resp[7], resp[8], resp[9], resp[10], resp[11]);
+  for (unsigned i = sizeof(capa); i < sizeof(resp); i++) CHECK(resp[i] == 0, "read capacity16: byte %u is %02x", i, resp[i]);
+
+  cdb[13] = 12;
+  memset(resp, 0xAA, sizeof(resp));
+  CHECK(host_command(cdb, sizeof(cdb), true, resp, 12) == MSC_CSW_STATUS_PASSED, "short read capacity16 failed");
+  CHECK(memcmp(resp, capa, sizeof(capa)) == 0 && resp[12] == 0xAA, "short read capacity16 content");
+
+  // WRITE(16) then READ(16) of the same blocks
+  uint32_t const lba = 300, blocks = 20;
+
+  fill(host_buf, blocks * BLOCK_SIZE, 16);
+  CHECK(host_rdwr16(false, lba, blocks, host_buf) == MSC_CSW_STATUS_PASSED, "write16 failed");
+
+#if CFG_TUD_MSC_CACHE_LINES
+  uint8_t const sync[10] = { SCSI_CMD_SYNCHRONIZE_CACHE_10 };
+  CHECK(host_command(sync, sizeof(sync), false, NULL, 0) == MSC_CSW_STATUS_PASSED, "synchronize cache failed");
+#endif
+
+  CHECK(memcmp(disk + lba * BLOCK_SIZE, host_buf, blocks * BLOCK_SIZE) == 0, "write16 data differs");
+
+  memset(host_buf, 0, blocks * BLOCK_SIZE);
+  CHECK(host_rdwr16(true, lba, blocks, host_buf) == MSC_CSW_STATUS_PASSED, "read16 failed");
+  CHECK(memcmp(disk + lba * BLOCK_SIZE, host_buf, blocks * BLOCK_SIZE) == 0, "read16 data differs");
+
+  // LBA above 32 bits: failed without touching block lba & 0xFFFFFFFF, sense LBA out of range
+  uint64_t const far_lba = (1ull << 32) + lba;
+  uint8_t const before = disk[lba * BLOCK_SIZE];
+
+  CHECK(host_rdwr16(true, far_lba, 2, host_buf) == MSC_CSW_STATUS_FAILED, "read16 above 32-bit lba passed");
+  CHECK(host.csw.data_residue == 2 * BLOCK_SIZE, "read16 above 32-bit lba residue %u", (unsigned) host.csw.data_residue);
+  check_sense(SCSI_SENSE_ILLEGAL_REQUEST, 0x21, "read16 above 32-bit lba");
+
+  memset(host_buf, (uint8_t) ~before, 2 * BLOCK_SIZE);
+  CHECK(host_rdwr16(false, far_lba, 2, host_buf) == MSC_CSW_STATUS_FAILED, "write16 above 32-bit lba passed");
+  CHECK(host.csw.data_residue == 2 * BLOCK_SIZE, "write16 above 32-bit lba residue %u", (unsigned) host.csw.data_residue);
+  check_sense(SCSI_SENSE_ILLEGAL_REQUEST, 0x21, "write16 above 32-bit lba");
+  CHECK(disk[lba * BLOCK_SIZE] == before, "write16 above 32-bit lba wrapped to lba %u", (unsigned) lba);
+
+  // a command after the stalled one works again
+  CHECK(host_rdwr10(true, lba, 1, host_buf) == MSC_CSW_STATUS_PASSED, "read10 after rejected read16 failed");
+}
+
+#if CFG_TUD_MSC_CACHE_LINES
+
+static uint8_t expect[sizeof(disk)];
+
+static void check_disk(char const* what)
+{
+  for (uint32_t i = 0; i < sizeof(disk); i++)
+  {
+    if ( disk[i] != expect[i] )
+    {
+      printf("%s: disk differs at byte %u\n", what, (unsigned) i);
+      exit(1);
+    }
+  }
+}
+
+static void cache_write_blocks(uint32_t lba, uint16_t blocks, uint32_t seed)
+{
+  fill(host_buf, blocks * BLOCK_SIZE, seed);
+  if ( host_rdwr10(false, lba, blocks, host_buf) != MSC_CSW_STATUS_PASSED )
+  {
+    printf("write failed at lba %u\n", (unsigned) lba);
+    exit(1);
+  }
+  memcpy(expect + lba * BLOCK_SIZE, host_buf, blocks * BLOCK_SIZE);
+}
+
+static void cache_command(uint8_t const* cdb, uint8_t len, char const* what)
+{
+  if ( host_command(cdb, len, false, NULL, 0) != MSC_CSW_STATUS_PASSED )
+  {
+    printf("%s failed\n", what);
+    exit(1);
+  }
+}
+
+static void cache_test(void)
+{
+  uint8_t const sync[10]  = { SCSI_CMD_SYNCHRONIZE_CACHE_10 };
+  uint8_t const eject[6]  = { SCSI_CMD_START_STOP_UNIT, 0, 0, 0, 0x02, 0 };
+
+  memcpy(expect, disk, sizeof(disk));
+  wr_quirks = true;
+
+  // sequential: lines are evicted all the time
+  for (uint32_t lba = 0; lba < 2048; lba += XFER_BLOCKS) cache_write_blocks(lba, XFER_BLOCKS, lba);
+  cache_command(sync, sizeof(sync), "synchronize cache");
+  check_disk("sequential write");
+
+  // scattered single blocks within a few erase blocks, read back through the cache before write back
+  for (uint32_t i = 0; i < 200; i++) cache_write_blocks(4096 + (i * 37) % 40, 1, i);
+
+  for (uint32_t lba = 4096; lba < 4096 + 64; lba += 16)
+  {
+    if ( host_rdwr10(true, lba, 16, host_buf) != MSC_CSW_STATUS_PASSED ||
+         memcmp(host_buf, expect + lba * BLOCK_SIZE, 16 * BLOCK_SIZE) )
+    {
+      printf("read through cache differs at lba %u\n", (unsigned) lba);
+      exit(1);
+    }
+  }
+
+  cache_command(eject, sizeof(eject), "eject");
+  check_disk("scattered write");
+
+  // idle flush: written back without any command
+  cache_write_blocks(8000, 3, 77);
+  cache_write_blocks(9000, 5, 78);
+  tud_msc_cache_task(0);
+  tud_msc_cache_task(CFG_TUD_MSC_CACHE_IDLE_MS);
+  while ( event_count ) event_run();
+  check_disk("idle flush");
+
+  tud_msc_cache_stats_t stats;
+  tud_msc_cache_get_stats(&stats);
+
+  printf("cache (double buffer %d, %u byte buffer): OK, %u write backs, %u write callbacks\n",
+         CFG_TUD_MSC_DOUBLE_BUFFER, CFG_TUD_MSC_EP_BUFSIZE, (unsigned) stats.writebacks, (unsigned) stats.write_cbs);
+}
+
+#endif
+
+int main(int argc, char* argv[])
+{
+  double const bus_mbps   = (argc > 1) ? atof(argv[1]) : 13*512*8000 / 1e6; // high speed bulk, 13 packets per microframe
+  double const latency_us = (argc > 2) ? atof(argv[2]) : 20;
+  double const media_mbps = (argc > 3) ? atof(argv[3]) : 40;
+
+  bus_us_per_byte   = 1 / bus_mbps;
+  media_latency_us  = latency_us;
+  media_us_per_byte = (media_mbps > 0) ? 1 / media_mbps : 0;
+
+  static uint8_t const desc[] = { TUD_MSC_DESCRIPTOR(0, 0, EP_OUT, EP_IN, 512) };
+
+  mscd_init();
+  if ( mscd_open(0, (tusb_desc_interface_t const*) desc, sizeof(desc)) != sizeof(desc) )
+  {
+    printf("open failed\n");
+    return 1;
+  }
+
+  fill(disk, sizeof(disk), 0x5a);
+
+  cdb16_test();
+  if ( test_result("16-byte commands") ) return 1;
+
+#if CFG_TUD_MSC_CACHE_LINES
+  cache_test();
+  return 0;
+#endif
+
+  double const rd = sequential(true);
+
+#if CFG_TUD_MSC_READAHEAD_SIZE
+  rd_async = true;
+  double const rd_async_mbps = sequential(true);
+  rd_async = false;
+
+  tud_msc_readahead_stats_t stats;
+  tud_msc_readahead_get_stats(&stats);
+
+  printf("read-ahead %u: sync read %6.2f MB/s, async read %6.2f MB/s, %u prefetches, %u hits\n",
+         CFG_TUD_MSC_READAHEAD_SIZE, rd, rd_async_mbps, (unsigned) stats.prefetches, (unsigned) stats.hits);
+  // medium works while the bus transfers: close to the slower of both, not their sum
+  double const chunk_us = media_latency_us + CFG_TUD_MSC_EP_BUFSIZE * media_us_per_byte;
+  double const bound    = ((CFG_TUD_MSC_EP_BUFSIZE / chunk_us < bus_mbps) ? CFG_TUD_MSC_EP_BUFSIZE / chunk_us : bus_mbps);
+
+  CHECK(rd > 0.9 * bound, "sync read-ahead %.2f MB/s, expected close to %.2f", rd, bound);
+  CHECK(rd_async_mbps > 0.9 * bound, "async read-ahead %.2f MB/s, expected close to %.2f", rd_async_mbps, bound);
+
+  rd_async = true;
+  readahead_error();
+  rd_async = false;
+  readahead_error();
+
+  if ( test_result("read-ahead") ) return 1;
+#endif
+
+  double const wr = sequential(false);
+  read_error();
+
+  printf("double buffer %d: read %6.2f MB/s, write %6.2f MB/s (bus %.1f MB/s, media %.0f us + %.0f MB/s, %u byte buffer)\n",
+         CFG_TUD_MSC_DOUBLE_BUFFER, rd, wr, bus_mbps, latency_us, media_mbps, CFG_TUD_MSC_EP_BUFSIZE);
+
+  return 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * USB Attached SCSI harness for the MSC device driver.
+ *
+ * Unlike msc_ramdisk, the real usbd.c and usbd_control.c run on top of a mock DCD,
+ * so SET_INTERFACE closes and reopens endpoints the way it does on hardware: a
+ * transfer left pending on a closed endpoint must not keep it busy once reopened.
+ * The host enumerates, switches to the UAS alternate setting, queues several
+ * tagged commands and a task management request, then goes back to BOT and once
+ * more to UAS, checking every IU on the way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tusb.h"
+#include "device/dcd.h"
+#include "test_common.h"
+
+#define EP_BOT_OUT    0x01
+#define EP_BOT_IN     0x81  // also the UAS Data-In pipe
+#define EP_CMD        0x02
+#define EP_STATUS     0x82
+#define EP_DATA_OUT   0x03
+#define EP_SIZE       64
+
+#define BLOCK_SIZE    512
+#define DISK_BLOCKS   64
+
+static uint8_t disk[DISK_BLOCKS * BLOCK_SIZE];
+
+//--------------------------------------------------------------------+
+// Descriptors
+//--------------------------------------------------------------------+
+static tusb_desc_device_t const desc_device =
+{
+  .bLength            = sizeof(tusb_desc_device_t),
+  .bDescriptorType    = TUSB_DESC_DEVICE,
+  .bcdUSB             = 0x0200,
+  .bMaxPacketSize0    = CFG_TUD_ENDPOINT0_SIZE,
+  .idVendor           = 0xCafe,
+  .idProduct          = 0x4003,
+  .bNumConfigurations = 1
+};
+
+static uint8_t const desc_config[] =
+{
+  TUD_CONFIG_DESCRIPTOR(1, 1, 0, TUD_CONFIG_DESC_LEN + TUD_MSC_UAS_DESC_LEN, 0, 100),
+  TUD_MSC_UAS_DESCRIPTOR(0, 0, EP_BOT_OUT, EP_BOT_IN, EP_CMD, EP_STATUS, EP_DATA_OUT, EP_SIZE),
+};
+
+uint8_t const* tud_descriptor_device_cb(void)
+{
+  return (uint8_t const*) &desc_device;
+}
+
+uint8_t const* tud_descriptor_configuration_cb(uint8_t index)
+{
+  (void) index;
+  return desc_config;
+}
+
+uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+  (void) index; (void) langid;
+  return NULL;
+}
+
+//--------------------------------------------------------------------+
+// DCD mock, transfers wait until the host side completes them
+//--------------------------------------------------------------------+
+static struct
+{
+  uint8_t* buf;
+  uint16_t len;
+  bool     pending;
+  bool     open;
+  bool     stalled;
+} ep_state[8][2];
+
+#define EP_STATE(_addr)  ep_state[tu_edpt_number(_addr)][tu_edpt_dir(_addr)]
+
+void dcd_init(uint8_t rhport)                               { (void) rhport; }
+void dcd_int_enable(uint8_t rhport)                         { (void) rhport; }
+void dcd_int_disable(uint8_t rhport)                        { (void) rhport; }
+void dcd_remote_wakeup(uint8_t rhport)                      { (void) rhport; }
+
+// DCD sends the status stage itself, the new address applies once it is complete
+void dcd_set_address(uint8_t rhport, uint8_t dev_addr)
+{
+  (void) dev_addr;
+  dcd_edpt_xfer(rhport, 0x80, NULL, 0);
+}
+
+bool dcd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const * desc_ep)
+{
+  (void) rhport;
+  uint8_t const ep_addr = desc_ep->bEndpointAddress;
+
+  // BOT In and UAS Data-In share an address, the driver has to close one before opening the other
+  CHECK(!EP_STATE(ep_addr).open, "endpoint %02x opened twice", ep_addr);
+  EP_STATE(ep_addr).open = true;
+
+  return true;
+}
+
+void dcd_edpt_close(uint8_t rhport, uint8_t ep_addr)
+{
+  (void) rhport;
+  EP_STATE(ep_addr).open    = false;
+  EP_STATE(ep_addr).pending = false;  // transfer is abandoned, it never completes
+  EP_STATE(ep_addr).stalled = false;
+}
+
+bool dcd_edpt_xfer(uint8_t rhport, uint8_t ep_addr, uint8_t* buffer, uint16_t total_bytes)
+{
+  (void) rhport;
+
+  CHECK(tu_edpt_number(ep_addr) == 0 || EP_STATE(ep_addr).open, "transfer on closed endpoint %02x", ep_addr);
+  CHECK(!EP_STATE(ep_addr).pending, "endpoint %02x already has a transfer", ep_addr);
+
+  EP_STATE(ep_addr).buf     = buffer;
+  EP_STATE(ep_addr).len     = total_bytes;
+  EP_STATE(ep_addr).pending = true;
+
+  return true;
+}
+
+void dcd_edpt_stall(uint8_t rhport, uint8_t ep_addr)
+{
+  (void) rhport;
+  EP_STATE(ep_addr).stalled = true;
+}
+
+void dcd_edpt_clear_stall(uint8_t rhport, uint8_t ep_addr)
+{
+  (void) rhport;
+  EP_STATE(ep_addr).stalled = false;
+}
+
+//--------------------------------------------------------------------+
+// Host
+//--------------------------------------------------------------------+
+
+// Complete the transfer pending on an IN endpoint, return the number of bytes received
+static uint16_t host_in(uint8_t ep_addr, void* data, uint16_t max_len)
+{
+  if ( !EP_STATE(ep_addr).pending )
+  {
+    CHECK(false, "nothing to receive on %02x", ep_addr);
+    return 0;
+  }
+
+  uint16_t const len = tu_min16(EP_STATE(ep_addr).len, max_len);
+  if ( len ) memcpy(data, EP_STATE(ep_addr).buf, len);
+
+  EP_STATE(ep_addr).pending = false;
+  dcd_event_xfer_complete(0, ep_addr, len, XFER_RESULT_SUCCESS, false);
+  tud_task();
+
+  return len;
+}
+
+static void host_out(uint8_t ep_addr, void const* data, uint16_t len)
+{
+  if ( !EP_STATE(ep_addr).pending || EP_STATE(ep_addr).len < len )
+  {
+    CHECK(false, "endpoint %02x does not take %u bytes", ep_addr, len);
+    return;
+  }
+
+  if ( len ) memcpy(EP_STATE(ep_addr).buf, data, len);
+
+  EP_STATE(ep_addr).pending = false;
+  dcd_event_xfer_complete(0, ep_addr, len, XFER_RESULT_SUCCESS, false);
+  tud_task();
+}
+
+// Control transfer without data or with an IN data stage, false if the device stalls it
+static bool host_control(uint8_t bm_request_type, uint8_t request, uint16_t value, uint16_t index, void* data, uint16_t len)
+{
+  tusb_control_request_t const setup =
+  {
+    .bmRequestType = bm_request_type,
+    .bRequest      = request,
+    .wValue        = value,
+    .wIndex        = index,
+    .wLength       = len
+  };
+
+  dcd_event_setup_received(0, (uint8_t const*) &setup, false);
+  tud_task();
+
+  if ( EP_STATE(0x80).stalled || EP_STATE(0x00).stalled )
+  {
+    EP_STATE(0x80).stalled = EP_STATE(0x00).stalled = false;
+    EP_STATE(0x80).pending = EP_STATE(0x00).pending = false;
+    return false;
+  }
+
+  if ( len )
+  {
+    host_in(0x80, data, len);
+    host_out(0x00, NULL, 0);
+  }
+  else
+  {
+    host_in(0x80, NULL, 0);
+  }
+
+  return true;
+}
+
+static void set_interface(uint8_t alt)
+{
+  CHECK(host_control(0x01, TUSB_REQ_SET_INTERFACE, alt, 0, NULL, 0), "SET_INTERFACE %u stalled", alt);
+
+  uint8_t cur = 0xFF;
+  CHECK(host_control(0x81, TUSB_REQ_GET_INTERFACE, 0, 0, &cur, 1), "GET_INTERFACE stalled");
+  CHECK(cur == alt, "GET_INTERFACE %u, expected %u", cur, alt);
+}
+
+static void uas_send_cmd(uint16_t tag, uint8_t const* cdb, uint8_t cdb_len)
+{
+  msc_uas_command_iu_t iu;
+
+  tu_memclr(&iu, sizeof(iu));
+  iu.iu_id = MSC_UAS_IU_COMMAND;
+  iu.tag   = tu_htons(tag);
+  memcpy(iu.cdb, cdb, cdb_len);
+
+  host_out(EP_CMD, &iu, sizeof(iu));
+}
+
+static void uas_rdwr10(uint16_t tag, bool read, uint32_t lba, uint16_t blocks)
+{
+  uint8_t cdb[10] = { read ? SCSI_CMD_READ_10 : SCSI_CMD_WRITE_10 };
+  uint32_t const lba_be = tu_htonl(lba);
+  uint16_t const cnt_be = tu_htons(blocks);
+
+  memcpy(cdb + 2, &lba_be, 4);
+  memcpy(cdb + 7, &cnt_be, 2);
+  uas_send_cmd(tag, cdb, sizeof(cdb));
+}
+
+static void uas_rdwr16(uint16_t tag, bool read, uint64_t lba, uint32_t blocks)
+{
+  uint8_t cdb[16] = { read ? SCSI_CMD_READ_16 : SCSI_CMD_WRITE_16 };
+  uint32_t const lba_hi = tu_htonl((uint32_t) (lba >> 32));
+  uint32_t const lba_lo = tu_htonl((uint32_t) lba);
+  uint32_t const cnt_be = tu_htonl(blocks);
+
+  memcpy(cdb + 2, &lba_hi, 4);
+  memcpy(cdb + 6, &lba_lo, 4);
+  memcpy(cdb + 10, &cnt_be, 4);
+  uas_send_cmd(tag, cdb, sizeof(cdb));
+}
+
+// Next IU on the status pipe must be a Read/Write Ready of this tag
+static void uas_expect_ready(uint16_t tag, uint8_t iu_id)
+{
+  msc_uas_ready_iu_t ready;
+
+  tu_memclr(&ready, sizeof(ready));
+  host_in(EP_STATUS, &ready, sizeof(ready));
+  CHECK(ready.iu_id == iu_id && tu_ntohs(ready.tag) == tag, "expected ready IU %u of tag %u, got IU %u tag %u",
+        iu_id, tag, ready.iu_id, tu_ntohs(ready.tag));
+}
+
+// Next IU on the status pipe must be the Sense IU of this tag, with sense data if status is not good
+static void uas_expect_sense(uint16_t tag, uint8_t status, uint8_t sense_key, uint8_t asc)
+{
+  msc_uas_sense_iu_t sense;
+
+  tu_memclr(&sense, sizeof(sense));
+  host_in(EP_STATUS, &sense, sizeof(sense));
+  CHECK(sense.iu_id == MSC_UAS_IU_SENSE && tu_ntohs(sense.tag) == tag, "expected sense IU of tag %u, got IU %u tag %u",
+        tag, sense.iu_id, tu_ntohs(sense.tag));
+  CHECK(sense.status == status, "tag %u status %u, expected %u", tag, sense.status, status);
+
+  if ( status )
+  {
+    CHECK(sense.sense.sense_key == sense_key && sense.sense.add_sense_code == asc, "tag %u sense %u/%02x, expected %u/%02x",
+          tag, sense.sense.sense_key, sense.sense.add_sense_code, sense_key, asc);
+  }
+}
+
+static uint8_t host_buf[4 * BLOCK_SIZE];
+
+static void fill(uint8_t* buf, uint32_t len, uint32_t seed)
+{
+  for (uint32_t i = 0; i < len; i++) buf[i] = (uint8_t) ((i * 7 + seed) ^ (i >> 9));
+}
+
+// Plain BOT READ10 of one block, works only with alternate setting 0
+static void bot_read_block(uint32_t lba)
+{
+  msc_cbw_t cbw;
+  msc_csw_t csw;
+  uint32_t const lba_be = tu_htonl(lba);
+
+  tu_memclr(&cbw, sizeof(cbw));
+  cbw.signature   = MSC_CBW_SIGNATURE;
+  cbw.tag         = 0xB0B0;
+  cbw.total_bytes = BLOCK_SIZE;
+  cbw.dir         = TU_BIT(7);
+  cbw.cmd_len     = 10;
+  cbw.command[0]  = SCSI_CMD_READ_10;
+  cbw.command[8]  = 1;
+  memcpy(cbw.command + 2, &lba_be, 4);
+
+  host_out(EP_BOT_OUT, &cbw, sizeof(cbw));
+  CHECK(host_in(EP_BOT_IN, host_buf, BLOCK_SIZE) == BLOCK_SIZE, "BOT read: no data");
+  CHECK(memcmp(host_buf, disk + lba * BLOCK_SIZE, BLOCK_SIZE) == 0, "BOT read: data differs");
+
+  tu_memclr(&csw, sizeof(csw));
+  host_in(EP_BOT_IN, &csw, sizeof(csw));
+  CHECK(csw.signature == MSC_CSW_SIGNATURE && csw.tag == cbw.tag && csw.status == MSC_CSW_STATUS_PASSED, "BOT read: bad CSW");
+}
+
+//--------------------------------------------------------------------+
+// RAM disk callbacks
+//--------------------------------------------------------------------+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize)
+{
+  (void) lun;
+  if ( (uint64_t) lba * BLOCK_SIZE + offset + bufsize > sizeof(disk) ) return TUD_MSC_RET_ERROR;
+
+  memcpy(buffer, disk + lba * BLOCK_SIZE + offset, bufsize);
+  return (int32_t) bufsize;
+}
+
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize)
+{
+  (void) lun;
+  if ( (uint64_t) lba * BLOCK_SIZE + offset + bufsize > sizeof(disk) ) return TUD_MSC_RET_ERROR;
+
+  memcpy(disk + lba * BLOCK_SIZE + offset, buffer, bufsize);
+  return (int32_t) bufsize;
+}
+
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
+{
+  (void) lun;
+  memcpy(vendor_id, "TinyUSB", 7);
+  memcpy(product_id, "UAS disk", 8);
+  memcpy(product_rev, "1.0", 3);
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun)
+{
+  (void) lun;
+  return true;
+}
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size)
+{
+  (void) lun;
+  *block_count = DISK_BLOCKS;
+  *block_size  = BLOCK_SIZE;
+}
+
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize)
+{
+  (void) lun; (void) scsi_cmd; (void) buffer; (void) bufsize;
+  return -1;
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+static void test_enumerate(void)
+{
+  tusb_init();
+  dcd_event_bus_reset(0, TUSB_SPEED_FULL, false);
+  tud_task();
+
+  CHECK(host_control(0x00, TUSB_REQ_SET_ADDRESS, 5, 0, NULL, 0), "SET_ADDRESS stalled");
+  CHECK(host_control(0x00, TUSB_REQ_SET_CONFIGURATION, 1, 0, NULL, 0), "SET_CONFIGURATION stalled");
+  CHECK(tud_mounted(), "not mounted");
+
+  // BOT is the default, waiting for a CBW
+  CHECK(EP_STATE(EP_BOT_OUT).pending, "CBW not armed");
+  CHECK(!EP_STATE(EP_CMD).open && !EP_STATE(EP_STATUS).open, "UAS pipes open with alternate setting 0");
+
+  bot_read_block(3);
+}
+
+// Commands queued behind each other run in order, every IU carries the tag of its command
+static void test_queued_tags(void)
+{
+  uint8_t const tur[6] = { SCSI_CMD_TEST_UNIT_READY };
+
+  fill(host_buf, 2 * BLOCK_SIZE, 0x33);
+
+  // the first command starts right away, the others wait in the queue
+  uas_rdwr10(1, false, 10, 2);
+  uas_rdwr10(2, true, 10, 2);
+  uas_send_cmd(3, tur, sizeof(tur));
+
+  uas_expect_ready(1, MSC_UAS_IU_WRITE_READY);
+  host_out(EP_DATA_OUT, host_buf, 2 * BLOCK_SIZE);
+  uas_expect_sense(1, 0, 0, 0);
+  CHECK(memcmp(disk + 10 * BLOCK_SIZE, host_buf, 2 * BLOCK_SIZE) == 0, "tag 1: write differs");
+
+  uas_expect_ready(2, MSC_UAS_IU_READ_READY);
+  uint8_t rd[2 * BLOCK_SIZE];
+  CHECK(host_in(EP_BOT_IN, rd, sizeof(rd)) == sizeof(rd), "tag 2: short read");
+  CHECK(memcmp(rd, host_buf, sizeof(rd)) == 0, "tag 2: read differs");
+  uas_expect_sense(2, 0, 0, 0);
+
+  uas_expect_sense(3, 0, 0, 0);
+  CHECK(!EP_STATE(EP_STATUS).pending, "status IU without command");
+
+  // ABORT TASK drops a queued command, the running one completes before the response
+  uint8_t const* const expect = disk + 20 * BLOCK_SIZE;
+  msc_uas_task_mgmt_iu_t tm;
+
+  uas_rdwr10(4, true, 20, 1);
+  uas_send_cmd(5, tur, sizeof(tur));
+
+  tu_memclr(&tm, sizeof(tm));
+  tm.iu_id    = MSC_UAS_IU_TASK_MGMT;
+  tm.tag      = tu_htons(6);
+  tm.function = MSC_UAS_TMF_ABORT_TASK;
+  tm.task_tag = tu_htons(5);
+  host_out(EP_CMD, &tm, sizeof(tm));
+
+  uas_expect_ready(4, MSC_UAS_IU_READ_READY);
+  CHECK(host_in(EP_BOT_IN, rd, BLOCK_SIZE) == BLOCK_SIZE && memcmp(rd, expect, BLOCK_SIZE) == 0, "tag 4: read differs");
+  uas_expect_sense(4, 0, 0, 0);
+
+  msc_uas_response_iu_t resp;
+  tu_memclr(&resp, sizeof(resp));
+  host_in(EP_STATUS, &resp, sizeof(resp));
+  CHECK(resp.iu_id == MSC_UAS_IU_RESPONSE && tu_ntohs(resp.tag) == 6 && resp.response_code == MSC_UAS_RESPONSE_TMF_COMPLETE,
+        "abort task: IU %u tag %u response %u", resp.iu_id, tu_ntohs(resp.tag), resp.response_code);
+  CHECK(!EP_STATE(EP_STATUS).pending, "aborted tag 5 still ran");
+}
+
+static void test_cmd16(void)
+{
+  // 8M blocks of 512 bytes is 4 GiB, it does not fit the 32-bit length of the data phase
+  uas_rdwr16(7, true, 0, 0x800000);
+  uas_expect_sense(7, 2, SCSI_SENSE_ILLEGAL_REQUEST, 0x24);
+
+  uas_rdwr16(8, false, 0, 0x800001);
+  uas_expect_sense(8, 2, SCSI_SENSE_ILLEGAL_REQUEST, 0x24);
+
+  // LBA above 32 bits: data phase is announced, then the command fails without data
+  uas_rdwr16(9, true, (1ull << 32) + 1, 1);
+  uas_expect_ready(9, MSC_UAS_IU_READ_READY);
+  uas_expect_sense(9, 2, SCSI_SENSE_ILLEGAL_REQUEST, 0x21);
+  CHECK(!EP_STATE(EP_BOT_IN).pending, "tag 9: data sent");
+
+  // READ(16) within range
+  uas_rdwr16(10, true, 10, 2);
+  uas_expect_ready(10, MSC_UAS_IU_READ_READY);
+  CHECK(host_in(EP_BOT_IN, host_buf, 2 * BLOCK_SIZE) == 2 * BLOCK_SIZE &&
+        memcmp(host_buf, disk + 10 * BLOCK_SIZE, 2 * BLOCK_SIZE) == 0, "tag 10: read differs");
+  uas_expect_sense(10, 0, 0, 0);
+}
+
+int main(void)
+{
+  fill(disk, sizeof(disk), 0x5a);
+
+  test_enumerate();
+
+  set_interface(1);
+  CHECK(EP_STATE(EP_CMD).pending, "command pipe not armed");
+  CHECK(!EP_STATE(EP_BOT_OUT).open, "BOT Out still open with alternate setting 1");
+
+  test_queued_tags();
+  test_cmd16();
+
+  // back to BOT while the command pipe waits for an IU: the BOT endpoints are reopened and usable
+  set_interface(0);
+  CHECK(!EP_STATE(EP_CMD).open && !EP_STATE(EP_STATUS).open && !EP_STATE(EP_DATA_OUT).open, "UAS pipes still open");
+  CHECK(EP_STATE(EP_BOT_OUT).pending, "CBW not armed after switching back");
+  bot_read_block(5);
+
+  // and UAS once more, the command pipe closed with a transfer pending takes a new one
+  set_interface(1);
+  CHECK(EP_STATE(EP_CMD).pending, "command pipe not armed after reopen");
+  uas_rdwr10(11, true, 5, 1);
+  uas_expect_ready(11, MSC_UAS_IU_READ_READY);
+  CHECK(host_in(EP_BOT_IN, host_buf, BLOCK_SIZE) == BLOCK_SIZE && memcmp(host_buf, disk + 5 * BLOCK_SIZE, BLOCK_SIZE) == 0,
+        "tag 11: read differs");
+  uas_expect_sense(11, 0, 0, 0);
+
+  return test_result("uas");
+}
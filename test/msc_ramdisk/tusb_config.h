@@ -0,0 +1,17 @@
+/* Host harness configuration: MSC device driver only, run without a DCD */
+#ifndef _TUSB_CONFIG_H_
+#define _TUSB_CONFIG_H_
+
+#define CFG_TUSB_MCU              OPT_MCU_NONE
+#define CFG_TUSB_RHPORT0_MODE     OPT_MODE_DEVICE
+#define CFG_TUSB_OS               OPT_OS_NONE
+#define CFG_TUSB_MEM_ALIGN        __attribute__ ((aligned(4)))
+
+#define CFG_TUD_ENDPOINT0_SIZE    64
+#define CFG_TUD_MSC               1
+
+#ifndef CFG_TUD_MSC_EP_BUFSIZE
+#define CFG_TUD_MSC_EP_BUFSIZE    4096
+#endif
+
+#endif
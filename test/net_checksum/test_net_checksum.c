@@ -0,0 +1,276 @@
+/*
+ * Host test and benchmark of the internet checksum helpers (net_checksum.c).
+ *
+ * Three kernels sum the same buffers: a halfword loop as the reference, the
+ * 32-bit word loop and netd_csum_add(), which unrolls that loop four words at
+ * a time. Results are checked against each other at every start alignment,
+ * then the throughput of each kernel is printed for typical frame sizes.
+ * netd_csum_fill() and netd_csum_verify() are checked on UDP and TCP frames.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tusb.h"
+#include "test_common.h"
+
+//--------------------------------------------------------------------+
+// Kernels
+//--------------------------------------------------------------------+
+
+// reference: one halfword per iteration, memory order
+static uint32_t csum_halfword(void const* data, uint16_t len, uint32_t sum)
+{
+  uint8_t const* pb = (uint8_t const*) data;
+  uint32_t acc = 0;
+
+  while ( len >= 2 )
+  {
+    uint16_t h;
+    memcpy(&h, pb, 2);
+    acc += h;
+    pb  += 2;
+    len -= 2;
+  }
+
+  if ( len )
+  {
+    uint16_t t = 0;
+    ((uint8_t*) &t)[0] = *pb;
+    acc += t;
+  }
+
+  return sum + netd_csum_fold(acc);
+}
+
+// netd_csum_add() without the unrolled loop: one 32-bit word per iteration
+#define CSUM_WORD(_w)   ( ((_w) & 0xFFFFu) + ((_w) >> 16) )
+
+static uint32_t csum_word(void const* data, uint16_t len, uint32_t sum)
+{
+  uint8_t const* pb = (uint8_t const*) data;
+  uint32_t acc = 0;
+  uint16_t t = 0;
+  bool const odd = ((uintptr_t) pb) & 1;
+
+  if ( odd && len )
+  {
+    ((uint8_t*) &t)[1] = *pb++;
+    len--;
+  }
+
+  if ( (((uintptr_t) pb) & 2) && len >= 2 )
+  {
+    acc += *((uint16_t const*) ((void const*) pb));
+    pb  += 2;
+    len -= 2;
+  }
+
+  uint32_t const* pw = (uint32_t const*) ((void const*) pb);
+
+  while ( len >= 4 )
+  {
+    acc += CSUM_WORD(*pw);
+    pw++;
+    len -= 4;
+  }
+
+  pb = (uint8_t const*) pw;
+
+  if ( len >= 2 )
+  {
+    acc += *((uint16_t const*) ((void const*) pb));
+    pb  += 2;
+    len -= 2;
+  }
+
+  if ( len ) ((uint8_t*) &t)[0] = *pb;
+  acc += t;
+
+  uint16_t folded = netd_csum_fold(acc);
+  if ( odd ) folded = (uint16_t) ((folded << 8) | (folded >> 8));
+
+  return sum + folded;
+}
+
+typedef uint32_t (*csum_kernel_t)(void const* data, uint16_t len, uint32_t sum);
+
+static struct
+{
+  char const*   name;
+  csum_kernel_t func;
+} const kernels[] =
+{
+  { "halfword", csum_halfword },
+  { "word"    , csum_word     },
+  { "unrolled", netd_csum_add },
+};
+
+#define KERNEL_COUNT  (sizeof(kernels) / sizeof(kernels[0]))
+
+// ones-complement equality, 0x0000 and 0xFFFF are both zero
+static bool csum_equal(uint16_t a, uint16_t b)
+{
+  return (a == b) || ((a == 0 || a == 0xFFFF) && (b == 0 || b == 0xFFFF));
+}
+
+static uint32_t rng = 0x2545F491;
+
+static uint8_t random_byte(void)
+{
+  rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+  return (uint8_t) rng;
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+static uint8_t buf[2048 + 8] __attribute__ ((aligned(8)));
+
+static void test_kernels(void)
+{
+  printf("kernels:\n");
+
+  for (unsigned it = 0; it < 20000; it++)
+  {
+    unsigned const off = random_byte() % 8;
+    uint16_t const len = (uint16_t) ((random_byte() << 8 | random_byte()) % 1600);
+
+    // all ones exercises the end around carry
+    for (unsigned i = 0; i < len; i++) buf[off + i] = (it % 3) ? random_byte() : 0xFF;
+
+    uint16_t const ref = netd_csum_fold(csum_halfword(buf + off, len, 0));
+
+    for (unsigned k = 1; k < KERNEL_COUNT; k++)
+    {
+      uint16_t const got = netd_csum_fold(kernels[k].func(buf + off, len, 0));
+      CHECK(csum_equal(got, ref), "%s offset %u len %u: %04x, expected %04x", kernels[k].name, off, len, got, ref);
+    }
+  }
+
+  // a sum split at any even offset gives the same result
+  for (uint16_t len = 0; len < 200; len += 2)
+  {
+    uint16_t const whole = netd_inet_chksum(buf + 1, len);
+    for (uint16_t k = 0; k <= len; k += 2)
+    {
+      uint32_t const sum = netd_csum_add(buf + 1 + k, (uint16_t) (len - k), netd_csum_add(buf + 1, k, 0));
+      CHECK(netd_csum_fold(sum) == whole, "split %u of %u", k, len);
+    }
+  }
+}
+
+static void test_frames(void)
+{
+  printf("frames:\n");
+
+  for (unsigned tcp = 0; tcp < 2; tcp++)
+  {
+    for (unsigned off = 0; off < 4; off++)
+    {
+      uint8_t* frame = buf + off;
+      uint16_t const l4_hlen = tcp ? 20 : 8;
+      uint16_t const l4_len  = (uint16_t) (l4_hlen + 1 + random_byte());
+      uint16_t const ip_len  = (uint16_t) (20 + l4_len);
+      uint16_t const len     = (uint16_t) (14 + ip_len);
+
+      memset(frame, 0, 14);
+      frame[12] = 0x08;  // IPv4
+
+      uint8_t* ip = frame + 14;
+      memset(ip, 0, 20);
+      ip[0] = 0x45;
+      ip[2] = (uint8_t) (ip_len >> 8);
+      ip[3] = (uint8_t) ip_len;
+      ip[8] = 64;
+      ip[9] = tcp ? 6 : 17;
+      memcpy(ip + 12, "\xC0\xA8\x07\x01\xC0\xA8\x07\x02", 8);
+
+      uint8_t* l4 = ip + 20;
+      for (unsigned i = 0; i < l4_len; i++) l4[i] = random_byte();
+      if ( tcp )
+      {
+        l4[12] = 0x50;  // data offset 5 words
+      }else
+      {
+        l4[4] = (uint8_t) (l4_len >> 8);
+        l4[5] = (uint8_t) l4_len;
+      }
+
+      CHECK(netd_csum_fill(frame, len), "%s offset %u not filled", tcp ? "TCP" : "UDP", off);
+      CHECK(csum_equal(netd_inet_chksum(ip, 20), 0xFFFF), "IP header checksum");
+      CHECK(netd_csum_verify(frame, len), "%s offset %u does not verify", tcp ? "TCP" : "UDP", off);
+
+      l4[l4_hlen] ^= 1;
+      CHECK(!netd_csum_verify(frame, len), "%s payload error not detected", tcp ? "TCP" : "UDP");
+      l4[l4_hlen] ^= 1;
+
+      ip[8]--;
+      CHECK(!netd_csum_verify(frame, len), "IP header error not detected");
+    }
+  }
+}
+
+//--------------------------------------------------------------------+
+// Benchmark
+//--------------------------------------------------------------------+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// MB/s of a kernel summing 'len' bytes at 'off' repeatedly, best of 5 runs of 32 MB
+static double bench(csum_kernel_t func, unsigned off, uint16_t len)
+{
+  uint32_t const rounds = 32 * 1024 * 1024 / len;
+  volatile uint32_t sink = 0;
+  double best = 0;
+
+  for (unsigned run = 0; run < 5; run++)
+  {
+    double const t0 = now_sec();
+    for (uint32_t r = 0; r < rounds; r++) sink = func(buf + off, len, sink & 0xFFFF);
+    double const mbps = (double) rounds * len / (now_sec() - t0) / 1e6;
+
+    if ( mbps > best ) best = mbps;
+  }
+
+  return best;
+}
+
+static void benchmark(void)
+{
+  static uint16_t const sizes[] = { 64, 576, 1514 };
+
+  for (unsigned i = 0; i < sizeof(buf); i++) buf[i] = random_byte();
+
+  printf("throughput MB/s:\n  size offset");
+  for (unsigned k = 0; k < KERNEL_COUNT; k++) printf(" %9s", kernels[k].name);
+  printf("\n");
+
+  for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+  {
+    // offset 2: IP header behind the 14 byte Ethernet header in a word aligned buffer
+    static unsigned const offsets[] = { 0, 2, 1 };
+
+    for (unsigned o = 0; o < 3; o++)
+    {
+      printf("  %4u %6u", sizes[s], offsets[o]);
+      for (unsigned k = 0; k < KERNEL_COUNT; k++) printf(" %9.0f", bench(kernels[k].func, offsets[o], sizes[s]));
+      printf("\n");
+    }
+  }
+}
+
+int main(void)
+{
+  test_kernels();
+  test_frames();
+  benchmark();
+
+  return test_result("net_checksum");
+}
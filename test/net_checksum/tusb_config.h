@@ -0,0 +1,12 @@
+/* Host benchmark configuration: checksum helpers of the network driver only */
+#ifndef _TUSB_CONFIG_H_
+#define _TUSB_CONFIG_H_
+
+#define CFG_TUSB_MCU              OPT_MCU_NONE
+#define CFG_TUSB_RHPORT0_MODE     OPT_MODE_DEVICE
+#define CFG_TUSB_OS               OPT_OS_NONE
+
+#define CFG_TUD_ENDPOINT0_SIZE    64
+#define CFG_TUD_NET               1
+
+#endif
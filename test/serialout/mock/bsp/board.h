@@ -0,0 +1,11 @@
+/* Host mock of the board API used by serialout.c */
+#ifndef BOARD_MOCK_H
+#define BOARD_MOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+uint32_t board_millis(void);
+void board_led_write(bool state);
+
+#endif
@@ -0,0 +1,2 @@
+/* Host mock of the STM32 device header, see stm32f1xx_hal.h */
+#include "stm32f1xx_hal.h"
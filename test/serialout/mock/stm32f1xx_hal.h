@@ -0,0 +1,123 @@
+/*
+ * Minimal host mock of the STM32F1 HAL used by serialout.c.
+ * DMA transfers are recorded, completion and reception are driven by the test.
+ */
+
+#ifndef STM32F1XX_HAL_MOCK_H
+#define STM32F1XX_HAL_MOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum { HAL_OK = 0, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT } HAL_StatusTypeDef;
+typedef enum { HAL_UART_STATE_READY = 0x20, HAL_UART_STATE_BUSY_RX = 0x22 } HAL_UART_StateTypeDef;
+typedef int IRQn_Type;
+
+typedef struct
+{
+  uint32_t Direction, PeriphInc, MemInc, PeriphDataAlignment, MemDataAlignment, Mode, Priority;
+} DMA_InitTypeDef;
+
+typedef struct
+{
+  void*           Instance;
+  DMA_InitTypeDef Init;
+
+  // mock state: remaining count (CNDTR) and transfer complete flag
+  uint16_t        counter;
+  uint32_t        tc_flag;
+} DMA_HandleTypeDef;
+
+typedef struct
+{
+  uint32_t BaudRate, WordLength, StopBits, Parity, Mode, HwFlowCtl, OverSampling;
+} UART_InitTypeDef;
+
+typedef struct
+{
+  void*                   Instance;
+  UART_InitTypeDef        Init;
+  DMA_HandleTypeDef*      hdmatx;
+  DMA_HandleTypeDef*      hdmarx;
+  volatile uint32_t       RxState;
+} UART_HandleTypeDef;
+
+typedef struct
+{
+  uint32_t Pin, Mode, Pull, Speed;
+} GPIO_InitTypeDef;
+
+// peripherals and constants, values are irrelevant
+extern int mock_periph[8];
+#define USART1                  ((void*) &mock_periph[0])
+#define GPIOA                   ((void*) &mock_periph[1])
+#define DMA1_Channel4           ((void*) &mock_periph[2])
+#define DMA1_Channel5           ((void*) &mock_periph[3])
+#define USART1_IRQn             37
+#define DMA1_Channel4_IRQn      14
+#define DMA1_Channel5_IRQn      15
+
+#define UART_WORDLENGTH_8B      0
+#define UART_STOPBITS_1         0
+#define UART_PARITY_NONE        0
+#define UART_HWCONTROL_NONE     0
+#define UART_MODE_TX_RX         0x0C
+#define UART_OVERSAMPLING_16    0
+
+#define GPIO_PIN_9              (1u << 9)
+#define GPIO_PIN_10             (1u << 10)
+#define GPIO_MODE_AF_PP         2
+#define GPIO_MODE_INPUT         0
+#define GPIO_PULLUP             1
+#define GPIO_SPEED_FREQ_HIGH    3
+
+#define DMA_MEMORY_TO_PERIPH    0x10
+#define DMA_PERIPH_TO_MEMORY    0
+#define DMA_PINC_DISABLE        0
+#define DMA_MINC_ENABLE         0x80
+#define DMA_PDATAALIGN_BYTE     0
+#define DMA_MDATAALIGN_BYTE     0
+#define DMA_NORMAL              0
+#define DMA_CIRCULAR            0x20
+#define DMA_PRIORITY_LOW        0
+#define DMA_PRIORITY_HIGH       0x2000
+#define DMA_IT_HT               0x04
+
+#define __HAL_RCC_USART1_FORCE_RESET()
+#define __HAL_RCC_USART1_RELEASE_RESET()
+#define __HAL_RCC_USART1_CLK_ENABLE()
+#define __HAL_RCC_DMA1_CLK_ENABLE()
+#define __HAL_RCC_GPIOA_CLK_ENABLE()
+
+#define __HAL_LINKDMA(_h, _field, _dma)      do { (_h)->_field = &(_dma); } while(0)
+#define __HAL_DMA_DISABLE_IT(_h, _it)        ((void) (_h))
+#define __HAL_DMA_GET_COUNTER(_h)            ((_h)->counter)
+#define __HAL_DMA_GET_TC_FLAG_INDEX(_h)      1u
+#define __HAL_DMA_GET_FLAG(_h, _flag)        ((_h)->tc_flag & (_flag))
+
+static inline uint32_t __get_PRIMASK(void) { return 0; }
+static inline void __set_PRIMASK(uint32_t m) { (void) m; }
+static inline void __disable_irq(void) { }
+
+void HAL_NVIC_SetPriority(IRQn_Type irq, uint32_t prio, uint32_t sub);
+void HAL_NVIC_EnableIRQ(IRQn_Type irq);
+void HAL_GPIO_Init(void* port, GPIO_InitTypeDef* init);
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef* hdma);
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef* hdma);
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef* huart);
+HAL_StatusTypeDef HAL_HalfDuplex_Init(UART_HandleTypeDef* huart);
+HAL_StatusTypeDef HAL_HalfDuplex_EnableTransmitter(UART_HandleTypeDef* huart);
+HAL_StatusTypeDef HAL_HalfDuplex_EnableReceiver(UART_HandleTypeDef* huart);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef* huart);
+void HAL_UART_IRQHandler(UART_HandleTypeDef* huart);
+
+// implemented by serialout.c
+void HAL_UART_MspInit(UART_HandleTypeDef* huart);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef* huart);
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef* huart, uint16_t size);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef* huart);
+
+#endif
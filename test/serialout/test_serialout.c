@@ -0,0 +1,391 @@
+/*
+ * Host test of the serialout DMA transmit queue.
+ *
+ * The STM32 HAL is mocked: HAL_UART_Transmit_DMA records the transfer and the
+ * test plays the DMA complete interrupt by calling HAL_UART_TxCpltCallback.
+ * Reception writes into the circular buffer and moves the DMA counter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+#include "bsp/board.h"
+#include "serialout.h"
+#include "test_common.h"
+
+//--------------------------------------------------------------------+
+// Mock HAL
+//--------------------------------------------------------------------+
+int mock_periph[8];
+
+extern UART_HandleTypeDef UartHandle;
+extern uint8_t aRxBuffer[SERIAL_RX_BUFSIZE];
+
+static struct
+{
+  int      tx_calls;         // HAL_UART_Transmit_DMA invocations
+  uint8_t* tx_ptr;           // transfer in progress
+  uint16_t tx_len;
+  bool     tx_busy;
+  bool     transmitter;      // single wire direction
+  int      rx_starts;
+
+  uint8_t  wire[8192];       // everything sent so far, in order
+  size_t   wire_len;
+} hal;
+
+void HAL_NVIC_SetPriority(IRQn_Type irq, uint32_t prio, uint32_t sub) { (void) irq; (void) prio; (void) sub; }
+void HAL_NVIC_EnableIRQ(IRQn_Type irq) { (void) irq; }
+void HAL_GPIO_Init(void* port, GPIO_InitTypeDef* init) { (void) port; (void) init; }
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef* hdma) { (void) hdma; return HAL_OK; }
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef* hdma) { (void) hdma; }
+void HAL_UART_IRQHandler(UART_HandleTypeDef* huart) { (void) huart; }
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef* huart)
+{
+  HAL_UART_MspInit(huart);
+  huart->RxState = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_HalfDuplex_Init(UART_HandleTypeDef* huart) { (void) huart; return HAL_OK; }
+
+HAL_StatusTypeDef HAL_HalfDuplex_EnableTransmitter(UART_HandleTypeDef* huart)
+{
+  (void) huart;
+  hal.transmitter = true;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_HalfDuplex_EnableReceiver(UART_HandleTypeDef* huart)
+{
+  (void) huart;
+  hal.transmitter = false;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size)
+{
+  (void) huart;
+  if (hal.tx_busy || size == 0) return HAL_BUSY;
+
+  hal.tx_calls++;
+  hal.tx_ptr  = data;
+  hal.tx_len  = size;
+  hal.tx_busy = true;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size)
+{
+  (void) data;
+  huart->RxState = HAL_UART_STATE_BUSY_RX;
+  huart->hdmarx->counter = size;
+  huart->hdmarx->tc_flag = 0;
+  hal.rx_starts++;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef* huart)
+{
+  huart->RxState = HAL_UART_STATE_READY;
+  return HAL_OK;
+}
+
+uint32_t board_millis(void) { static uint32_t ms; return ms++; }
+void board_led_write(bool state) { (void) state; }
+
+// DMA finished the current transfer: move the bytes onto the wire and raise the interrupt
+static void dma_tx_complete(void)
+{
+  if (!hal.tx_busy) { fprintf(stderr, "no transfer in progress\n"); exit(1); }
+
+  memcpy(hal.wire + hal.wire_len, hal.tx_ptr, hal.tx_len);
+  hal.wire_len += hal.tx_len;
+  hal.tx_busy = false;
+
+  HAL_UART_TxCpltCallback(&UartHandle);
+}
+
+// Target sends len bytes: circular DMA writes them, the transfer complete
+// flag is raised on wrap-around. The interrupt is serviced only if irq is set.
+static uint8_t rx_seq;
+
+static void dma_rx(size_t len, bool irq)
+{
+  DMA_HandleTypeDef* hdma = UartHandle.hdmarx;
+
+  while (len--)
+  {
+    uint16_t pos = SERIAL_RX_BUFSIZE - hdma->counter;
+    aRxBuffer[pos] = rx_seq++;
+    if (--hdma->counter == 0)
+    {
+      hdma->counter = SERIAL_RX_BUFSIZE;
+      hdma->tc_flag = 1;
+      if (irq)
+      {
+        hdma->tc_flag = 0;
+        HAL_UARTEx_RxEventCallback(&UartHandle, SERIAL_RX_BUFSIZE);
+      }
+    }
+  }
+}
+
+// Pending transfer complete interrupt runs
+static void dma_rx_irq(void)
+{
+  DMA_HandleTypeDef* hdma = UartHandle.hdmarx;
+  if (hdma->tc_flag)
+  {
+    hdma->tc_flag = 0;
+    HAL_UARTEx_RxEventCallback(&UartHandle, SERIAL_RX_BUFSIZE);
+  }
+}
+
+// Read count bytes through peek/consume, checking they continue the sequence
+static bool read_seq(uint8_t* expect, uint16_t count)
+{
+  bool ok = true;
+  while (count)
+  {
+    uint8_t const* data;
+    uint16_t n = serial_receive_peek(&data);
+    if (n == 0) return false;
+    if (n > count) n = count;
+    for (uint16_t i = 0; i < n; i++) ok = ok && (data[i] == (*expect)++);
+    serial_receive_consume(n);
+    count -= n;
+  }
+  return ok;
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+static void setup(void)
+{
+  memset(&hal, 0, sizeof(hal));
+  serial_init();
+}
+
+static void fill(uint8_t* buf, size_t len, uint8_t seed)
+{
+  for (size_t i = 0; i < len; i++) buf[i] = (uint8_t) (seed + i);
+}
+
+static void test_single_send(void)
+{
+  setup();
+  uint8_t line[10];
+  fill(line, sizeof(line), 1);
+
+  CHECK(serial_send_idle());
+  CHECK(!hal.transmitter);
+
+  CHECK(serial_send(line, sizeof(line)) == sizeof(line));
+  CHECK(hal.tx_calls == 1);
+  CHECK(hal.tx_len == sizeof(line));
+  CHECK(hal.transmitter);
+  CHECK(!serial_send_idle());
+
+  dma_tx_complete();
+  CHECK(hal.tx_calls == 1);
+  CHECK(serial_send_idle());
+  CHECK(!hal.transmitter);  // wire handed back for the response
+  CHECK(hal.wire_len == sizeof(line) && memcmp(hal.wire, line, sizeof(line)) == 0);
+  CHECK(serial_send_available() == SERIAL_TX_BUFSIZE);
+}
+
+static void test_chaining(void)
+{
+  setup();
+  uint8_t a[100], b[50], c[30];
+  fill(a, sizeof(a), 0x10);
+  fill(b, sizeof(b), 0x80);
+  fill(c, sizeof(c), 0xc0);
+
+  CHECK(serial_send(a, sizeof(a)) == sizeof(a));
+  // queued while DMA is busy, no new transfer
+  CHECK(serial_send(b, sizeof(b)) == sizeof(b));
+  CHECK(serial_send(c, sizeof(c)) == sizeof(c));
+  CHECK(hal.tx_calls == 1);
+  CHECK(hal.tx_len == sizeof(a));
+
+  // completion chains everything queued meanwhile in one transfer
+  dma_tx_complete();
+  CHECK(hal.tx_calls == 2);
+  CHECK(hal.tx_len == sizeof(b) + sizeof(c));
+  CHECK(hal.transmitter);
+  CHECK(!serial_send_idle());
+
+  dma_tx_complete();
+  CHECK(hal.tx_calls == 2);
+  CHECK(serial_send_idle());
+  CHECK(!hal.transmitter);
+
+  uint8_t expect[sizeof(a) + sizeof(b) + sizeof(c)];
+  memcpy(expect, a, sizeof(a));
+  memcpy(expect + sizeof(a), b, sizeof(b));
+  memcpy(expect + sizeof(a) + sizeof(b), c, sizeof(c));
+  CHECK(hal.wire_len == sizeof(expect) && memcmp(hal.wire, expect, sizeof(expect)) == 0);
+}
+
+static void test_wrap_around(void)
+{
+  setup();
+  static uint8_t a[SERIAL_TX_BUFSIZE - 100], b[300];
+  fill(a, sizeof(a), 3);
+  fill(b, sizeof(b), 7);
+
+  CHECK(serial_send(a, sizeof(a)) == sizeof(a));
+  dma_tx_complete();
+  CHECK(serial_send_idle());
+
+  // queue wraps at the buffer end: sent as two chained transfers
+  CHECK(serial_send(b, sizeof(b)) == sizeof(b));
+  CHECK(hal.tx_len == 100);
+  dma_tx_complete();
+  CHECK(hal.tx_len == 200);
+  CHECK(hal.transmitter);
+  dma_tx_complete();
+  CHECK(hal.tx_calls == 3);
+  CHECK(serial_send_idle());
+
+  CHECK(hal.wire_len == sizeof(a) + sizeof(b));
+  CHECK(memcmp(hal.wire + sizeof(a), b, sizeof(b)) == 0);
+}
+
+static void test_queue_full(void)
+{
+  setup();
+  static uint8_t a[SERIAL_TX_BUFSIZE - 10], b[20];
+  fill(a, sizeof(a), 0);
+  fill(b, sizeof(b), 0);
+
+  CHECK(serial_send(a, sizeof(a)) == sizeof(a));
+  CHECK(serial_send_available() == 10);
+
+  // all or nothing
+  CHECK(serial_send(b, sizeof(b)) == 0);
+  CHECK(serial_send_available() == 10);
+  CHECK(serial_send(b, 10) == 10);
+  CHECK(serial_send_available() == 0);
+
+  dma_tx_complete();
+  CHECK(hal.tx_len == 10);
+  CHECK(serial_send_available() == SERIAL_TX_BUFSIZE - 10);
+  dma_tx_complete();
+  CHECK(serial_send_idle());
+  CHECK(hal.wire_len == SERIAL_TX_BUFSIZE);
+}
+
+static void test_baudrate_while_busy(void)
+{
+  setup();
+  uint8_t line[8] = { 0 };
+
+  CHECK(serial_send(line, sizeof(line)) == sizeof(line));
+  CHECK(!serial_set_baudrate(115200));
+  CHECK(serial_get_baudrate() == SERIAL_DEFAULT_BAUDRATE);
+
+  dma_tx_complete();
+  CHECK(serial_set_baudrate(115200));
+  CHECK(serial_get_baudrate() == 115200);
+  CHECK(!serial_set_baudrate(SERIAL_MAX_BAUDRATE + 1));
+}
+
+static void test_receive_wrap(void)
+{
+  setup();
+  rx_seq = 0;
+  uint8_t expect = 0;
+  uint32_t const errors = serial_error_count();
+
+  CHECK(serial_receive_available() == 0);
+
+  dma_rx(SERIAL_RX_BUFSIZE - 10, true);
+  CHECK(serial_receive_available() == SERIAL_RX_BUFSIZE - 10);
+  CHECK(read_seq(&expect, SERIAL_RX_BUFSIZE - 20));
+
+  // wraps around, split into two linear parts
+  dma_rx(30, true);
+  CHECK(serial_receive_available() == 40);
+  uint8_t const* data;
+  CHECK(serial_receive_peek(&data) == 20);
+  CHECK(read_seq(&expect, 40));
+  CHECK(serial_receive_available() == 0);
+
+  // completely full buffer is not an overrun
+  dma_rx(SERIAL_RX_BUFSIZE, true);
+  CHECK(serial_receive_available() == SERIAL_RX_BUFSIZE);
+  CHECK(read_seq(&expect, SERIAL_RX_BUFSIZE));
+  CHECK(serial_error_count() == errors);
+}
+
+static void test_receive_overrun(void)
+{
+  setup();
+  rx_seq = 0;
+  uint8_t expect = 0;
+  uint32_t const errors = serial_error_count();
+
+  dma_rx(100, true);
+  CHECK(read_seq(&expect, 50));
+
+  // DMA laps the reader: the 50 unread bytes and more are overwritten
+  dma_rx(SERIAL_RX_BUFSIZE + 5, true);
+  CHECK(serial_receive_available() == 0);
+  CHECK(serial_error_count() == errors + 1);
+
+  // resynced to the DMA position, new data reads fine
+  expect = rx_seq;
+  dma_rx(10, true);
+  CHECK(serial_receive_available() == 10);
+  CHECK(read_seq(&expect, 10));
+  CHECK(serial_error_count() == errors + 1);
+}
+
+static void test_receive_wrap_irq_pending(void)
+{
+  setup();
+  rx_seq = 0;
+  uint8_t expect = 0;
+  uint32_t const errors = serial_error_count();
+
+  dma_rx(SERIAL_RX_BUFSIZE - 4, true);
+  CHECK(read_seq(&expect, SERIAL_RX_BUFSIZE - 8));
+
+  // wrapped, transfer complete interrupt not serviced yet
+  dma_rx(6, false);
+  CHECK(serial_receive_available() == 10);
+  CHECK(read_seq(&expect, 6));
+  dma_rx_irq();
+  CHECK(serial_receive_available() == 4);
+  CHECK(read_seq(&expect, 4));
+
+  // overrun detected while the interrupt is still pending
+  dma_rx(SERIAL_RX_BUFSIZE - 3, true);
+  dma_rx(10, false);
+  CHECK(serial_receive_available() == 0);
+  CHECK(serial_error_count() == errors + 1);
+  dma_rx_irq();
+  CHECK(serial_receive_available() == 0);
+  CHECK(serial_error_count() == errors + 1);
+}
+
+int main(void)
+{
+  test_single_send();
+  test_chaining();
+  test_wrap_around();
+  test_queue_full();
+  test_baudrate_while_busy();
+  test_receive_wrap();
+  test_receive_overrun();
+  test_receive_wrap_irq_pending();
+
+  return test_result("serialout");
+}
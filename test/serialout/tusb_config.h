@@ -0,0 +1,8 @@
+/* Host test configuration: only the fifo of the stack is used */
+#ifndef _TUSB_CONFIG_H_
+#define _TUSB_CONFIG_H_
+
+#define CFG_TUSB_MCU          OPT_MCU_NONE
+#define CFG_TUSB_OS           OPT_OS_NONE
+
+#endif
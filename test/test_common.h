@@ -0,0 +1,48 @@
+/*
+ * Shared helpers of the host tests: failure counting and reporting.
+ *
+ *   CHECK(cond);                          prints the condition if it is false
+ *   CHECK(cond, "got %u", value);         prints the printf style message instead
+ *   return test_result("name");           prints "name: OK" or "name: FAILED", exit status
+ */
+
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+static int failures;
+
+static inline void test_fail(char const* file, int line, char const* cond, char const* fmt, ...)
+{
+  printf("  FAIL %s:%d: ", file, line);
+
+  if ( fmt )
+  {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+  }
+  else
+  {
+    printf("CHECK(%s)", cond);
+  }
+
+  printf("\n");
+  failures++;
+}
+
+// the message is optional, a trailing NULL stands in for it when it is left out
+#define CHECK(...)           CHECK_IMPL(__VA_ARGS__, NULL)
+#define CHECK_IMPL(_cond, ...) \
+  do { if ( !(_cond) ) test_fail(__FILE__, __LINE__, #_cond, __VA_ARGS__); } while (0)
+
+static inline int test_result(char const* name)
+{
+  printf("%s: %s\n", name, failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ * Host test of lib/vfat: the generated volume is mounted with lib/fatfs, the
+ * directory and the content of every file are checked against the file table.
+ * Runs once with a FAT12 and once with a FAT16 sized volume.
+ *
+ * Write detection is fed sector writes the way hosts issue them: file data
+ * before its directory entry, the directory entry before the data, and
+ * rewrites of a root sector that lists files reported already.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vfat.h"
+#include "ff.h"
+#include "diskio.h"
+#include "test_common.h"
+
+#define ARRAY_SIZE(_a)  (sizeof(_a) / sizeof((_a)[0]))
+
+//--------------------------------------------------------------------+
+// Files
+//--------------------------------------------------------------------+
+static char const readme[] = "Virtual FAT volume generated by lib/vfat\r\n";
+
+static uint8_t pattern_at(uint32_t offset)
+{
+  return (uint8_t) ((offset * 7) ^ (offset >> 9));
+}
+
+static void pattern_cb(vfat_file_t const* file, uint32_t offset, uint8_t* buffer, uint32_t len)
+{
+  (void) file;
+  for (uint32_t i = 0; i < len; i++) buffer[i] = pattern_at(offset + i);
+}
+
+static vfat_file_t const files[] =
+{
+  { .name = "README.TXT"   , .size = sizeof(readme) - 1, .data = readme },
+  { .name = "FIRMWARE.BIN" , .size = 100000            , .read_cb = pattern_cb },  // many clusters
+  { .name = "EMPTY.DAT"    , .size = 0 },
+  { .name = "ZERO.BIN"     , .size = 1537 },                                        // zero filled
+  { .name = "LONGNAME1.TXT", .size = 512               , .read_cb = pattern_cb },  // truncated to 8.3
+};
+
+static char const* const names[] = { "README.TXT", "FIRMWARE.BIN", "EMPTY.DAT", "ZERO.BIN", "LONGNAME.TXT" };
+
+static uint8_t expected_at(uint16_t idx, uint32_t offset)
+{
+  vfat_file_t const* f = &files[idx];
+  if ( f->data    ) return ((uint8_t const*) f->data)[offset];
+  if ( f->read_cb ) return pattern_at(offset);
+  return 0;
+}
+
+//--------------------------------------------------------------------+
+// Disk I/O for fatfs, sectors come from vfat_read10()
+//--------------------------------------------------------------------+
+static vfat_t vfat;
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+  (void) pdrv;
+  return 0;
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+  (void) pdrv;
+  return 0;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE* buff, DWORD sector, BYTE count)
+{
+  (void) pdrv;
+
+  // odd split of the sectors exercises partial reads
+  uint32_t const total = count * VFAT_SECTOR_SIZE;
+  uint32_t done = 0;
+
+  while ( done < total )
+  {
+    uint32_t const pos    = done % VFAT_SECTOR_SIZE;
+    uint32_t const chunk  = (pos == 0) ? 300 : VFAT_SECTOR_SIZE - pos;
+    uint32_t const len    = (total - done < chunk) ? total - done : chunk;
+    int32_t  const nbytes = vfat_read10(&vfat, sector + done / VFAT_SECTOR_SIZE, pos, buff + done, len);
+
+    if ( nbytes <= 0 ) return RES_ERROR;
+    done += (uint32_t) nbytes;
+  }
+
+  return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE* buff, DWORD sector, BYTE count)
+{
+  (void) pdrv; (void) buff; (void) sector; (void) count;
+  return RES_WRPRT;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+  (void) pdrv;
+
+  switch ( cmd )
+  {
+    case CTRL_SYNC       : return RES_OK;
+    case GET_SECTOR_COUNT: *(DWORD*) buff = vfat_block_count(&vfat); return RES_OK;
+    case GET_SECTOR_SIZE : *(WORD*) buff  = VFAT_SECTOR_SIZE;        return RES_OK;
+    default              : return RES_PARERR;
+  }
+}
+
+DWORD get_fattime(void)
+{
+  return 0;
+}
+
+//--------------------------------------------------------------------+
+// Tests
+//--------------------------------------------------------------------+
+static void test_volume(uint32_t sector_count, bool fat16)
+{
+  static vfat_config_t cfg;
+
+  cfg = (vfat_config_t)
+  {
+    .label        = "TINYUSB",
+    .volume_id    = 0x12345678,
+    .sector_count = sector_count,
+    .files        = files,
+    .file_count   = ARRAY_SIZE(files),
+  };
+
+  printf("%u sectors:\n", (unsigned) sector_count);
+
+  CHECK(vfat_init(&vfat, &cfg), "vfat_init failed");
+  CHECK(vfat.fat16 == fat16, "expected FAT%d", fat16 ? 16 : 12);
+
+  static FATFS fs;
+  CHECK(f_mount(0, &fs) == FR_OK, "mount failed");
+
+  // volume
+  DWORD nfree = 0;
+  FATFS* pfs;
+  CHECK(f_getfree("", &nfree, &pfs) == FR_OK, "getfree failed");
+  CHECK(fs.fs_type == (fat16 ? FS_FAT16 : FS_FAT12), "fatfs sees type %u", fs.fs_type);
+  CHECK(nfree == vfat.cluster_count - (vfat.free_cluster - 2), "free clusters %u, expected %u",
+        (unsigned) nfree, (unsigned) (vfat.cluster_count - (vfat.free_cluster - 2)));
+
+  TCHAR label[12];
+  DWORD sn = 0;
+  CHECK(f_getlabel("", label, &sn) == FR_OK, "getlabel failed");
+  CHECK(strcmp(label, cfg.label) == 0, "label '%s'", label);
+  CHECK(sn == cfg.volume_id, "volume id %08x", (unsigned) sn);
+
+  // root directory lists the files in table order, nothing else
+  DIR dir;
+  FILINFO fno;
+  char lfn[64];
+  uint16_t count = 0;
+
+  fno.lfname = lfn;
+  fno.lfsize = sizeof(lfn);
+
+  CHECK(f_opendir(&dir, "/") == FR_OK, "opendir failed");
+  while ( f_readdir(&dir, &fno) == FR_OK && fno.fname[0] )
+  {
+    if ( count < ARRAY_SIZE(files) )
+    {
+      CHECK(strcmp(fno.fname, names[count]) == 0, "entry %u is '%s', expected '%s'", count, fno.fname, names[count]);
+      CHECK(fno.fsize == files[count].size, "%s size %u", fno.fname, (unsigned) fno.fsize);
+      CHECK(!(fno.fattrib & AM_DIR), "%s is a directory", fno.fname);
+    }
+    count++;
+  }
+  CHECK(count == ARRAY_SIZE(files), "%u directory entries", count);
+
+  // content
+  for (uint16_t i = 0; i < ARRAY_SIZE(files); i++)
+  {
+    static uint8_t buf[4096];
+    FIL fil;
+    char path[20];
+    uint32_t offset = 0;
+    UINT br;
+
+    snprintf(path, sizeof(path), "/%s", names[i]);
+    CHECK(f_open(&fil, path, FA_READ) == FR_OK, "open %s failed", path);
+
+    do
+    {
+      CHECK(f_read(&fil, buf, sizeof(buf), &br) == FR_OK, "read %s failed", path);
+
+      for (UINT k = 0; k < br; k++)
+      {
+        if ( buf[k] != expected_at(i, offset + k) )
+        {
+          CHECK(false, "%s differs at %u", path, (unsigned) (offset + k));
+          break;
+        }
+      }
+      offset += br;
+    } while ( br == sizeof(buf) );
+
+    CHECK(offset == files[i].size, "%s read %u bytes", path, (unsigned) offset);
+    f_close(&fil);
+  }
+
+  f_mount(0, NULL);
+}
+
+//--------------------------------------------------------------------+
+// Write detection
+//--------------------------------------------------------------------+
+static struct
+{
+  uint8_t  name[11];
+  uint32_t offset;
+  uint32_t size;
+  unsigned count;
+} reported;
+
+static uint32_t written;
+
+static void write_cb(vfat_t* v, uint32_t offset, uint8_t const* data, uint32_t len)
+{
+  (void) v; (void) data;
+  if ( offset + len > written ) written = offset + len;
+}
+
+static void file_cb(vfat_t* v, uint8_t const name[11], uint32_t offset, uint32_t size)
+{
+  (void) v;
+  memcpy(reported.name, name, 11);
+  reported.offset = offset;
+  reported.size   = size;
+  reported.count++;
+}
+
+// host writes the sectors holding 'size' bytes from the start of free cluster 'idx'
+static void write_file_data(uint32_t idx, uint32_t size)
+{
+  static uint8_t const sector[VFAT_SECTOR_SIZE];
+  uint32_t const lba = vfat.data_start + (vfat.free_cluster - 2 + idx) * vfat.sec_per_cluster;
+
+  for (uint32_t i = 0; i < (size + VFAT_SECTOR_SIZE - 1) / VFAT_SECTOR_SIZE; i++)
+  {
+    CHECK(vfat_write10(&vfat, lba + i, 0, sector, VFAT_SECTOR_SIZE) == VFAT_SECTOR_SIZE, "data write failed");
+  }
+}
+
+// add a file at free cluster 'idx' to the root sector image and write the whole sector
+static void write_root_entry(uint8_t* root, char const name[11], uint32_t idx, uint32_t size)
+{
+  uint8_t* entry = root;
+  while ( entry[0] ) entry += 32;
+
+  uint32_t const cluster = vfat.free_cluster + idx;
+
+  memset(entry, 0, 32);
+  memcpy(entry, name, 11);
+  entry[11] = 0x20;  // archive
+  entry[20] = (uint8_t) (cluster >> 16); entry[21] = (uint8_t) (cluster >> 24);
+  entry[26] = (uint8_t) cluster;         entry[27] = (uint8_t) (cluster >> 8);
+  entry[28] = (uint8_t) size;            entry[29] = (uint8_t) (size >> 8);
+  entry[30] = (uint8_t) (size >> 16);    entry[31] = (uint8_t) (size >> 24);
+
+  // in two writes as with a 64 byte endpoint buffer
+  CHECK(vfat_write10(&vfat, vfat.root_start, 0, root, 192) == 192, "root write failed");
+  CHECK(vfat_write10(&vfat, vfat.root_start, 192, root + 192, VFAT_SECTOR_SIZE - 192) == VFAT_SECTOR_SIZE - 192, "root write failed");
+}
+
+static void test_write(uint32_t sector_count)
+{
+  static uint8_t write_map[16], report_map[16];
+  static vfat_config_t cfg;
+
+  cfg = (vfat_config_t)
+  {
+    .label          = "TINYUSB",
+    .sector_count   = sector_count,
+    .files          = files,
+    .file_count     = ARRAY_SIZE(files),
+    .write_map      = write_map,
+    .write_map_size = sizeof(write_map),
+    .report_map     = report_map,
+    .write_cb       = write_cb,
+    .file_cb        = file_cb,
+  };
+
+  memset(write_map, 0, sizeof(write_map));
+  memset(report_map, 0, sizeof(report_map));
+  memset(&reported, 0, sizeof(reported));
+  written = 0;
+
+  printf("%u sectors, writes:\n", (unsigned) sector_count);
+  CHECK(vfat_init(&vfat, &cfg), "vfat_init failed");
+
+  uint32_t const csize = vfat.sec_per_cluster * VFAT_SECTOR_SIZE;
+  uint32_t const a_size = 2 * csize + 700;  // last cluster partly used
+  uint32_t const b_idx  = 3;
+  uint32_t const b_size = csize + 1;
+
+  uint8_t root[VFAT_SECTOR_SIZE];
+  CHECK(vfat_read10(&vfat, vfat.root_start, 0, root, sizeof(root)) == sizeof(root), "root read failed");
+
+  // data first: reported once the directory entry shows up
+  write_file_data(0, a_size);
+  CHECK(written == (a_size + VFAT_SECTOR_SIZE - 1) / VFAT_SECTOR_SIZE * VFAT_SECTOR_SIZE, "write_cb saw %u bytes", (unsigned) written);
+  CHECK(reported.count == 0, "reported before the directory entry");
+
+  write_root_entry(root, "FIRST   BIN", 0, a_size);
+  CHECK(reported.count == 1, "data first: %u reports", reported.count);
+  CHECK(memcmp(reported.name, "FIRST   BIN", 11) == 0, "data first: name");
+  CHECK(reported.offset == 0 && reported.size == a_size, "data first: offset %u size %u", (unsigned) reported.offset, (unsigned) reported.size);
+
+  // directory first: the sector now lists both files, only the new one is pending
+  write_root_entry(root, "SECOND  BIN", b_idx, b_size);
+  CHECK(reported.count == 1, "directory first: reported before its data");
+
+  write_file_data(b_idx, b_size);
+  CHECK(reported.count == 2, "directory first: %u reports", reported.count);
+  CHECK(memcmp(reported.name, "SECOND  BIN", 11) == 0, "directory first: name");
+  CHECK(reported.offset == b_idx * csize && reported.size == b_size, "directory first: offset %u size %u",
+        (unsigned) reported.offset, (unsigned) reported.size);
+
+  // host rewrites the root sector again, e.g. to update access dates
+  CHECK(vfat_write10(&vfat, vfat.root_start, 0, root, sizeof(root)) == sizeof(root), "root write failed");
+  CHECK(reported.count == 2, "root rewrite: %u reports", reported.count);
+}
+
+int main(void)
+{
+  test_volume(4096, false);    // 2 MiB
+  test_volume(65536, true);    // 32 MiB
+
+  test_write(4096);
+  test_write(65536);
+
+  return test_result("vfat");
+}
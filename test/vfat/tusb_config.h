@@ -0,0 +1,8 @@
+/* Host test configuration: lib/fatfs reads the volume generated by lib/vfat */
+#ifndef _TUSB_CONFIG_H_
+#define _TUSB_CONFIG_H_
+
+#define CFG_TUH_MSC                 1
+#define CFG_TUSB_HOST_DEVICE_MAX    1
+
+#endif
@@ -4,8 +4,15 @@
   document.addEventListener('DOMContentLoaded', event => {
     let connectButton = document.querySelector("#connect");
     let statusDisplay = document.querySelector('#status');
+    let framedCheckbox = document.querySelector('#framed');
+    let baudSelect = document.querySelector('#baudrate');
+    let statsDisplay = document.querySelector('#stats');
     let port;
 
+    // Pipelined mode: lines are sent as frames without waiting for the device reply
+    let sender = null;
+    let parser = null;
+
     function addLine(linesId, text) {
       var senderLine = document.createElement("div");
       senderLine.className = 'line';
@@ -25,12 +32,17 @@
       currentReceiverLine.innerHTML =  currentReceiverLine.innerHTML + t;
     }
 
+    // Resolves once the port is open and receiving, rejects if it could not be opened
     function connect() {
-      port.connect().then(() => {
+      return port.connect().then(() => {
         statusDisplay.textContent = '';
         connectButton.textContent = 'Disconnect';
 
         port.onReceive = data => {
+          if (parser) {
+            parser.push(data);
+            return;
+          }
           let textDecoder = new TextDecoder();
           console.log(textDecoder.decode(data));
           if (data.getInt8() === 13) {
@@ -42,21 +54,68 @@
         port.onReceiveError = error => {
           console.error(error);
         };
+      });
+    }
+
+    function setFramed(enabled) {
+      if (!port) return;
+      port.setFramedMode(enabled).then(() => {
+        if (enabled) {
+          sender = new frame.Sender(port);
+          parser = new frame.Parser((type, seq, payload) => {
+            if (!sender.onFrame(type, seq, payload)) {
+              addLine('receiver_lines', new TextDecoder().decode(payload));
+            }
+          });
+        } else {
+          sender = null;
+          parser = null;
+        }
+      }, error => {
+        statusDisplay.textContent = error;
+        framedCheckbox.checked = false;
+      });
+    }
+
+    framedCheckbox.addEventListener('change', function() {
+      setFramed(framedCheckbox.checked);
+    });
+
+    const baudStatusText = ['ok', 'switching', 'invalid rate', 'probe failed', 'too many errors'];
+
+    function pollBaudRate() {
+      port.getBaudRate().then(result => {
+        if (result.status === 1) {
+          setTimeout(pollBaudRate, 50);
+          return;
+        }
+        baudSelect.value = result.baudRate;
+        statusDisplay.textContent = result.baudRate + ' baud: ' + baudStatusText[result.status];
       }, error => {
         statusDisplay.textContent = error;
       });
     }
 
+    baudSelect.addEventListener('change', function() {
+      if (!port) return;
+      port.setBaudRate(parseInt(baudSelect.value), true).then(pollBaudRate, error => {
+        statusDisplay.textContent = error;
+      });
+    });
+
     connectButton.addEventListener('click', function() {
       if (port) {
         port.disconnect();
+        sender = null;
+        parser = null;
+        framedCheckbox.checked = false;
         connectButton.textContent = 'Connect';
         statusDisplay.textContent = '';
         port = null;
       } else {
         serial.requestPort().then(selectedPort => {
           port = selectedPort;
-          connect();
+          return connect();
         }).catch(error => {
           statusDisplay.textContent = error;
         });
@@ -69,14 +128,131 @@
       } else {
         statusDisplay.textContent = 'Connecting...';
         port = ports[0];
-        connect();
+        connect().catch(error => {
+          statusDisplay.textContent = error;
+        });
       }
     });
 
 
+    // Throughput and latency, refreshed every second
+    let lastStats = null;
+    setInterval(() => {
+      if (!port) {
+        statsDisplay.textContent = '';
+        lastStats = null;
+        return;
+      }
+      let stats = port.stats;
+      if (lastStats) {
+        statsDisplay.textContent =
+          'RX ' + ((stats.rxBytes - lastStats.rxBytes) / 1024).toFixed(1) + ' KiB/s (' +
+          (stats.rxTransfers - lastStats.rxTransfers) + ' transfers/s), ' +
+          'TX ' + ((stats.txBytes - lastStats.txBytes) / 1024).toFixed(1) + ' KiB/s (' +
+          (stats.txTransfers - lastStats.txTransfers) + ' transfers/s), ' +
+          'TX latency ' + stats.txLatencyMs.toFixed(1) + ' ms';
+      }
+      lastStats = Object.assign({}, stats);
+    }, 1000);
+
+    // File upload: the image is streamed as DATA frames. If the browser exposes WebUSB
+    // to workers the transfer runs there so page rendering can't stall USB I/O, the
+    // page releases the device for the duration of the upload.
+    let uploadButton = document.querySelector('#upload');
+    let uploadFile = document.querySelector('#upload_file');
+    let uploadProgress = document.querySelector('#upload_progress');
+    let uploadStatus = document.querySelector('#upload_status');
+    let uploading = false;
+
+    function showUploadProgress(progress) {
+      uploadProgress.max = progress.total || 1;
+      uploadProgress.value = progress.acked;
+      uploadStatus.textContent =
+        progress.acked + ' / ' + progress.total + ' bytes, ' +
+        (progress.bytesPerSec / 1024).toFixed(1) + ' KiB/s, ' +
+        progress.retransmits + ' retransmits';
+    }
+
+    function uploadInWorker(worker, bytes) {
+      let device = port.getDevice();
+      return port.disconnect().then(() => new Promise((resolve, reject) => {
+        worker.onmessage = event => {
+          let msg = event.data;
+          if (msg.type === 'progress') showUploadProgress(msg);
+          if (msg.type === 'done') resolve();
+          if (msg.type === 'error') reject(msg.message);
+        };
+        worker.postMessage({
+          'cmd': 'start',
+          'vendorId': device.vendorId,
+          'productId': device.productId,
+          'serialNumber': device.serialNumber,
+          'bytes': bytes.buffer,
+          'chunkSize': frame.MAX_PAYLOAD
+        }, [bytes.buffer]);
+      })).then(() => connect(), error => {
+        // reconnect anyway, the upload error is the one reported
+        let rethrow = () => { throw error; };
+        return connect().then(rethrow, rethrow);
+      });
+    }
+
+    function probeWorker() {
+      if (!window.Worker) return Promise.resolve(null);
+      return new Promise(resolve => {
+        let worker;
+        try {
+          worker = new Worker('upload_worker.js');
+        } catch (error) {
+          resolve(null);
+          return;
+        }
+        worker.onerror = () => resolve(null);
+        worker.onmessage = event => resolve(event.data.usb ? worker : (worker.terminate(), null));
+        worker.postMessage({ 'cmd': 'probe' });
+      });
+    }
+
+    uploadButton.addEventListener('click', function() {
+      if (!port || uploading || uploadFile.files.length === 0) return;
+      uploading = true;
+      sender = null;
+      parser = null;
+      framedCheckbox.checked = false;
+
+      let bytes;
+      uploadFile.files[0].arrayBuffer().then(buffer => {
+        bytes = new Uint8Array(buffer);
+        return probeWorker();
+      }).then(worker => {
+        if (worker) {
+          uploadStatus.textContent = 'Uploading (worker)...';
+          return uploadInWorker(worker, bytes).finally(() => worker.terminate());
+        }
+        uploadStatus.textContent = 'Uploading...';
+        return upload.run(port, bytes, frame.MAX_PAYLOAD, showUploadProgress);
+      }).then(() => {
+        uploadStatus.textContent += ', done';
+      }, error => {
+        uploadStatus.textContent = 'Upload failed: ' + error;
+      }).finally(() => {
+        uploading = false;
+      });
+    });
+
     let commandLine = document.getElementById("command_line");
 
     commandLine.addEventListener("keypress", function(event) {
+      if (sender) {
+        // whole line goes out as one frame
+        if (event.keyCode === 13 && commandLine.value.length > 0) {
+          addLine('sender_lines', commandLine.value);
+          sender.send(new TextEncoder('utf-8').encode(commandLine.value));
+          commandLine.value = '';
+        }
+        return;
+      }
+
       if (event.keyCode === 13) {
         if (commandLine.value.length > 0) {
           addLine('sender_lines', commandLine.value);
@@ -88,5 +264,17 @@
 
       port.send(new TextEncoder('utf-8').encode(String.fromCharCode(event.which || event.keyCode)));
     });
+
+    // In pipelined mode pasted text is streamed line by line, all frames are queued at once
+    commandLine.addEventListener("paste", function(event) {
+      if (!sender) return;
+      let lines = event.clipboardData.getData('text').split(/\r?\n/).filter(line => line.length > 0);
+      if (lines.length < 2) return;
+      event.preventDefault();
+      lines.forEach(line => {
+        addLine('sender_lines', line);
+        sender.send(new TextEncoder('utf-8').encode(line));
+      });
+    });
   });
 })();
\ No newline at end of file
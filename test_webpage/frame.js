@@ -0,0 +1,205 @@
+var frame = {};
+
+(function() {
+  'use strict';
+
+  // Must match vendor_frame.h on the device
+  frame.SOF = 0xA5;
+  frame.TYPE_DATA = 0x01;
+  frame.TYPE_ACK = 0x02;
+  frame.TYPE_NAK = 0x03;
+  frame.HEADER_SIZE = 5;
+  frame.CRC_SIZE = 2;
+  frame.MAX_PAYLOAD = 256;
+
+  // CRC-16/CCITT-FALSE
+  frame.crc16 = function(crc, bytes, start, end) {
+    for (let i = start; i < end; i++) {
+      crc ^= bytes[i] << 8;
+      for (let b = 0; b < 8; b++) {
+        crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+      }
+      crc &= 0xFFFF;
+    }
+    return crc;
+  };
+
+  frame.encode = function(type, seq, payload) {
+    let len = payload.length;
+    let bytes = new Uint8Array(frame.HEADER_SIZE + len + frame.CRC_SIZE);
+    bytes[0] = frame.SOF;
+    bytes[1] = type;
+    bytes[2] = seq & 0xFF;
+    bytes[3] = len & 0xFF;
+    bytes[4] = len >> 8;
+    bytes.set(payload, frame.HEADER_SIZE);
+    let crc = frame.crc16(0xFFFF, bytes, 1, frame.HEADER_SIZE + len);
+    bytes[frame.HEADER_SIZE + len] = crc & 0xFF;
+    bytes[frame.HEADER_SIZE + len + 1] = crc >> 8;
+    return bytes;
+  };
+
+  // Incremental parser for frames received from the device.
+  // onFrame(type, seq, payload) is invoked for every frame with a valid CRC.
+  frame.Parser = function(onFrame) {
+    this.buffer_ = new Uint8Array(0);
+    this.onFrame = onFrame;
+  };
+
+  frame.Parser.prototype.push = function(data) {
+    let incoming = new Uint8Array(data.buffer, data.byteOffset, data.byteLength);
+    let buffer = new Uint8Array(this.buffer_.length + incoming.length);
+    buffer.set(this.buffer_);
+    buffer.set(incoming, this.buffer_.length);
+
+    let pos = 0;
+    while (pos < buffer.length) {
+      if (buffer[pos] !== frame.SOF) {
+        pos++;
+        continue;
+      }
+      if (buffer.length - pos < frame.HEADER_SIZE) break;
+
+      let len = buffer[pos + 3] | (buffer[pos + 4] << 8);
+      if (len > frame.MAX_PAYLOAD) {
+        pos++;
+        continue;
+      }
+
+      let total = frame.HEADER_SIZE + len + frame.CRC_SIZE;
+      if (buffer.length - pos < total) break;
+
+      let crc = frame.crc16(0xFFFF, buffer, pos + 1, pos + frame.HEADER_SIZE + len);
+      let frameCrc = buffer[pos + total - 2] | (buffer[pos + total - 1] << 8);
+      if (crc !== frameCrc) {
+        pos++;
+        continue;
+      }
+
+      this.onFrame(buffer[pos + 1], buffer[pos + 2],
+                   buffer.slice(pos + frame.HEADER_SIZE, pos + frame.HEADER_SIZE + len));
+      pos += total;
+    }
+
+    this.buffer_ = buffer.slice(pos);
+  };
+
+  // Sliding window sender: keeps up to `window` DATA frames in flight and
+  // releases them on cumulative ACKs. A NAK resends everything after the
+  // sequence number the device expects (go-back-N).
+  // Gives up after maxRetries timeouts in a row or when a transfer fails.
+  frame.Sender = function(port) {
+    this.port_ = port;
+    this.window = 4;        // updated from every ACK/NAK
+    this.timeoutMs = 1000;  // resend if nothing is acknowledged for that long
+    this.maxRetries = 5;    // consecutive timeouts before giving up
+    this.timeouts_ = 0;
+    this.failed_ = false;
+    this.nextSeq_ = 0;
+    this.baseSeq_ = 0;
+    this.inflight_ = [];    // encoded frames not acknowledged yet, oldest first
+    this.queue_ = [];       // payloads waiting for window space
+    this.timer_ = null;
+    this.sentFrames = 0;
+    this.sentBytes = 0;
+    this.ackedBytes = 0;
+    this.retransmits = 0;
+    this.onDrain = null;    // invoked when all queued frames are acknowledged
+    this.onError = null;    // invoked once with the reason when giving up
+  };
+
+  frame.Sender.prototype.send = function(payload) {
+    if (this.failed_) return;
+    for (let pos = 0; pos < payload.length || pos === 0; pos += frame.MAX_PAYLOAD) {
+      this.queue_.push(payload.slice(pos, pos + frame.MAX_PAYLOAD));
+    }
+    this.pump_();
+  };
+
+  frame.Sender.prototype.pending = function() {
+    return this.queue_.length + this.inflight_.length;
+  };
+
+  frame.Sender.prototype.pump_ = function() {
+    while (this.inflight_.length < this.window && this.queue_.length > 0) {
+      let payload = this.queue_.shift();
+      let bytes = frame.encode(frame.TYPE_DATA, this.nextSeq_, payload);
+      this.inflight_.push(bytes);
+      this.nextSeq_ = (this.nextSeq_ + 1) & 0xFF;
+      this.sentFrames++;
+      this.sentBytes += payload.length;
+      this.transmit_(bytes);
+    }
+    this.armTimer_();
+  };
+
+  frame.Sender.prototype.transmit_ = function(bytes) {
+    this.port_.send(bytes).catch(error => this.abort(error));
+  };
+
+  frame.Sender.prototype.armTimer_ = function() {
+    clearTimeout(this.timer_);
+    this.timer_ = null;
+    if (this.inflight_.length > 0 && !this.failed_) {
+      this.timer_ = setTimeout(() => this.timeout_(), this.timeoutMs);
+    }
+  };
+
+  frame.Sender.prototype.timeout_ = function() {
+    this.timer_ = null;
+    if (++this.timeouts_ > this.maxRetries) {
+      this.abort(new Error('No response from device'));
+      return;
+    }
+    this.resend_();
+  };
+
+  frame.Sender.prototype.resend_ = function() {
+    this.inflight_.forEach(bytes => {
+      this.retransmits++;
+      this.transmit_(bytes);
+    });
+    this.armTimer_();
+  };
+
+  // Stop sending: drops everything pending, stops the resend timer and reports
+  // error through onError. Without error this is a silent cancel.
+  frame.Sender.prototype.abort = function(error) {
+    if (this.failed_) return;
+    this.failed_ = true;
+    clearTimeout(this.timer_);
+    this.timer_ = null;
+    this.queue_ = [];
+    this.inflight_ = [];
+    if (error && this.onError) this.onError(error);
+  };
+
+  frame.Sender.prototype.acknowledge_ = function(expected, window) {
+    let acked = (expected - this.baseSeq_) & 0xFF;
+    if (acked <= this.inflight_.length) {
+      if (acked > 0) this.timeouts_ = 0;
+      this.inflight_.splice(0, acked).forEach(bytes => {
+        this.ackedBytes += bytes.length - frame.HEADER_SIZE - frame.CRC_SIZE;
+      });
+      this.baseSeq_ = expected;
+    }
+    if (window > 0) this.window = window;
+  };
+
+  // Feed frames received from the device
+  frame.Sender.prototype.onFrame = function(type, seq, payload) {
+    if (type !== frame.TYPE_ACK && type !== frame.TYPE_NAK) return false;
+    if (payload.length < 2 || this.failed_) return true;
+
+    this.acknowledge_(payload[0], payload[1]);
+    if (type === frame.TYPE_NAK) {
+      this.resend_();
+    }
+    this.pump_();
+
+    if (this.pending() === 0 && this.onDrain) {
+      this.onDrain();
+    }
+    return true;
+  };
+})();
@@ -19,20 +19,49 @@ var serial = {};
     );
   }
 
+  // Several IN transfers are kept queued so the host controller always has a
+  // buffer ready and there is no JS round trip between packets. Transfers on
+  // one endpoint complete in the order they were submitted.
+  serial.READS_IN_FLIGHT = 4;
+  serial.READ_SIZE = 4096;
+
+  // Small writes issued while a transfer is in flight are merged into one
+  serial.MAX_WRITE_SIZE = 16384;
+
   serial.Port = function(device) {
     this.device_ = device;
     this.interfaceNumber = 0;
     this.endpointIn = 0;
     this.endpointOut = 0;
+
+    this.sendQueue_ = [];     // {data, resolve, reject, time}
+    this.sending_ = false;
+    this.reading_ = false;
+
+    this.stats = {
+      rxBytes: 0,
+      rxTransfers: 0,
+      txBytes: 0,
+      txTransfers: 0,
+      txLatencyMs: 0    // time from send() to transfer completion, moving average
+    };
   };
 
   serial.Port.prototype.connect = function() {
     let readLoop = () => {
-      this.device_.transferIn(this.endpointIn, 64).then(result => {
-        this.onReceive(result.data);
+      if (!this.reading_) return;
+      this.device_.transferIn(this.endpointIn, serial.READ_SIZE).then(result => {
+        if (result.data && result.data.byteLength > 0) {
+          this.stats.rxBytes += result.data.byteLength;
+          this.stats.rxTransfers++;
+          this.onReceive(result.data);
+        }
         readLoop();
       }, error => {
-        this.onReceiveError(error);
+        if (this.reading_) {
+          this.reading_ = false;
+          this.onReceiveError(error);
+        }
       });
     };
 
@@ -69,11 +98,20 @@ var serial = {};
             'value': 0x01,
             'index': this.interfaceNumber}))
         .then(() => {
-          readLoop();
+          this.reading_ = true;
+          for (let i = 0; i < serial.READS_IN_FLIGHT; i++) {
+            readLoop();
+          }
         });
   };
 
+  // WebUSB device behind the port, e.g. to reopen it from a worker
+  serial.Port.prototype.getDevice = function() {
+    return this.device_;
+  };
+
   serial.Port.prototype.disconnect = function() {
+    this.reading_ = false;
     return this.device_.controlTransferOut({
             'requestType': 'class',
             'recipient': 'interface',
@@ -83,7 +121,91 @@ var serial = {};
         .then(() => this.device_.close());
   };
 
+  // Switch device between '#xxxx#' line mode and framed (pipelined) mode, see frame.js
+  serial.Port.prototype.setFramedMode = function(enabled) {
+    return this.device_.controlTransferOut({
+            'requestType': 'vendor',
+            'recipient': 'device',
+            'request': 0x03,
+            'value': enabled ? 0x01 : 0x00,
+            'index': this.interfaceNumber});
+  };
+
+  // Switch UART baud rate towards the target. With probe the device verifies the
+  // link with an echo of a test pattern and falls back to the old rate on failure.
+  serial.Port.prototype.setBaudRate = function(baudRate, probe) {
+    let data = new DataView(new ArrayBuffer(4));
+    data.setUint32(0, baudRate, true);
+    return this.device_.controlTransferOut({
+            'requestType': 'vendor',
+            'recipient': 'device',
+            'request': 0x04,
+            'value': probe ? 0x01 : 0x00,
+            'index': this.interfaceNumber}, data.buffer);
+  };
+
+  // Resolves to {baudRate, status}, status: 0 ok, 1 busy, 2 invalid, 3 probe failed, 4 errors
+  serial.Port.prototype.getBaudRate = function() {
+    return this.device_.controlTransferIn({
+            'requestType': 'vendor',
+            'recipient': 'device',
+            'request': 0x05,
+            'value': 0x00,
+            'index': this.interfaceNumber}, 5)
+        .then(result => ({
+          'baudRate': result.data.getUint32(0, true),
+          'status': result.data.getUint8(4)
+        }));
+  };
+
+  // Queue data for the OUT endpoint. Resolves once the data has been transferred.
   serial.Port.prototype.send = function(data) {
-    return this.device_.transferOut(this.endpointOut, data);
+    return new Promise((resolve, reject) => {
+      this.sendQueue_.push({
+        'data': new Uint8Array(data.buffer || data, data.byteOffset || 0, data.byteLength),
+        'resolve': resolve,
+        'reject': reject,
+        'time': performance.now()
+      });
+      this.flushSendQueue_();
+    });
+  };
+
+  serial.Port.prototype.flushSendQueue_ = function() {
+    if (this.sending_ || this.sendQueue_.length === 0) return;
+
+    // merge as many queued writes as fit into one transfer
+    let batch = [];
+    let size = 0;
+    while (this.sendQueue_.length > 0 &&
+           (batch.length === 0 || size + this.sendQueue_[0].data.length <= serial.MAX_WRITE_SIZE)) {
+      let entry = this.sendQueue_.shift();
+      batch.push(entry);
+      size += entry.data.length;
+    }
+
+    let buffer = new Uint8Array(size);
+    let offset = 0;
+    batch.forEach(entry => {
+      buffer.set(entry.data, offset);
+      offset += entry.data.length;
+    });
+
+    this.sending_ = true;
+    this.device_.transferOut(this.endpointOut, buffer).then(result => {
+      let now = performance.now();
+      this.stats.txBytes += size;
+      this.stats.txTransfers++;
+      batch.forEach(entry => {
+        this.stats.txLatencyMs += ((now - entry.time) - this.stats.txLatencyMs) / 8;
+        entry.resolve(result);
+      });
+      this.sending_ = false;
+      this.flushSendQueue_();
+    }, error => {
+      batch.forEach(entry => entry.reject(error));
+      this.sending_ = false;
+      this.flushSendQueue_();
+    });
   };
 })();
\ No newline at end of file
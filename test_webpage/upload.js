@@ -0,0 +1,58 @@
+var upload = {};
+
+(function() {
+  'use strict';
+
+  // Stream a binary image to the device as pipelined DATA frames. Every chunk is
+  // forwarded to the target like the payload of a '#xxxx#' line.
+  // onProgress({total, sent, acked, bytesPerSec, retransmits}) is invoked periodically.
+  // Port must be connected; it is switched to framed mode and back.
+  // Rejects if a transfer fails or the device stops acknowledging.
+  upload.run = function(port, bytes, chunkSize, onProgress) {
+    chunkSize = Math.min(chunkSize || frame.MAX_PAYLOAD, frame.MAX_PAYLOAD);
+
+    let sender = new frame.Sender(port);
+    let parser = new frame.Parser((type, seq, payload) => sender.onFrame(type, seq, payload));
+    let previousOnReceive = port.onReceive;
+    let previousOnReceiveError = port.onReceiveError;
+    let startTime = performance.now();
+    let timer = null;
+
+    let report = () => {
+      let seconds = (performance.now() - startTime) / 1000;
+      onProgress({
+        'total': bytes.length,
+        'sent': sender.sentBytes,
+        'acked': sender.ackedBytes,
+        'bytesPerSec': seconds > 0 ? sender.ackedBytes / seconds : 0,
+        'retransmits': sender.retransmits
+      });
+    };
+
+    let finish = () => {
+      clearInterval(timer);
+      sender.abort();
+      port.onReceive = previousOnReceive;
+      port.onReceiveError = previousOnReceiveError;
+      report();
+      return port.setFramedMode(false);
+    };
+
+    return port.setFramedMode(true).then(() => new Promise((resolve, reject) => {
+      port.onReceive = data => parser.push(data);
+      port.onReceiveError = error => sender.abort(error);
+      sender.onDrain = resolve;
+      sender.onError = reject;
+      timer = setInterval(report, 200);
+
+      // everything is queued at once, the sender keeps `window` frames in flight
+      for (let pos = 0; pos < bytes.length; pos += chunkSize) {
+        sender.send(bytes.subarray(pos, pos + chunkSize));
+      }
+      if (bytes.length === 0) resolve();
+    })).then(finish, error => {
+      // the device may be gone, leaving framed mode fails then: keep the original error
+      return finish().catch(() => {}).then(() => { throw error; });
+    });
+  };
+})();
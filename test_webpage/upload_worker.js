@@ -0,0 +1,44 @@
+// Runs an upload in a worker so page rendering can't stall USB I/O.
+// Messages in:  {cmd: 'probe'}
+//               {cmd: 'start', vendorId, productId, serialNumber, bytes, chunkSize}
+// Messages out: {type: 'probe', usb}, {type: 'progress', ...}, {type: 'done'}, {type: 'error', message}
+importScripts('serial.js', 'frame.js', 'upload.js');
+
+(function() {
+  'use strict';
+
+  function findPort(msg) {
+    return navigator.usb.getDevices().then(devices => {
+      let device = devices.find(d => d.vendorId === msg.vendorId && d.productId === msg.productId &&
+                                     d.serialNumber === msg.serialNumber);
+      if (!device) throw new Error('Device not found');
+      return new serial.Port(device);
+    });
+  }
+
+  self.onmessage = event => {
+    let msg = event.data;
+
+    if (msg.cmd === 'probe') {
+      self.postMessage({ 'type': 'probe', 'usb': !!(self.navigator && self.navigator.usb) });
+      return;
+    }
+
+    if (msg.cmd === 'start') {
+      let port;
+      findPort(msg)
+        .then(p => {
+          port = p;
+          port.onReceive = () => {};
+          port.onReceiveError = () => {};
+          return port.connect();
+        })
+        .then(() => upload.run(port, new Uint8Array(msg.bytes), msg.chunkSize, progress => {
+          self.postMessage(Object.assign({ 'type': 'progress' }, progress));
+        }))
+        .then(() => port.disconnect())
+        .then(() => self.postMessage({ 'type': 'done' }),
+              error => self.postMessage({ 'type': 'error', 'message': String(error) }));
+    }
+  };
+})();
@@ -33,6 +33,8 @@ SRC_C += \
 	src/class/midi/midi_device.c \
 	src/class/msc/msc_device.c \
 	src/class/net/net_device.c \
+	src/class/net/ncm_device.c \
+	src/class/net/net_checksum.c \
 	src/class/usbtmc/usbtmc_device.c \
 	src/class/vendor/vendor_device.c
 
@@ -0,0 +1,168 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+
+#include "bsp/board.h"
+#include "serialout.h"
+#include "baudrate.h"
+
+//--------------------------------------------------------------------+
+// MACRO CONSTANT TYPEDEF
+//--------------------------------------------------------------------+
+enum
+{
+  STATE_IDLE = 0,
+  STATE_WAIT_TX,    // waiting for transmit queue to drain
+  STATE_PROBING,    // probe sent, waiting for echo
+  STATE_MONITOR,    // switched, watching receive errors
+};
+
+#define PROBE_LEN   (sizeof(BAUD_PROBE_PATTERN) - 1)
+
+static uint8_t  state = STATE_IDLE;
+static uint8_t  status = BAUD_STATUS_OK;
+static bool     probe_enabled;
+static bool     falling_back;
+static uint8_t  fallback_reason;
+static uint32_t requested_rate;
+static uint32_t previous_rate = SERIAL_DEFAULT_BAUDRATE;
+static uint32_t probe_start_ms;
+static uint8_t  probe_rx[PROBE_LEN];
+static uint16_t probe_rx_count;
+
+//--------------------------------------------------------------------+
+// API
+//--------------------------------------------------------------------+
+void baudrate_request(uint32_t baudrate, bool probe)
+{
+  if (baudrate < SERIAL_MIN_BAUDRATE || baudrate > SERIAL_MAX_BAUDRATE)
+  {
+    status = BAUD_STATUS_INVALID;
+    return;
+  }
+
+  requested_rate = baudrate;
+  probe_enabled  = probe;
+  falling_back   = false;
+  state          = STATE_WAIT_TX;
+  status         = BAUD_STATUS_BUSY;
+}
+
+bool baudrate_busy(void)
+{
+  return state == STATE_WAIT_TX || state == STATE_PROBING;
+}
+
+void baudrate_get_status(baudrate_status_t* st)
+{
+  st->baudrate = serial_get_baudrate();
+  st->status   = status;
+}
+
+// Go back to the rate we had before, as soon as transmit queue is empty
+static void fall_back(uint8_t reason)
+{
+  requested_rate  = previous_rate;
+  probe_enabled   = false;
+  falling_back    = true;
+  fallback_reason = reason;
+  state           = STATE_WAIT_TX;
+}
+
+void baudrate_task(void)
+{
+  switch (state)
+  {
+    case STATE_WAIT_TX:
+      // everything queued at the old rate must be out first
+      if (!serial_send_idle()) return;
+
+      if (falling_back)
+      {
+        serial_set_baudrate(requested_rate);
+        status = fallback_reason;
+        state  = STATE_IDLE;
+        return;
+      }
+
+      previous_rate = serial_get_baudrate();
+      serial_set_baudrate(requested_rate);
+
+      if (probe_enabled)
+      {
+        probe_rx_count = 0;
+        probe_start_ms = board_millis();
+        serial_send((uint8_t const*) BAUD_PROBE_PATTERN, PROBE_LEN);
+        state = STATE_PROBING;
+      }
+      else
+      {
+        status = BAUD_STATUS_OK;
+        state  = STATE_MONITOR;
+      }
+    break;
+
+    case STATE_PROBING:
+    {
+      // collect echo straight from the receive buffer
+      uint8_t const* data;
+      uint16_t count;
+      while ( probe_rx_count < PROBE_LEN && (count = serial_receive_peek(&data)) > 0 )
+      {
+        if (count > PROBE_LEN - probe_rx_count) count = PROBE_LEN - probe_rx_count;
+        memcpy(probe_rx + probe_rx_count, data, count);
+        probe_rx_count += count;
+        serial_receive_consume(count);
+      }
+
+      if (probe_rx_count == PROBE_LEN)
+      {
+        if ( 0 == memcmp(probe_rx, BAUD_PROBE_PATTERN, PROBE_LEN) && serial_error_count() == 0 )
+        {
+          status = BAUD_STATUS_OK;
+          state  = STATE_MONITOR;
+        }
+        else
+        {
+          fall_back(BAUD_STATUS_PROBE_FAILED);
+        }
+      }
+      else if (board_millis() - probe_start_ms > BAUD_PROBE_TIMEOUT_MS)
+      {
+        fall_back(BAUD_STATUS_PROBE_FAILED);
+      }
+    }
+    break;
+
+    case STATE_MONITOR:
+      // a link that looked fine during the probe can still be marginal
+      if (serial_error_count() > BAUD_MAX_ERRORS)
+      {
+        fall_back(BAUD_STATUS_ERRORS);
+      }
+    break;
+
+    default: break;
+  }
+}
@@ -0,0 +1,81 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef _BAUDRATE_H_
+#define _BAUDRATE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Runtime baud rate switching of the UART link to the target
+ *
+ * The host first tells the target to change its rate (with a normal line/frame),
+ * then issues VENDOR_REQUEST_SET_BAUDRATE. Once the transmit queue has drained the
+ * UART is switched. With probing enabled, BAUD_PROBE_PATTERN is sent and the target
+ * must echo it back within BAUD_PROBE_TIMEOUT_MS, otherwise the previous rate is
+ * restored. After a switch, too many receive errors also restore the previous rate.
+ * USB traffic continues throughout; UART forwarding is held off while switching.
+ */
+
+#define BAUD_PROBE_PATTERN        "\x55\xAA\x0F\xF0\x33\xCC\x00\xFF"
+#define BAUD_PROBE_TIMEOUT_MS     100
+
+// Receive errors tolerated at a new rate before falling back
+#define BAUD_MAX_ERRORS           8
+
+enum
+{
+  BAUD_STATUS_OK = 0,
+  BAUD_STATUS_BUSY,          // switch pending or probing
+  BAUD_STATUS_INVALID,       // requested rate out of range
+  BAUD_STATUS_PROBE_FAILED,  // target did not echo probe, previous rate restored
+  BAUD_STATUS_ERRORS,        // too many receive errors, previous rate restored
+};
+
+// Reply of VENDOR_REQUEST_GET_BAUDRATE
+typedef struct __attribute__ ((packed))
+{
+  uint32_t baudrate;  // current rate
+  uint8_t  status;    // BAUD_STATUS_*
+} baudrate_status_t;
+
+// Queue a baud rate change, executed by baudrate_task()
+void baudrate_request(uint32_t baudrate, bool probe);
+
+// Must be called from main loop
+void baudrate_task(void);
+
+// True while a switch is pending: UART traffic must be held back
+bool baudrate_busy(void);
+
+void baudrate_get_status(baudrate_status_t* status);
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif /* _BAUDRATE_H_ */
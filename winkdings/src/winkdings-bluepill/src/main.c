@@ -41,6 +41,8 @@
 #include "tusb.h"
 #include "usb_descriptors.h"
 #include "serialout.h"
+#include "vendor_frame.h"
+#include "baudrate.h"
 
 //--------------------------------------------------------------------+
 // MACRO CONSTANT TYPEDEF PROTYPES
@@ -74,15 +76,24 @@ const tusb_desc_webusb_url_t desc_url =
 
 static bool web_serial_connected = false;
 
+// Pipelined programming: host streams binary frames (vendor_frame.h) instead of '#xxxx#' lines
+static bool framed_mode = false;
+
 uint8_t rxbuffer[1024];
 uint32_t rxbuffer_pos = 0;
 
+// length of a complete line in rxbuffer that waits for room in the UART queue, 0 if none
+uint32_t rxbuffer_pending = 0;
+
 //------------- prototypes -------------//
 void led_blinking_task(void);
 void cdc_task(void);
 void webserial_task(void);
+void uart_forward_task(void);
 void echo_all(uint8_t* buf, uint32_t count);
 void echo_string(const char* buf, uint32_t count);
+bool handle_line(uint8_t* buffer, uint32_t count);
+bool on_line_read(uint32_t count);
 #define ECHO_STR(x) echo_string(x, sizeof(x));
 int32_t hexchar2int(uint8_t c);
 uint32_t header_bytecount(uint8_t* buf);
@@ -99,22 +110,32 @@ int main(void)
     tud_task(); // tinyusb device task
     cdc_task();
     webserial_task();
+    uart_forward_task();
+    baudrate_task();
     led_blinking_task();
   }
 
   return 0;
 }
 
-void handle_line(uint8_t* buffer, uint32_t count)
+// returns false if the UART queue has no room for the line yet
+bool handle_line(uint8_t* buffer, uint32_t count)
 {
+  if (baudrate_busy() || serial_send_available() < count + 1)
+  {
+    return false;
+  }
+
   echo_all(buffer, count);
   ECHO_STR("\nOK\n");
 
   serial_send(buffer, count);
   serial_send((uint8_t*)"\n", 1);
+  return true;
 }
 
-void on_line_read(uint32_t count)
+// returns false if the line could not be processed yet and must be retried
+bool on_line_read(uint32_t count)
 {
   /* Expected format
    * #xxxx#ssssssssss\n
@@ -133,32 +154,68 @@ void on_line_read(uint32_t count)
     if (count < 7)
     {
       ECHO_STR("FAIL too short\n");
-      return;
+      return true;
     }
     if (rxbuffer[0] != '#' || rxbuffer[5] != '#')
     {
       ECHO_STR("FAIL invalid format\n");
-      return;
+      return true;
     }
     uint32_t header_bytes = header_bytecount(rxbuffer);
     if (header_bytes < 1)
     {
       ECHO_STR("FAIL invalid header byte count\n");
-      return;
+      return true;
     }
     if (header_bytes+6 > count)
     {
       ECHO_STR("FAIL shorter than specified\n");
-      return;
+      return true;
     }
-    handle_line(rxbuffer+6, header_bytes);
+    return handle_line(rxbuffer+6, header_bytes);
+  }
+  return true;
+}
+
+// Invoked by vframe_task() for every in-order frame.
+// A frame carries the same payload as a '#xxxx#' line and is forwarded the same way,
+// but without echo and "OK": the host gets a cumulative ACK instead.
+bool vframe_rx_cb(vframe_payload_t const* payload)
+{
+  // backpressure: leave frame in fifo (unacknowledged) until UART queue has drained enough
+  if (baudrate_busy() || serial_send_available() < payload->len + 1)
+  {
+    return false;
   }
+
+  serial_send(payload->ptr[0], payload->part_len[0]);
+  if (payload->part_len[1])
+  {
+    serial_send(payload->ptr[1], payload->part_len[1]);
+  }
+  serial_send((uint8_t*)"\n", 1);
+
+  return true;
 }
 
 void webserial_task(void)
 {
   if ( web_serial_connected )
   {
+    if ( framed_mode )
+    {
+      vframe_task();
+      return;
+    }
+
+    if ( rxbuffer_pending )
+    {
+      // previous line still waits for the UART
+      if ( !on_line_read(rxbuffer_pending) ) return;
+      rxbuffer_pending = 0;
+      rxbuffer_pos = 0;
+    }
+
     if ( tud_vendor_available() )
     {
       uint32_t maxread = sizeof(rxbuffer) - rxbuffer_pos ;
@@ -168,7 +225,11 @@ void webserial_task(void)
         if (rxbuffer[pos] == '\n')
         {
           // have complete line
-          on_line_read(pos);
+          if ( !on_line_read(pos) )
+          {
+            rxbuffer_pending = pos;
+            return;
+          }
           // reset
           rxbuffer_pos = 0;
           return;
@@ -191,6 +252,53 @@ void webserial_task(void)
 
 
 
+// Forward responses of the target device, received on the UART, to the browser.
+// Data goes from the UART DMA buffer straight into the vendor tx fifo.
+void uart_forward_task(void)
+{
+  // bytes are pushed out on idle line even if they don't fill a frame
+  static bool flush = false;
+
+  // receive buffer belongs to the probe while switching baud rate
+  if ( baudrate_busy() ) return;
+
+  flush |= serial_receive_idle();
+
+  uint8_t const* data;
+  uint16_t count = serial_receive_peek(&data);
+
+  if ( !web_serial_connected )
+  {
+    // nobody is listening
+    serial_receive_consume(count);
+    return;
+  }
+
+  if ( framed_mode )
+  {
+    // collect up to a full frame unless the target has stopped talking,
+    // or the linear part ends at the buffer wrap-around and can't grow anymore
+    uint16_t const available = serial_receive_available();
+    bool const wrapped = (count < available);
+
+    if ( count > VFRAME_MAX_PAYLOAD ) count = VFRAME_MAX_PAYLOAD;
+    if ( count && (flush || wrapped || available >= VFRAME_MAX_PAYLOAD) )
+    {
+      if ( vframe_send_data(data, count) ) serial_receive_consume(count);
+    }
+  }
+  else if ( count )
+  {
+    serial_receive_consume( (uint16_t) tud_vendor_write(data, count) );
+  }
+
+  if ( flush && !serial_receive_available() )
+  {
+    tud_vendor_write_flush();
+    flush = false;
+  }
+}
+
 // send characters to both CDC and WebUSB
 void echo_string(const char* buf, uint32_t count)
 {
@@ -245,6 +353,17 @@ void tud_resume_cb(void)
 // return false to stall control endpoint (e.g unsupported request)
 bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const * request)
 {
+  static uint32_t baudrate_req;
+  static baudrate_status_t baudrate_status;
+
+  // new baud rate is only available once data stage is complete
+  if ( stage == CONTROL_STAGE_DATA && request->bmRequestType_bit.type == TUSB_REQ_TYPE_VENDOR &&
+       request->bRequest == VENDOR_REQUEST_SET_BAUDRATE )
+  {
+    baudrate_request(tu_le32toh(baudrate_req), request->wValue & 0x01);
+    return true;
+  }
+
   // nothing to with DATA & ACK stage
   if (stage != CONTROL_STAGE_SETUP) return true;
 
@@ -258,6 +377,21 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
           // Get landing page url
           return tud_control_xfer(rhport, request, (void*) &desc_url, desc_url.bLength);
 
+        case VENDOR_REQUEST_FRAMED_MODE:
+          framed_mode = (request->wValue != 0);
+          vframe_init();
+          rxbuffer_pos = 0;
+          rxbuffer_pending = 0;
+          return tud_control_status(rhport, request);
+
+        case VENDOR_REQUEST_SET_BAUDRATE:
+          if ( request->wLength != sizeof(baudrate_req) ) return false;
+          return tud_control_xfer(rhport, request, &baudrate_req, sizeof(baudrate_req));
+
+        case VENDOR_REQUEST_GET_BAUDRATE:
+          baudrate_get_status(&baudrate_status);
+          return tud_control_xfer(rhport, request, &baudrate_status, sizeof(baudrate_status));
+
         case VENDOR_REQUEST_MICROSOFT:
           if ( request->wIndex == 7 )
           {
@@ -281,6 +415,7 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
       {
         // Webserial simulate the CDC_REQUEST_SET_CONTROL_LINE_STATE (0x22) to connect and disconnect.
         web_serial_connected = (request->wValue != 0);
+        framed_mode = false;
 
         // Always lit LED if connected
         if ( web_serial_connected )
@@ -1,8 +1,5 @@
 
 
-#ifndef _SERIAL_OUT_H_
-#define _SERIAL_OUT_H_
-
 // uses some code from
 // https://github.com/stm32duino/Arduino_Core_STM32/blob/master/libraries/SrcWrapper/src/stm32/uart.c
 // https://github.com/stm32duino/Arduino_Core_STM32/blob/master/cores/arduino/stm32/uart.h
@@ -15,21 +12,44 @@
 #include "stm32f1xx.h"
 #include "stm32f1xx_hal.h"
 #include "bsp/board.h"
+#include "tusb.h"
 #include "uart.h"
+#include "serialout.h"
 
 /* UART handler declaration */
 UART_HandleTypeDef UartHandle;
 
+/* Transmit queue, drained in the background by chained DMA transfers */
+static uint8_t tx_ff_buf[SERIAL_TX_BUFSIZE];
+static tu_fifo_t tx_ff;
+
+/* Bytes of tx_ff currently being sent by DMA, 0 if DMA is idle */
+static volatile uint16_t tx_dma_count = 0;
+
 /* Buffer used for transmission */
 uint8_t aTxBuffer[] = "\n\r ****UART-Hyperterminal communication based on DMA****\n\r Enter 10 characters using keyboard :\n\r";
 
-/* Buffer used for reception */
-#define RXBUFFERSIZE 1024
-uint8_t aRxBuffer[RXBUFFERSIZE];
+/* Buffer used for reception, filled by circular DMA */
+uint8_t aRxBuffer[SERIAL_RX_BUFSIZE];
+
+/* Next byte of aRxBuffer to hand out to the application */
+static uint16_t rx_tail = 0;
+
+/* DMA wrap-arounds and bytes handed out since reception was started.
+   Their difference tells whether DMA has lapped the reader. */
+static volatile uint32_t rx_wraps = 0;
+static uint32_t rx_consumed = 0;
+
+/* Set by idle line and DMA wrap-around events */
+static volatile bool rx_event = false;
+
+/* Framing, noise and overrun errors reported by HAL, and receive buffer overruns */
+static volatile uint32_t rx_errors = 0;
 
 /* Private function prototypes -----------------------------------------------*/
 
 static void Error_Handler(void);
+static void rx_start_dma(void);
 
 int delay(int millis)
 {
@@ -60,9 +80,12 @@ void serial_init(void)
     __HAL_RCC_USART1_CLK_ENABLE();
 #endif
 
+  tu_fifo_config(&tx_ff, tx_ff_buf, SERIAL_TX_BUFSIZE, 1, false);
+  tx_dma_count = 0;
+
   UartHandle.Instance          = USARTx;
   
-  UartHandle.Init.BaudRate     = 9600;
+  UartHandle.Init.BaudRate     = SERIAL_DEFAULT_BAUDRATE;
   UartHandle.Init.WordLength   = UART_WORDLENGTH_8B;
   UartHandle.Init.StopBits     = UART_STOPBITS_1;
   UartHandle.Init.Parity       = UART_PARITY_NONE;
@@ -83,30 +106,177 @@ void serial_init(void)
       Error_Handler();
     }
   } 
+
+  /* Single wire: listen until there is something to send */
+  HAL_HalfDuplex_EnableReceiver(&UartHandle);
+  rx_start_dma();
+}
+
+/* Start DMA on the next linear part of the transmit queue.
+   Must be called with interrupts disabled or from the UART interrupt. */
+static void tx_start_dma(void)
+{
+  tu_fifo_buffer_info_t info;
+  tu_fifo_get_read_info(&tx_ff, &info);
+
+  if (info.len_lin == 0) return;
+
+  /* Turn the single wire around, receive DMA stays armed but sees no data */
+  HAL_HalfDuplex_EnableTransmitter(&UartHandle);
+
+  if (HAL_UART_Transmit_DMA(&UartHandle, (uint8_t*)info.ptr_lin, info.len_lin) == HAL_OK)
+  {
+    tx_dma_count = info.len_lin;
+  }
 }
 
 uint16_t serial_send(const uint8_t* buffer, uint16_t count)
 {
-  /*  Before starting a new communication transfer, you need to check the current
-      state of the peripheral; if its busy you need to wait for the end of current
-      transfer before starting a new one.
-      For simplicity reasons, this example is just waiting till the end of the
-      transfer, but application may perform other tasks while transfer operation
-      is ongoing. */
-  //while (HAL_UART_GetState(&UartHandle) != HAL_UART_STATE_READY)
-  //{
-  //}
-  
-  if (HAL_UART_Transmit(&UartHandle, (uint8_t*)buffer, count, TX_TIMEOUT) == HAL_OK) 
+  /* Queue the data and return immediately, the DMA complete interrupt keeps
+     feeding the UART until the queue is empty.
+     All or nothing: partial lines would get interleaved with the next one. */
+  if (serial_send_available() < count)
+  {
+    return 0;
+  }
+
+  tu_fifo_write_n(&tx_ff, buffer, count);
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (tx_dma_count == 0)
+  {
+    tx_start_dma();
+  }
+  __set_PRIMASK(primask);
+
+  return count;
+}
+
+uint16_t serial_send_available(void)
+{
+  return tu_fifo_remaining(&tx_ff);
+}
+
+bool serial_send_idle(void)
+{
+  return (tx_dma_count == 0) && tu_fifo_empty(&tx_ff);
+}
+
+/* Start circular reception, the idle line interrupt marks the end of a response */
+static void rx_start_dma(void)
+{
+  rx_tail = 0;
+  rx_wraps = 0;
+  rx_consumed = 0;
+  if (HAL_UARTEx_ReceiveToIdle_DMA(&UartHandle, aRxBuffer, SERIAL_RX_BUFSIZE) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  /* only idle line and buffer wrap are of interest */
+  __HAL_DMA_DISABLE_IT(UartHandle.hdmarx, DMA_IT_HT);
+}
+
+/* Total bytes written by DMA since reception was started,
+   position in aRxBuffer the DMA will write next in *head */
+static uint32_t rx_received(uint16_t* head)
+{
+  DMA_HandleTypeDef* const hdma = UartHandle.hdmarx;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t wraps = rx_wraps;
+  uint16_t remaining = __HAL_DMA_GET_COUNTER(hdma);
+  if (__HAL_DMA_GET_FLAG(hdma, __HAL_DMA_GET_TC_FLAG_INDEX(hdma)))
+  {
+    /* Wrapped, but the interrupt counting it has not run yet */
+    wraps++;
+    remaining = __HAL_DMA_GET_COUNTER(hdma);
+  }
+  __set_PRIMASK(primask);
+
+  uint16_t const pos = SERIAL_RX_BUFSIZE - remaining;
+  *head = (pos == SERIAL_RX_BUFSIZE) ? 0 : pos;
+  return wraps * SERIAL_RX_BUFSIZE + pos;
+}
+
+/* Unread bytes in aRxBuffer. If DMA has overwritten some of them the
+   whole backlog is garbage: count an overrun and skip to the DMA position. */
+static uint32_t rx_pending(uint16_t* head)
+{
+  uint32_t const received = rx_received(head);
+  uint32_t pending = received - rx_consumed;
+
+  if (pending > SERIAL_RX_BUFSIZE)
+  {
+    rx_errors++;
+    rx_consumed = received;
+    rx_tail = *head;
+    pending = 0;
+  }
+  return pending;
+}
+
+uint16_t serial_receive_available(void)
+{
+  uint16_t head;
+  return (uint16_t) rx_pending(&head);
+}
+
+uint16_t serial_receive_peek(uint8_t const** data)
+{
+  uint16_t head;
+  uint32_t const pending = rx_pending(&head);
+  uint16_t const linear = SERIAL_RX_BUFSIZE - rx_tail;
+
+  *data = aRxBuffer + rx_tail;
+  return (pending < linear) ? (uint16_t) pending : linear;
+}
+
+bool serial_set_baudrate(uint32_t baudrate)
+{
+  if (baudrate < SERIAL_MIN_BAUDRATE || baudrate > SERIAL_MAX_BAUDRATE) return false;
+
+  /* Switching in the middle of a transmission would garble it */
+  if (!serial_send_idle()) return false;
+
+  HAL_UART_AbortReceive(&UartHandle);
+
+  /* UART is initialized already: this only recomputes BRR, MSP and DMA stay as they are */
+  UartHandle.Init.BaudRate = baudrate;
+  if (HAL_HalfDuplex_Init(&UartHandle) != HAL_OK)
   {
-    return count;
+    Error_Handler();
   }
-  return 0;
+
+  HAL_HalfDuplex_EnableReceiver(&UartHandle);
+  rx_start_dma();
+  rx_errors = 0;
+
+  return true;
 }
 
-void serial_receive(void)
+uint32_t serial_get_baudrate(void)
 {
- 
+  return UartHandle.Init.BaudRate;
+}
+
+uint32_t serial_error_count(void)
+{
+  return rx_errors;
+}
+
+void serial_receive_consume(uint16_t count)
+{
+  rx_tail = (rx_tail + count) % SERIAL_RX_BUFSIZE;
+  rx_consumed += count;
+}
+
+bool serial_receive_idle(void)
+{
+  if (!rx_event) return false;
+  rx_event = false;
+  return true;
 }
 
 /**
@@ -129,29 +299,80 @@ static void Error_Handler(void)
 /**
   * @brief  Tx Transfer completed callback
   * @param  huart: UART handle.
-  * @note   This example shows a simple way to report end of DMA Tx transfer, and
-  *         you can add your own implementation.
+  * @note   Invoked from USART interrupt once the last byte of a DMA transfer is out.
   * @retval None
   */
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 {
-  UNUSED(huart);
-  /* Toogle LED2 : Transfer in transmission process is correct */
-  //BSP_LED_On(LED2);
+  if (huart != &UartHandle) return;
+
+  /* Release what has been sent and chain the next part of the queue */
+  tu_fifo_advance_read_pointer(&tx_ff, tx_dma_count);
+  tx_dma_count = 0;
+  tx_start_dma();
+
+  /* All sent: give the wire back to the target for its response */
+  if (tx_dma_count == 0)
+  {
+    HAL_HalfDuplex_EnableReceiver(huart);
+  }
 }
 
 /**
-  * @brief  Rx Transfer completed callback
+  * @brief  Reception event callback
   * @param  huart: UART handle
-  * @note   This example shows a simple way to report end of DMA Rx transfer, and
-  *         you can add your own implementation.
+  * @param  Size: position in receive buffer reached by DMA
+  * @note   Invoked on idle line and when circular DMA wraps around. Data is
+  *         picked up from the main loop via serial_receive_peek().
   * @retval None
   */
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
 {
-  UNUSED(huart);
-  /* Turn LED2 on: Transfer in reception process is correct */
-  //BSP_LED_On(LED2);
+  if (huart != &UartHandle) return;
+
+  /* Size is the buffer size on DMA transfer complete, smaller on idle line */
+  if (Size == SERIAL_RX_BUFSIZE)
+  {
+    rx_wraps++;
+  }
+
+  rx_event = true;
+}
+
+/**
+  * @brief  UART error callback
+  * @param  huart: UART handle
+  * @note   HAL aborts DMA reception on errors such as overrun, restart it.
+  * @retval None
+  */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  if (huart != &UartHandle) return;
+
+  rx_errors++;
+
+  if (huart->RxState == HAL_UART_STATE_READY)
+  {
+    rx_start_dma();
+  }
+}
+
+/**
+  * @brief  Interrupt handlers, forwarded to HAL which invokes the callbacks above
+  */
+void USARTx_DMA_TX_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(UartHandle.hdmatx);
+}
+
+void USARTx_DMA_RX_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(UartHandle.hdmarx);
+}
+
+void USARTx_IRQHandler(void)
+{
+  HAL_UART_IRQHandler(&UartHandle);
 }
 
 
@@ -227,7 +448,7 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart)
   hdma_rx.Init.MemInc              = DMA_MINC_ENABLE;
   hdma_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
   hdma_rx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
-  hdma_rx.Init.Mode                = DMA_NORMAL;
+  hdma_rx.Init.Mode                = DMA_CIRCULAR;
   hdma_rx.Init.Priority            = DMA_PRIORITY_HIGH;
 
   HAL_DMA_Init(&hdma_rx);
@@ -291,5 +512,3 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef *huart)
 #ifdef __cplusplus
  }
 #endif
-
-#endif /* _SERIAL_OUT_H_ */
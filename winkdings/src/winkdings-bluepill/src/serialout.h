@@ -3,14 +3,60 @@
 #ifndef _SERIAL_OUT_H_
 #define _SERIAL_OUT_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
  extern "C" {
 #endif
 
+// Size of transmit queue, must hold at least one complete line
+#ifndef SERIAL_TX_BUFSIZE
+#define SERIAL_TX_BUFSIZE 2048
+#endif
+
+// Size of circular receive buffer
+#ifndef SERIAL_RX_BUFSIZE
+#define SERIAL_RX_BUFSIZE 1024
+#endif
+
+#define SERIAL_DEFAULT_BAUDRATE   9600
+
+// USART1 runs from PCLK2 (72 MHz on BluePill), 16x oversampling
+#define SERIAL_MIN_BAUDRATE       1200
+#define SERIAL_MAX_BAUDRATE       4500000
+
 void serial_init(void);
 
+// Switch baud rate, only possible while transmit queue is empty.
+// Receive buffer is reset, data not yet picked up is dropped.
+bool     serial_set_baudrate(uint32_t baudrate);
+uint32_t serial_get_baudrate(void);
+
+// Number of receive errors (framing, noise, overrun) since last baud rate change.
+// Also counts receive buffer overruns: data not picked up before DMA came
+// around again, which is dropped.
+uint32_t serial_error_count(void);
+
+// Queue data for transmission, non-blocking.
+// Returns count, or 0 if there is not enough room for all of it.
 uint16_t serial_send(const uint8_t* buffer, uint16_t count);
 
+// Free space in transmit queue
+uint16_t serial_send_available(void);
+
+// True when everything queued has been transmitted
+bool serial_send_idle(void);
+
+// Received data is read in place from the DMA buffer:
+// peek returns the next linear part (up to the buffer end), consume releases it.
+uint16_t serial_receive_available(void);
+uint16_t serial_receive_peek(uint8_t const** data);
+void     serial_receive_consume(uint16_t count);
+
+// True once after an idle line (end of a response) or receive buffer wrap-around event
+bool     serial_receive_idle(void);
+
 #ifdef __cplusplus
  }
 #endif
@@ -12,8 +12,6 @@
 #define UART_IRQ_SUBPRIO    0
 #endif
 
-#define TX_TIMEOUT  1000
-
 
 /* Exported types ------------------------------------------------------------*/
 /* Exported constants --------------------------------------------------------*/
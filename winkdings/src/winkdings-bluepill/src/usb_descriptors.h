@@ -28,7 +28,10 @@
 enum
 {
   VENDOR_REQUEST_WEBUSB = 1,
-  VENDOR_REQUEST_MICROSOFT = 2
+  VENDOR_REQUEST_MICROSOFT = 2,
+  VENDOR_REQUEST_FRAMED_MODE = 3, // wValue 1: switch to framed transport (vendor_frame.h), 0: line mode
+  VENDOR_REQUEST_SET_BAUDRATE = 4,// data: uint32 baud rate, wValue 1: verify with probe (baudrate.h)
+  VENDOR_REQUEST_GET_BAUDRATE = 5 // reply: baudrate_status_t
 };
 
 extern uint8_t const desc_ms_os_20[];
@@ -0,0 +1,269 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+
+#include "tusb.h"
+#include "vendor_frame.h"
+
+// A whole frame must fit into the rx fifo since it is parsed in place
+TU_VERIFY_STATIC(CFG_TUD_VENDOR_RX_BUFSIZE >= VFRAME_MAX_PAYLOAD + VFRAME_OVERHEAD, "vendor rx fifo too small for VFRAME_MAX_PAYLOAD");
+// and into the tx fifo since vframe_send() writes it only when there is room for all of it
+TU_VERIFY_STATIC(CFG_TUD_VENDOR_TX_BUFSIZE >= VFRAME_MAX_PAYLOAD + VFRAME_OVERHEAD, "vendor tx fifo too small for VFRAME_MAX_PAYLOAD");
+TU_VERIFY_STATIC(VFRAME_WINDOW > 0 && VFRAME_WINDOW < 128, "invalid VFRAME_WINDOW");
+
+//--------------------------------------------------------------------+
+// MACRO CONSTANT TYPEDEF
+//--------------------------------------------------------------------+
+typedef struct
+{
+  uint8_t rx_expected;   // next DATA sequence number we accept
+  uint8_t rx_unacked;    // frames consumed but not acknowledged yet
+  bool    nak_sent;      // only one NAK per gap, until expected frame shows up
+  uint8_t tx_seq;        // sequence number of next DATA frame we send
+
+  vframe_stats_t stats;
+} vframe_state_t;
+
+static vframe_state_t _vframe;
+
+//--------------------------------------------------------------------+
+// CRC
+//--------------------------------------------------------------------+
+static const uint16_t _crc16_nibble[16] =
+{
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+uint16_t vframe_crc16(uint16_t crc, uint8_t const* data, uint32_t len)
+{
+  while (len--)
+  {
+    uint8_t const b = *data++;
+    crc = (uint16_t) ((crc << 4) ^ _crc16_nibble[(crc >> 12) ^ (b >> 4)]);
+    crc = (uint16_t) ((crc << 4) ^ _crc16_nibble[(crc >> 12) ^ (b & 0x0F)]);
+  }
+  return crc;
+}
+
+//--------------------------------------------------------------------+
+// FIFO access helpers, offsets are relative to the fifo read position
+//--------------------------------------------------------------------+
+static inline uint8_t ff_byte(tu_fifo_buffer_info_t const* info, uint16_t offset)
+{
+  return (offset < info->len_lin) ? ((uint8_t const*) info->ptr_lin)[offset] :
+                                    ((uint8_t const*) info->ptr_wrap)[offset - info->len_lin];
+}
+
+// Split a region of the fifo into at most two linear parts
+static void ff_region(tu_fifo_buffer_info_t const* info, uint16_t offset, uint16_t len,
+                      uint8_t const* ptr[2], uint16_t part_len[2])
+{
+  if ( offset >= info->len_lin )
+  {
+    ptr[0]      = ((uint8_t const*) info->ptr_wrap) + (offset - info->len_lin);
+    part_len[0] = len;
+    ptr[1]      = NULL;
+    part_len[1] = 0;
+  }
+  else
+  {
+    ptr[0]      = ((uint8_t const*) info->ptr_lin) + offset;
+    part_len[0] = tu_min16(len, info->len_lin - offset);
+    ptr[1]      = info->ptr_wrap;
+    part_len[1] = len - part_len[0];
+  }
+}
+
+//--------------------------------------------------------------------+
+// API
+//--------------------------------------------------------------------+
+void vframe_init(void)
+{
+  tu_memclr(&_vframe, sizeof(_vframe));
+}
+
+vframe_stats_t const* vframe_get_stats(void)
+{
+  return &_vframe.stats;
+}
+
+bool vframe_send(uint8_t type, uint8_t seq, void const* data, uint16_t len)
+{
+  TU_VERIFY(len <= VFRAME_MAX_PAYLOAD);
+  TU_VERIFY(tud_vendor_n_write_available(VFRAME_ITF) >= (uint32_t) len + VFRAME_OVERHEAD);
+
+  uint8_t header[VFRAME_HEADER_SIZE] = { VFRAME_SOF, type, seq, TU_U16_LOW(len), TU_U16_HIGH(len) };
+
+  uint16_t crc = vframe_crc16(0xFFFF, header+1, VFRAME_HEADER_SIZE-1);
+  crc = vframe_crc16(crc, (uint8_t const*) data, len);
+
+  uint8_t const trailer[VFRAME_CRC_SIZE] = { TU_U16_LOW(crc), TU_U16_HIGH(crc) };
+
+  tud_vendor_n_write(VFRAME_ITF, header, sizeof(header));
+  if ( len ) tud_vendor_n_write(VFRAME_ITF, data, len);
+  tud_vendor_n_write(VFRAME_ITF, trailer, sizeof(trailer));
+  tud_vendor_n_write_flush(VFRAME_ITF);
+
+  _vframe.stats.tx_frames++;
+
+  return true;
+}
+
+bool vframe_send_data(void const* data, uint16_t len)
+{
+  TU_VERIFY( vframe_send(VFRAME_TYPE_DATA, _vframe.tx_seq, data, len) );
+  _vframe.tx_seq++;
+  return true;
+}
+
+static bool send_ack(uint8_t type)
+{
+  uint8_t const payload[2] = { _vframe.rx_expected, VFRAME_WINDOW };
+  return vframe_send(type, 0, payload, sizeof(payload));
+}
+
+//--------------------------------------------------------------------+
+// Receive
+//--------------------------------------------------------------------+
+
+// Handle frame at the start of the fifo.
+// Return number of bytes to remove from fifo, 0 if we have to wait for more data.
+static uint16_t process_frame(tu_fifo_buffer_info_t const* info, uint16_t avail)
+{
+  // Resync: skip everything up to the next start of frame
+  if ( ff_byte(info, 0) != VFRAME_SOF )
+  {
+    uint16_t skip = 1;
+    while ( skip < avail && ff_byte(info, skip) != VFRAME_SOF ) skip++;
+
+    _vframe.stats.rx_sync_bytes += skip;
+    return skip;
+  }
+
+  if ( avail < VFRAME_HEADER_SIZE ) return 0;
+
+  uint8_t  const type = ff_byte(info, 1);
+  uint8_t  const seq  = ff_byte(info, 2);
+  uint16_t const len  = tu_u16(ff_byte(info, 4), ff_byte(info, 3));
+
+  // Not a valid header, most likely a payload byte that happens to look like start of frame
+  if ( len > VFRAME_MAX_PAYLOAD )
+  {
+    _vframe.stats.rx_sync_bytes++;
+    return 1;
+  }
+
+  uint16_t const total = VFRAME_OVERHEAD + len;
+  if ( avail < total ) return 0;
+
+  vframe_payload_t payload =
+  {
+    .type = type,
+    .seq  = seq,
+    .len  = len
+  };
+  ff_region(info, VFRAME_HEADER_SIZE, len, payload.ptr, payload.part_len);
+
+  // CRC covers everything after start of frame up to the crc itself
+  uint8_t const* hdr_ptr[2];
+  uint16_t       hdr_len[2];
+  ff_region(info, 1, VFRAME_HEADER_SIZE-1, hdr_ptr, hdr_len);
+
+  uint16_t crc = 0xFFFF;
+  crc = vframe_crc16(crc, hdr_ptr[0], hdr_len[0]);
+  crc = vframe_crc16(crc, hdr_ptr[1], hdr_len[1]);
+  crc = vframe_crc16(crc, payload.ptr[0], payload.part_len[0]);
+  crc = vframe_crc16(crc, payload.ptr[1], payload.part_len[1]);
+
+  uint16_t const frame_crc = tu_u16(ff_byte(info, total-1), ff_byte(info, total-2));
+
+  if ( crc != frame_crc )
+  {
+    _vframe.stats.rx_crc_errors++;
+
+    // start of frame could have been a payload byte, resync from the next byte
+    if ( !_vframe.nak_sent ) _vframe.nak_sent = send_ack(VFRAME_TYPE_NAK);
+    return 1;
+  }
+
+  // Only DATA frames are expected from host
+  if ( type != VFRAME_TYPE_DATA ) return total;
+
+  if ( seq == _vframe.rx_expected )
+  {
+    // application can't take it yet, keep it in fifo (which eventually NAKs the endpoint)
+    if ( vframe_rx_cb && !vframe_rx_cb(&payload) ) return 0;
+
+    _vframe.rx_expected++;
+    _vframe.rx_unacked++;
+    _vframe.nak_sent = false;
+    _vframe.stats.rx_frames++;
+  }
+  else
+  {
+    _vframe.stats.rx_seq_errors++;
+
+    uint8_t const behind = (uint8_t) (_vframe.rx_expected - seq);
+    if ( behind > 0 && behind <= VFRAME_WINDOW )
+    {
+      // duplicate of a frame we already have, host probably missed our ACK
+      send_ack(VFRAME_TYPE_ACK);
+      _vframe.rx_unacked = 0;
+    }
+    else if ( !_vframe.nak_sent )
+    {
+      // gap: a previous frame was lost, ask host to go back
+      _vframe.nak_sent = send_ack(VFRAME_TYPE_NAK);
+    }
+  }
+
+  return total;
+}
+
+void vframe_task(void)
+{
+  while (1)
+  {
+    tu_fifo_buffer_info_t info;
+    tud_vendor_n_read_info(VFRAME_ITF, &info);
+
+    uint16_t const avail = info.len_lin + info.len_wrap;
+    if ( avail == 0 ) break;
+
+    uint16_t const consumed = process_frame(&info, avail);
+    if ( consumed == 0 ) break;
+
+    tud_vendor_n_read_advance(VFRAME_ITF, consumed);
+  }
+
+  // Acknowledge once half the window is used, or when host has nothing more queued
+  if ( _vframe.rx_unacked )
+  {
+    if ( (_vframe.rx_unacked >= (VFRAME_WINDOW+1)/2) || !tud_vendor_n_available(VFRAME_ITF) )
+    {
+      if ( send_ack(VFRAME_TYPE_ACK) ) _vframe.rx_unacked = 0;
+    }
+  }
+}
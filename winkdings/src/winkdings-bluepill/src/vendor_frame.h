@@ -0,0 +1,124 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef _VENDOR_FRAME_H_
+#define _VENDOR_FRAME_H_
+
+#include "common/tusb_common.h"
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Framed message transport on top of the vendor (WebUSB) class
+ *
+ * Frame layout, multi-byte fields are little endian:
+ *   0xA5       -> start of frame
+ *   type       -> VFRAME_TYPE_*
+ *   seq        -> sequence number, increments by one per DATA frame (wraps at 256)
+ *   len (2)    -> payload length, at most VFRAME_MAX_PAYLOAD
+ *   payload    -> len bytes
+ *   crc (2)    -> CRC-16/CCITT-FALSE over type, seq, len and payload
+ *
+ * Host -> device DATA frames are acknowledged cumulatively: an ACK carries the
+ * sequence number of the next expected frame and the number of frames the host
+ * may send beyond it (window). A frame that is out of order or damaged is
+ * answered with a NAK carrying the expected sequence number, the host then
+ * resends from there (go-back-N). Frames sent by the device are not acknowledged.
+ */
+
+#ifndef VFRAME_ITF
+#define VFRAME_ITF            0
+#endif
+
+#ifndef VFRAME_MAX_PAYLOAD
+#define VFRAME_MAX_PAYLOAD    256
+#endif
+
+// Number of DATA frames the host may have outstanding
+#ifndef VFRAME_WINDOW
+#define VFRAME_WINDOW         4
+#endif
+
+#define VFRAME_SOF            0xA5
+#define VFRAME_HEADER_SIZE    5
+#define VFRAME_CRC_SIZE       2
+#define VFRAME_OVERHEAD       (VFRAME_HEADER_SIZE + VFRAME_CRC_SIZE)
+
+enum
+{
+  VFRAME_TYPE_DATA = 0x01,
+  VFRAME_TYPE_ACK  = 0x02, // payload: next expected seq, window
+  VFRAME_TYPE_NAK  = 0x03, // payload: next expected seq, window
+};
+
+// Payload of a received frame, still located in the vendor rx fifo.
+// It can be split into two parts when the frame wraps around the end of the fifo.
+typedef struct
+{
+  uint8_t        type;
+  uint8_t        seq;
+  uint16_t       len;
+  uint8_t const* ptr[2];
+  uint16_t       part_len[2];
+} vframe_payload_t;
+
+typedef struct
+{
+  uint32_t rx_frames;
+  uint32_t rx_crc_errors;
+  uint32_t rx_seq_errors;
+  uint32_t rx_sync_bytes; // bytes skipped while looking for start of frame
+  uint32_t tx_frames;
+} vframe_stats_t;
+
+void vframe_init(void);
+
+// Parse frames from the vendor rx fifo and send acknowledgements, call from main loop
+void vframe_task(void);
+
+// Send a frame, return false if there is not enough room in the vendor tx fifo
+bool vframe_send(uint8_t type, uint8_t seq, void const* data, uint16_t len);
+
+// Send a DATA frame with the next device sequence number
+bool vframe_send_data(void const* data, uint16_t len);
+
+vframe_stats_t const* vframe_get_stats(void);
+
+// CRC-16/CCITT-FALSE, pass 0xFFFF as initial value
+uint16_t vframe_crc16(uint16_t crc, uint8_t const* data, uint32_t len);
+
+//--------------------------------------------------------------------+
+// Application Callback API (weak is optional)
+//--------------------------------------------------------------------+
+
+// Invoked for every in-order DATA frame. Payload is only valid during the callback.
+// Return false if the frame cannot be consumed yet: it stays in the fifo, is offered
+// again on the next vframe_task() and is not acknowledged until then.
+TU_ATTR_WEAK bool vframe_rx_cb(vframe_payload_t const* payload);
+
+#ifdef __cplusplus
+ }
+#endif
+
+#endif /* _VENDOR_FRAME_H_ */